@@ -56,6 +56,83 @@ local uLong adler32_combine_(uLong adler1, uLong adler2, z_off64_t len2);
 #  define MOD4(a) a %= BASE
 #endif
 
+/* On processors with SSE2 (always so on x86-64), blocks of 32 bytes are done
+   with SSE2 as in Chromium's zlib (adler32_simd.c): the byte sums of a block
+   with _mm_sad_epu8(), and the sums weighted by the position in the block
+   with _mm_madd_epi16(), NMAX bytes at a time between the modulos.  This is
+   several times as fast as ADO16, and is skipped when cpuGetLevel() is below
+   L_CPU_SSE2 (e.g. with JBIG2_CPU=scalar).  Define NO_ADLER32_SSE2 to leave
+   it out. */
+#if defined(__SSE2__) && !defined(NO_ADLER32_SSE2)
+#  define ADLER32_SSE2
+#  include "cpufeatures.h"
+#  include <emmintrin.h>
+
+#  define ADLER32_SSE2_MIN 64   /* shortest length done with SSE2 */
+
+/* Add blocks blocks of 32 bytes to *adler and *sum2, both less than BASE
+   before and after */
+local void adler32_sse2(adler, sum2, buf, blocks)
+    unsigned long *adler;
+    unsigned long *sum2;
+    const Bytef *buf;
+    unsigned blocks;
+{
+    unsigned long s1 = *adler;
+    unsigned long s2 = *sum2;
+    const __m128i zero = _mm_setzero_si128();
+    /* the weights of the bytes of a block, 32 down to 1 */
+    const __m128i w0 = _mm_setr_epi16(32, 31, 30, 29, 28, 27, 26, 25);
+    const __m128i w1 = _mm_setr_epi16(24, 23, 22, 21, 20, 19, 18, 17);
+    const __m128i w2 = _mm_setr_epi16(16, 15, 14, 13, 12, 11, 10, 9);
+    const __m128i w3 = _mm_setr_epi16(8, 7, 6, 5, 4, 3, 2, 1);
+
+    while (blocks) {
+        unsigned n = NMAX / 32;
+        __m128i v_ps, v_s1, v_s2;
+
+        if (n > blocks)
+            n = blocks;
+        blocks -= n;
+
+        /* v_ps sums s1 before each block: each adds 32 times it to s2 */
+        v_ps = _mm_cvtsi32_si128((int)(s1 * n));
+        v_s1 = zero;
+        v_s2 = _mm_cvtsi32_si128((int)s2);
+        do {
+            const __m128i b0 = _mm_loadu_si128((const __m128i *)buf);
+            const __m128i b1 = _mm_loadu_si128((const __m128i *)(buf + 16));
+
+            v_ps = _mm_add_epi32(v_ps, v_s1);
+            v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(b0, zero));
+            v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(b1, zero));
+            v_s2 = _mm_add_epi32(v_s2,
+                _mm_madd_epi16(_mm_unpacklo_epi8(b0, zero), w0));
+            v_s2 = _mm_add_epi32(v_s2,
+                _mm_madd_epi16(_mm_unpackhi_epi8(b0, zero), w1));
+            v_s2 = _mm_add_epi32(v_s2,
+                _mm_madd_epi16(_mm_unpacklo_epi8(b1, zero), w2));
+            v_s2 = _mm_add_epi32(v_s2,
+                _mm_madd_epi16(_mm_unpackhi_epi8(b1, zero), w3));
+            buf += 32;
+        } while (--n);
+        v_s2 = _mm_add_epi32(v_s2, _mm_slli_epi32(v_ps, 5));
+
+        /* add up the lanes */
+        v_s1 = _mm_add_epi32(v_s1, _mm_shuffle_epi32(v_s1, 0x4e));
+        v_s1 = _mm_add_epi32(v_s1, _mm_shuffle_epi32(v_s1, 0xb1));
+        s1 += (unsigned)_mm_cvtsi128_si32(v_s1);
+        v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, 0x4e));
+        v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, 0xb1));
+        s2 = (unsigned)_mm_cvtsi128_si32(v_s2);
+        MOD(s1);
+        MOD(s2);
+    }
+    *adler = s1;
+    *sum2 = s2;
+}
+#endif /* ADLER32_SSE2 */
+
 /* ========================================================================= */
 uLong ZEXPORT adler32(adler, buf, len)
     uLong adler;
@@ -96,6 +173,16 @@ uLong ZEXPORT adler32(adler, buf, len)
         return adler | (sum2 << 16);
     }
 
+#ifdef ADLER32_SSE2
+    if (len >= ADLER32_SSE2_MIN && cpuGetLevel() >= L_CPU_SSE2) {
+        unsigned blocks = len / 32;
+
+        adler32_sse2(&adler, &sum2, buf, blocks);
+        buf += blocks * 32;
+        len -= blocks * 32;
+    }
+#endif /* ADLER32_SSE2 */
+
     /* do length NMAX blocks -- requires just one modulo operation */
     while (len >= NMAX) {
         len -= NMAX;
@@ -21,6 +21,7 @@
 #define LIBLEPT_MINOR_VERSION   68
 
 #include "alltypes.h"
+#include "cpufeatures.h"
 
 #ifndef NO_PROTOS
 #include  "leptprotos.h"
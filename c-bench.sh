@@ -0,0 +1,24 @@
+#! /bin/bash --
+# Builds jbig2bench, which times the stages of jbig2 (see jbig2bench.cc).
+set -ex
+rm -f *.o
+gcc -s -O2 -c \
+    -ffunction-sections -fdata-sections \
+    -W -Wall -Wno-uninitialized -Wno-sign-compare -Wno-unused-parameter \
+    leptonica.c
+
+g++ -fno-exceptions -fno-rtti -s -O2 -c \
+    -ffunction-sections -fdata-sections \
+    -W -Wall \
+    -I. \
+    jbig2arith.cc jbig2bench.cc jbig2enc.cc jbig2mmr.cc jbig2pool.cc jbig2sym.cc \
+    jbig2synth.cc
+
+g++ -Wl,--gc-sections \
+    -fno-exceptions -fno-rtti -s -o jbig2bench \
+    leptonica.o jbig2arith.o jbig2bench.o jbig2enc.o jbig2mmr.o jbig2pool.o jbig2sym.o \
+    jbig2synth.o \
+    -lpng -lz -lpthread
+
+echo OK.
+: OK.
@@ -26,7 +26,8 @@ g++-mp-4.4 -fno-exceptions -fno-rtti -static-libgcc -O2 -c \
     -ffunction-sections -fdata-sections \
     -W -Wall \
     -I. \
-    jbig2arith.cc jbig2.cc jbig2enc.cc jbig2sym.cc
+    jbig2arith.cc jbig2cache.cc jbig2.cc jbig2enc.cc jbig2mmr.cc jbig2pool.cc jbig2sym.cc \
+    jbig2raw.cc jbig2tiff.cc
 
 # Find libstdc++.a next to libstdc++.*.dylib.
 echo 'main(){}' >empty.cc
@@ -33,7 +33,8 @@ g++ -fno-stack-protector \
     -ffunction-sections -fdata-sections \
     -W -Wall \
     -I. \
-    jbig2arith.cc jbig2.cc jbig2enc.cc
+    jbig2arith.cc jbig2cache.cc jbig2.cc jbig2enc.cc jbig2mmr.cc jbig2pool.cc jbig2sym.cc \
+    jbig2raw.cc jbig2tiff.cc
 
 # Example stdin line: /usr/bin/ld: Removing unused section '.text._Z6answerv' in file 'jbig2.o'  
 demangle() {
@@ -45,7 +46,7 @@ demangle() {
 rm -f jbig2.unused
 
 # Example line in unused.out /usr/bin/ld: Removing unused section '.text._Z6answerv' in file 'jbig2.o'  
-g++ -Wl,--gc-sections,--print-gc-sections -fno-exceptions -fno-rtti -s -o jbig2.unused *.o 2>&1 | demangle | tee unused.out >&2 || :
+g++ -Wl,--gc-sections,--print-gc-sections -fno-exceptions -fno-rtti -s -o jbig2.unused *.o -lpthread 2>&1 | demangle | tee unused.out >&2 || :
 test -f jbig2.unused
 
 : OK.
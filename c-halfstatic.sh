@@ -25,11 +25,12 @@ g++ -fno-exceptions -fno-rtti -s -O2 -c \
     -ffunction-sections -fdata-sections \
     -W -Wall \
     -I. \
-    jbig2arith.cc jbig2.cc jbig2enc.cc jbig2sym.cc
+    jbig2arith.cc jbig2cache.cc jbig2.cc jbig2enc.cc jbig2mmr.cc jbig2pool.cc jbig2sym.cc \
+    jbig2raw.cc jbig2tiff.cc
 
 #g++ -Wl,--gc-sections,--print-gc-sections
 g++ -Wl,--gc-sections \
-    -fno-exceptions -fno-rtti -s -o jbig2.halfstatic *.o
+    -fno-exceptions -fno-rtti -s -o jbig2.halfstatic *.o -lpthread
 
 echo OK.
 : OK.
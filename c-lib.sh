@@ -0,0 +1,44 @@
+#! /bin/bash --
+# Builds libjbig2enc.a and libjbig2enc.so: the encoder as a library with the C
+# API of jbig2lib.h, for encoding images in the calling process (e.g. from
+# Python with ctypes). zlib, libpng and Leptonica are built in, and only the
+# functions of jbig2lib.h are exported from the shared library.
+set -ex
+rm -f *.o
+
+gcc -s -O2 -fPIC -fvisibility=hidden -c \
+    -ffunction-sections -fdata-sections \
+    -W -Wall \
+    -I. \
+    zall.c
+
+gcc -s -O2 -fPIC -fvisibility=hidden -c \
+    -ffunction-sections -fdata-sections \
+    -W -Wall -Wno-uninitialized -Wno-sign-compare \
+    -I. \
+    pngall.c
+
+gcc -s -O2 -fPIC -fvisibility=hidden -c \
+    -ffunction-sections -fdata-sections \
+    -W -Wall -Wno-uninitialized -Wno-sign-compare -Wno-unused-parameter \
+    -I. \
+    leptonica.c
+
+g++ -fno-exceptions -fno-rtti -s -O2 -fPIC -fvisibility=hidden -c \
+    -ffunction-sections -fdata-sections \
+    -W -Wall \
+    -I. \
+    jbig2arith.cc jbig2enc.cc jbig2lib.cc jbig2mmr.cc jbig2pool.cc jbig2sym.cc
+
+rm -f libjbig2enc.a
+ar rcs libjbig2enc.a zall.o pngall.o leptonica.o \
+    jbig2arith.o jbig2enc.o jbig2lib.o jbig2mmr.o jbig2pool.o jbig2sym.o
+
+g++ -shared -Wl,--gc-sections \
+    -fno-exceptions -fno-rtti -s -o libjbig2enc.so \
+    zall.o pngall.o leptonica.o \
+    jbig2arith.o jbig2enc.o jbig2lib.o jbig2mmr.o jbig2pool.o jbig2sym.o \
+    -lpthread
+
+echo OK.
+: OK.
@@ -0,0 +1,25 @@
+#! /bin/bash --
+# Builds jbig2micro, which times the coder and the pixel kernels on their own
+# (see jbig2micro.cc). leptonica.c is built with its functions not static, so
+# that the line kernels can be called.
+set -ex
+rm -f *.o
+gcc -s -O2 -c \
+    -ffunction-sections -fdata-sections \
+    -W -Wall -Wno-uninitialized -Wno-sign-compare -Wno-unused-parameter \
+    -DLEPTONICA_EXPORT= -DLEPTONICA_EXTERN=extern \
+    leptonica.c
+
+g++ -fno-exceptions -fno-rtti -s -O2 -c \
+    -ffunction-sections -fdata-sections \
+    -W -Wall \
+    -I. \
+    jbig2arith.cc jbig2micro.cc jbig2synth.cc
+
+g++ -Wl,--gc-sections \
+    -fno-exceptions -fno-rtti -s -o jbig2micro \
+    leptonica.o jbig2arith.o jbig2micro.o jbig2synth.o \
+    -lpng -lz -lpthread
+
+echo OK.
+: OK.
@@ -0,0 +1,124 @@
+/*====================================================================*
+ -  Copyright (C) 2001 Leptonica.  All rights reserved.
+ -  This software is distributed in the hope that it will be
+ -  useful, but with NO WARRANTY OF ANY KIND.
+ -  No author or distributor accepts responsibility to anyone for the
+ -  consequences of using this software, or for whether it serves any
+ -  particular purpose or works at all, unless he or she says so in
+ -  writing.  Everyone is granted permission to copy, modify and
+ -  redistribute this source code, for commercial or non-commercial
+ -  purposes, with the following restrictions: (1) the origin of this
+ -  source code must not be misrepresented; (2) modified versions must
+ -  be plainly marked as such; and (3) this notice may not be removed
+ -  or altered from any source or modified source distribution.
+ *====================================================================*/
+
+
+/*
+ *  cpufeatures.c
+ *
+ *       Run-time choice of the SIMD code of the kernels
+ *           l_int32      cpuGetLevel()
+ *           const char  *cpuGetLevelName()
+ *
+ *  The kernels with SIMD code (thresholding and scaling to binary here,
+ *  the row copies of the coder, and adler32, crc32 and the png filters of
+ *  the bundled zlib and libpng) ask cpuGetLevel() which code to run, so
+ *  that a binary built for a plain x86-64 runs the AVX2 code where there
+ *  is AVX2.  Kernels with more than one SIMD version bind a function
+ *  pointer the first time they are called; the others test the level.
+ *
+ *  The level is found once.  The environment variable JBIG2_CPU, set to
+ *  scalar, sse2 or avx2, lowers it, so that the speed of each version can
+ *  be measured, and a difference in the output tracked down, on the same
+ *  machine.  It can't raise the level above what the processor has.
+ *  The output is the same at every level.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "allheaders.h"
+
+static l_int32  cpuLevel = -1;  /* not found yet */
+
+static const char  *cpuLevelNames[] = {"scalar", "sse2", "avx2"};
+
+
+/*
+ *  cpuDetectLevel()
+ *
+ *      Return: highest level that the processor has
+ */
+static l_int32
+cpuDetectLevel(void)
+{
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+    __builtin_cpu_init();
+#ifdef L_CPU_AVX2_TARGET
+    if (__builtin_cpu_supports("avx2"))
+        return L_CPU_AVX2;
+#endif  /* L_CPU_AVX2_TARGET */
+    if (__builtin_cpu_supports("sse2"))
+        return L_CPU_SSE2;
+#endif  /* x86 */
+    return L_CPU_SCALAR;
+}
+
+
+/*
+ *  cpuGetLevel()
+ *
+ *      Return: level of the SIMD code to run (L_CPU_SCALAR, L_CPU_SSE2
+ *              or L_CPU_AVX2)
+ *
+ *  Notes:
+ *      (1) The first call finds the level and reads JBIG2_CPU.  Threads
+ *          may do that at the same time, so the level is read and
+ *          written with relaxed atomics: each finds the same.
+ *      (2) An unknown JBIG2_CPU, or one above what the processor has,
+ *          is warned about and ignored.
+ */
+LEPTONICA_REAL_EXPORT l_int32
+cpuGetLevel(void)
+{
+l_int32      level, i;
+const char  *env;
+
+    PROCNAME("cpuGetLevel");
+
+    if ((level = __atomic_load_n(&cpuLevel, __ATOMIC_RELAXED)) >= 0)
+        return level;
+
+    level = cpuDetectLevel();
+    if ((env = getenv("JBIG2_CPU")) != NULL && env[0] != '\0') {
+        for (i = 0; i <= L_CPU_AVX2; i++) {
+            if (!strcmp(env, cpuLevelNames[i]))
+                break;
+        }
+        if (i > L_CPU_AVX2)
+            L_WARNING("unknown JBIG2_CPU; ignored", procName);
+        else if (i > level)
+            L_WARNING("processor lacks the JBIG2_CPU level; ignored",
+                      procName);
+        else
+            level = i;
+    }
+    __atomic_store_n(&cpuLevel, level, __ATOMIC_RELAXED);
+    return level;
+}
+
+
+/*
+ *  cpuGetLevelName()
+ *
+ *      Input:  level (as returned by cpuGetLevel())
+ *      Return: its name, as for JBIG2_CPU
+ */
+LEPTONICA_REAL_EXPORT const char *
+cpuGetLevelName(l_int32  level)
+{
+    if (level < 0 || level > L_CPU_AVX2)
+        return "unknown";
+    return cpuLevelNames[level];
+}
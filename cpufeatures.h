@@ -0,0 +1,53 @@
+/*====================================================================*
+ -  Copyright (C) 2001 Leptonica.  All rights reserved.
+ -  This software is distributed in the hope that it will be
+ -  useful, but with NO WARRANTY OF ANY KIND.
+ -  No author or distributor accepts responsibility to anyone for the
+ -  consequences of using this software, or for whether it serves any
+ -  particular purpose or works at all, unless he or she says so in
+ -  writing.  Everyone is granted permission to copy, modify and
+ -  redistribute this source code, for commercial or non-commercial
+ -  purposes, with the following restrictions: (1) the origin of this
+ -  source code must not be misrepresented; (2) modified versions must
+ -  be plainly marked as such; and (3) this notice may not be removed
+ -  or altered from any source or modified source distribution.
+ *====================================================================*/
+
+#ifndef  LEPTONICA_CPUFEATURES_H
+#define  LEPTONICA_CPUFEATURES_H
+
+/*
+ *  cpufeatures.h
+ *
+ *  The levels of SIMD code that the kernels choose between at run time
+ *  (see cpufeatures.c).  The bundled zlib and libpng use this as well as
+ *  Leptonica and the encoder, so it doesn't need any other header.
+ */
+
+    /* Levels returned by cpuGetLevel(); each includes those below it */
+enum {
+    L_CPU_SCALAR = 0,         /* plain C                                */
+    L_CPU_SSE2 = 1,           /* SSE2                                   */
+    L_CPU_AVX2 = 2            /* AVX2                                   */
+};
+
+    /* Defined if functions for AVX2 can be compiled with the target
+     * attribute, without -mavx2 for the whole file */
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || __GNUC__ > 4 || \
+     (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define L_CPU_AVX2_TARGET
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif  /* __cplusplus */
+
+extern int cpuGetLevel(void);
+extern const char * cpuGetLevelName(int level);
+
+#ifdef __cplusplus
+}
+#endif  /* __cplusplus */
+
+#endif  /* LEPTONICA_CPUFEATURES_H */
@@ -217,6 +217,134 @@ const unsigned long FAR * ZEXPORT get_crc_table()
 #define DO1 crc = crc_table[0][((int)crc ^ (*buf++)) & 0xff] ^ (crc >> 8)
 #define DO8 DO1; DO1; DO1; DO1; DO1; DO1; DO1; DO1
 
+/* =========================================================================
+ * On x86 processors with the carry-less multiply instruction, the CRC of
+ * blocks of 16 bytes is computed by folding with PCLMULQDQ, as described in
+ * Intel's "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ
+ * Instruction" and done in Chromium's zlib (crc32_simd.c), from which the
+ * constants are.  This is about ten times as fast as the four tables.  The
+ * instruction is looked for at run time, and not used when cpuGetLevel() is
+ * below L_CPU_SSE2 (e.g. with JBIG2_CPU=scalar); define NO_CRC32_PCLMUL to
+ * leave the code out.
+ */
+#if !defined(NO_CRC32_PCLMUL) && (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#  define CRC32_PCLMUL
+#  include "cpufeatures.h"
+#  include <emmintrin.h>
+#  include <smmintrin.h>
+#  include <wmmintrin.h>
+
+#  define CRC32_PCLMUL_MIN 64   /* shortest length done with PCLMULQDQ */
+
+local int crc32_pclmul_usable = -1;     /* not known yet */
+
+/* Returns true if the processor can do crc32_pclmul() */
+local int crc32_pclmul_ok OF((void));
+local int crc32_pclmul_ok()
+{
+    int usable;
+
+    /* Threads may get here together, so the flag is read and written
+       atomically; relaxed order will do, since every thread finds the same
+       value and nothing else is published with it. */
+    usable = __atomic_load_n(&crc32_pclmul_usable, __ATOMIC_RELAXED);
+    if (usable < 0) {
+        usable = cpuGetLevel() >= L_CPU_SSE2 &&
+                 __builtin_cpu_supports("pclmul") &&
+                 __builtin_cpu_supports("sse4.1");
+        __atomic_store_n(&crc32_pclmul_usable, usable, __ATOMIC_RELAXED);
+    }
+    return usable;
+}
+
+/* The CRC before the final exclusive-or of len bytes, len >= 64 and a
+   multiple of 16, with crc the same of the bytes before them */
+__attribute__((target("pclmul,sse4.1")))
+local unsigned crc32_pclmul(crc, buf, len)
+    unsigned crc;
+    const unsigned char FAR *buf;
+    uInt len;
+{
+    const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596LL, 0x0154442bd4LL);
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009eLL, 0x01751997d0LL);
+    const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124LL);
+    const __m128i poly = _mm_set_epi64x(0x01f7011641LL, 0x01db710641LL);
+    const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+    /* four lanes of 16 bytes, the crc folded into the first */
+    x1 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+    x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+    buf += 64;
+    len -= 64;
+
+    /* fold 64 bytes at a time into the four lanes */
+    x0 = k1k2;
+    while (len >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        y5 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+        y6 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+        y7 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+        y8 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+        buf += 64;
+        len -= 64;
+    }
+
+    /* fold the four lanes into one */
+    x0 = k3k4;
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    /* fold 16 bytes at a time into it */
+    while (len >= 16) {
+        x2 = _mm_loadu_si128((const __m128i *)buf);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        buf += 16;
+        len -= 16;
+    }
+
+    /* fold 128 bits to 64 */
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, mask32);
+    x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    /* Barrett reduction to 32 bits */
+    x2 = _mm_and_si128(x1, mask32);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+    x2 = _mm_and_si128(x2, mask32);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return (unsigned)_mm_extract_epi32(x1, 1);
+}
+#endif /* CRC32_PCLMUL */
+
 /* ========================================================================= */
 unsigned long ZEXPORT crc32(crc, buf, len)
     unsigned long crc;
@@ -225,6 +353,19 @@ unsigned long ZEXPORT crc32(crc, buf, len)
 {
     if (buf == Z_NULL) return 0UL;
 
+#ifdef CRC32_PCLMUL
+    if (len >= CRC32_PCLMUL_MIN && crc32_pclmul_ok()) {
+        uInt blocks = len & ~(uInt)15;
+
+        crc = crc32_pclmul((unsigned)crc ^ 0xffffffffU, buf, blocks) ^
+              0xffffffffUL;
+        buf += blocks;
+        len -= blocks;
+        if (len == 0)
+            return crc;
+    }
+#endif /* CRC32_PCLMUL */
+
 #ifdef DYNAMIC_CRC_TABLE
     if (crc_table_empty)
         make_crc_table();
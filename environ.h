@@ -78,6 +78,35 @@ typedef intptr_t l_intptr_t;
 typedef uintptr_t l_uintptr_t;
 typedef void *L_TIMER;
 
+    /* Running row bands in parallel: see setRowBandRunner() in utils.c */
+typedef void (*L_JOB_FUNC)(void *arg, int index, int worker);
+typedef void (*L_PARALLEL_FOR)(int nthreads, int count, L_JOB_FUNC fn,
+                               void *arg);
+typedef void (*L_BAND_FUNC)(void *arg, int y0, int y1);
+
+    /* Thread-local variables */
+#if defined(_MSC_VER)
+#define L_THREAD_LOCAL  __declspec(thread)
+#else
+#define L_THREAD_LOCAL  __thread
+#endif  /* _MSC_VER */
+
+    /* Steps of pixConvertTo1Transfer(): see setConvertStepHook() */
+enum {
+    L_STEP_CMAP = 1,           /* colormap removed                 */
+    L_STEP_GRAY = 2,           /* rgb made gray, before upscaling  */
+    L_STEP_THRESHOLD = 3       /* thresholded, and maybe upscaled  */
+};
+typedef void (*L_STEP_FUNC)(void *arg, int step);
+
+    /* Bytes of pix data allocated: see setPixBytesCounter() in pix1.c */
+struct L_PixBytes
+{
+    size_t           bytes;            /* allocated and not yet freed  */
+    size_t           peak;             /* most bytes at any time       */
+};
+typedef struct L_PixBytes  L_PIX_BYTES;
+
 /* Specified for functions etc. definitions (not declarations). */
 #ifndef LEPTONICA_EXPORT
 #define LEPTONICA_EXPORT
@@ -117,7 +117,7 @@ PIX       *pixt, *pixd;
     if (d == 8 && thresh > 256)
         return (PIX *)ERROR_PTR("8 bpp thresh not in {0-256}", procName, NULL);
 
-    if ((pixd = pixCreate(w, h, 1)) == NULL)
+    if ((pixd = pixCreateNoInit(w, h, 1)) == NULL)
         return (PIX *)ERROR_PTR("pixd not made", procName, NULL);
     pixCopyResolution(pixd, pixs);
     datad = pixGetData(pixd);
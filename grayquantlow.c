@@ -22,10 +22,14 @@
  *              void       ditherToBinaryLow()
  *              void       ditherToBinaryLineLow()
  *
- *          Simple (pixelwise) binarization
+ *          Simple (pixelwise) binarization, also of the green
+ *          samples of 32 bpp rgb
  *              void       thresholdToBinaryLow()
  *              void       thresholdToBinaryLineLow()
  *
+ *          Binarization of colormapped 1, 2, 4 and 8 bpp by table lookup
+ *              void       thresholdCmapToBinaryLow()
+ *
  *          A slower version of Floyd-Steinberg dithering that uses LUTs
  *              void       ditherToBinaryLUTLow()
  *              void       ditherToBinaryLineLUTLow()
@@ -52,6 +56,12 @@
 #include <string.h>
 #include "allheaders.h"
 
+#if defined(L_CPU_AVX2_TARGET)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif  /* L_CPU_AVX2_TARGET */
+
 #ifndef  NO_CONSOLE_IO
 #define DEBUG_UNROLLING 0
 #endif   /* ~NO_CONSOLE_IO */
@@ -60,11 +70,48 @@
 /*------------------------------------------------------------------*
  *             Simple binarization with fixed threshold             *
  *------------------------------------------------------------------*/
+    /* Arguments of the row band functions for thresholdToBinaryLow()
+     * and thresholdCmapToBinaryLow() */
+struct ThreshBands
+{
+    l_uint32  *datad;
+    l_int32    w;
+    l_int32    wpld;
+    l_uint32  *datas;
+    l_int32    d;
+    l_int32    wpls;
+    l_int32    thresh;
+    l_uint8   *tab;  /* for thresholdCmapToBinaryLow() */
+};
+
+static void
+thresholdToBinaryBand(void    *arg,
+                      l_int32  y0,
+                      l_int32  y1)
+{
+l_int32              i;
+struct ThreshBands  *tb;
+
+    tb = (struct ThreshBands *)arg;
+    for (i = y0; i < y1; i++) {
+        thresholdToBinaryLineLow(tb->datad + i * tb->wpld, tb->w,
+                                 tb->datas + i * tb->wpls, tb->d, tb->thresh);
+    }
+    return;
+}
+
+
 /*
  *  thresholdToBinaryLow()
  *
  *  If the source pixel is less than thresh,
- *  the dest will be 1; otherwise, it will be 0
+ *  the dest will be 1; otherwise, it will be 0.
+ *  For d == 32, the green sample of each rgb pixel is used,
+ *  as in pixConvertRGBToGrayFast().
+ *  datad may be the same as datas: each dest word is stored only
+ *  after the source words at and below its address have been read.
+ *  Otherwise, the rows are done in bands in parallel (see
+ *  runRowBands()); in place, they have to be done in order.
  */
 LEPTONICA_EXPORT void
 thresholdToBinaryLow(l_uint32  *datad,
@@ -76,18 +123,203 @@ thresholdToBinaryLow(l_uint32  *datad,
                      l_int32    wpls,
                      l_int32    thresh)
 {
-l_int32    i;
-l_uint32  *lines, *lined;
+struct ThreshBands  tb;
 
-    for (i = 0; i < h; i++) {
-        lines = datas + i * wpls;
-        lined = datad + i * wpld;
-        thresholdToBinaryLineLow(lined, w, lines, d, thresh);
-    }
+    tb.datad = datad;
+    tb.w = w;
+    tb.wpld = wpld;
+    tb.datas = datas;
+    tb.d = d;
+    tb.wpls = wpls;
+    tb.thresh = thresh;
+    tb.tab = NULL;
+    if (datad == datas)
+        thresholdToBinaryBand(&tb, 0, h);
+    else
+        runRowBands(w, h, thresholdToBinaryBand, &tb);
     return;
 }
 
 
+/*
+ *  threshLine8*(), threshLine32*()
+ *
+ *  The SIMD code of thresholdToBinaryLineLow() for d == 8 and d == 32.
+ *  Each does the whole dest words of a line, or as many of them as it
+ *  can, and returns the number of pixels done, a multiple of 32; the
+ *  rest are done with the C code.  The threshLine8*() need thresh > 0.
+ *  threshLine8 and threshLine32 are bound to the best version for the
+ *  processor (see cpuGetLevel()) by the first call.  Threads may bind
+ *  them at the same time, so the pointers are read and written with
+ *  relaxed atomics: each thread binds the same version.
+ */
+typedef l_int32 (*L_THRESH_LINE_FUNC)(l_uint32 *lined, l_int32 w,
+                                      const l_uint32 *lines, l_int32 thresh);
+
+static l_int32
+threshLineNone(l_uint32        *lined,
+               l_int32          w,
+               const l_uint32  *lines,
+               l_int32          thresh)
+{
+    return 0;
+}
+
+#if defined(__SSE2__)
+    /* Compare 32 samples (8 source words) at a time.  The samples
+     * are unsigned, so gval < thresh is tested as
+     * min(gval, thresh - 1) == gval, which needs thresh > 0.
+     * In the byte mask, bit k is from byte k in memory, which is
+     * pixel k with the order of each group of 4 reversed, because
+     * the source words are little-endian.  Reversing the order of
+     * the 8 nibbles of the mask puts pixel 0 in the MSB of the
+     * dest word. */
+static l_int32
+threshLine8SSE2(l_uint32        *lined,
+                l_int32          w,
+                const l_uint32  *lines,
+                l_int32          thresh)
+{
+l_int32   j;
+l_uint32  dword;
+__m128i   s0, s1, thr;
+
+    thr = _mm_set1_epi8((char)(thresh - 1));
+    for (j = 0; j + 31 < w; j += 32) {
+        s0 = _mm_loadu_si128((const __m128i *)(lines + j / 4));
+        s1 = _mm_loadu_si128((const __m128i *)(lines + j / 4 + 4));
+        s0 = _mm_cmpeq_epi8(_mm_min_epu8(s0, thr), s0);
+        s1 = _mm_cmpeq_epi8(_mm_min_epu8(s1, thr), s1);
+        dword = (l_uint32)_mm_movemask_epi8(s0) |
+                ((l_uint32)_mm_movemask_epi8(s1) << 16);
+        dword = (dword >> 24) | ((dword >> 8) & 0x0000ff00) |
+                ((dword << 8) & 0x00ff0000) | (dword << 24);
+        lined[j / 32] = ((dword >> 4) & 0x0f0f0f0f) |
+                        ((dword & 0x0f0f0f0f) << 4);
+    }
+    return j;
+}
+
+    /* Compare 16 green samples at a time; the byte mask has pixel k
+     * in bit k, so it is bit-reversed to put pixel 0 in the MSB of
+     * the dest word. */
+static l_int32
+threshLine32SSE2(l_uint32        *lined,
+                 l_int32          w,
+                 const l_uint32  *lines,
+                 l_int32          thresh)
+{
+l_int32   j, k;
+l_uint32  dword;
+__m128i   g0, g1, g2, g3, m16, thr;
+
+    thr = _mm_set1_epi32(thresh);
+    m16 = _mm_set1_epi32(0xff);
+    for (j = 0; j + 31 < w; j += 32) {
+        dword = 0;
+        for (k = 0; k < 2; k++) {
+            g0 = _mm_loadu_si128((const __m128i *)(lines + j + 16 * k));
+            g1 = _mm_loadu_si128((const __m128i *)(lines + j + 16 * k + 4));
+            g2 = _mm_loadu_si128((const __m128i *)(lines + j + 16 * k + 8));
+            g3 = _mm_loadu_si128((const __m128i *)(lines + j + 16 * k + 12));
+            g0 = _mm_cmplt_epi32(_mm_and_si128(
+                     _mm_srli_epi32(g0, L_GREEN_SHIFT), m16), thr);
+            g1 = _mm_cmplt_epi32(_mm_and_si128(
+                     _mm_srli_epi32(g1, L_GREEN_SHIFT), m16), thr);
+            g2 = _mm_cmplt_epi32(_mm_and_si128(
+                     _mm_srli_epi32(g2, L_GREEN_SHIFT), m16), thr);
+            g3 = _mm_cmplt_epi32(_mm_and_si128(
+                     _mm_srli_epi32(g3, L_GREEN_SHIFT), m16), thr);
+            g0 = _mm_packs_epi16(_mm_packs_epi32(g0, g1),
+                                 _mm_packs_epi32(g2, g3));
+            dword |= (l_uint32)_mm_movemask_epi8(g0) << (16 * k);
+        }
+        dword = ((dword >> 1) & 0x55555555) | ((dword & 0x55555555) << 1);
+        dword = ((dword >> 2) & 0x33333333) | ((dword & 0x33333333) << 2);
+        dword = ((dword >> 4) & 0x0f0f0f0f) | ((dword & 0x0f0f0f0f) << 4);
+        dword = ((dword >> 8) & 0x00ff00ff) | ((dword & 0x00ff00ff) << 8);
+        lined[j / 32] = (dword >> 16) | (dword << 16);
+    }
+    return j;
+}
+#endif  /* __SSE2__ */
+
+#ifdef L_CPU_AVX2_TARGET
+    /* As threshLine8SSE2(), with the 32 samples in one register */
+__attribute__((target("avx2")))
+static l_int32
+threshLine8AVX2(l_uint32        *lined,
+                l_int32          w,
+                const l_uint32  *lines,
+                l_int32          thresh)
+{
+l_int32   j;
+l_uint32  dword;
+__m256i   s0, thr;
+
+    thr = _mm256_set1_epi8((char)(thresh - 1));
+    for (j = 0; j + 31 < w; j += 32) {
+        s0 = _mm256_loadu_si256((const __m256i *)(lines + j / 4));
+        s0 = _mm256_cmpeq_epi8(_mm256_min_epu8(s0, thr), s0);
+        dword = (l_uint32)_mm256_movemask_epi8(s0);
+        dword = (dword >> 24) | ((dword >> 8) & 0x0000ff00) |
+                ((dword << 8) & 0x00ff0000) | (dword << 24);
+        lined[j / 32] = ((dword >> 4) & 0x0f0f0f0f) |
+                        ((dword & 0x0f0f0f0f) << 4);
+    }
+    return j;
+}
+#endif  /* L_CPU_AVX2_TARGET */
+
+static l_int32 threshLine8Bind(l_uint32 *lined, l_int32 w,
+                               const l_uint32 *lines, l_int32 thresh);
+static l_int32 threshLine32Bind(l_uint32 *lined, l_int32 w,
+                                const l_uint32 *lines, l_int32 thresh);
+
+static L_THRESH_LINE_FUNC  threshLine8 = threshLine8Bind;
+static L_THRESH_LINE_FUNC  threshLine32 = threshLine32Bind;
+
+static l_int32
+threshLine8Bind(l_uint32        *lined,
+                l_int32          w,
+                const l_uint32  *lines,
+                l_int32          thresh)
+{
+l_int32             level;
+L_THRESH_LINE_FUNC  func;
+
+    level = cpuGetLevel();
+    func = threshLineNone;
+#if defined(__SSE2__)
+    if (level >= L_CPU_SSE2)
+        func = threshLine8SSE2;
+#endif  /* __SSE2__ */
+#ifdef L_CPU_AVX2_TARGET
+    if (level >= L_CPU_AVX2)
+        func = threshLine8AVX2;
+#endif  /* L_CPU_AVX2_TARGET */
+    __atomic_store_n(&threshLine8, func, __ATOMIC_RELAXED);
+    return func(lined, w, lines, thresh);
+}
+
+static l_int32
+threshLine32Bind(l_uint32        *lined,
+                 l_int32          w,
+                 const l_uint32  *lines,
+                 l_int32          thresh)
+{
+L_THRESH_LINE_FUNC  func;
+
+    func = threshLineNone;
+#if defined(__SSE2__)
+    if (cpuGetLevel() >= L_CPU_SSE2)
+        func = threshLine32SSE2;
+#endif  /* __SSE2__ */
+    __atomic_store_n(&threshLine32, func, __ATOMIC_RELAXED);
+    return func(lined, w, lines, thresh);
+}
+
+
 /*
  *  thresholdToBinaryLineLow()
  *
@@ -99,8 +331,9 @@ thresholdToBinaryLineLow(l_uint32  *lined,
                          l_int32    d,
                          l_int32    thresh)
 {
-l_int32  j, k, gval, scount, dcount;
-l_uint32 sword, dword;
+l_int32             j, k, gval, scount, dcount;
+l_uint32            sword, dword;
+L_THRESH_LINE_FUNC  simd;
 
     PROCNAME("thresholdToBinaryLineLow");
 
@@ -162,8 +395,13 @@ l_uint32 sword, dword;
 #endif
         break;
     case 8:
+            /* The whole dest words with SIMD code, if any */
+        simd = __atomic_load_n(&threshLine8, __ATOMIC_RELAXED);
+        j = (thresh > 0) ? simd(lined, w, lines, thresh) : 0;
+        scount = j / 4;
+        dcount = j / 32;
             /* Unrolled as 8 source words, 1 dest word */
-        for (j = 0, scount = 0, dcount = 0; j + 31 < w; j += 32) {
+        for (; j + 31 < w; j += 32) {
             dword = 0;
             for (k = 0; k < 8; k++) {
                 sword = lines[scount++];
@@ -197,12 +435,123 @@ l_uint32 sword, dword;
             gval = GET_DATA_BYTE(lines, j);
             CHECK_BIT(lined, j, gval < thresh ? 1 : 0);
         }
+#endif
+        break;
+    case 32:
+            /* The whole dest words with SIMD code, if any */
+        simd = __atomic_load_n(&threshLine32, __ATOMIC_RELAXED);
+        j = simd(lined, w, lines, thresh);
+        scount = j;
+        dcount = j / 32;
+            /* 32 source words, 1 dest word */
+        for (; j + 31 < w; j += 32) {
+            dword = 0;
+            for (k = 0; k < 32; k++) {
+                gval = (lines[scount++] >> L_GREEN_SHIFT) & 0xff;
+                dword |= (((gval - thresh) >> 31) & 1) << (31 - k);
+            }
+            lined[dcount++] = dword;
+        }
+
+        if (j < w) {
+            dword = 0;
+            for (; j < w; j++) {
+                gval = (lines[scount++] >> L_GREEN_SHIFT) & 0xff;
+                dword |= (((gval - thresh) >> 31) & 1) << (31 - (j & 31));
+            }
+            lined[dcount] = dword;
+        }
+#if DEBUG_UNROLLING
+        for (j = 0; j < w; j++) {
+            gval = (lines[j] >> L_GREEN_SHIFT) & 0xff;
+            CHECK_BIT(lined, j, gval < thresh ? 1 : 0);
+        }
 #undef CHECK_BIT
 #endif
         break;
     default:
-        L_ERROR("src depth not 4 or 8 bpp", procName);
+        L_ERROR("src depth not 4, 8 or 32 bpp", procName);
         break;
     }
     return;
 }
+
+
+/*------------------------------------------------------------------*
+ *   Binarization of colormapped or 2/4 bpp image by table lookup   *
+ *------------------------------------------------------------------*/
+/*
+ *  thresholdCmapToBinaryLow()
+ *
+ *  Each source byte holds 8 / d colormap indices or gray samples,
+ *  and tab maps the byte to their 8 / d dest bits, right-justified.
+ *  So d source words make one dest word.  The bits beyond w in the last word
+ *  of each dest line are cleared.
+ *  As with thresholdToBinaryLow(), datad may be the same as datas,
+ *  and otherwise the rows are done in parallel bands.
+ */
+static void
+thresholdCmapToBinaryBand(void    *arg,
+                          l_int32  y0,
+                          l_int32  y1)
+{
+l_int32              i, j, k, w, d, wpls, nbits, scount, dcount;
+l_uint32             sword, dword, endmask;
+l_uint32            *lines, *lined;
+l_uint8             *tab;
+struct ThreshBands  *tb;
+
+    tb = (struct ThreshBands *)arg;
+    w = tb->w;
+    d = tb->d;
+    wpls = tb->wpls;
+    tab = tb->tab;
+    nbits = 8 / d;
+    endmask = (w & 31) ? 0xffffffff << (32 - (w & 31)) : 0xffffffff;
+    for (i = y0; i < y1; i++) {
+        lines = tb->datas + (size_t)i * wpls;
+        lined = tb->datad + i * tb->wpld;
+        for (j = 0, scount = 0, dcount = 0; j < w; j += 32) {
+            dword = 0;
+            for (k = 0; k < d; k++) {
+                sword = (scount < wpls) ? lines[scount++] : 0;
+                dword = (dword << nbits) | tab[sword >> 24];
+                dword = (dword << nbits) | tab[(sword >> 16) & 0xff];
+                dword = (dword << nbits) | tab[(sword >> 8) & 0xff];
+                dword = (dword << nbits) | tab[sword & 0xff];
+            }
+            if (j + 32 > w)
+                dword &= endmask;
+            lined[dcount++] = dword;
+        }
+    }
+    return;
+}
+
+
+LEPTONICA_EXPORT void
+thresholdCmapToBinaryLow(l_uint32  *datad,
+                         l_int32    w,
+                         l_int32    h,
+                         l_int32    wpld,
+                         l_uint32  *datas,
+                         l_int32    d,
+                         l_int32    wpls,
+                         l_uint8   *tab)
+{
+struct ThreshBands  tb;
+
+    tb.datad = datad;
+    tb.w = w;
+    tb.wpld = wpld;
+    tb.datas = datas;
+    tb.d = d;
+    tb.wpls = wpls;
+    tb.thresh = 0;
+    tb.tab = tab;
+    if (datad == datas)
+        thresholdCmapToBinaryBand(&tb, 0, h);
+    else
+        runRowBands(w, h, thresholdCmapToBinaryBand, &tb);
+    return;
+}
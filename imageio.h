@@ -50,7 +50,8 @@ enum {
     IFF_WEBP           = 15,
     IFF_LPDF           = 16,
     IFF_DEFAULT        = 17,
-    IFF_SPIX           = 18
+    IFF_SPIX           = 18,
+    IFF_PNM_GZ         = 19      /* raw pnm compressed with gzip */
 };
 
 
@@ -149,5 +150,11 @@ struct L_Pdf_Data
 typedef struct L_Pdf_Data  L_PDF_DATA;
 
 
+/* ----------------- Row by row binarizing png reader ------------------- */
+    /* The contents are only used in pngio.c */
+struct L_PngBinReader;
+typedef struct L_PngBinReader  L_PNG_BIN_READER;
+
+
 #endif  /* LEPTONICA_IMAGEIO_H */
 
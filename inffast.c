@@ -64,6 +64,296 @@
       requires strm->avail_out >= 258 for each loop to avoid checking for
       output space.
  */
+#ifdef INFLATE_FAST64
+
+#ifdef _MSC_VER
+typedef unsigned __int64 z_word64;
+#else
+typedef unsigned long long z_word64;
+#endif
+
+/* Load eight bytes from anywhere, least significant byte first */
+local z_word64 load64(p)
+const unsigned char FAR *p;
+{
+    z_word64 w;
+    zmemcpy(&w, p, 8);
+    return w;
+}
+
+/* Copy eight bytes, which may be anywhere but must not overlap */
+#define COPY8(dst, src) \
+    do { \
+        z_word64 w8; \
+        zmemcpy(&w8, src, 8); \
+        zmemcpy(dst, &w8, 8); \
+    } while (0)
+
+/*
+   Copy a match of len bytes from dist bytes back in the output, where the two
+   may overlap, and return the new out.  Up to seven bytes after the match are
+   also written.
+
+   For eight or more bytes back, the copy is done eight bytes at a time: each
+   load is then of bytes already written.  A run (dist == 1) is a memset().
+   For a period of two to seven bytes, the first few bytes are copied one at a
+   time until the pattern repeats at least eight bytes back, and the rest is
+   copied eight bytes at a time from there.
+ */
+local unsigned char FAR *copy_match(out, dist, len)
+unsigned char FAR *out;
+unsigned dist;
+unsigned len;
+{
+    unsigned char FAR *from = out - dist;
+    unsigned char FAR *stop = out + len;
+
+    if (dist == 1) {
+        memset(out, *from, len);
+        return stop;
+    }
+    if (dist < 8) {
+        unsigned lead = dist * ((8 + dist - 1) / dist) - dist;
+        if (len <= lead) {
+            do {
+                *out++ = *from++;
+            } while (--len);
+            return out;
+        }
+        len = lead;
+        do {
+            *out++ = *from++;
+        } while (--len);
+        from = out - (lead + dist);
+    }
+    do {
+        COPY8(out, from);
+        out += 8;
+        from += 8;
+    } while (out < stop);
+    return stop;
+}
+
+/*
+   This is inflate_fast() below with a 64-bit bit buffer, in the manner of
+   the inflate of libdeflate and the chunked inflate of Chromium's zlib.
+   The bit buffer is refilled eight bytes at a time to at least 56 bits, which
+   is enough for a whole length/distance pair (48 bits, see below), so there is
+   no more than one refill per code.  The bytes partly in the bit buffer are
+   loaded again by the next refill, which puts the same bits in the same place.
+   Matches are copied by copy_match() above, and the parts from the window
+   with zmemcpy().
+
+   The entry assumptions are as below, but with INFLATE_FAST_MIN_HAVE and
+   INFLATE_FAST_MIN_LEFT (see inffast.h) in place of 6 and 258.  The output is
+   the same.
+ */
+void ZLIB_INTERNAL inflate_fast(strm, start)
+z_streamp strm;
+unsigned start;         /* inflate()'s starting value for strm->avail_out */
+{
+    struct inflate_state FAR *state;
+    unsigned char FAR *in;      /* local strm->next_in */
+    unsigned char FAR *last;    /* while in < last, eight bytes can be read */
+    unsigned char FAR *out;     /* local strm->next_out */
+    unsigned char FAR *beg;     /* inflate()'s initial strm->next_out */
+    unsigned char FAR *end;     /* while out < end, enough space available */
+#ifdef INFLATE_STRICT
+    unsigned dmax;              /* maximum distance from zlib header */
+#endif
+    unsigned wsize;             /* window size or zero if not using window */
+    unsigned whave;             /* valid bytes in the window */
+    unsigned wnext;             /* window write index */
+    unsigned char FAR *window;  /* allocated sliding window, if wsize != 0 */
+    z_word64 hold;              /* local strm->hold */
+    unsigned bits;              /* local strm->bits */
+    code const FAR *lcode;      /* local strm->lencode */
+    code const FAR *dcode;      /* local strm->distcode */
+    unsigned lmask;             /* mask for first level of length codes */
+    unsigned dmask;             /* mask for first level of distance codes */
+    code here;                  /* retrieved table entry */
+    unsigned op;                /* code bits, operation, extra bits, or */
+                                /*  window position, window bytes to copy */
+    unsigned len;               /* match length, unused bytes */
+    unsigned dist;              /* match distance */
+    unsigned char FAR *from;    /* where to copy match from */
+
+    /* copy state to local variables */
+    state = (struct inflate_state FAR *)strm->state;
+    in = strm->next_in;
+    last = in + (strm->avail_in - 7);
+    out = strm->next_out;
+    beg = out - (start - strm->avail_out);
+    end = out + (strm->avail_out - (INFLATE_FAST_MIN_LEFT - 1));
+#ifdef INFLATE_STRICT
+    dmax = state->dmax;
+#endif
+    wsize = state->wsize;
+    whave = state->whave;
+    wnext = state->wnext;
+    window = state->window;
+    hold = state->hold;
+    bits = state->bits;
+    lcode = state->lencode;
+    dcode = state->distcode;
+    lmask = (1U << state->lenbits) - 1;
+    dmask = (1U << state->distbits) - 1;
+
+    /* decode literals and length/distances until end-of-block or not enough
+       input data or output space */
+    do {
+        if (bits < 48) {
+            hold |= load64(in) << bits;
+            in += (63 - bits) >> 3;
+            bits |= 56;
+        }
+        here = lcode[hold & lmask];
+      dolen:
+        op = (unsigned)(here.bits);
+        hold >>= op;
+        bits -= op;
+        op = (unsigned)(here.op);
+        if (op == 0) {                          /* literal */
+            Tracevv((stderr, here.val >= 0x20 && here.val < 0x7f ?
+                    "inflate:         literal '%c'\n" :
+                    "inflate:         literal 0x%02x\n", here.val));
+            *out++ = (unsigned char)(here.val);
+        }
+        else if (op & 16) {                     /* length base */
+            len = (unsigned)(here.val);
+            op &= 15;                           /* number of extra bits */
+            if (op) {
+                len += (unsigned)hold & ((1U << op) - 1);
+                hold >>= op;
+                bits -= op;
+            }
+            Tracevv((stderr, "inflate:         length %u\n", len));
+            here = dcode[hold & dmask];
+          dodist:
+            op = (unsigned)(here.bits);
+            hold >>= op;
+            bits -= op;
+            op = (unsigned)(here.op);
+            if (op & 16) {                      /* distance base */
+                dist = (unsigned)(here.val);
+                op &= 15;                       /* number of extra bits */
+                dist += (unsigned)hold & ((1U << op) - 1);
+#ifdef INFLATE_STRICT
+                if (dist > dmax) {
+                    strm->msg = (char *)"invalid distance too far back";
+                    state->mode = BAD;
+                    break;
+                }
+#endif
+                hold >>= op;
+                bits -= op;
+                Tracevv((stderr, "inflate:         distance %u\n", dist));
+                op = (unsigned)(out - beg);     /* max distance in output */
+                if (dist > op) {                /* see if copy from window */
+                    op = dist - op;             /* distance back in window */
+                    if (op > whave) {
+                        if (state->sane) {
+                            strm->msg =
+                                (char *)"invalid distance too far back";
+                            state->mode = BAD;
+                            break;
+                        }
+#ifdef INFLATE_ALLOW_INVALID_DISTANCE_TOOFAR_ARRR
+                        if (len <= op - whave) {
+                            do {
+                                *out++ = 0;
+                            } while (--len);
+                            continue;
+                        }
+                        len -= op - whave;
+                        do {
+                            *out++ = 0;
+                        } while (--op > whave);
+                        if (op == 0) {
+                            from = out - dist;
+                            do {
+                                *out++ = *from++;
+                            } while (--len);
+                            continue;
+                        }
+#endif
+                    }
+                    from = window;
+                    if (wnext == 0) {           /* very common case */
+                        from += wsize - op;
+                    }
+                    else if (wnext < op) {      /* wrap around window */
+                        from += wsize + wnext - op;
+                        op -= wnext;
+                        if (op < len) {         /* some from end of window */
+                            len -= op;
+                            zmemcpy(out, from, op);
+                            out += op;
+                            from = window;
+                            op = wnext;         /* then start of window */
+                        }
+                    }
+                    else {                      /* contiguous in window */
+                        from += wnext - op;
+                    }
+                    if (op < len) {             /* some from window */
+                        len -= op;
+                        zmemcpy(out, from, op);
+                        out += op;
+                        out = copy_match(out, dist, len);  /* rest from output */
+                    }
+                    else {
+                        zmemcpy(out, from, len);
+                        out += len;
+                    }
+                }
+                else
+                    out = copy_match(out, dist, len);  /* direct from output */
+            }
+            else if ((op & 64) == 0) {          /* 2nd level distance code */
+                here = dcode[here.val + (hold & ((1U << op) - 1))];
+                goto dodist;
+            }
+            else {
+                strm->msg = (char *)"invalid distance code";
+                state->mode = BAD;
+                break;
+            }
+        }
+        else if ((op & 64) == 0) {              /* 2nd level length code */
+            here = lcode[here.val + (hold & ((1U << op) - 1))];
+            goto dolen;
+        }
+        else if (op & 32) {                     /* end-of-block */
+            Tracevv((stderr, "inflate:         end of block\n"));
+            state->mode = TYPE;
+            break;
+        }
+        else {
+            strm->msg = (char *)"invalid literal/length code";
+            state->mode = BAD;
+            break;
+        }
+    } while (in < last && out < end);
+
+    /* return unused bytes (on entry, bits < 8, so in won't go too far back) */
+    len = bits >> 3;
+    in -= len;
+    bits -= len << 3;
+    hold &= (1U << bits) - 1;
+
+    /* update state and return */
+    strm->next_in = in;
+    strm->next_out = out;
+    strm->avail_in = (unsigned)(last - in) + 7;
+    strm->avail_out = (unsigned)(end - out) + (INFLATE_FAST_MIN_LEFT - 1);
+    state->hold = (unsigned long)hold;
+    state->bits = bits;
+    return;
+}
+
+#else /* !INFLATE_FAST64 */
+
 void ZLIB_INTERNAL inflate_fast(strm, start)
 z_streamp strm;
 unsigned start;         /* inflate()'s starting value for strm->avail_out */
@@ -323,6 +613,8 @@ unsigned start;         /* inflate()'s starting value for strm->avail_out */
     return;
 }
 
+#endif /* INFLATE_FAST64 */
+
 /*
    inflate_fast() speedups that turned out slower (on a PowerPC G3 750CXe):
    - Using bit fields for code structure
@@ -8,4 +8,21 @@
    subject to change. Applications should only use zlib.h.
  */
 
+/* On 64-bit little-endian machines inflate_fast() keeps a 64-bit bit buffer,
+   refilled eight bytes at a time, and copies matches eight bytes at a time.
+   For that it needs a little more input and output to be available than the
+   classic one.  Define NO_INFLATE_FAST64 to use the classic one anyway.
+ */
+#if !defined(NO_INFLATE_FAST64) && !defined(ASMINF) && \
+    (defined(__x86_64__) || defined(_M_X64) || \
+     (defined(__aarch64__) && defined(__BYTE_ORDER__) && \
+      __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__))
+#  define INFLATE_FAST64
+#  define INFLATE_FAST_MIN_HAVE 8     /* one eight byte refill */
+#  define INFLATE_FAST_MIN_LEFT 265   /* longest match, plus seven bytes */
+#else
+#  define INFLATE_FAST_MIN_HAVE 6
+#  define INFLATE_FAST_MIN_LEFT 258
+#endif
+
 void ZLIB_INTERNAL inflate_fast OF((z_streamp strm, unsigned start));
@@ -16,111 +16,3325 @@
 // limitations under the License.
 
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#if !defined(WIN32)
+#include <sys/time.h>
+#endif
 
 #include <allheaders.h>
 #include <pix.h>
 
+#include "jbig2arith.h"
+#include "jbig2cache.h"
 #include "jbig2enc.h"
+#include "jbig2mmr.h"
+#include "jbig2pool.h"
+#include "jbig2raw.h"
+#include "jbig2sym.h"
+#include "jbig2tiff.h"
 
 #if defined(WIN32)
 #define WINBINARY O_BINARY
 #else
 #define WINBINARY 0
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+#endif
+
+#if defined(__linux__)
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
 #endif
 
+// Most bytes of freed image data kept to be reused by the next pages
+#define PIX_DATA_CACHE_BYTES (256 << 20)
+
+// Largest "data" request of the server without --memory-limit (see serve)
+#define MAX_REQUEST_DATA ((size_t) 1 << 30)
+
 static void
 usage(const char *argv0) {
   fprintf(stderr, "Usage: %s [options] <input filenames...>\n", argv0);
+  fprintf(stderr, "A filename of - reads a PNG, PNM or TIFF image from stdin.\n");
   fprintf(stderr, "Some functions removed for pdfsizeopt.\n");
   fprintf(stderr, "Options:\n");
+  fprintf(stderr, "  -b <basename>: output file root name; each page is written to\n"
+                  "     <basename>.0000, <basename>.0001, ... (def: all pages to stdout)\n");
+  fprintf(stderr, "  --manifest <file>: read the pages from file (- for stdin) rather\n"
+                  "     than the command line, one per line, each with options of its own\n"
+                  "     and possibly its own output (see read_manifest in jbig2.cc); with\n"
+                  "     -j, pages written to files of their own are coded largest first\n");
+  fprintf(stderr, "  --journal <file>: record the pages written in file, and skip those\n"
+                  "     already written, and unchanged since, when run again, e.g. to\n"
+                  "     finish a batch which was stopped (see journal_entry in jbig2.cc)\n");
+  fprintf(stderr, "  --multipage: write all the pages as one JBIG2 file, to stdout or to\n"
+                  "     <basename>.jb2\n");
+  fprintf(stderr, "  --xobjects: write every page as the body of a PDF image XObject (as\n"
+                  "     with -p, with the dictionary and stream around it) into one file,\n"
+                  "     to stdout or <basename>.xobj, followed by an index of where each\n"
+                  "     one is (see write_xobject_index in jbig2.cc)\n");
+  fprintf(stderr, "  --framed: write all the pages as length-prefixed records of one\n"
+                  "     stream, to stdout or <basename>.frames, followed by an index of\n"
+                  "     where each one is, so that the output of a batch can be split\n"
+                  "     in one pass or a page found by seeking (see write_frame in\n"
+                  "     jbig2.cc)\n");
+  fprintf(stderr, "  -j <threads>: number of pages to encode in parallel (def: 1, 0: one per CPU);\n"
+                  "     threads with no page left help with the stripes (-S) of the others\n");
+  fprintf(stderr, "  --affinity <compact|spread>: pin the threads to CPUs (Linux), filling\n"
+                  "     one NUMA node before the next or going round the nodes; the images\n"
+                  "     and coder of a page are then kept on the node of its thread, and\n"
+                  "     only threads of that node help with its stripes\n");
+  fprintf(stderr, "  --max-inflight <pages>: most pages being read, coded or waiting to\n"
+                  "     be written at a time, which bounds the memory used with -j when\n"
+                  "     one page takes much longer than the ones after it (def: no limit)\n");
+  fprintf(stderr, "  --memory-limit <MiB>: keep the images of the pages being coded and\n"
+                  "     their output within about this much; pages waiting for memory\n"
+                  "     are started later, and a PNG page larger than it all is read by\n"
+                  "     rows (ignoring -S, --cache and --auto-tpgd for it) (def: no limit)\n");
+  fprintf(stderr, "  -S --stripe-height <rows>: encode each page as stripes of this many\n"
+                  "     rows, which can be encoded in parallel (def: whole page)\n");
+  fprintf(stderr, "  --interleave <n>: with -S, code n (1..%d) stripes at a time on each\n"
+                  "     thread, in one loop; the output is the same (def: 1)\n",
+          JBIG2_INTERLEAVE_MAX);
+  fprintf(stderr, "  --stream: write each page while it is being coded, with an unknown\n"
+                  "     length generic region; to stdout, pages are coded one at a time\n");
+  fprintf(stderr, "  --server: encode the pages requested on stdin, replying on stdout\n"
+                  "     (see the comments of serve in jbig2.cc for the protocol)\n");
+#if !defined(WIN32)
+  fprintf(stderr, "  --socket <path>: as --server, but for the clients connecting to\n"
+                  "     a Unix domain socket at path\n");
+#endif
+  fprintf(stderr, "  --cache <MiB>: keep the streams of pages in memory, up to this much,\n"
+                  "     and reuse them for identical pages (same image and options)\n");
+  fprintf(stderr, "  --cache-dir <dir>: also keep the streams of pages in the existing\n"
+                  "     directory dir, to be reused by later runs\n");
+  fprintf(stderr, "  --trusted-png: don't check the CRCs of PNG input, which is faster;\n"
+                  "     only for files which can't be damaged, e.g. just written\n");
+  fprintf(stderr, "  --hugepages: keep the large images and the coding contexts in\n"
+                  "     huge pages (Linux), for fewer TLB misses on big pages\n");
   fprintf(stderr, "  -d --duplicate-line-removal: use TPGD in generic region coder\n");
+  fprintf(stderr, "  --deadline-ms <ms>: code each page within this long from when it\n"
+                  "     is started: once the coding time says it would take longer,\n"
+                  "     the rest of the page (or of its stripes, with -S) is coded with\n"
+                  "     MMR; --stats=json reports which; pages are then never read by\n"
+                  "     rows\n");
+  fprintf(stderr, "  --halftone <density>: code the bands of rows of coarse halftones with\n"
+                  "     MMR, which is faster there, the rest as usual: those in which at\n"
+                  "     least this fraction (below %g) of the pixels differ from the one\n"
+                  "     to their left; text is about 0.05 at 300 dpi; pages are then\n"
+                  "     never read by rows\n",
+          JBIG2_HALFTONE_MMR_MAX_DENSITY);
+  fprintf(stderr, "  --despeckle <size>: remove the specks of black pixels left by the\n"
+                  "     scanner, groups of at most size (1 or 2) pixels with only white\n"
+                  "     around them, before coding; smaller and faster to code, but\n"
+                  "     lossy; pages are then never read by rows\n");
+  fprintf(stderr, "  --auto-tpgd <cutoff>: use TPGD, as -d, only for the pages on which at\n"
+                  "     least this fraction (0..1) of the rows repeat the row above; pages\n"
+                  "     with many blank lines code faster, dense ones don't pay for it\n"
+                  "     (0.3 is a good start)\n");
+  fprintf(stderr, "  -g <template>: generic region template, 0..3; 1..3 are faster but\n"
+                  "     compress less well (def: 0)\n");
+  fprintf(stderr, "  --mmr: code generic regions with MMR (G4): many times faster,\n"
+                  "     but larger\n");
+  fprintf(stderr, "  -s --symbol-mode: use text region, not generic coder: smaller for text\n"
+                  "     but lossy; one symbol dictionary is shared by all the pages, which\n"
+                  "     go to one JBIG2 file (as --multipage) or, with -p, to <basename>.sym\n"
+                  "     and <basename>.0000, ... (-b is needed)\n");
+  fprintf(stderr, "  --refine <ratio>: code a page of which at least this fraction (0..1]\n"
+                  "     of the rows are the same as in a page before it as a refinement\n"
+                  "     of that page, e.g. for forms; implies --multipage (0.5 is a good\n"
+                  "     start)\n");
+  fprintf(stderr, "  --verify: decode the stream of each page with the built-in decoder\n"
+                  "     and check that it gives the image back, failing with exit code\n"
+                  "     12 if not; pages are then never read by rows\n");
+  fprintf(stderr, "  --estimate <fraction>: don't encode, but print an estimate of the\n"
+                  "     size of each page, from coding this fraction (0..1] of its rows\n");
   fprintf(stderr, "  -p --pdf: produce PDF ready data\n");
   fprintf(stderr, "  -t <threshold>: set classification threshold for symbol coder (def: 0.85)\n"); 
+  fprintf(stderr, "  -w <weight>: set classification weight factor for symbol coder (def: 0.5)\n");
   fprintf(stderr, "  -T <bw threshold>: set 1 bpp threshold (def: 188)\n");
   fprintf(stderr, "  -2: upsample 2x before thresholding\n");
   fprintf(stderr, "  -4: upsample 4x before thresholding\n");
+  fprintf(stderr, "  -r <factor>: downscale 2x or 4x after thresholding, for a quick\n"
+                  "     preview: a pixel is black if any in its block is (see --rank);\n"
+                  "     pages are then never read by rows\n");
+  fprintf(stderr, "  --rank <level>: with -r, a pixel is black if at least level\n"
+                  "     (1..factor^2) pixels in its block are (def: 1)\n");
+  fprintf(stderr, "  --xres <dpi>, --yres <dpi>: the resolution to write into the page\n"
+                  "     information (def: that of the image)\n");
+  fprintf(stderr, "  --raw <stream>: the inputs are raw 1 bpp image streams taken out of\n"
+                  "     a PDF file rather than image files, decoded a row at a time:\n"
+                  "       ccitt:<w>x<h>[,k=<K>][,blackis1][,align][,invert]\n"
+                  "       flate:<w>x<h>[,predictor=<n>][,invert]\n"
+                  "     with the /DecodeParms of the stream, and invert for an image\n"
+                  "     with /Decode [1 0]\n");
+  fprintf(stderr, "  --stats=json: write the time and CPU time of each stage, the peak\n"
+                  "     image memory and the output size of each page to stderr, as one\n"
+                  "     JSON object per line (see print_stats in jbig2.cc)\n");
+  fprintf(stderr, "  --stats=perf: as json, with the cycles, instructions, branch misses\n"
+                  "     and L1 data and last level cache misses of each stage, read from\n"
+                  "     the hardware counters where the kernel allows it\n");
   fprintf(stderr, "  -v: be verbose\n");
+  fprintf(stderr, "The environment variable JBIG2_CPU=scalar|sse2|avx2 limits the SIMD code\n"
+                  "run by the kernels to that level, e.g. to time each version; the output\n"
+                  "is the same at every level\n");
 }
 
 static bool verbose = false;
 
 
-static void
-pixInfo(PIX *pix, const char *msg) {
-  if (msg != NULL) fprintf(stderr, "%s ", msg);
-  if (pix == NULL) {
-    fprintf(stderr, "NULL pointer!\n");
-    return;
-  }
-  fprintf(stderr, "%u x %u (%d bits) %udpi x %udpi, refcount = %u\n",
-          pix->w, pix->h, pix->d, pix->xres, pix->yres, pix->refcount);
-}
+static void
+pixInfo(PIX *pix, const char *msg) {
+  if (msg != NULL) fprintf(stderr, "%s ", msg);
+  if (pix == NULL) {
+    fprintf(stderr, "NULL pointer!\n");
+    return;
+  }
+  fprintf(stderr, "%u x %u (%d bits) %udpi x %udpi, refcount = %u\n",
+          pix->w, pix->h, pix->d, pix->xres, pix->yres, pix->refcount);
+}
+
+#ifdef WIN32
+// -----------------------------------------------------------------------------
+// Windows, sadly, lacks asprintf
+// -----------------------------------------------------------------------------
+#include <stdarg.h>
+int
+asprintf(char **strp, const char *fmt, ...) {
+    va_list va;
+    va_start(va, fmt);
+
+    const int required = vsnprintf(NULL, 0, fmt, va);
+    char *const buffer = (char *) malloc(required + 1);
+    const int ret = vsnprintf(buffer, required + 1, fmt, va);
+    *strp = buffer;
+
+    va_end(va);
+
+    return ret;
+}
+#endif
+
+static int write_all(int fd, const void *buf, size_t count) {
+  const char *p = (const char*)buf;
+  while (count > 0) {
+    ssize_t got = write(fd, p, count);
+    if (got < 0) return -1;
+    p += got;
+    count -= (size_t) got;
+  }
+  return 0;
+}
+
+// -----------------------------------------------------------------------------
+// Read everything from fd, which may be a pipe, into a malloced buffer. Returns
+// -1 on error.
+// -----------------------------------------------------------------------------
+static int
+read_all(int fd, uint8_t **data, size_t *size) {
+  size_t capacity = 64 * 1024;
+  *size = 0;
+  *data = (uint8_t *) malloc(capacity);
+  if (!*data) abort();
+  for (;;) {
+    if (*size == capacity) {
+      capacity *= 2;
+      *data = (uint8_t *) realloc(*data, capacity);
+      if (!*data) abort();
+    }
+    const ssize_t got = read(fd, *data + *size, capacity - *size);
+    if (got == 0) return 0;
+    if (got < 0) {
+      free(*data);
+      *data = NULL;
+      return -1;
+    }
+    *size += got;
+  }
+}
+
+// -----------------------------------------------------------------------------
+// Map the whole of filename into memory, read only, and set *mapped. An empty
+// file gives *data == NULL. The filename "-" is stdin, which is read into a
+// malloced buffer instead (*mapped is false), as are all files on WIN32.
+// Returns -1 on error.
+// -----------------------------------------------------------------------------
+static int
+map_input(const char *filename, uint8_t **data, size_t *size, bool *mapped) {
+  *mapped = false;
+  if (strcmp(filename, "-") == 0) {
+#if defined(WIN32)
+    setmode(0, WINBINARY);
+#endif
+    return read_all(0, data, size);
+  }
+  const int fd = open(filename, O_RDONLY | WINBINARY);
+  if (fd < 0) return -1;
+#if defined(WIN32)
+  const int ret = read_all(fd, data, size);
+#else
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return -1;
+  }
+  *data = NULL;
+  *size = st.st_size;
+  if (*size > 0) {
+    void *p = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    *data = p == MAP_FAILED ? NULL : (uint8_t *) p;
+#if defined(MADV_SEQUENTIAL)
+    // the file is decoded from start to end, so let the kernel read ahead
+    if (*data) madvise(p, *size, MADV_SEQUENTIAL);
+#endif
+    *mapped = *data != NULL;
+  }
+  const int ret = *size > 0 && !*data ? -1 : 0;
+#endif
+  close(fd);
+  return ret;
+}
+
+static void
+unmap_input(uint8_t *data, size_t size, bool mapped) {
+  if (!data) return;
+#if defined(WIN32)
+  (void) size;
+  (void) mapped;
+  free(data);
+#else
+  if (mapped) {
+    munmap(data, size);
+  } else {
+    free(data);
+  }
+#endif
+}
+
+// -----------------------------------------------------------------------------
+// Open <basename><suffix> for writing, or stdout if basename is NULL. Returns
+// -1 on error.
+// -----------------------------------------------------------------------------
+static int
+open_output(const char *basename, const char *suffix) {
+  if (!basename) return 1;
+
+  char *filename;
+  asprintf(&filename, "%s%s", basename, suffix);
+  const int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | WINBINARY, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "Unable to open \"%s\" for writing\n", filename);
+  }
+  free(filename);
+  return fd;
+}
+
+// -----------------------------------------------------------------------------
+// Open the output of page number pageno: output if it isn't NULL, else stdout
+// if basename is NULL, otherwise <basename>.<pageno>
+// -----------------------------------------------------------------------------
+static int
+open_page(const char *basename, const char *output, int pageno) {
+  if (output) return open_output(output, "");
+  char suffix[16];
+  snprintf(suffix, sizeof(suffix), ".%04d", pageno);
+  return open_output(basename, suffix);
+}
+
+static int
+close_page(const char *basename, int fd) {
+  if (!basename) return 0;
+  return close(fd);
+}
+
+// -----------------------------------------------------------------------------
+// Write the encoded stream of page number pageno (see open_page)
+// -----------------------------------------------------------------------------
+static int
+write_page(const char *basename, const char *output, int pageno,
+           const uint8_t *buf, size_t length) {
+  const int fd = open_page(basename, output, pageno);
+  if (fd < 0) return -1;
+  const int ret = write_all(fd, buf, length);
+  if (close_page(output ? output : basename, fd) < 0) return -1;
+  return ret;
+}
+
+// -----------------------------------------------------------------------------
+// A jbig2enc_sink writing to the file descriptor of the fd_sink_state pointed
+// to by opaque
+// -----------------------------------------------------------------------------
+struct fd_sink_state {
+  int fd;
+  size_t length;  // bytes written so far
+};
+
+static int
+fd_sink(void *opaque, const uint8_t *data, size_t length) {
+  struct fd_sink_state *const state = (struct fd_sink_state *) opaque;
+  state->length += length;
+  return write_all(state->fd, data, length);
+}
+
+// -----------------------------------------------------------------------------
+// Returns a monotonic time in seconds
+// -----------------------------------------------------------------------------
+static double
+now() {
+#if defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+#else
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+#endif
+}
+
+// -----------------------------------------------------------------------------
+// Returns the CPU time used by the calling thread in seconds, or 0 if unknown
+// -----------------------------------------------------------------------------
+static double
+thread_cpu_time() {
+#if defined(CLOCK_THREAD_CPUTIME_ID)
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+#else
+  return 0;
+#endif
+}
+
+// -----------------------------------------------------------------------------
+// With --stats: the stages timed for each page
+// -----------------------------------------------------------------------------
+enum {
+  STAGE_READ = 0,  // file into memory (map_input)
+  STAGE_SNIFF,  // findFileFormatBuffer
+  STAGE_DECODE,  // PNG, PNM, TIFF... into a pix
+  STAGE_CMAP,  // colormap removal
+  STAGE_GRAY,  // rgb to gray, only done on its own before upscaling
+  STAGE_THRESHOLD,  // to 1 bpp, upscaled with -2 or -4
+  STAGE_DESPECKLE,  // with --despeckle
+  STAGE_CODING,  // the rest: the JBIG2 stream of the page
+  NSTAGES
+};
+
+static const char *const stage_names[NSTAGES] = {
+  "read", "sniff", "decode", "cmap", "gray", "threshold", "despeckle",
+  "coding",
+};
+
+// of JBIG2_PATH_*
+static const char *const coder_path_names[] = {"arith", "arith+mmr", "mmr"};
+
+// With --stats=perf, the hardware counters read with each time
+enum {
+  COUNTER_CYCLES = 0,
+  COUNTER_INSTRUCTIONS,
+  COUNTER_BRANCH_MISSES,
+  COUNTER_L1D_MISSES,  // L1 data cache read misses
+  COUNTER_LLC_MISSES,  // last level cache misses
+  NCOUNTERS
+};
+
+static const char *const counter_names[NCOUNTERS] = {
+  "cycles", "instructions", "branch_misses", "l1d_misses", "llc_misses",
+};
+
+struct stage_time {
+  double wall;
+  double cpu;  // of the thread which did the stage
+  unsigned long long counters[NCOUNTERS];  // of that thread, in user space
+};
+
+struct page_stats {
+  struct stage_time stages[NSTAGES];
+  struct stage_time mark;  // when the stage being timed started
+  L_PIX_BYTES pix_bytes;  // of the image data made for the page
+  int width, height;  // of the 1 bpp image
+  bool by_rows;  // read by encode_page_rows: decoding and thresholding are
+                 // done as the rows are coded, and timed as coding
+  int coder_path;  // with --deadline-ms, the coders used (JBIG2_PATH_*)
+  int halftone_rows;  // with --halftone, the rows coded with MMR
+  bool counted[NCOUNTERS];  // with --stats=perf, the counters which could be
+                           // read on the page's worker
+#ifdef JBIG2_CODER_STATS
+  struct jbig2enc_stats coder;  // of the coder contexts used for the page
+  struct jbig2enc_stats coder_mark;  // of the context at stats_begin
+#endif
+};
+
+// -----------------------------------------------------------------------------
+// With --stats=perf: the calling thread's hardware counters, opened as one
+// perf_event_open group the first time the thread reads them, so that they
+// all count over the same instructions. A counter which the processor or the
+// kernel doesn't have (none at all without perf events, or with
+// perf_event_paranoid above 2) reads as 0 and is printed as null.
+// -----------------------------------------------------------------------------
+static bool stats_perf = false;
+
+#if defined(__linux__)
+static __thread int perf_leader = -2;  // fd of the group, -1 if it couldn't be
+                                       // opened, -2 if not tried yet
+static __thread int perf_slot[NCOUNTERS];  // of each counter in the values
+                                           // read, -1 if not opened
+static __thread int perf_nopen;  // counters in the group
+static bool perf_warned = false;
+
+static int
+perf_open(unsigned type, unsigned long long config, int group) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.read_format = PERF_FORMAT_GROUP;
+  attr.disabled = group < 0;  // the leader starts the group when enabled
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return syscall(__NR_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+static void
+perf_start() {
+  static const struct {
+    unsigned type;
+    unsigned long long config;
+  } events[NCOUNTERS] = {
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+                         (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+  };
+  perf_leader = -1;
+  perf_nopen = 0;
+  for (int i = 0; i < NCOUNTERS; ++i) {
+    perf_slot[i] = -1;
+    const int fd = perf_open(events[i].type, events[i].config, perf_leader);
+    if (fd < 0) {
+      if (perf_leader < 0 && i == COUNTER_CYCLES && !perf_warned) {
+        perf_warned = true;
+        fprintf(stderr, "Hardware counters unavailable (perf_event_open: %s); "
+                        "they are printed as null\n", strerror(errno));
+      }
+      continue;
+    }
+    if (perf_leader < 0) perf_leader = fd;
+    perf_slot[i] = perf_nopen++;
+  }
+  if (perf_leader >= 0) ioctl(perf_leader, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+static void
+perf_read(unsigned long long *counters) {
+  if (perf_leader == -2) perf_start();
+  unsigned long long values[1 + NCOUNTERS];  // nr, then the counters
+  const ssize_t want = (1 + perf_nopen) * sizeof(values[0]);
+  if (perf_leader < 0 || read(perf_leader, values, want) != want) {
+    memset(counters, 0, NCOUNTERS * sizeof(*counters));
+    return;
+  }
+  for (int i = 0; i < NCOUNTERS; ++i)
+    counters[i] = perf_slot[i] >= 0 ? values[1 + perf_slot[i]] : 0;
+}
+
+// Whether counter i can be read on the calling thread
+static bool
+perf_has(int i) {
+  return perf_leader >= 0 && perf_slot[i] >= 0;
+}
+#else
+static void
+perf_read(unsigned long long *counters) {
+  memset(counters, 0, NCOUNTERS * sizeof(*counters));
+}
+
+static bool
+perf_has(int) {
+  return false;
+}
+#endif
+
+static void
+stats_time(struct stage_time *t) {
+  t->wall = now();
+  t->cpu = thread_cpu_time();
+  if (stats_perf) perf_read(t->counters);
+  else memset(t->counters, 0, sizeof(t->counters));
+}
+
+// -----------------------------------------------------------------------------
+// Add the time since the last mark to stage and mark the time again
+// -----------------------------------------------------------------------------
+static void
+stats_add(struct page_stats *stats, int stage) {
+  if (!stats) return;
+  struct stage_time t;
+  stats_time(&t);
+  stats->stages[stage].wall += t.wall - stats->mark.wall;
+  stats->stages[stage].cpu += t.cpu - stats->mark.cpu;
+  for (int i = 0; i < NCOUNTERS; ++i)
+    stats->stages[stage].counters[i] += t.counters[i] - stats->mark.counters[i];
+  stats->mark = t;
+}
+
+// An L_STEP_FUNC timing the steps of pixConvertTo1Transfer
+static void
+convert_step_done(void *arg, int step) {
+  stats_add((struct page_stats *) arg,
+            step == L_STEP_CMAP ? STAGE_CMAP :
+            step == L_STEP_GRAY ? STAGE_GRAY : STAGE_THRESHOLD);
+}
+
+// -----------------------------------------------------------------------------
+// Start timing work on a page on this thread, coded with ctx: the pix data
+// made until stats_end are charged to it, and the steps of the conversion to
+// 1 bpp are timed
+// -----------------------------------------------------------------------------
+static void
+stats_begin(struct page_stats *stats, const struct jbig2enc_ctx *ctx) {
+  if (!stats) return;
+  setPixBytesCounter(&stats->pix_bytes);
+  setConvertStepHook(convert_step_done, stats);
+#ifdef JBIG2_CODER_STATS
+  jbig2enc_getstats(ctx, &stats->coder_mark);
+#else
+  (void) ctx;
+#endif
+  stats_time(&stats->mark);
+  for (int i = 0; i < NCOUNTERS; ++i)
+    stats->counted[i] = stats_perf && perf_has(i);
+}
+
+// -----------------------------------------------------------------------------
+// Stop timing work on a page, adding the time since the last mark to stage
+// -----------------------------------------------------------------------------
+static void
+stats_end(struct page_stats *stats, int stage,
+          const struct jbig2enc_ctx *ctx) {
+  if (!stats) return;
+  stats_add(stats, stage);
+  setConvertStepHook(NULL, NULL);
+  setPixBytesCounter(NULL);
+#ifdef JBIG2_CODER_STATS
+  struct jbig2enc_stats now;
+  jbig2enc_getstats(ctx, &now);
+  stats->coder.bits += now.bits - stats->coder_mark.bits;
+  stats->coder.lps += now.lps - stats->coder_mark.lps;
+  stats->coder.renorm_shifts +=
+      now.renorm_shifts - stats->coder_mark.renorm_shifts;
+  stats->coder.byteouts += now.byteouts - stats->coder_mark.byteouts;
+  stats->coder.stuffed += now.stuffed - stats->coder_mark.stuffed;
+  stats->coder.bytes += now.bytes - stats->coder_mark.bytes;
+  stats->coder.contexts += now.contexts - stats->coder_mark.contexts;
+#else
+  (void) ctx;
+#endif
+}
+
+// -----------------------------------------------------------------------------
+// Settings from the command line which apply to every page, unless changed for
+// some of them by their lines of the manifest (see read_manifest)
+// -----------------------------------------------------------------------------
+struct encode_options {
+  bool duplicate_line_removal;
+  int gbtemplate;
+  bool mmr;
+  bool pdfmode;
+  int bw_threshold;
+  bool up2, up4;
+  int reduce;  // 2 or 4 to downscale after thresholding, else 1
+  int reduce_rank;  // with reduce, the level of pixReduceRankBinary
+  int xres, yres;  // if > 0, the resolution written into the page information
+                   // instead of that of the image
+  struct jbig2_raw_params raw;  // with --raw, how the inputs are coded
+  const char *basename;
+  int stripe_height;  // 0 to encode each page as a single region
+  int stripe_threads;  // most threads used per page for the stripes and row
+                       // bands
+  int interleave;  // stripes coded at a time by each thread (see
+                   // jbig2_encode_generic_striped)
+  bool stream;  // write pages as they are coded (see jbig2_encode_generic_sink)
+  bool multipage;  // join the pages into one file (see jbig2_file_page)
+  bool xobjects;  // join the pages into one file of PDF XObjects (see
+                  // jbig2_pdf_xobject)
+  bool framed;  // join the pages into one stream of records (see write_frame)
+  struct jbig2_symbols *symbols;  // the classes of symbols in symbol mode
+  struct jbig2_cache *cache;  // of the streams of pages already encoded, or NULL
+  double estimate;  // if > 0, estimate the sizes from this fraction of rows
+  int despeckle;  // if > 0, remove specks of up to this many pixels (see
+                  // jbig2_despeckle)
+  double auto_tpgd;  // if >= 0, TPGD is used for the pages with at least
+                     // this fraction of repeated rows (see
+                     // jbig2_duplicate_row_ratio), instead of for all pages
+                     // with duplicate_line_removal
+  double refine;  // if > 0, pages with at least this fraction of their rows
+                  // the same as in their reference are refinements of it
+                  // (see jbig2_encode_refined_page)
+  double deadline;  // if > 0, the seconds each page has (see
+                   // jbig2_encode_generic_deadline)
+  double halftone;  // if > 0, the least density of the bands coded with MMR
+                    // (see jbig2_encode_generic_halftone)
+  bool stats;  // print the stats of each page (see print_stats)
+  bool verify;  // decode the stream of each page and compare it with the
+                // image (see verify_page)
+  struct jbig2_budget *budget;  // with --memory-limit, shared by the pages
+                                // being coded (see page_budget), else NULL
+};
+
+// -----------------------------------------------------------------------------
+// Everything but the image which goes into the stream of a page, hashed into
+// its cache key. Bump CACHE_VERSION whenever the encoder output changes.
+// -----------------------------------------------------------------------------
+#define CACHE_VERSION 2
+
+struct cache_params {
+  int version;
+  int full_headers;
+  int duplicate_line_removal;
+  int gbtemplate;
+  int mmr;
+  int stripe_height;
+  int xres, yres;
+  double halftone;
+};
+
+// -----------------------------------------------------------------------------
+// With --journal: everything the output of a page is made from, all of which
+// must be unchanged for the output to be reused (see journal_resume)
+// -----------------------------------------------------------------------------
+struct journal_key {
+  bool valid;  // false for stdin, or a file which can't be found
+  uint64_t input_size;
+  int64_t input_mtime;
+  struct jbig2_cache_key input_hash;  // of the whole file
+  uint64_t params_hash;  // of the options of the page (see journal_params)
+};
+
+// -----------------------------------------------------------------------------
+// A file mapped by map_input
+// -----------------------------------------------------------------------------
+struct page_input {
+  uint8_t *data;
+  size_t size;
+  bool mapped;
+  int users;  // of a stream of PNM images, the pages yet to be done with it
+};
+
+// -----------------------------------------------------------------------------
+// A single input image and, once it has been encoded, its JBIG2 stream
+// -----------------------------------------------------------------------------
+struct page {
+  int pageno;
+  const char *filename;
+  const char *output;  // the file it is written to instead of the one named
+                       // by open_page, or NULL
+  const struct encode_options *opts;  // those of the batch, or of its line of
+                                      // the manifest
+  int subimage;  // the index of the image of a TIFF file, else -1
+  uint8_t *input;  // the file mapped by map_input, until the page is decoded
+  size_t input_size;
+  bool input_mapped;
+  bool input_shared;  // if input is a TIFF file, which all its pages are read
+                      // from, freed at the end (see struct page_list)
+  struct page_input *stream;  // if input is one of several PNM images of a
+                              // file, the whole file, else NULL
+  l_int32 format;  // of the file, as found from the first bytes of input
+  struct jbig2_symbols_page *components;  // in symbol mode, until classified
+  struct Pix *bw;  // with refine, the 1 bpp image until coded
+  uint64_t *row_hashes;  // with refine, of bw (see jbig2_row_hashes)
+  int reference;  // with refine, the page it is coded against, its own
+                  // number if it is the reference of others, or -1
+  unsigned dict_segnum;  // of the dictionary of a reference page in the file
+  uint8_t *data;
+  size_t length;  // or the estimated length, with estimate
+  int estimate_error;  // the bound on the error of the estimated length
+  int status;  // exit code of the program if the page failed, or 0
+  size_t budget_held;  // bytes of opts->budget held until written
+  struct page_stats *stats;  // with --stats, else NULL
+  struct journal_key journal;  // with --journal
+  bool resumed;  // with --journal, if its output was already written by an
+                 // earlier run, and it is skipped
+};
+
+// -----------------------------------------------------------------------------
+// Done with the input of page, once it has been decoded or skipped
+// -----------------------------------------------------------------------------
+static void
+release_input(struct page *page) {
+  if (page->stream) {
+    // the last of the pages of the file to be done with it frees it
+    struct page_input *const stream = page->stream;
+    if (page->input &&
+        __atomic_sub_fetch(&stream->users, 1, __ATOMIC_ACQ_REL) == 0) {
+      unmap_input(stream->data, stream->size, stream->mapped);
+      free(stream);
+    }
+  } else if (!page->input_shared) {
+    unmap_input(page->input, page->input_size, page->input_mapped);
+  }
+  page->input = NULL;
+}
+
+// -----------------------------------------------------------------------------
+// Everything the workers of jbig2_parallel_for need to encode a batch of pages
+// -----------------------------------------------------------------------------
+struct batch {
+  const struct encode_options *opts;
+  struct page *pages;
+  struct jbig2enc_ctx **ctxs;  // one per worker thread, or NULL until its
+                               // first page (see worker_ctx)
+  int fd;  // the output of all the pages with multipage, xobjects or framed
+  uint64_t written;  // bytes written to fd so far, with xobjects or framed
+  uint64_t *offsets;  // with xobjects or framed, of the XObject or record of
+                      // each page in fd and of the end of the last one
+  unsigned segnum;  // the next segment number in it
+  int reference;  // with refine, the reference of the last page, or -1
+  int npages;
+  int *order;  // the page coded by each job, if not in page order (see
+               // order_pages), else NULL
+  struct journal *journal;  // with --journal, else NULL
+  int readahead;  // how far after the page being started to prefetch the
+                  // input of another (see prefetch_input), or 0
+  struct input_range *prefetch;  // with readahead, the input of the page of
+                                 // each job (see input_ranges), else NULL
+};
+
+// -----------------------------------------------------------------------------
+// The coder of worker. It is made by the worker itself, so that with --affinity
+// its contexts are in memory first touched on the node of the worker.
+// -----------------------------------------------------------------------------
+static struct jbig2enc_ctx *
+worker_ctx(struct batch *b, int worker) {
+  if (!b->ctxs[worker]) {
+    b->ctxs[worker] =
+        (struct jbig2enc_ctx *) malloc(sizeof(struct jbig2enc_ctx));
+    if (!b->ctxs[worker]) abort();
+    jbig2enc_init(b->ctxs[worker]);
+  }
+  return b->ctxs[worker];
+}
+
+// -----------------------------------------------------------------------------
+// Runs the row bands of Leptonica's conversions (see setRowBandRunner)
+// -----------------------------------------------------------------------------
+static void
+leptonica_parallel_for(int nthreads, int count, L_JOB_FUNC fn, void *arg) {
+  jbig2_parallel_for(nthreads, count, fn, NULL, arg);
+}
+
+// -----------------------------------------------------------------------------
+// Whether the options leave page to be read by rows (see encode_page_rows).
+// With low_memory, -S, --cache and --auto-tpgd, which only make a page faster
+// to code, don't stop it.
+// -----------------------------------------------------------------------------
+static bool
+rows_allowed(const struct encode_options *opts, const struct page *page,
+             bool low_memory) {
+  if (page->subimage >= 0 || opts->up2 || opts->up4 || opts->reduce > 1 ||
+      opts->stream ||
+      opts->mmr || opts->symbols || opts->estimate > 0 || opts->refine > 0 ||
+      opts->verify || opts->despeckle > 0 || opts->deadline > 0 ||
+      opts->halftone > 0)
+    return false;
+  if (!low_memory && (opts->stripe_height > 0 || opts->cache ||
+                      opts->auto_tpgd >= 0))
+    return false;
+  return page->input && (page->format == IFF_PNG ||
+                         opts->raw.filter != JBIG2_RAW_NONE);
+}
+
+// -----------------------------------------------------------------------------
+// The image of a page read by encode_page_rows: a PNG image thresholded by
+// rows, or a raw stream
+// -----------------------------------------------------------------------------
+struct row_source {
+  const struct encode_options *opts;
+  const struct page *page;
+  L_PNG_BIN_READER *png;
+  struct jbig2_raw_reader *raw;
+};
+
+// -----------------------------------------------------------------------------
+// A jbig2_row_rewind for the row_source pointed to by opaque, which also opens
+// it the first time. Returns -1 if the PNG reader refuses the image.
+// -----------------------------------------------------------------------------
+static int
+row_source_open(void *opaque) {
+  struct row_source *const src = (struct row_source *) opaque;
+  const struct page *const page = src->page;
+  if (src->opts->raw.filter != JBIG2_RAW_NONE) {
+    if (src->raw) jbig2_raw_reader_free(src->raw);
+    src->raw = jbig2_raw_reader_new(&src->opts->raw, page->input,
+                                    page->input_size);
+    return 0;
+  }
+  if (src->png) pngBinReaderDestroy(&src->png);
+  src->png = pngBinReaderCreateMem(page->input, page->input_size,
+                                   src->opts->bw_threshold);
+  return src->png ? 0 : -1;
+}
+
+// -----------------------------------------------------------------------------
+// A jbig2_row_reader reading from the row_source pointed to by opaque
+// -----------------------------------------------------------------------------
+static int
+row_source_read(void *opaque, uint32_t *row) {
+  struct row_source *const src = (struct row_source *) opaque;
+  if (src->raw) return jbig2_raw_reader_row(src->raw, row);
+  return pngBinReaderReadRow(src->png, row);
+}
+
+static void
+row_source_close(struct row_source *src) {
+  if (src->raw) jbig2_raw_reader_free(src->raw);
+  if (src->png) pngBinReaderDestroy(&src->png);
+}
+
+// -----------------------------------------------------------------------------
+// Encode a page while it is being read, without ever holding the whole image
+// at more than 1 bpp: PNG images are thresholded and coded a row at a time,
+// and raw streams are decoded a row at a time. With low_memory the 1 bpp image
+// isn't held either, and it is read twice instead (see
+// jbig2_encode_generic_rows). Returns -1 if the page can't be encoded this
+// way, otherwise the same as encode_page.
+// -----------------------------------------------------------------------------
+static int
+encode_page_rows(const struct encode_options *opts, struct jbig2enc_ctx *ctx,
+                 struct page *page, bool low_memory) {
+  if (!rows_allowed(opts, page, low_memory)) return -1;
+  struct row_source src = {opts, page, NULL, NULL};
+  if (row_source_open(&src)) return -1;
+
+  int w, h, xres, yres;
+  if (src.raw) {
+    w = opts->raw.width;
+    h = opts->raw.height;
+    xres = opts->xres;
+    yres = opts->yres;
+  } else {
+    pngBinReaderGetInfo(src.png, &w, &h, &xres, &yres);
+    if (opts->xres > 0) xres = opts->xres;
+    if (opts->yres > 0) yres = opts->yres;
+  }
+  if (page->stats) {
+    page->stats->width = w;
+    page->stats->height = h;
+    page->stats->by_rows = true;
+  }
+  if (verbose && src.raw) {
+    fprintf(stderr, "source image: %d x %d raw, read by rows\n", w, h);
+  } else if (verbose) {
+    fprintf(stderr, "source image: %d x %d %ddpi x %ddpi, read by rows\n",
+            w, h, xres, yres);
+  }
+  page->data = jbig2_encode_generic_rows(ctx, w, h, !opts->pdfmode, xres, yres,
+                                         opts->duplicate_line_removal,
+                                         opts->gbtemplate, row_source_read,
+                                         low_memory ? row_source_open : NULL,
+                                         &src, &page->length);
+  row_source_close(&src);
+  return page->data ? 0 : 3;
+}
+
+// -----------------------------------------------------------------------------
+// Read the header of the image of page, as pixReadHeaderMem does. Returns 0,
+// or 1 if it can't be found without decoding the image (gzipped PNM, and TIFF
+// images which only libtiff reads).
+// -----------------------------------------------------------------------------
+static int
+read_page_header(const struct page *page, l_int32 *format, l_int32 *w,
+                 l_int32 *h, l_int32 *bps, l_int32 *spp) {
+  if (!page->input) return 1;
+  if (page->opts->raw.filter != JBIG2_RAW_NONE) {
+    *format = IFF_UNKNOWN;
+    *w = page->opts->raw.width;
+    *h = page->opts->raw.height;
+    *bps = *spp = 1;
+    return 0;
+  }
+  if (page->format == IFF_TIFF) {
+    int width, height;
+    if (jbig2_tiff_info(page->input, page->input_size,
+                        page->subimage < 0 ? 0 : page->subimage, &width,
+                        &height))
+      return 1;
+    *format = IFF_TIFF;
+    *w = width;
+    *h = height;
+    *bps = *spp = 1;
+    return 0;
+  }
+  l_int32 iscmap;
+  return pixReadHeaderMem(page->input, page->input_size, format, w, h, bps,
+                          spp, &iscmap);
+}
+
+// -----------------------------------------------------------------------------
+// With --memory-limit: a bound on the memory coding page holds at once, from
+// the size in the header of its image. Read by rows, that is just the coded
+// stream. Otherwise it is the decoded image, a gray copy of it, the 1 bpp
+// image, a copy of its ink box and the stream, which is taken to be no larger
+// than the 1 bpp image. Returns (size_t) -1 if the size can't be found
+// without decoding the image (see read_page_header).
+// -----------------------------------------------------------------------------
+static size_t
+page_memory(const struct encode_options *opts, const struct page *page,
+            bool by_rows) {
+  l_int32 format, w, h, bps, spp;
+  if (read_page_header(page, &format, &w, &h, &bps, &spp))
+    return (size_t) -1;
+  const int scale = opts->up2 ? 2 : opts->up4 ? 4 : 1;
+  const size_t bw_bytes = ((size_t) w * scale + 31) / 32 * 4 * h * scale;
+  if (by_rows) return bw_bytes;
+  int depth = spp > 1 ? 32 : bps;
+  if (format == IFF_PNG && depth > 8) depth = 8;  // stripped to 8 on reading
+  const size_t source_bytes = ((size_t) w * depth + 31) / 32 * 4 * h;
+  const size_t gray_bytes =
+      depth == 1 && scale == 1 ? 0 : ((size_t) w + 3) / 4 * 4 * h;
+  return source_bytes + gray_bytes + 3 * bw_bytes;
+}
+
+// -----------------------------------------------------------------------------
+// With --memory-limit: the bytes of the budget which coding page takes, which
+// are never more than the whole budget. *low_memory is set if the page would
+// need more coded whole, and is to be read by rows instead.
+// -----------------------------------------------------------------------------
+static size_t
+page_budget(const struct encode_options *opts, const struct page *page,
+            bool *low_memory) {
+  *low_memory = false;
+  const size_t limit = jbig2_budget_limit(opts->budget);
+  size_t need = page_memory(opts, page, false);
+  if (need > limit && rows_allowed(opts, page, true) &&
+      opts->raw.filter != JBIG2_RAW_NONE) {
+    *low_memory = true;
+    need = page_memory(opts, page, true);
+  } else if (need > limit && rows_allowed(opts, page, true)) {
+    // the reader refuses some images, such as interlaced ones
+    L_PNG_BIN_READER *rdr = pngBinReaderCreateMem(page->input,
+                                                  page->input_size,
+                                                  opts->bw_threshold);
+    if (rdr) {
+      pngBinReaderDestroy(&rdr);
+      *low_memory = true;
+      need = page_memory(opts, page, true);
+    }
+  }
+  if (need > limit) {
+    fprintf(stderr, "%s: over --memory-limit, coding it on its own\n",
+            page->filename);
+    need = limit;
+  }
+  return need;
+}
+
+// -----------------------------------------------------------------------------
+// With --verify: decode the stream of page and check that it is bw, the image
+// it was coded from. Returns 0 if it is, otherwise the exit code of the
+// program.
+// -----------------------------------------------------------------------------
+static int
+verify_page(const struct encode_options *opts, const struct page *page,
+            struct Pix *bw) {
+  const int ret = jbig2_verify_generic(page->data, page->length,
+                                       !opts->pdfmode, bw);
+  if (ret == 0) return 0;
+  fprintf(stderr, "%s: %s\n", page->filename,
+          ret < 0 ? "the coded page can't be decoded"
+                  : "the coded page doesn't decode to the image");
+  return 12;
+}
+
+// -----------------------------------------------------------------------------
+// Read, threshold and encode a single page. Returns 0 on success, otherwise
+// the exit code of the program. With low_memory, the page is read by rows if
+// it can be at all (see rows_allowed).
+// -----------------------------------------------------------------------------
+static int
+encode_page(const struct encode_options *opts, struct jbig2enc_ctx *ctx,
+            struct page *page, bool low_memory) {
+  const double start = now();
+  const int status = encode_page_rows(opts, ctx, page, low_memory);
+  if (status >= 0) {
+    release_input(page);
+    return status;
+  }
+
+  PIX *source = NULL;
+  if (page->input && opts->raw.filter != JBIG2_RAW_NONE) {
+    source = jbig2_raw_read(&opts->raw, page->input, page->input_size);
+  } else if (page->input && page->format == IFF_TIFF) {
+    source = jbig2_tiff_read(page->input, page->input_size,
+                             page->subimage < 0 ? 0 : page->subimage);
+#if HAVE_LIBTIFF
+    // such as LZW or gray images, which the built-in reader leaves
+    if (!source && strcmp(page->filename, "-") != 0)
+      source = pixReadTiff(page->filename,
+                           page->subimage < 0 ? 0 : page->subimage);
+#endif
+  } else if (page->input && page->format == IFF_PNM) {
+    // one of several images of a file can be smaller than pixReadMem takes
+    source = pixReadMemPnm(page->input, page->input_size);
+  } else if (page->input && (page->format == IFF_PNG ||
+                             page->format == IFF_PNM_GZ)) {
+    source = pixReadMem(page->input, page->input_size);
+  } else {
+    source = pixRead(page->filename);
+  }
+
+  release_input(page);
+  stats_add(page->stats, STAGE_DECODE);
+
+  if (!source) return 3;
+  if (verbose)
+    pixInfo(source, "source image:");
+
+  // source is consumed; unless upscaling, the 1 bpp image reuses its data
+  PIX *pixt = pixConvertTo1Transfer(&source, opts->bw_threshold,
+                                    opts->up2 ? 2 : opts->up4 ? 4 : 1);
+  if (!pixt) {
+    fprintf(stderr, "Failed to convert %s to 1 bpp\n", page->filename);
+    return 1;
+  }
+  if (opts->reduce > 1) {
+    // the resolution is divided by the factor, unless --xres or --yres
+    PIX *reduced = pixReduceRankBinary(pixt, opts->reduce, opts->reduce_rank);
+    pixDestroy(&pixt);
+    if (!reduced) {
+      fprintf(stderr, "Failed to downscale %s\n", page->filename);
+      return 1;
+    }
+    pixt = reduced;
+  }
+  // every coder takes the resolution from the image, as does the cache key
+  if (opts->xres > 0) pixt->xres = opts->xres;
+  if (opts->yres > 0) pixt->yres = opts->yres;
+  if (verbose)
+    pixInfo(pixt, "thresholded image:");
+  // everything after this, including the cache key and --verify, sees the
+  // image without its specks
+  if (opts->despeckle > 0) {
+    const int removed = jbig2_despeckle(pixt, opts->despeckle);
+    stats_add(page->stats, STAGE_DESPECKLE);
+    if (verbose) fprintf(stderr, "despeckle: %d pixels removed\n", removed);
+  }
+  if (page->stats) {
+    page->stats->width = pixt->w;
+    page->stats->height = pixt->h;
+  }
+
+  // When MMR codes the page whole, the runs of its rows, which it codes, are
+  // found first (see jbig2_runs_new), and the repeated rows of --auto-tpgd and
+  // the ink box are taken from them rather than from scanning the bitmap
+  // again. For the arithmetic coder, the scans are quicker than finding them.
+  const bool whole = !opts->symbols && !opts->stripe_height &&
+                     !opts->stream && opts->estimate <= 0 && opts->refine <= 0;
+  struct jbig2_runs *runs = NULL;
+  if (opts->mmr && whole) {
+    pixSetPadBits(pixt, 0);
+    runs = jbig2_runs_new(pixt->data, pixt->w, pixt->h, pixt->wpl);
+    if (verbose)
+      fprintf(stderr, "runs: %zu changes, %.1f%% of the size of the bitmap\n",
+              runs->start[pixt->h],
+              100.0 * (runs->start[pixt->h] * sizeof(int) +
+                       (pixt->h + 1) * sizeof(size_t)) /
+                  ((double) pixt->wpl * 4 * pixt->h));
+  }
+
+  struct encode_options page_opts;
+  if (opts->auto_tpgd >= 0) {
+    page_opts = *opts;
+    const double ratio = jbig2_duplicate_row_ratio(pixt, runs);
+    page_opts.duplicate_line_removal = ratio >= opts->auto_tpgd;
+    if (verbose)
+      fprintf(stderr, "%.0f%% of rows repeated: TPGD %s\n", ratio * 100,
+              page_opts.duplicate_line_removal ? "on" : "off");
+    opts = &page_opts;
+  }
+
+  if (opts->refine > 0) {
+    // coded once the references have been found (see match_page_done)
+    page->row_hashes = jbig2_row_hashes(pixt);
+    page->bw = pixt;
+    return 0;
+  }
+
+  if (opts->estimate > 0) {
+    page->length = jbig2_estimate_size(ctx, pixt, !opts->pdfmode,
+                                       opts->duplicate_line_removal,
+                                       opts->gbtemplate, opts->mmr,
+                                       opts->estimate, &page->estimate_error);
+    jbig2_runs_free(runs);
+    pixDestroy(&pixt);
+    return 0;
+  }
+
+  struct jbig2_cache_key key;
+  const bool cached = opts->cache && !opts->symbols && !opts->stream;
+  if (cached) {
+    struct cache_params params;
+    memset(&params, 0, sizeof(params));
+    params.version = CACHE_VERSION;
+    params.full_headers = !opts->pdfmode;
+    params.duplicate_line_removal = opts->duplicate_line_removal;
+    params.gbtemplate = opts->gbtemplate;
+    params.mmr = opts->mmr;
+    params.stripe_height = opts->stripe_height;
+    params.halftone = opts->halftone;
+    params.xres = pixt->xres;
+    params.yres = pixt->yres;
+    jbig2_cache_key(pixt, &params, sizeof(params), &key);
+    page->data = jbig2_cache_get(opts->cache, &key, &page->length);
+    if (page->data) {
+      if (verbose)
+        fprintf(stderr, "%s: found in the cache\n", page->filename);
+      const int status = opts->verify ? verify_page(opts, page, pixt) : 0;
+      jbig2_runs_free(runs);
+      pixDestroy(&pixt);
+      return status;
+    }
+  }
+
+  // with --deadline-ms, what is left of the page's time for coding it
+  double budget = -1;
+  int path = opts->mmr ? JBIG2_PATH_MMR : JBIG2_PATH_ARITH;
+  if (opts->deadline > 0) {
+    budget = opts->deadline - (now() - start);
+    if (budget < 0) budget = 0;
+  }
+
+  if (opts->symbols) {
+    // most components are classified here, in parallel, against the classes
+    // of the pages already added, leaving only the rest to classify_page_done
+    page->components = jbig2_symbols_extract(pixt);
+    jbig2_symbols_match(opts->symbols, page->components);
+  } else if (opts->stripe_height > 0) {
+    page->data = jbig2_encode_generic_striped(pixt, !opts->pdfmode, 0, 0,
+                                              opts->duplicate_line_removal,
+                                              opts->gbtemplate, opts->mmr,
+                                              opts->stripe_height,
+                                              opts->stripe_threads,
+                                              opts->interleave, budget, &path,
+                                              &page->length);
+  } else if (budget >= 0 && !opts->mmr) {
+    page->data = jbig2_encode_generic_deadline(ctx, pixt, !opts->pdfmode, 0, 0,
+                                               opts->duplicate_line_removal,
+                                               opts->gbtemplate, budget, &path,
+                                               &page->length);
+  } else if (opts->halftone > 0 && !opts->mmr) {
+    int mmr_rows;
+    page->data = jbig2_encode_generic_halftone(ctx, pixt, !opts->pdfmode, 0, 0,
+                                               opts->duplicate_line_removal,
+                                               opts->gbtemplate,
+                                               opts->halftone, &mmr_rows,
+                                               &page->length);
+    if (page->stats) page->stats->halftone_rows = mmr_rows;
+    if (verbose)
+      fprintf(stderr, "halftone: %d of %d rows coded with MMR\n", mmr_rows,
+              pixt->h);
+  } else if (opts->stream) {
+    struct fd_sink_state sink;
+    sink.fd = open_page(opts->basename, page->output, page->pageno);
+    sink.length = 0;
+    if (sink.fd < 0 ||
+        jbig2_encode_generic_sink(ctx, pixt, !opts->pdfmode, 0, 0,
+                                  opts->duplicate_line_removal,
+                                  opts->gbtemplate, opts->mmr, fd_sink,
+                                  (void *) &sink) ||
+        close_page(page->output ? page->output : opts->basename,
+                   sink.fd) < 0)
+      abort();
+    page->length = sink.length;
+  } else {
+    page->data = jbig2_encode_generic_runs(ctx, pixt, runs, !opts->pdfmode, 0,
+                                           0, opts->duplicate_line_removal,
+                                           opts->gbtemplate, opts->mmr,
+                                           &page->length);
+  }
+  jbig2_runs_free(runs);
+  if (page->stats) page->stats->coder_path = path;
+  if (verbose && opts->deadline > 0)
+    fprintf(stderr, "deadline: coded with %s\n", coder_path_names[path]);
+  // a region too long for a segment (see jbig2enc.h)
+  if (!page->data && !opts->symbols && !opts->stream) {
+    pixDestroy(&pixt);
+    return 3;
+  }
+  if (opts->verify) {
+    const int status = verify_page(opts, page, pixt);
+    if (status) {
+      pixDestroy(&pixt);
+      return status;
+    }
+  }
+  pixDestroy(&pixt);
+  // a page which fell back to MMR to be in time isn't what the cache key says
+  if (cached && path == (opts->mmr ? JBIG2_PATH_MMR : JBIG2_PATH_ARITH))
+    jbig2_cache_put(opts->cache, &key, page->data, page->length);
+  return 0;
+}
+
+// -----------------------------------------------------------------------------
+// With --journal: a record of the pages written, so that a batch which was
+// stopped part way can be run again and only code the pages it hadn't
+// finished. A line is appended once the output of a page has been written
+// and closed:
+//
+//   <input size> <input mtime> <input hash> <options hash> <output length>
+//   <output hash> <output file> <input file>
+//
+// separated by tabs, with the hashes in hex (see jbig2_cache_hash). A later
+// run skips a page if the last line for its output file has the same input
+// file, unchanged, coded with the same options, and the output file is still
+// what was written. Lines which can't be parsed, such as one cut short, are
+// ignored, as are pages read from stdin or with a tab or a newline in their
+// file names.
+// -----------------------------------------------------------------------------
+struct journal_entry {
+  const char *output;
+  const char *input;
+  int line;  // later lines win
+  uint64_t input_size;
+  int64_t input_mtime;
+  struct jbig2_cache_key input_hash;
+  uint64_t params_hash;
+  uint64_t output_length;
+  struct jbig2_cache_key output_hash;
+};
+
+struct journal {
+  char *text;  // of the journal when opened, which the entries point into
+  struct journal_entry *entries;  // sorted by output file and line
+  int nentries;
+  FILE *out;  // for appending
+};
+
+// -----------------------------------------------------------------------------
+// The options which go into the output of a page, hashed into its
+// journal_key (which must not contain uninitialised padding)
+// -----------------------------------------------------------------------------
+struct journal_params {
+  int version;  // CACHE_VERSION
+  int subimage;
+  int full_headers;
+  int duplicate_line_removal;
+  int gbtemplate;
+  int mmr;
+  int stripe_height;
+  int bw_threshold;
+  int scale;
+  int reduce, reduce_rank;
+  int xres, yres;
+  double auto_tpgd;
+  double deadline;
+  double halftone;
+  int despeckle;
+  int raw_filter, raw_width, raw_height, raw_k, raw_predictor;
+  int raw_black_is_1, raw_byte_align, raw_invert;
+};
+
+static int
+compare_journal_entries(const void *a, const void *b) {
+  const struct journal_entry *const x = (const struct journal_entry *) a;
+  const struct journal_entry *const y = (const struct journal_entry *) b;
+  const int cmp = strcmp(x->output, y->output);
+  return cmp ? cmp : x->line - y->line;
+}
+
+// -----------------------------------------------------------------------------
+// Parse a key in hex from the 32 characters at p. Returns false if they
+// aren't hex digits.
+// -----------------------------------------------------------------------------
+static bool
+parse_hash(const char *p, struct jbig2_cache_key *key) {
+  if (strlen(p) != 32) return false;
+  for (int i = 0; i < 2; ++i) {
+    key->hash[i] = 0;
+    for (int j = 0; j < 16; ++j) {
+      const char c = *p++;
+      const int digit = c >= '0' && c <= '9' ? c - '0'
+                        : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+      if (digit < 0) return false;
+      key->hash[i] = key->hash[i] << 4 | digit;
+    }
+  }
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+// Parse a line of the journal into e. Returns false if it isn't one.
+// -----------------------------------------------------------------------------
+static bool
+parse_journal_line(char *line, struct journal_entry *e) {
+  char *fields[8];
+  for (int i = 0; i < 8; ++i) {
+    fields[i] = line;
+    char *const tab = strchr(line, '\t');
+    if (i < 7) {
+      if (!tab) return false;
+      *tab = 0;
+      line = tab + 1;
+    } else if (tab) {
+      return false;
+    }
+  }
+  char *endptr;
+  e->input_size = strtoull(fields[0], &endptr, 10);
+  if (*endptr || endptr == fields[0]) return false;
+  e->input_mtime = strtoll(fields[1], &endptr, 10);
+  if (*endptr || endptr == fields[1]) return false;
+  if (!parse_hash(fields[2], &e->input_hash)) return false;
+  e->params_hash = strtoull(fields[3], &endptr, 16);
+  if (*endptr || endptr == fields[3]) return false;
+  e->output_length = strtoull(fields[4], &endptr, 10);
+  if (*endptr || endptr == fields[4]) return false;
+  if (!parse_hash(fields[5], &e->output_hash)) return false;
+  e->output = fields[6];
+  e->input = fields[7];
+  return *e->output && *e->input;
+}
+
+// -----------------------------------------------------------------------------
+// Read the journal at path, if there is one, and open it for appending.
+// Returns NULL on error.
+// -----------------------------------------------------------------------------
+static struct journal *
+journal_open(const char *path) {
+  struct journal *journal = (struct journal *) calloc(1, sizeof(*journal));
+  if (!journal) abort();
+  uint8_t *data = NULL;
+  size_t size = 0;
+  const int fd = open(path, O_RDONLY | WINBINARY);
+  if (fd >= 0) {
+    if (read_all(fd, &data, &size) < 0) {
+      fprintf(stderr, "Unable to read the journal \"%s\"\n", path);
+      close(fd);
+      free(journal);
+      return NULL;
+    }
+    close(fd);
+  }
+  journal->text = (char *) realloc(data, size + 1);
+  if (!journal->text) abort();
+  journal->text[size] = 0;
+
+  int nlines = 0;
+  for (size_t k = 0; k < size; ++k) nlines += journal->text[k] == '\n';
+  journal->entries =
+      (struct journal_entry *) malloc(sizeof(struct journal_entry) *
+                                      (nlines + 1));
+  if (!journal->entries) abort();
+  // only whole lines: the last may have been cut short
+  char *line = journal->text;
+  for (int n = 0; n < nlines; ++n) {
+    char *const next = strchr(line, '\n');
+    *next = 0;
+    struct journal_entry *const e = &journal->entries[journal->nentries];
+    e->line = n;
+    if (parse_journal_line(line, e)) journal->nentries++;
+    line = next + 1;
+  }
+  qsort(journal->entries, journal->nentries, sizeof(struct journal_entry),
+        compare_journal_entries);
+
+  journal->out = fopen(path, "ab");
+  if (!journal->out) {
+    fprintf(stderr, "Unable to open the journal \"%s\" for writing\n", path);
+    free(journal->entries);
+    free(journal->text);
+    free(journal);
+    return NULL;
+  }
+  // a line cut short isn't to be joined to the next one
+  if (size && journal->text[size - 1] != '\n') fputc('\n', journal->out);
+  return journal;
+}
+
+static void
+journal_close(struct journal *journal) {
+  if (!journal) return;
+  fclose(journal->out);
+  free(journal->entries);
+  free(journal->text);
+  free(journal);
+}
+
+// -----------------------------------------------------------------------------
+// The last entry of the journal for output, or NULL
+// -----------------------------------------------------------------------------
+static const struct journal_entry *
+journal_find(const struct journal *journal, const char *output) {
+  int lo = 0, hi = journal->nentries;
+  while (lo < hi) {  // the first entry after output
+    const int mid = (lo + hi) / 2;
+    if (strcmp(journal->entries[mid].output, output) <= 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (!lo || strcmp(journal->entries[lo - 1].output, output)) return NULL;
+  return &journal->entries[lo - 1];
+}
+
+// -----------------------------------------------------------------------------
+// The file page is written to. The caller must free it.
+// -----------------------------------------------------------------------------
+static char *
+page_output_name(const char *basename, const struct page *page) {
+  char *name;
+  if (page->output) {
+    asprintf(&name, "%s", page->output);
+  } else {
+    asprintf(&name, "%s.%04d", basename, page->pageno);
+  }
+  return name;
+}
+
+// -----------------------------------------------------------------------------
+// A hash of everything in opts which the output of page is made from, other
+// than its image (see journal_params)
+// -----------------------------------------------------------------------------
+static uint64_t
+options_hash(const struct encode_options *opts, const struct page *page) {
+  struct journal_params params;
+  memset(&params, 0, sizeof(params));
+  params.version = CACHE_VERSION;
+  params.subimage = page->subimage;
+  params.full_headers = !opts->pdfmode;
+  params.duplicate_line_removal = opts->duplicate_line_removal;
+  params.gbtemplate = opts->gbtemplate;
+  params.mmr = opts->mmr;
+  params.stripe_height = opts->stripe_height;
+  params.bw_threshold = opts->bw_threshold;
+  params.scale = opts->up2 ? 2 : opts->up4 ? 4 : 1;
+  params.reduce = opts->reduce;
+  params.reduce_rank = opts->reduce_rank;
+  params.xres = opts->xres;
+  params.yres = opts->yres;
+  params.auto_tpgd = opts->auto_tpgd;
+  params.deadline = opts->deadline;
+  params.halftone = opts->halftone;
+  params.despeckle = opts->despeckle;
+  params.raw_filter = opts->raw.filter;
+  params.raw_width = opts->raw.width;
+  params.raw_height = opts->raw.height;
+  params.raw_k = opts->raw.k;
+  params.raw_predictor = opts->raw.predictor;
+  params.raw_black_is_1 = opts->raw.black_is_1;
+  params.raw_byte_align = opts->raw.byte_align;
+  params.raw_invert = opts->raw.invert;
+  struct jbig2_cache_key params_key;
+  jbig2_cache_hash(&params, sizeof(params), &params_key);
+  return params_key.hash[0];
+}
+
+// -----------------------------------------------------------------------------
+// Find the journal_key of page, which is coded with opts, and return whether
+// the journal has its output as already written, and unchanged since.
+// Called from the workers, with the input of the page still mapped.
+// -----------------------------------------------------------------------------
+static bool
+journal_resume(const struct journal *journal, const char *basename,
+               const struct encode_options *opts, struct page *page) {
+  struct journal_key *const key = &page->journal;
+  struct stat st;
+  key->valid = false;
+  if (strcmp(page->filename, "-") == 0 ||
+      strpbrk(page->filename, "\t\n") ||
+      (page->output && strpbrk(page->output, "\t\n")) ||
+      stat(page->filename, &st) < 0)
+    return false;
+  key->input_size = st.st_size;
+  key->input_mtime = st.st_mtime;
+  jbig2_cache_hash(page->input, page->input_size, &key->input_hash);
+  key->params_hash = options_hash(opts, page);
+  key->valid = true;
+
+  char *const output = page_output_name(basename, page);
+  const struct journal_entry *const e = journal_find(journal, output);
+  bool done = e && strcmp(e->input, page->filename) == 0 &&
+              e->input_size == key->input_size &&
+              e->input_mtime == key->input_mtime &&
+              e->input_hash.hash[0] == key->input_hash.hash[0] &&
+              e->input_hash.hash[1] == key->input_hash.hash[1] &&
+              e->params_hash == key->params_hash;
+  if (done) {
+    uint8_t *data;
+    size_t length;
+    bool mapped;
+    struct jbig2_cache_key output_hash;
+    if (map_input(output, &data, &length, &mapped) < 0) {
+      done = false;
+    } else {
+      jbig2_cache_hash(data, length, &output_hash);
+      unmap_input(data, length, mapped);
+      done = length == e->output_length &&
+             output_hash.hash[0] == e->output_hash.hash[0] &&
+             output_hash.hash[1] == e->output_hash.hash[1];
+    }
+  }
+  free(output);
+  return done;
+}
+
+// -----------------------------------------------------------------------------
+// Append the line of page, whose output has just been written, to the journal
+// -----------------------------------------------------------------------------
+static void
+journal_add(struct journal *journal, const char *basename,
+            const struct page *page) {
+  const struct journal_key *const key = &page->journal;
+  if (!key->valid) return;
+  struct jbig2_cache_key output_hash;
+  jbig2_cache_hash(page->data, page->length, &output_hash);
+  char *const output = page_output_name(basename, page);
+  fprintf(journal->out, "%llu\t%lld\t%016llx%016llx\t%016llx\t%llu\t"
+                        "%016llx%016llx\t%s\t%s\n",
+          (unsigned long long) key->input_size,
+          (long long) key->input_mtime,
+          (unsigned long long) key->input_hash.hash[0],
+          (unsigned long long) key->input_hash.hash[1],
+          (unsigned long long) key->params_hash,
+          (unsigned long long) page->length,
+          (unsigned long long) output_hash.hash[0],
+          (unsigned long long) output_hash.hash[1], output, page->filename);
+  free(output);
+  // a batch stopped from outside loses at most the page being written
+  if (fflush(journal->out)) abort();
+}
+
+// -----------------------------------------------------------------------------
+// The mapped input of a page, for prefetch_input
+// -----------------------------------------------------------------------------
+struct input_range {
+  const uint8_t *data;
+  size_t size;  // 0 if the input isn't mapped
+};
+
+// -----------------------------------------------------------------------------
+// The page coded by job index of b
+// -----------------------------------------------------------------------------
+static struct page *
+job_page(const struct batch *b, int index) {
+  return &b->pages[b->order ? b->order[index] : index];
+}
+
+// -----------------------------------------------------------------------------
+// The input of the page of each job of b, copied before the workers start: a
+// worker may be done with a page, and unmap its input (see release_input),
+// while another is prefetching it, so the pages themselves can't be read then.
+// -----------------------------------------------------------------------------
+static struct input_range *
+input_ranges(const struct batch *b) {
+  struct input_range *const ranges =
+      (struct input_range *) calloc(b->npages ? b->npages : 1,
+                                    sizeof(struct input_range));
+  if (!ranges) abort();
+  for (int i = 0; i < b->npages; ++i) {
+    const struct page *const page = job_page(b, i);
+    if (!page->input || !page->input_mapped) continue;
+    ranges[i].data = page->input;
+    ranges[i].size = page->input_size;
+  }
+  return ranges;
+}
+
+// -----------------------------------------------------------------------------
+// Have the kernel start reading the file of a page which is likely yet to be
+// started, so that its worker finds it in memory rather than wait for the
+// disk while decoding it. The page may already be done and its file unmapped:
+// the advice is then refused, or applies to whatever is mapped there now, and
+// either way nothing is read or written.
+// -----------------------------------------------------------------------------
+static void
+prefetch_input(const struct input_range *range) {
+#if defined(MADV_WILLNEED)
+  if (range->size)
+    madvise((void *) range->data, range->size, MADV_WILLNEED);
+#else
+  (void) range;
+#endif
+}
+
+static void
+encode_page_job(void *arg, int index, int worker) {
+  struct batch *b = (struct batch *) arg;
+  struct page *page = job_page(b, index);
+  // the page readahead jobs on is often yet to be started, though it may
+  // also be done already (see prefetch_input)
+  if (b->readahead && index + b->readahead < b->npages)
+    prefetch_input(&b->prefetch[index + b->readahead]);
+  if (b->journal &&
+      journal_resume(b->journal, b->opts->basename, page->opts, page)) {
+    if (verbose)
+      fprintf(stderr, "%s: already written, skipped\n", page->filename);
+    page->resumed = true;
+    release_input(page);
+    if (b->opts->budget) jbig2_budget_take(b->opts->budget, index, 0);
+    return;
+  }
+  struct jbig2enc_ctx *const ctx = worker_ctx(b, worker);
+  stats_begin(page->stats, ctx);
+  // The stream is held until written, and the rest of the budget is given
+  // back now. What is kept for the later passes of -s and --refine isn't
+  // counted.
+  bool low_memory = false;
+  size_t need = 0;
+  if (b->opts->budget) {
+    need = page_budget(page->opts, page, &low_memory);
+    jbig2_budget_take(b->opts->budget, index, need);
+  }
+  page->status = encode_page(page->opts, ctx, page, low_memory);
+  if (b->opts->budget) {
+    page->budget_held = !page->data ? 0
+                        : page->length < need ? page->length : need;
+    jbig2_budget_give(b->opts->budget, need - page->budget_held);
+  }
+  stats_end(page->stats, STAGE_CODING, ctx);
+}
+
+// -----------------------------------------------------------------------------
+// In symbol mode: called in page order as the components of the pages are
+// found, and sorts them into the classes of symbols
+// -----------------------------------------------------------------------------
+static int
+classify_page_done(void *arg, int index) {
+  struct batch *b = (struct batch *) arg;
+  struct page *page = &b->pages[index];
+  if (page->status) return page->status;
+  jbig2_symbols_add_page(b->opts->symbols, page->components);
+  page->components = NULL;
+  return 0;
+}
+
+// -----------------------------------------------------------------------------
+// In symbol mode, once the dictionary has been coded: code a page
+// -----------------------------------------------------------------------------
+static void
+encode_symbol_page_job(void *arg, int index, int worker) {
+  struct batch *b = (struct batch *) arg;
+  struct page *page = &b->pages[index];
+  struct jbig2enc_ctx *const ctx = worker_ctx(b, worker);
+  stats_begin(page->stats, ctx);
+  page->data = jbig2_encode_symbol_page(ctx, b->opts->symbols,
+                                        index,
+                                        page->opts->duplicate_line_removal,
+                                        page->opts->gbtemplate,
+                                        page->opts->mmr, &page->length);
+  if (!page->data) page->status = 3;
+  stats_end(page->stats, STAGE_CODING, ctx);
+}
+
+// -----------------------------------------------------------------------------
+// With refine: whether page can be coded against reference
+// -----------------------------------------------------------------------------
+static bool
+similar_pages(const struct encode_options *opts, const struct page *page,
+              const struct page *reference) {
+  if (page->bw->w != reference->bw->w || page->bw->h != reference->bw->h)
+    return false;
+  const double ratio = jbig2_row_match_ratio(page->row_hashes,
+                                             reference->row_hashes,
+                                             page->bw->h);
+  if (verbose)
+    fprintf(stderr, "%s: %.0f%% of rows the same as in %s\n", page->filename,
+            ratio * 100, reference->filename);
+  return ratio >= opts->refine;
+}
+
+// -----------------------------------------------------------------------------
+// With refine: called in page order as the pages are read, and finds the
+// reference of each page. A page is coded against the reference of the page
+// before it if they are similar enough, otherwise against the page before it
+// if that one isn't coded against any other page. Only pages which are the
+// reference of others are kept by the decoder, as symbols.
+// -----------------------------------------------------------------------------
+static int
+match_page_done(void *arg, int index) {
+  struct batch *b = (struct batch *) arg;
+  struct page *page = &b->pages[index];
+  if (page->status) return page->status;
+  struct page *const prev = index ? &b->pages[index - 1] : NULL;
+  if (b->reference >= 0 &&
+      similar_pages(b->opts, page, &b->pages[b->reference])) {
+    page->reference = b->reference;
+  } else if (prev && prev->reference < 0 &&
+             similar_pages(b->opts, page, prev)) {
+    prev->reference = index - 1;
+    page->reference = index - 1;
+  }
+  b->reference = page->reference;
+  return 0;
+}
+
+// -----------------------------------------------------------------------------
+// With refine, once all the references have been found: code a page
+// -----------------------------------------------------------------------------
+static void
+encode_refine_page_job(void *arg, int index, int worker) {
+  struct batch *b = (struct batch *) arg;
+  struct page *page = &b->pages[index];
+  struct jbig2enc_ctx *const ctx = worker_ctx(b, worker);
+  stats_begin(page->stats, ctx);
+  if (page->reference < 0) {
+    page->data = jbig2_encode_generic_ctx(ctx, page->bw, false, 0, 0,
+                                          page->opts->duplicate_line_removal,
+                                          page->opts->gbtemplate,
+                                          page->opts->mmr, &page->length);
+  } else if (page->reference != index) {
+    page->data = jbig2_encode_refined_page(ctx, page->bw,
+                                           b->pages[page->reference].bw, 0,
+                                           &page->length);
+  } else {
+    // the dictionary goes first, with no page (see jbig2_file_page)
+    size_t dict_length, length;
+    uint8_t *const dict = jbig2_encode_reference_dictionary(ctx, page->bw,
+                                                            &dict_length);
+    uint8_t *const data = jbig2_encode_refined_page(ctx, page->bw, page->bw,
+                                                    0, &length);
+    if (dict && data) {
+      page->data = (uint8_t *) realloc(dict, dict_length + length);
+      if (!page->data) abort();
+      memcpy(page->data + dict_length, data, length);
+      page->length = dict_length + length;
+    } else {
+      free(dict);
+    }
+    free(data);
+  }
+  // references are needed by the pages coded against them
+  if (page->reference != index) pixDestroy(&page->bw);
+  if (!page->data) page->status = 3;
+  stats_end(page->stats, STAGE_CODING, ctx);
+}
+
+// -----------------------------------------------------------------------------
+// Write str to out as a JSON string
+// -----------------------------------------------------------------------------
+static void
+print_json_string(FILE *out, const char *str) {
+  fputc('"', out);
+  for (const unsigned char *p = (const unsigned char *) str; *p; ++p) {
+    if (*p == '"' || *p == '\\') {
+      fprintf(out, "\\%c", *p);
+    } else if (*p < 0x20) {
+      fprintf(out, "\\u%04x", *p);
+    } else {
+      fputc(*p, out);
+    }
+  }
+  fputc('"', out);
+}
+
+// -----------------------------------------------------------------------------
+// With --stats: write the stats of a finished page to stderr, as one line of
+//
+//   {"page": 0, "file": "a.png", "width": 2480, "height": 3508,
+//    "by_rows": false, "output_bytes": 41234, "peak_pix_bytes": 8702976,
+//    "pixels_per_second": 1.2e+08,
+//    "stages": {"read": {"wall": 0.000012, "cpu": 0.000011}, "sniff": ...,
+//               "decode": ..., "cmap": ..., "gray": ..., "threshold": ...,
+//               "coding": ...},
+//    "total": {"wall": 0.071, "cpu": 0.069}}
+//
+// With --deadline-ms, "deadline": {"ms": 50, "path": "arith+mmr"} comes after
+// "total": path is "arith" for a page coded in time, "arith+mmr" for one
+// which switched to MMR part way and "mmr" for one coded with MMR throughout.
+// With --halftone, "halftone_rows": 1184 follows, the rows coded with MMR.
+//
+// Times are in seconds. CPU times are those of the thread working on the page
+// (0 where that can't be found), so they leave out the threads running its
+// stripes and row bands. A mapped file is only read as it is decoded, which is
+// then timed as decoding. width and height are those of the 1 bpp image, and
+// pixels_per_second is its size over the total time. output_bytes is the size
+// of the stream of the page (the estimate, with --estimate) and peak_pix_bytes
+// the most image data (allocated by pix_malloc) held for the page at any time.
+//
+// Built with JBIG2_CODER_STATS, the counts of the arithmetic coder (see struct
+// jbig2enc_stats) come before the end, as
+//
+//    "coder": {"bits": 8671234, "lps": 190345, "lps_rate": 0.02195,
+//              "renorm_shifts": 412876, "byteouts": 51609, "stuffed": 210,
+//              "bytes": 41217, "contexts": 21034}
+//
+// Only the coder of the page's worker is counted: not those of stripes (-S).
+//
+// With --stats=perf, each stage and the total also have the hardware counters
+// of the page's worker over them, counting user space only:
+//
+//    "coding": {"wall": 0.052, "cpu": 0.051, "cycles": 163208117,
+//               "instructions": 402117230, "branch_misses": 301236,
+//               "l1d_misses": 2210871, "llc_misses": 18020}
+//
+// A counter which can't be read (see perf_start) is null. As with the CPU
+// times, the threads running stripes and row bands aren't counted.
+// -----------------------------------------------------------------------------
+// With --stats=perf, the counters of a stage, after its times
+static void
+print_counters(const struct page_stats *stats,
+               const unsigned long long *counters) {
+  if (!stats_perf) return;
+  for (int i = 0; i < NCOUNTERS; ++i) {
+    if (stats->counted[i]) {
+      fprintf(stderr, ", \"%s\": %llu", counter_names[i], counters[i]);
+    } else {
+      fprintf(stderr, ", \"%s\": null", counter_names[i]);
+    }
+  }
+}
+
+static void
+print_stats(const struct page *page, int index) {
+  const struct page_stats *stats = page->stats;
+  struct stage_time total;
+  memset(&total, 0, sizeof(total));
+  for (int i = 0; i < NSTAGES; ++i) {
+    total.wall += stats->stages[i].wall;
+    total.cpu += stats->stages[i].cpu;
+    for (int j = 0; j < NCOUNTERS; ++j)
+      total.counters[j] += stats->stages[i].counters[j];
+  }
+  fprintf(stderr, "{\"page\": %d, \"file\": ", index);
+  print_json_string(stderr, page->filename);
+  fprintf(stderr, ", \"width\": %d, \"height\": %d, \"by_rows\": %s, "
+                  "\"simd\": \"%s\", "
+                  "\"output_bytes\": %lu, \"peak_pix_bytes\": %lu, "
+                  "\"pixels_per_second\": %.4g, \"stages\": {",
+          stats->width, stats->height, stats->by_rows ? "true" : "false",
+          cpuGetLevelName(cpuGetLevel()),
+          (unsigned long) page->length, (unsigned long) stats->pix_bytes.peak,
+          total.wall > 0 ? (double) stats->width * stats->height / total.wall
+                         : 0.0);
+  for (int i = 0; i < NSTAGES; ++i) {
+    fprintf(stderr, "%s\"%s\": {\"wall\": %.6f, \"cpu\": %.6f",
+            i ? ", " : "", stage_names[i], stats->stages[i].wall,
+            stats->stages[i].cpu);
+    print_counters(stats, stats->stages[i].counters);
+    fprintf(stderr, "}");
+  }
+  fprintf(stderr, "}, \"total\": {\"wall\": %.6f, \"cpu\": %.6f",
+          total.wall, total.cpu);
+  print_counters(stats, total.counters);
+  fprintf(stderr, "}");
+  if (page->opts->deadline > 0) {
+    fprintf(stderr, ", \"deadline\": {\"ms\": %.6g, \"path\": \"%s\"}",
+            page->opts->deadline * 1000, coder_path_names[stats->coder_path]);
+  }
+  if (page->opts->halftone > 0)
+    fprintf(stderr, ", \"halftone_rows\": %d", stats->halftone_rows);
+#ifdef JBIG2_CODER_STATS
+  const struct jbig2enc_stats *const coder = &stats->coder;
+  fprintf(stderr, ", \"coder\": {\"bits\": %llu, \"lps\": %llu, "
+                  "\"lps_rate\": %.4g, \"renorm_shifts\": %llu, "
+                  "\"byteouts\": %llu, \"stuffed\": %llu, \"bytes\": %llu, "
+                  "\"contexts\": %llu}",
+          (unsigned long long) coder->bits, (unsigned long long) coder->lps,
+          coder->bits ? (double) coder->lps / coder->bits : 0.0,
+          (unsigned long long) coder->renorm_shifts,
+          (unsigned long long) coder->byteouts,
+          (unsigned long long) coder->stuffed,
+          (unsigned long long) coder->bytes,
+          (unsigned long long) coder->contexts);
+#endif
+  fprintf(stderr, "}\n");
+}
+
+// -----------------------------------------------------------------------------
+// With --framed: the pages are written as one stream of records, so that the
+// output of a whole batch can go through a pipe and be split by its reader in
+// one pass, and a page be found by seeking in it once it is in a file:
+//
+//   "JB2F" <version: 4>
+//   "PAGE" <page: 4> <options: 8> <length: 8> <length bytes of JBIG2 stream>
+//   ...
+//   "INDX" <npages: 4> (<page: 4> <offset: 8> <length: 8>) * npages
+//   <offset of "INDX": 8> "JB2E"
+//
+// with a PAGE record for each page in page order. The numbers are unsigned and
+// big endian, as in JBIG2. page is the number of the page in the batch (as in
+// <basename>.<page>), options a hash of the options it was coded with (as in
+// the journal, see journal_params), and the offsets in the index are those of
+// the PAGE records from the start of the stream, the lengths those of their
+// JBIG2 streams. The index can be found from the last 12 bytes. A stream cut
+// short by a failed page has no index.
+// -----------------------------------------------------------------------------
+#define FRAME_VERSION 1
+
+static void
+put_be(uint8_t *p, uint64_t value, int bytes) {
+  for (int i = bytes - 1; i >= 0; --i) {
+    p[i] = value & 0xff;
+    value >>= 8;
+  }
+}
+
+static int
+write_frame_header(struct batch *b) {
+  uint8_t header[8];
+  memcpy(header, "JB2F", 4);
+  put_be(header + 4, FRAME_VERSION, 4);
+  b->written = sizeof(header);
+  return write_all(b->fd, header, sizeof(header));
+}
+
+// The PAGE record of page, the index-th of the batch
+static int
+write_frame(struct batch *b, const struct page *page, int index) {
+  uint8_t header[24];
+  memcpy(header, "PAGE", 4);
+  put_be(header + 4, page->pageno, 4);
+  put_be(header + 8, options_hash(page->opts, page), 8);
+  put_be(header + 16, page->length, 8);
+  if (write_all(b->fd, header, sizeof(header)) < 0 ||
+      write_all(b->fd, page->data, page->length) < 0)
+    return -1;
+  b->offsets[index] = b->written;
+  b->written += sizeof(header) + page->length;
+  b->offsets[index + 1] = b->written;
+  return 0;
+}
+
+static int
+write_frame_index(const struct batch *b) {
+  const size_t size = 8 + (size_t) b->npages * 20 + 12;
+  uint8_t *const index = (uint8_t *) malloc(size);
+  if (!index) abort();
+  memcpy(index, "INDX", 4);
+  put_be(index + 4, b->npages, 4);
+  uint8_t *p = index + 8;
+  for (int i = 0; i < b->npages; ++i) {
+    put_be(p, b->pages[i].pageno, 4);
+    put_be(p + 4, b->offsets[i], 8);
+    put_be(p + 12, b->offsets[i + 1] - b->offsets[i] - 24, 8);
+    p += 20;
+  }
+  put_be(p, b->written, 8);
+  memcpy(p + 8, "JB2E", 4);
+  const int ret = write_all(b->fd, index, size);
+  free(index);
+  return ret;
+}
+
+// -----------------------------------------------------------------------------
+// Called in job order as the pages are finished: page order, unless each page
+// is written to a file of its own (see order_pages).
+// -----------------------------------------------------------------------------
+static int
+write_page_done(void *arg, int index) {
+  struct batch *b = (struct batch *) arg;
+  struct page *page = job_page(b, index);
+  if (page->status) return page->status;
+  if (page->resumed) return 0;
+  if (page->stats) print_stats(page, page->pageno);
+  if (b->opts->stream) return 0;  // already written
+  if (b->opts->estimate > 0) {
+    printf("%s: %lu +- %d bytes\n", page->filename,
+           (unsigned long) page->length,
+           page->estimate_error);
+    return 0;
+  }
+  if (b->opts->multipage) {
+    // a reference page starts with its dictionary, which the pages coded
+    // against it refer to as segment 0
+    unsigned ref_base = 0;
+    if (page->reference == index) {
+      page->dict_segnum = b->segnum;
+    } else if (page->reference >= 0) {
+      ref_base = b->pages[page->reference].dict_segnum;
+    }
+    size_t length;
+    uint8_t *const data = jbig2_file_page(page->data, page->length, index + 1,
+                                          ref_base, &b->segnum, &length);
+    if (!data || write_all(b->fd, data, length) < 0) abort();
+    free(data);
+  } else if (b->opts->xobjects) {
+    size_t length;
+    uint8_t *const data = jbig2_pdf_xobject(page->data, page->length,
+                                            &length);
+    if (!data || write_all(b->fd, data, length) < 0) abort();
+    free(data);
+    b->offsets[index] = b->written;
+    b->written += length;
+    b->offsets[index + 1] = b->written;
+  } else if (b->opts->framed) {
+    if (write_frame(b, page, index) < 0) abort();
+  } else if (0 > write_page(b->opts->basename, page->output, page->pageno,
+                            page->data, page->length)) {
+    abort();
+  } else if (b->journal) {
+    journal_add(b->journal, b->opts->basename, page);
+  }
+  free(page->data);
+  page->data = NULL;
+  if (b->opts->budget) jbig2_budget_give(b->opts->budget, page->budget_held);
+  return 0;
+}
+
+// -----------------------------------------------------------------------------
+// With --xobjects: the index which follows the XObjects of the npages pages,
+// so that they can all be read with the file in one go, and picked out of it
+// without parsing it:
+//
+//   xobjects <npages>
+//   <offset> <length>
+//   ...
+//   startxobjects
+//   <offset of the "xobjects" line>
+//
+// with a line of offset and length for each page, in page order. The offsets
+// are from the start of the file, and each such line is 42 bytes long: two
+// 20-digit numbers with leading zeros, wide enough for any 64-bit offset, much
+// as in the cross-reference table of a PDF file, so the index can be read
+// backwards from its last line, as a PDF reader finds its xref from startxref.
+// -----------------------------------------------------------------------------
+static int
+write_xobject_index(const struct batch *b) {
+  const size_t size = 64 + (size_t) b->npages * 42;
+  char *const index = (char *) malloc(size);
+  if (!index) abort();
+  size_t length = snprintf(index, size, "xobjects %d\n", b->npages);
+  for (int p = 0; p < b->npages; ++p) {
+    length += snprintf(index + length, size - length, "%020llu %020llu\n",
+                       (unsigned long long) b->offsets[p],
+                       (unsigned long long) (b->offsets[p + 1] -
+                                             b->offsets[p]));
+  }
+  length += snprintf(index + length, size - length, "startxobjects\n%llu\n",
+                     (unsigned long long) b->written);
+  const int ret = write_all(b->fd, index, length);
+  free(index);
+  return ret;
+}
+
+// -----------------------------------------------------------------------------
+// Server mode (--server or --socket): encode any number of pages in one warm
+// process, reusing the arithmetic coder context from page to page. Each
+// request is a single line
+//
+//   <options> file <path>
+//   <options> data <length>
+//
+// where the options are any of
+//
+//   [-d] [-g <template>] [--mmr] [-p] [-t <threshold>] [-T <bw threshold>]
+//   [-2 | -4] [-r <factor>] [--rank <level>] [--estimate <fraction>]
+//   [--auto-tpgd <cutoff>]
+//   [--despeckle <size>] [--xres <dpi>] [--yres <dpi>] [--raw <stream>]
+//   [--deadline-ms <ms>] [--halftone <density>]
+//
+// The options start from those given on the command line for each request.
+// "file" reads the image from path (which may contain spaces); "data" is
+// followed by length bytes of PNG, PNM or TIFF image, or of a raw stream with
+// --raw, of at most the --memory-limit (1 GiB without it): a longer one gets
+// "ERROR data too large" and ends the connection. The data of a request whose
+// options are wrong is read and dropped. The reply is a line
+//
+//   OK <length>
+//
+// followed by the length bytes of the JBIG2 stream (with --estimate, the line
+// "ESTIMATE <length> <error>" and nothing else), or a line
+//
+//   ERROR <message>
+//
+// Requests are served in order until the end of the input.
+// -----------------------------------------------------------------------------
+
+// -----------------------------------------------------------------------------
+// Parse the options of a request line into opts and return the rest of the
+// line, starting at "file" or "data". Returns NULL after writing an error
+// message to err. If output isn't NULL, "-o <file>" is also taken, and sets it
+// to the file name, which is in line and can't contain spaces.
+// -----------------------------------------------------------------------------
+static char *
+parse_request(char *line, struct encode_options *opts, const char **output,
+              const char **err) {
+  char *p = line;
+  for (;;) {
+    while (*p == ' ') ++p;
+    if (strncmp(p, "file ", 5) == 0 || strncmp(p, "data ", 5) == 0) {
+      if (opts->reduce_rank > opts->reduce * opts->reduce) {
+        *err = "rank level above the square of the downscale factor";
+        return NULL;
+      }
+      break;
+    }
+    if (*p != '-') {
+      *err = "expected \"file <path>\" or \"data <length>\"";
+      return NULL;
+    }
+    char *const option = p;
+    while (*p && *p != ' ') ++p;
+    const char *value = NULL;
+    if (*p) {
+      *p++ = 0;
+      while (*p == ' ') ++p;
+      value = p;
+    }
+
+    if (strcmp(option, "-d") == 0) {
+      opts->duplicate_line_removal = true;
+      opts->auto_tpgd = -1;
+    } else if (strcmp(option, "--mmr") == 0) {
+      if (opts->verify) {
+        *err = "can't have --mmr with --verify";
+        return NULL;
+      }
+      if (opts->halftone > 0) {
+        *err = "can't have --halftone with --mmr";
+        return NULL;
+      }
+      opts->mmr = true;
+    } else if (strcmp(option, "-p") == 0) {
+      opts->pdfmode = true;
+    } else if (strcmp(option, "-2") == 0) {
+      opts->up2 = true;
+      opts->up4 = false;
+    } else if (strcmp(option, "-4") == 0) {
+      opts->up4 = true;
+      opts->up2 = false;
+    } else if (strcmp(option, "-r") == 0) {
+      if (!value || (*value != '1' && *value != '2' && *value != '4') ||
+          (value[1] && value[1] != ' ')) {
+        *err = "invalid downscale factor: (1, 2 or 4)";
+        return NULL;
+      }
+      opts->reduce = *value - '0';
+      p = (char *) value + 1;
+    } else if (strcmp(option, "--rank") == 0) {
+      char *endptr;
+      const long v = value ? strtol(value, &endptr, 10) : 0;
+      if (!value || endptr == value || (*endptr && *endptr != ' ') ||
+          v < 1 || v > 16) {
+        *err = "invalid rank level: (1..16)";
+        return NULL;
+      }
+      opts->reduce_rank = v;
+      p = endptr;
+    } else if (strcmp(option, "-g") == 0) {
+      if (!value || *value < '0' || *value > '3' ||
+          (value[1] && value[1] != ' ')) {
+        *err = "invalid generic region template: (0..3)";
+        return NULL;
+      }
+      opts->gbtemplate = *value - '0';
+      p = (char *) value + 1;
+    } else if (strcmp(option, "--auto-tpgd") == 0) {
+      char *endptr;
+      const double v = value ? strtod(value, &endptr) : 0;
+      if (!value || endptr == value || (*endptr && *endptr != ' ') ||
+          v < 0 || v > 1) {
+        *err = "invalid TPGD cutoff: (0..1)";
+        return NULL;
+      }
+      opts->auto_tpgd = v;
+      p = endptr;
+    } else if (strcmp(option, "--deadline-ms") == 0) {
+      char *endptr;
+      const double v = value ? strtod(value, &endptr) : 0;
+      if (!value || endptr == value || (*endptr && *endptr != ' ') ||
+          v <= 0) {
+        *err = "invalid deadline: (ms > 0)";
+        return NULL;
+      }
+      if (opts->verify) {
+        *err = "can't have --deadline-ms with --verify";
+        return NULL;
+      }
+      if (opts->halftone > 0) {
+        *err = "can't have --halftone with --deadline-ms";
+        return NULL;
+      }
+      opts->deadline = v / 1000;
+      p = endptr;
+    } else if (strcmp(option, "--halftone") == 0) {
+      char *endptr;
+      const double v = value ? strtod(value, &endptr) : 0;
+      if (!value || endptr == value || (*endptr && *endptr != ' ') ||
+          v <= 0 || v > 1) {
+        *err = "invalid halftone density: (0..1)";
+        return NULL;
+      }
+      if (opts->verify) {
+        *err = "can't have --halftone with --verify";
+        return NULL;
+      }
+      if (opts->mmr) {
+        *err = "can't have --halftone with --mmr";
+        return NULL;
+      }
+      if (opts->deadline > 0) {
+        *err = "can't have --halftone with --deadline-ms";
+        return NULL;
+      }
+      if (opts->estimate > 0) {
+        *err = "can't have --halftone with --estimate";
+        return NULL;
+      }
+      opts->halftone = v;
+      p = endptr;
+    } else if (strcmp(option, "--despeckle") == 0) {
+      if (!value || *value < '0' || *value > '2' ||
+          (value[1] && value[1] != ' ')) {
+        *err = "invalid speck size: (0..2)";
+        return NULL;
+      }
+      opts->despeckle = *value - '0';
+      p = (char *) value + 1;
+    } else if (strcmp(option, "--xres") == 0 ||
+               strcmp(option, "--yres") == 0) {
+      char *endptr;
+      const long v = value ? strtol(value, &endptr, 10) : 0;
+      if (!value || endptr == value || (*endptr && *endptr != ' ') ||
+          v < 1 || v > 65535) {
+        *err = "invalid resolution: (1..65535)";
+        return NULL;
+      }
+      if (option[2] == 'x') {
+        opts->xres = (int) v;
+      } else {
+        opts->yres = (int) v;
+      }
+      p = endptr;
+    } else if (strcmp(option, "--raw") == 0) {
+      const char *const end = value ? jbig2_raw_parse(value, &opts->raw) : NULL;
+      if (!end) {
+        *err = "invalid raw stream (see --raw)";
+        return NULL;
+      }
+      p = (char *) end;
+    } else if (output && strcmp(option, "-o") == 0) {
+      if (!value || !*value) {
+        *err = "missing output file";
+        return NULL;
+      }
+      *output = value;
+      while (*p && *p != ' ') ++p;
+      if (*p) *p++ = 0;
+    } else if (strcmp(option, "--estimate") == 0) {
+      char *endptr;
+      const double v = value ? strtod(value, &endptr) : 0;
+      if (!value || endptr == value || (*endptr && *endptr != ' ') ||
+          v <= 0 || v > 1) {
+        *err = "invalid estimate fraction: (0..1]";
+        return NULL;
+      }
+      if (opts->halftone > 0) {
+        *err = "can't have --halftone with --estimate";
+        return NULL;
+      }
+      opts->estimate = v;
+      p = endptr;
+    } else if (strcmp(option, "-t") == 0 || strcmp(option, "-T") == 0) {
+      // -t is only used by the symbol coder, so it is checked and ignored
+      char *endptr;
+      const double v = value ? strtod(value, &endptr) : 0;
+      if (!value || endptr == value || (*endptr && *endptr != ' ')) {
+        *err = "missing or bad option value";
+        return NULL;
+      }
+      if (option[1] == 'T') {
+        if (v < 0 || v > 255 || v != (int) v) {
+          *err = "invalid bw threshold: (0..255)";
+          return NULL;
+        }
+        opts->bw_threshold = (int) v;
+      } else if (v > 0.9 || v < 0.4) {
+        *err = "invalid threshold: (0.4..0.9)";
+        return NULL;
+      }
+      p = endptr;
+    } else {
+      *err = "unknown option";
+      return NULL;
+    }
+  }
+  return p;
+}
+
+// -----------------------------------------------------------------------------
+// Find whether request line is a "data" request, before parse_request cuts it
+// up: its first word which is "file" or "data", which no option value is,
+// decides. For "data", sets *length to the length which follows, or to -1 if
+// that isn't a length.
+// -----------------------------------------------------------------------------
+static bool
+data_request(const char *line, long *length) {
+  const char *p = line;
+  for (;;) {
+    while (*p == ' ') ++p;
+    if (!*p || strncmp(p, "file ", 5) == 0) return false;
+    if (strncmp(p, "data ", 5) == 0) break;
+    while (*p && *p != ' ') ++p;
+  }
+  char *endptr;
+  *length = strtol(p + 5, &endptr, 10);
+  if (*endptr || endptr == p + 5 || *length < 0) *length = -1;
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+// Read and drop length bytes of in. Returns false if in ends first.
+// -----------------------------------------------------------------------------
+static bool
+skip_data(FILE *in, long length) {
+  char buffer[8192];
+  while (length > 0) {
+    const size_t n = length < (long) sizeof(buffer) ? length : sizeof(buffer);
+    if (fread(buffer, 1, n, in) != n) return false;
+    length -= n;
+  }
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+// Serve requests read from in, writing the replies to out, until the end of
+// in. Returns 0 at the end of the input, or 1 if the connection can't be used
+// any more (a write failed, or the data of a request was cut short).
+// -----------------------------------------------------------------------------
+static int
+serve(FILE *in, FILE *out, const struct encode_options *defaults,
+      struct jbig2enc_ctx *ctx) {
+  char line[8192];
+  while (fgets(line, sizeof(line), in)) {
+    size_t n = strlen(line);
+    if (n == sizeof(line) - 1 && line[n - 1] != '\n') {
+      fprintf(out, "ERROR request line too long\n");
+      fflush(out);
+      return 1;
+    }
+    while (n && (line[n - 1] == '\n' || line[n - 1] == '\r')) line[--n] = 0;
+    if (!n) continue;
+
+    struct encode_options opts = *defaults;
+    struct page_stats stats;
+    struct page page;
+    page.pageno = 0;
+    page.output = NULL;
+    page.opts = &opts;
+    page.subimage = -1;
+    page.input = NULL;
+    page.input_size = 0;
+    page.input_mapped = false;
+    page.input_shared = false;
+    page.stream = NULL;
+    page.format = IFF_UNKNOWN;
+    page.components = NULL;
+    page.bw = NULL;
+    page.row_hashes = NULL;
+    page.reference = -1;
+    page.data = NULL;
+    page.length = 0;
+    page.estimate_error = 0;
+    page.budget_held = 0;
+    page.status = 0;
+    page.stats = NULL;
+    page.journal.valid = false;
+    page.resumed = false;
+
+    // The length of the data comes first: it's needed to find the next
+    // request even if this one fails.
+    long length = 0;
+    if (data_request(line, &length) && length < 0) {
+      fprintf(out, "ERROR bad data length\n");
+      fflush(out);
+      return 1;  // we can't find the start of the next request
+    }
+    const char *err = NULL;
+    char *what = parse_request(line, &opts, NULL, &err);
+    if (opts.stats) {
+      memset(&stats, 0, sizeof(stats));
+      page.stats = &stats;
+    }
+    stats_begin(page.stats, ctx);
+    if (!what && length && !skip_data(in, length)) {
+      fprintf(out, "ERROR data cut short\n");
+      fflush(out);
+      return 1;
+    } else if (what && strncmp(what, "data ", 5) == 0) {
+      // The length is the client's word: one too large for memory only ends
+      // its own connection, rather than being read to be dropped.
+      const size_t most = opts.budget ? jbig2_budget_limit(opts.budget)
+                                      : MAX_REQUEST_DATA;
+      if ((unsigned long) length > most ||
+          (length && !(page.input = (uint8_t *) malloc(length)))) {
+        stats_end(page.stats, STAGE_READ, ctx);
+        fprintf(out, "ERROR data too large\n");
+        fflush(out);
+        return 1;
+      }
+      page.filename = "<data>";
+      page.input_size = length;
+      if (fread(page.input, 1, length, in) != (size_t) length) {
+        stats_end(page.stats, STAGE_READ, ctx);
+        free(page.input);
+        fprintf(out, "ERROR data cut short\n");
+        fflush(out);
+        return 1;
+      }
+      stats_add(page.stats, STAGE_READ);
+      if (opts.raw.filter != JBIG2_RAW_NONE) {
+        // a raw stream, which has no format to find
+      } else if (page.input_size < 12 ||
+                 findFileFormatBuffer(page.input, &page.format)) {
+        err = "unable to get file format";
+      } else if (page.format != IFF_PNG && page.format != IFF_PNM &&
+                 page.format != IFF_PNM_GZ && page.format != IFF_TIFF) {
+        err = "only PNG, PNM and TIFF images can be sent as data";
+      }
+    } else if (what) {
+      page.filename = what + 5;
+      if (map_input(page.filename, &page.input, &page.input_size,
+                    &page.input_mapped) < 0) {
+        err = "unable to open file";
+      } else {
+        stats_add(page.stats, STAGE_READ);
+        if (page.input_size >= 12 && opts.raw.filter == JBIG2_RAW_NONE)
+          findFileFormatBuffer(page.input, &page.format);
+      }
+    }
+    stats_add(page.stats, STAGE_SNIFF);
+
+    if (!err) {
+      // One page is coded at a time, so only its own size counts.
+      bool low_memory = false;
+      if (opts.budget) page_budget(&opts, &page, &low_memory);
+      page.status = encode_page(&opts, ctx, &page, low_memory);
+      if (page.status) err = "cannot encode image";
+    }
+    unmap_input(page.input, page.input_size, page.input_mapped);
+    stats_end(page.stats, STAGE_CODING, ctx);
+    if (!err && page.stats) print_stats(&page, 0);
+
+    if (err) {
+      fprintf(out, "ERROR %s\n", err);
+    } else if (opts.estimate > 0) {
+      fprintf(out, "ESTIMATE %lu %d\n", (unsigned long) page.length,
+              page.estimate_error);
+    } else {
+      fprintf(out, "OK %lu\n", (unsigned long) page.length);
+      fwrite(page.data, 1, page.length, out);
+    }
+    free(page.data);
+    if (fflush(out) || ferror(out)) return 1;
+  }
+  return 0;
+}
+
+#if !defined(WIN32)
+// -----------------------------------------------------------------------------
+// Listen on the Unix domain socket at path and serve its connections, one
+// after another, forever. A stale socket left at path is replaced. Returns only
+// on error.
+// -----------------------------------------------------------------------------
+static int
+serve_socket(const char *path, const struct encode_options *defaults,
+             struct jbig2enc_ctx *ctx) {
+  struct sockaddr_un addr;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path too long: \"%s\"\n", path);
+    return 1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  struct stat st;
+  if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);
+  const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+      listen(fd, 16) < 0) {
+    fprintf(stderr, "Unable to listen on \"%s\"\n", path);
+    return 1;
+  }
+  // a client going away mustn't kill the server
+  signal(SIGPIPE, SIG_IGN);
+
+  for (;;) {
+    const int conn = accept(fd, NULL, NULL);
+    if (conn < 0) continue;
+    const int conn_out = dup(conn);
+    FILE *in = fdopen(conn, "rb");
+    FILE *out = conn_out < 0 ? NULL : fdopen(conn_out, "wb");
+    if (in && out) serve(in, out, defaults, ctx);
+    if (in) fclose(in); else close(conn);
+    if (out) fclose(out); else if (conn_out >= 0) close(conn_out);
+  }
+}
+#endif
+
+// -----------------------------------------------------------------------------
+// The pages of a batch, as its inputs are found
+// -----------------------------------------------------------------------------
+struct page_list {
+  struct page *pages;
+  int npages;
+  int capacity;
+  struct page_input *shared;  // the TIFF files which pages are read from
+  int nshared;
+  bool stdin_used;  // "-" can only be read once
+  bool stats;  // with --stats
+};
+
+// -----------------------------------------------------------------------------
+// Whether the size bytes at data start with the header of a PNM image
+// -----------------------------------------------------------------------------
+static bool
+is_pnm_start(const uint8_t *data, size_t size) {
+  return size >= 3 && data[0] == 'P' && data[1] >= '1' && data[1] <= '6' &&
+         (data[2] == ' ' || data[2] == '\t' || data[2] == '\n' ||
+          data[2] == '\r' || data[2] == '#');
+}
+
+// -----------------------------------------------------------------------------
+// Add the pages of the image file filename (one for each image of a TIFF file,
+// or of a file of PNM images one after another) to list, to be coded with
+// opts and written to output (see struct page).
+// Returns 0 on success, otherwise the exit code of the program.
+// -----------------------------------------------------------------------------
+static int
+add_input(struct page_list *list, const char *filename,
+          const struct encode_options *opts, const char *output) {
+  // The file is sniffed from its mapped bytes and later decoded straight
+  // from them, so that it is only read once.
+  uint8_t *input;
+  size_t input_size;
+  bool input_mapped;
+  if (strcmp(filename, "-") == 0 && list->stdin_used) {
+    fprintf(stderr, "Can only read stdin (\"-\") once\n");
+    return 1;
+  }
+  // the reading and sniffing are charged to the first page of the file
+  struct page_stats *file_stats = NULL;
+  if (list->stats) {
+    file_stats = (struct page_stats *) calloc(1, sizeof(*file_stats));
+    if (!file_stats) abort();
+    stats_time(&file_stats->mark);
+  }
+  if (map_input(filename, &input, &input_size, &input_mapped) < 0) {
+    fprintf(stderr, "Unable to open \"%s\"", filename);
+    return 1;
+  }
+  stats_add(file_stats, STAGE_READ);
+  // a raw stream is a single image, with no format to find
+  const bool raw = opts->raw.filter != JBIG2_RAW_NONE;
+  l_int32 filetype = IFF_UNKNOWN;
+  if (!raw && (input_size < 12 || findFileFormatBuffer(input, &filetype))) {
+    fprintf(stderr, "Unable to get file format of \"%s\"", filename);
+    return 1;
+  }
+  stats_add(file_stats, STAGE_SNIFF);
+  if (strcmp(filename, "-") == 0) {
+    // stdin can't be opened again by name, so only formats which can be
+    // decoded from memory will do.
+    list->stdin_used = true;
+    if (!raw && filetype != IFF_PNG && filetype != IFF_PNM &&
+        filetype != IFF_PNM_GZ && filetype != IFF_TIFF) {
+      fprintf(stderr,
+              "Only PNG, PNM and TIFF images can be read from stdin\n");
+      return 1;
+    }
+  }
+  // The images of a TIFF file are decoded from its mapped bytes, which its
+  // pages share, and which are kept until the end.
+  int numsubimages = 0;
+  if (filetype == IFF_TIFF) {
+    numsubimages = jbig2_tiff_count(input, input_size);
+    if (numsubimages == 0) {
+      fprintf(stderr, "Cannot read the images of TIFF file \"%s\"\n",
+              filename);
+      return 1;
+    }
+    list->shared = (struct page_input *) realloc(
+        list->shared, sizeof(struct page_input) * (list->nshared + 1));
+    if (!list->shared) abort();
+    list->shared[list->nshared].data = input;
+    list->shared[list->nshared].size = input_size;
+    list->shared[list->nshared].mapped = input_mapped;
+    list->shared[list->nshared].users = 0;
+    list->nshared++;
+  }
+
+  // Several PNM images one after another, as ghostscript writes the pages of a
+  // document to a pipe, are a page each. Anything after the last image which
+  // isn't the start of another one is ignored, as it always was.
+  int numimages = 1;
+  if (filetype == IFF_PNM) {
+    size_t offset = 0, nbytes;
+    for (;;) {
+      if (sreadSizePnm(input + offset, input_size - offset, &nbytes)) {
+        // a single image cut short is still read as far as it goes
+        if (numimages == 1) break;
+        fprintf(stderr, "Unable to read image %d of \"%s\"\n", numimages,
+                filename);
+        return 1;
+      }
+      offset += nbytes;
+      if (!is_pnm_start(input + offset, input_size - offset)) break;
+      ++numimages;
+    }
+  }
+
+  const int n = numsubimages > 0 ? numsubimages : numimages;
+  if (output && n > 1) {
+    fprintf(stderr, "\"%s\" has %d images, which can't all go to \"%s\"\n",
+            filename, n, output);
+    return 1;
+  }
+  if (list->npages + n > list->capacity) {
+    list->capacity = (list->npages + n) * 2;
+    list->pages = (struct page *) realloc(list->pages, sizeof(struct page) *
+                                                       list->capacity);
+    if (!list->pages) abort();
+  }
+  // The images of a PNM stream are decoded from their own part of it, which
+  // is freed once the last of them is done with it (see release_input).
+  struct page_input *stream = NULL;
+  if (numimages > 1) {
+    stream = (struct page_input *) malloc(sizeof(struct page_input));
+    if (!stream) abort();
+    stream->data = input;
+    stream->size = input_size;
+    stream->mapped = input_mapped;
+    stream->users = numimages;
+  }
+  size_t offset = 0;
+  for (int subimage = 0; subimage < n; ++subimage) {
+    struct page *page = &list->pages[list->npages++];
+    page->pageno = list->npages - 1;
+    page->filename = filename;
+    page->output = output;
+    page->opts = opts;
+    page->subimage = numsubimages > 0 ? subimage : -1;
+    page->input = input;
+    page->input_size = input_size;
+    page->input_mapped = input_mapped;
+    page->input_shared = numsubimages > 0;
+    page->stream = stream;
+    if (stream) {
+      sreadSizePnm(input + offset, input_size - offset, &page->input_size);
+      page->input = input + offset;
+      offset += page->input_size;
+    }
+    page->format = filetype;
+    page->components = NULL;
+    page->bw = NULL;
+    page->row_hashes = NULL;
+    page->reference = -1;
+    page->data = NULL;
+    page->length = 0;
+    page->estimate_error = 0;
+    page->budget_held = 0;
+    page->status = 0;
+    page->stats = file_stats;
+    page->journal.valid = false;
+    page->resumed = false;
+    if (list->stats && subimage > 0) {
+      page->stats = (struct page_stats *) calloc(1, sizeof(*page->stats));
+      if (!page->stats) abort();
+    }
+  }
+  return 0;
+}
+
+// -----------------------------------------------------------------------------
+// Read the manifest (--manifest) in filename, or stdin if it is "-", and add
+// the pages it lists to list. Each line is
+//
+//   <options> [-o <output>] file <path>
+//
+// with the options of a request in server mode (see parse_request), which
+// start from those of the command line on each line and apply only to the
+// pages of path. -o writes the page to output rather than to
+// <basename>.<pageno> or stdout; its name can't contain spaces, though path
+// can. Blank lines and lines starting with # are skipped. With fixed_coding (-s and --refine), the
+// pages are coded by the batch as a whole, so only the options which change
+// how a page is read (-T, -2, -4, --xres, --yres and --raw) can differ from
+// line to line.
+//
+// *text is set to the manifest, which the pages point into, and *line_opts to
+// the options of its lines, which the pages point to. Both are to be freed
+// once the pages are. Returns 0 on success, otherwise the exit code of the
+// program.
+// -----------------------------------------------------------------------------
+static int
+read_manifest(const char *filename, const struct encode_options *defaults,
+              bool fixed_coding, struct page_list *list, char **text,
+              struct encode_options **line_opts) {
+  const bool from_stdin = strcmp(filename, "-") == 0;
+  const int fd = from_stdin ? 0 : open(filename, O_RDONLY | WINBINARY);
+  uint8_t *data;
+  size_t size;
+  if (fd < 0 || read_all(fd, &data, &size) < 0) {
+    fprintf(stderr, "Unable to read the manifest \"%s\"\n", filename);
+    return 1;
+  }
+  if (!from_stdin) close(fd);
+  list->stdin_used |= from_stdin;
+  *text = (char *) realloc(data, size + 1);
+  if (!*text) abort();
+  (*text)[size] = 0;
+  int nlines = 1;
+  for (size_t k = 0; k < size; ++k) nlines += (*text)[k] == '\n';
+  *line_opts = (struct encode_options *) malloc(sizeof(**line_opts) * nlines);
+  if (!*line_opts) abort();
+
+  char *line = *text;
+  for (int lineno = 1; line; ++lineno) {
+    char *const next = strchr(line, '\n');
+    if (next) *next = 0;
+    size_t n = strlen(line);
+    if (n && line[n - 1] == '\r') line[--n] = 0;
+    while (*line == ' ' || *line == '\t') ++line;
+    if (*line && *line != '#') {
+      struct encode_options *const opts = &(*line_opts)[lineno - 1];
+      *opts = *defaults;
+      const char *output = NULL;
+      const char *err = NULL;
+      char *const what = parse_request(line, opts, &output, &err);
+      if (!what) {
+        // err is set
+      } else if (strncmp(what, "file ", 5) != 0) {
+        err = "expected \"file <path>\"";
+      } else if (opts->estimate != defaults->estimate) {
+        err = "--estimate can't differ from page to page";
+      } else if (fixed_coding &&
+                 (opts->duplicate_line_removal !=
+                  defaults->duplicate_line_removal ||
+                  opts->gbtemplate != defaults->gbtemplate ||
+                  opts->mmr != defaults->mmr ||
+                  opts->auto_tpgd != defaults->auto_tpgd)) {
+        err = "-d, -g, --mmr and --auto-tpgd can't differ from page to page "
+              "with -s or --refine";
+      } else if (output && (defaults->multipage || defaults->xobjects ||
+                            defaults->framed)) {
+        err = "-o can't be used with --multipage, --xobjects, --framed, "
+              "--refine or -s without -p";
+      }
+      if (err) {
+        fprintf(stderr, "%s:%d: %s\n", filename, lineno, err);
+        return 1;
+      }
+      const int status = add_input(list, what + 5, opts, output);
+      if (status) return status;
+    }
+    line = next ? next + 1 : NULL;
+  }
+  return 0;
+}
+
+// -----------------------------------------------------------------------------
+// The cost of coding a page, to order the pages by (see order_pages): the
+// pixels of its 1 bpp image, from the header of its image, or else the bits of
+// its file (see read_page_header)
+// -----------------------------------------------------------------------------
+struct page_cost {
+  uint64_t cost;
+  int pageno;
+};
+
+static int
+compare_page_cost(const void *a, const void *b) {
+  const struct page_cost *const x = (const struct page_cost *) a;
+  const struct page_cost *const y = (const struct page_cost *) b;
+  if (x->cost != y->cost) return x->cost > y->cost ? -1 : 1;
+  return x->pageno - y->pageno;
+}
+
+// -----------------------------------------------------------------------------
+// Pages written to files of their own can be coded in any order. Returns the
+// order to code them in, the largest first, so that the batch doesn't end with
+// a large page started last being coded by one thread while the others are
+// idle; or NULL if that is page order anyway.
+// -----------------------------------------------------------------------------
+static int *
+order_pages(const struct page *pages, int npages) {
+  struct page_cost *const costs =
+      (struct page_cost *) malloc(sizeof(*costs) * npages);
+  if (!costs) abort();
+  for (int p = 0; p < npages; ++p) {
+    const struct page *const page = &pages[p];
+    l_int32 format, w, h, bps, spp;
+    const uint64_t scale = page->opts->up2 ? 2 : page->opts->up4 ? 4 : 1;
+    costs[p].pageno = p;
+    if (!read_page_header(page, &format, &w, &h, &bps, &spp)) {
+      costs[p].cost = (uint64_t) w * h * scale * scale;
+    } else {
+      costs[p].cost = (uint64_t) page->input_size * 8;
+    }
+  }
+  qsort(costs, npages, sizeof(*costs), compare_page_cost);
+  int *order = (int *) malloc(sizeof(*order) * npages);
+  if (!order) abort();
+  bool in_page_order = true;
+  for (int k = 0; k < npages; ++k) {
+    order[k] = costs[k].pageno;
+    in_page_order &= order[k] == k;
+  }
+  free(costs);
+  if (in_page_order) {
+    free(order);
+    return NULL;
+  }
+  return order;
+}
+
+int
+main(int argc, char **argv) {
+  bool duplicate_line_removal = false;
+  int gbtemplate = 0;
+  bool mmr = false;
+  bool pdfmode = false;
+  bool symbol_mode = false;
+  float threshold = 0.85;
+  float weight = 0.5;
+  int bw_threshold = 188;
+  bool up2 = false, up4 = false;
+  int reduce = 1, reduce_rank = 1;
+  int xres = 0, yres = 0;
+  struct jbig2_raw_params raw;
+  memset(&raw, 0, sizeof(raw));
+  const char *basename = NULL;
+  const char *manifest = NULL;
+  const char *journal_path = NULL;
+  int nthreads = 1;
+  enum jbig2_affinity affinity = JBIG2_AFFINITY_NONE;
+  int max_inflight = 0;
+  long memory_mb = 0;
+  int stripe_height = 0;
+  int interleave = 1;
+  bool stream = false;
+  bool multipage = false;
+  bool xobjects = false;
+  bool framed = false;
+  bool server = false;
+  const char *socket_path = NULL;
+  long cache_mb = 0;
+  const char *cache_dir = NULL;
+  double estimate = 0;
+  double deadline = 0;
+  double halftone = 0;
+  double auto_tpgd = -1;
+  int despeckle = 0;
+  double refine = 0;
+  bool stats = false;
+  bool verify = false;
+  int i;
+
+  // Each page makes and frees buffers of the same sizes as the one before it:
+  // keep them rather than have the system fault in fresh memory every time.
+  setPixDataCache(PIX_DATA_CACHE_BYTES);
+
+  for (i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "-h") == 0 ||
+        strcmp(argv[i], "--help") == 0) {
+      usage(argv[0]);
+      return 0;
+      continue;
+    }
+
+    if (strcmp(argv[i], "-d") == 0 ||
+        strcmp(argv[i], "--duplicate-line-removal") == 0) {
+      duplicate_line_removal = true;
+      continue;
+    }
+
+    if (strcmp(argv[i], "-g") == 0) {
+      if (i + 1 == argc) {
+        usage(argv[0]);
+        return 1;
+      }
+      char *endptr;
+      gbtemplate = strtol(argv[i+1], &endptr, 10);
+      if (*endptr || gbtemplate < 0 || gbtemplate > 3) {
+        fprintf(stderr, "Invalid generic region template: %s (0..3)\n",
+                argv[i+1]);
+        return 1;
+      }
+      i++;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--mmr") == 0) {
+      mmr = true;
+      continue;
+    }
+
+    if (strcmp(argv[i], "-s") == 0 ||
+        strcmp(argv[i], "--symbol-mode") == 0) {
+      symbol_mode = true;
+      continue;
+    }
+
+    if (strcmp(argv[i], "-p") == 0 ||
+        strcmp(argv[i], "--pdf") == 0) {
+      pdfmode = true;
+      continue;
+    }
+
+    if (strcmp(argv[i], "-b") == 0) {
+      if (i + 1 == argc) {
+        usage(argv[0]);
+        return 1;
+      }
+      basename = argv[i+1];
+      i++;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--manifest") == 0) {
+      if (i + 1 == argc) {
+        usage(argv[0]);
+        return 1;
+      }
+      manifest = argv[i+1];
+      i++;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--journal") == 0) {
+      if (i + 1 == argc) {
+        usage(argv[0]);
+        return 1;
+      }
+      journal_path = argv[i+1];
+      i++;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--xres") == 0 ||
+        strcmp(argv[i], "--yres") == 0) {
+      if (i + 1 == argc) {
+        usage(argv[0]);
+        return 1;
+      }
+      char *endptr;
+      const long res = strtol(argv[i+1], &endptr, 10);
+      if (*endptr || res < 1 || res > 65535) {
+        fprintf(stderr, "Invalid resolution: %s (1..65535)\n", argv[i+1]);
+        return 1;
+      }
+      if (argv[i][2] == 'x') {
+        xres = res;
+      } else {
+        yres = res;
+      }
+      i++;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--raw") == 0) {
+      if (i + 1 == argc) {
+        usage(argv[0]);
+        return 1;
+      }
+      const char *const end = jbig2_raw_parse(argv[i+1], &raw);
+      if (!end || *end) {
+        fprintf(stderr, "Invalid raw stream: %s\n", argv[i+1]);
+        return 1;
+      }
+      i++;
+      continue;
+    }
+
+    if (strcmp(argv[i], "-j") == 0) {
+      if (i + 1 == argc) {
+        usage(argv[0]);
+        return 1;
+      }
+      char *endptr;
+      nthreads = strtol(argv[i+1], &endptr, 10);
+      if (*endptr || nthreads < 0) {
+        fprintf(stderr, "Cannot parse thread count: %s\n", argv[i+1]);
+        usage(argv[0]);
+        return 1;
+      }
+      if (nthreads == 0) nthreads = jbig2_ncpus();
+      i++;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--affinity") == 0) {
+      if (i + 1 == argc) {
+        usage(argv[0]);
+        return 1;
+      }
+      if (strcmp(argv[i+1], "compact") == 0) {
+        affinity = JBIG2_AFFINITY_COMPACT;
+      } else if (strcmp(argv[i+1], "spread") == 0) {
+        affinity = JBIG2_AFFINITY_SPREAD;
+      } else {
+        fprintf(stderr, "Unknown --affinity: %s\n", argv[i+1]);
+        usage(argv[0]);
+        return 1;
+      }
+      i++;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--max-inflight") == 0) {
+      if (i + 1 == argc) {
+        usage(argv[0]);
+        return 1;
+      }
+      char *endptr;
+      max_inflight = strtol(argv[i+1], &endptr, 10);
+      if (*endptr || max_inflight < 1) {
+        fprintf(stderr, "Invalid page limit: %s (1 or more)\n", argv[i+1]);
+        return 1;
+      }
+      i++;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--memory-limit") == 0) {
+      if (i + 1 == argc) {
+        usage(argv[0]);
+        return 1;
+      }
+      char *endptr;
+      memory_mb = strtol(argv[i+1], &endptr, 10);
+      if (*endptr || memory_mb < 1) {
+        fprintf(stderr, "Invalid memory limit: %s (1 MiB or more)\n",
+                argv[i+1]);
+        return 1;
+      }
+      i++;
+      continue;
+    }
+
+    if (strcmp(argv[i], "-S") == 0 ||
+        strcmp(argv[i], "--stripe-height") == 0) {
+      if (i + 1 == argc) {
+        usage(argv[0]);
+        return 1;
+      }
+      char *endptr;
+      stripe_height = strtol(argv[i+1], &endptr, 10);
+      if (*endptr || stripe_height < 0) {
+        fprintf(stderr, "Cannot parse stripe height: %s\n", argv[i+1]);
+        usage(argv[0]);
+        return 1;
+      }
+      i++;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--interleave") == 0) {
+      if (i + 1 == argc) {
+        usage(argv[0]);
+        return 1;
+      }
+      char *endptr;
+      interleave = strtol(argv[i+1], &endptr, 10);
+      if (*endptr || interleave < 1 || interleave > JBIG2_INTERLEAVE_MAX) {
+        fprintf(stderr, "Invalid interleave: %s (1..%d)\n", argv[i+1],
+                JBIG2_INTERLEAVE_MAX);
+        return 1;
+      }
+      i++;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--stream") == 0) {
+      stream = true;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--multipage") == 0) {
+      multipage = true;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--xobjects") == 0) {
+      xobjects = true;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--framed") == 0) {
+      framed = true;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--cache") == 0) {
+      if (i + 1 == argc) {
+        usage(argv[0]);
+        return 1;
+      }
+      char *endptr;
+      cache_mb = strtol(argv[i+1], &endptr, 10);
+      if (*endptr || cache_mb < 0) {
+        fprintf(stderr, "Cannot parse cache size: %s\n", argv[i+1]);
+        usage(argv[0]);
+        return 1;
+      }
+      i++;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--cache-dir") == 0) {
+      if (i + 1 == argc) {
+        usage(argv[0]);
+        return 1;
+      }
+      cache_dir = argv[i+1];
+      i++;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--auto-tpgd") == 0) {
+      if (i + 1 == argc) {
+        usage(argv[0]);
+        return 1;
+      }
+      char *endptr;
+      auto_tpgd = strtod(argv[i+1], &endptr);
+      if (*endptr || auto_tpgd < 0 || auto_tpgd > 1) {
+        fprintf(stderr, "Invalid TPGD cutoff: %s (0..1)\n", argv[i+1]);
+        return 1;
+      }
+      i++;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--despeckle") == 0) {
+      if (i + 1 == argc) {
+        usage(argv[0]);
+        return 1;
+      }
+      char *endptr;
+      despeckle = strtol(argv[i+1], &endptr, 10);
+      if (*endptr || despeckle < 0 || despeckle > 2) {
+        fprintf(stderr, "Invalid speck size: %s (0..2)\n", argv[i+1]);
+        return 1;
+      }
+      i++;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--refine") == 0) {
+      if (i + 1 == argc) {
+        usage(argv[0]);
+        return 1;
+      }
+      char *endptr;
+      refine = strtod(argv[i+1], &endptr);
+      if (*endptr || refine <= 0 || refine > 1) {
+        fprintf(stderr, "Invalid refinement ratio: %s (0..1]\n", argv[i+1]);
+        return 1;
+      }
+      i++;
+      continue;
+    }
 
-#ifdef WIN32
-// -----------------------------------------------------------------------------
-// Windows, sadly, lacks asprintf
-// -----------------------------------------------------------------------------
-#include <stdarg.h>
-int
-asprintf(char **strp, const char *fmt, ...) {
-    va_list va;
-    va_start(va, fmt);
+    if (strcmp(argv[i], "--deadline-ms") == 0) {
+      if (i + 1 == argc) {
+        usage(argv[0]);
+        return 1;
+      }
+      char *endptr;
+      deadline = strtod(argv[i+1], &endptr);
+      if (*endptr || deadline <= 0) {
+        fprintf(stderr, "Invalid deadline: %s (ms > 0)\n", argv[i+1]);
+        return 1;
+      }
+      deadline /= 1000;
+      i++;
+      continue;
+    }
 
-    const int required = vsnprintf(NULL, 0, fmt, va);
-    char *const buffer = (char *) malloc(required + 1);
-    const int ret = vsnprintf(buffer, required + 1, fmt, va);
-    *strp = buffer;
+    if (strcmp(argv[i], "--halftone") == 0) {
+      if (i + 1 == argc) {
+        usage(argv[0]);
+        return 1;
+      }
+      char *endptr;
+      halftone = strtod(argv[i+1], &endptr);
+      if (*endptr || halftone <= 0 || halftone > 1) {
+        fprintf(stderr, "Invalid halftone density: %s (0..1)\n", argv[i+1]);
+        return 1;
+      }
+      i++;
+      continue;
+    }
 
-    va_end(va);
+    if (strcmp(argv[i], "--estimate") == 0) {
+      if (i + 1 == argc) {
+        usage(argv[0]);
+        return 1;
+      }
+      char *endptr;
+      estimate = strtod(argv[i+1], &endptr);
+      if (*endptr || estimate <= 0 || estimate > 1) {
+        fprintf(stderr, "Invalid estimate fraction: %s (0..1]\n", argv[i+1]);
+        return 1;
+      }
+      i++;
+      continue;
+    }
 
-    return ret;
-}
-#endif
+    if (strncmp(argv[i], "--stats=", 8) == 0) {
+      if (strcmp(argv[i] + 8, "perf") == 0) {
+        stats_perf = true;
+      } else if (strcmp(argv[i] + 8, "json") != 0) {
+        fprintf(stderr, "Unknown stats format: %s (json, perf)\n",
+                argv[i] + 8);
+        return 1;
+      }
+      stats = true;
+      continue;
+    }
 
-static int write_all(int fd, const void *buf, ssize_t count) {
-  const char *p = (const char*)buf;
-  while (count > 0) {
-    ssize_t got = write(fd, p, count);
-    if (got < 0) return -1;
-    p += got;
-    count -= got;
-  }
-  return 0;
-}
+    if (strcmp(argv[i], "--verify") == 0) {
+      verify = true;
+      continue;
+    }
 
-int
-main(int argc, char **argv) {
-  bool duplicate_line_removal = false;
-  bool pdfmode = false;
-  float threshold = 0.85;
-  int bw_threshold = 188;
-  bool up2 = false, up4 = false;
-  int i;
+    if (strcmp(argv[i], "--trusted-png") == 0) {
+      l_pngSetReadTrusted(1);
+      continue;
+    }
 
-  for (i = 1; i < argc; ++i) {
-    if (strcmp(argv[i], "-h") == 0 ||
-        strcmp(argv[i], "--help") == 0) {
-      usage(argv[0]);
-      return 0;
+    if (strcmp(argv[i], "--hugepages") == 0) {
+      if (setPixDataHugePages(1) || !jbig2enc_use_hugepages(true)) {
+        fprintf(stderr, "--hugepages is not supported here\n");
+        return 1;
+      }
       continue;
     }
 
-    if (strcmp(argv[i], "-d") == 0 ||
-        strcmp(argv[i], "--duplicate-line-removal") == 0) {
-      duplicate_line_removal = true;
+    if (strcmp(argv[i], "--server") == 0) {
+      server = true;
       continue;
     }
 
-    if (strcmp(argv[i], "-p") == 0 ||
-        strcmp(argv[i], "--pdf") == 0) {
-      pdfmode = true;
+#if !defined(WIN32)
+    if (strcmp(argv[i], "--socket") == 0) {
+      if (i + 1 == argc) {
+        usage(argv[0]);
+        return 1;
+      }
+      socket_path = argv[i+1];
+      i++;
       continue;
     }
+#endif
 
     if (strcmp(argv[i], "-2") == 0) {
       up2 = true;
@@ -131,6 +3345,37 @@ main(int argc, char **argv) {
       continue;
     }
 
+    if (strcmp(argv[i], "-r") == 0) {
+      if (i + 1 == argc) {
+        usage(argv[0]);
+        return 1;
+      }
+      char *endptr;
+      reduce = strtol(argv[i+1], &endptr, 10);
+      if (*endptr || (reduce != 1 && reduce != 2 && reduce != 4)) {
+        fprintf(stderr, "Invalid downscale factor: %s (1, 2 or 4)\n",
+                argv[i+1]);
+        return 1;
+      }
+      i++;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--rank") == 0) {
+      if (i + 1 == argc) {
+        usage(argv[0]);
+        return 1;
+      }
+      char *endptr;
+      reduce_rank = strtol(argv[i+1], &endptr, 10);
+      if (*endptr || reduce_rank < 1 || reduce_rank > 16) {
+        fprintf(stderr, "Invalid rank level: %s (1..16)\n", argv[i+1]);
+        return 1;
+      }
+      i++;
+      continue;
+    }
+
     if (strcmp(argv[i], "-t") == 0) {
       char *endptr;
       threshold = strtod(argv[i+1], &endptr);
@@ -149,6 +3394,24 @@ main(int argc, char **argv) {
       continue;
     }
 
+    if (strcmp(argv[i], "-w") == 0) {
+      char *endptr;
+      weight = strtod(argv[i+1], &endptr);
+      if (*endptr) {
+        fprintf(stderr, "Cannot parse float value: %s\n", argv[i+1]);
+        usage(argv[0]);
+        return 1;
+      }
+
+      if (weight > 1.0 || weight < 0.0) {
+        fprintf(stderr, "Invalid value for weight\n");
+        fprintf(stderr, "(must be between 0.0 and 1.0)\n");
+        return 10;
+      }
+      i++;
+      continue;
+    }
+
     if (strcmp(argv[i], "-T") == 0) {
       char *endptr;
       bw_threshold = strtol(argv[i+1], &endptr, 10);
@@ -173,7 +3436,20 @@ main(int argc, char **argv) {
     break;
   }
 
-  if (i == argc) {
+  if ((server || socket_path) &&
+      (i != argc || basename || stream || multipage || symbol_mode ||
+       manifest)) {
+    fprintf(stderr, "Can't give filenames, -b, --stream, --multipage, -s or "
+                    "--manifest with --server or --socket!\n");
+    return 6;
+  }
+
+  if (manifest && i != argc) {
+    fprintf(stderr, "Can't give filenames with --manifest!\n");
+    return 6;
+  }
+
+  if (i == argc && !server && !socket_path && !manifest) {
     fprintf(stderr, "No filename given\n\n");
     usage(argv[0]);
     return 4;
@@ -184,6 +3460,108 @@ main(int argc, char **argv) {
     return 6;
   }
 
+  if (reduce > 1 && (up2 || up4)) {
+    fprintf(stderr, "Can't have -r with -2 or -4!\n");
+    return 6;
+  }
+
+  if (reduce_rank > reduce * reduce) {
+    fprintf(stderr, "Can't have --rank above the square of -r!\n");
+    return 6;
+  }
+
+  if (interleave > 1 && !stripe_height) {
+    fprintf(stderr, "Can't have --interleave without -S!\n");
+    return 6;
+  }
+
+  if (stream && stripe_height) {
+    fprintf(stderr, "Can't have both --stream and -S!\n");
+    return 6;
+  }
+
+  if (multipage && (stream || pdfmode)) {
+    fprintf(stderr, "Can't have --multipage with --stream or -p!\n");
+    return 6;
+  }
+
+  if (xobjects && (multipage || stream || symbol_mode || refine > 0 ||
+                   estimate > 0 || server || socket_path)) {
+    fprintf(stderr, "Can't have --xobjects with --multipage, --stream, -s, "
+                    "--refine, --estimate, --server or --socket!\n");
+    return 6;
+  }
+
+  if (framed && (multipage || xobjects || stream || symbol_mode ||
+                 refine > 0 || estimate > 0 || server || socket_path ||
+                 journal_path)) {
+    fprintf(stderr, "Can't have --framed with --multipage, --xobjects, "
+                    "--stream, -s, --refine, --estimate, --server, --socket "
+                    "or --journal!\n");
+    return 6;
+  }
+
+  if (verify && (mmr || symbol_mode || refine > 0 || stream ||
+                 estimate > 0)) {
+    fprintf(stderr, "Can't have --verify with --mmr, -s, --refine, --stream "
+                    "or --estimate!\n");
+    return 6;
+  }
+
+  if (journal_path && (multipage || xobjects || stream || symbol_mode ||
+                       refine > 0 || estimate > 0 || server || socket_path)) {
+    fprintf(stderr, "Can't have --journal with --multipage, --xobjects, "
+                    "--stream, -s, --refine, --estimate, --server or "
+                    "--socket!\n");
+    return 6;
+  }
+
+  if (estimate > 0 && (stream || multipage || symbol_mode)) {
+    fprintf(stderr, "Can't have --estimate with --stream, --multipage or -s!\n");
+    return 6;
+  }
+
+  if (auto_tpgd >= 0 && (duplicate_line_removal || symbol_mode)) {
+    fprintf(stderr, "Can't have --auto-tpgd with -d or -s!\n");
+    return 6;
+  }
+
+  if (refine > 0 && (server || socket_path || symbol_mode || stream ||
+                     stripe_height || pdfmode || estimate > 0 ||
+                     auto_tpgd >= 0)) {
+    fprintf(stderr, "Can't have --refine with --server, --socket, -s, --stream, "
+                    "-S, -p, --estimate or --auto-tpgd!\n");
+    return 6;
+  }
+
+  if (symbol_mode && (stream || stripe_height)) {
+    fprintf(stderr, "Can't have -s with --stream or -S!\n");
+    return 6;
+  }
+
+  if (deadline > 0 && (symbol_mode || refine > 0 || stream || verify)) {
+    fprintf(stderr, "Can't have --deadline-ms with -s, --refine, --stream or "
+                    "--verify!\n");
+    return 6;
+  }
+
+  if (halftone > 0 && (symbol_mode || stripe_height || mmr || stream ||
+                       refine > 0 || estimate > 0 || deadline > 0 || verify)) {
+    fprintf(stderr, "Can't have --halftone with -s, -S, --mmr, --stream, "
+                    "--refine, --estimate, --deadline-ms or --verify!\n");
+    return 6;
+  }
+
+  if (symbol_mode && pdfmode && !basename) {
+    fprintf(stderr, "-s with -p needs -b for the symbol dictionary!\n");
+    return 6;
+  }
+
+  // Without -p, the pages of symbol mode are all in one file, after the
+  // dictionary.
+  if (symbol_mode && !pdfmode) multipage = true;
+  if (refine > 0) multipage = true;
+
 #ifdef WIN32
   int result = setmode(1, WINBINARY);  // stdout.
   if (result == -1) {
@@ -192,83 +3570,271 @@ main(int argc, char **argv) {
   }
 #endif
 
-  int pageno = -1;
+  // The SIMD code of the kernels is chosen here, before there are threads, so
+  // that a bad JBIG2_CPU is warned about once (see cpufeatures.c).
+  const int cpu_level = cpuGetLevel();
+  if (verbose)
+    fprintf(stderr, "SIMD code: %s\n", cpuGetLevelName(cpu_level));
 
-  int numsubimages=0, subimage=0;
-  while (i < argc) {
-    if (subimage==numsubimages) {
-      subimage = numsubimages = 0;
-      FILE *fp;
-      if ((fp=fopen(argv[i], "rb"))==NULL) {
-        fprintf(stderr, "Unable to open \"%s\"", argv[i]);
-        return 1;
-      }
-      l_int32 filetype;
-      if (findFileFormatStream(fp, &filetype)) {
-        fprintf(stderr, "Unable to get file format of \"%s\"", argv[i]);
-        return 1;
-      }
-#if HAVE_LIBTIFF
-      if (filetype==IFF_TIFF && tiffGetCount(fp, &numsubimages)) {
-        fprintf(stderr, "Cannot process TIFF with subimages: \"%s\"", argv[i]);
-        return 1;
-      }
-#endif
-      fclose(fp);
+  if (affinity != JBIG2_AFFINITY_NONE) {
+    if (!jbig2_pool_set_affinity(affinity) || setPixDataNodeLocal(1)) {
+      fprintf(stderr, "--affinity is not supported here\n");
+      return 1;
     }
+    if (verbose)
+      fprintf(stderr, "threads pinned over %d NUMA node(s)\n",
+              jbig2_numa_nodes());
+  }
 
-    PIX *source;
-    if (numsubimages<=1) {
-      source = pixRead(argv[i]);
-    }
-#if HAVE_LIBTIFF
-    else {
-      source = pixReadTiff(argv[i], subimage++);
+  struct encode_options opts;
+  opts.duplicate_line_removal = duplicate_line_removal;
+  opts.gbtemplate = gbtemplate;
+  opts.mmr = mmr;
+  // The pages of a multipage file are coded without file headers, as for PDF,
+  // and renumbered into the file by write_page_done.
+  opts.pdfmode = pdfmode || multipage || xobjects;
+  opts.bw_threshold = bw_threshold;
+  opts.up2 = up2;
+  opts.up4 = up4;
+  opts.reduce = reduce;
+  opts.reduce_rank = reduce_rank;
+  opts.xres = xres;
+  opts.yres = yres;
+  opts.raw = raw;
+  opts.basename = basename;
+  opts.stripe_height = stripe_height;
+  opts.interleave = interleave;
+  opts.stream = stream;
+  opts.multipage = multipage;
+  opts.xobjects = xobjects;
+  opts.framed = framed;
+  opts.symbols = NULL;
+  opts.estimate = estimate;
+  opts.deadline = deadline;
+  opts.halftone = halftone;
+  opts.auto_tpgd = auto_tpgd;
+  opts.despeckle = despeckle;
+  opts.refine = refine;
+  opts.stats = stats;
+  opts.verify = verify;
+  opts.cache = cache_mb || cache_dir
+      ? jbig2_cache_new((size_t) cache_mb << 20, cache_dir) : NULL;
+  opts.budget = NULL;
+  if (memory_mb) {
+    // The freed image data kept for reuse and the cache of streams come out
+    // of the limit, and the pages get the rest.
+    const size_t limit = (size_t) memory_mb << 20;
+    const size_t pix_cache = limit / 4 < PIX_DATA_CACHE_BYTES
+                             ? limit / 4 : PIX_DATA_CACHE_BYTES;
+    const size_t fixed = pix_cache + ((size_t) cache_mb << 20);
+    if (fixed >= limit) {
+      fprintf(stderr, "--memory-limit must be more than 4/3 of --cache!\n");
+      return 6;
     }
+    setPixDataCache(pix_cache);
+    opts.budget = jbig2_budget_new(limit - fixed);
+  }
+
+  if (server || socket_path) {
+    // All the threads go to the stripes of the page being served.
+    opts.stripe_threads = nthreads;
+    setRowBandRunner(leptonica_parallel_for, opts.stripe_threads);
+    struct jbig2enc_ctx ctx;
+    jbig2enc_init(&ctx);
+#if defined(WIN32)
+    setmode(0, WINBINARY);  // stdin.
+    const int ret = serve(stdin, stdout, &opts, &ctx);
+#else
+    const int ret = socket_path ? serve_socket(socket_path, &opts, &ctx)
+                                : serve(stdin, stdout, &opts, &ctx);
 #endif
+    jbig2enc_dealloc(&ctx);
+    jbig2_cache_free(opts.cache);
+    jbig2_budget_free(opts.budget);
+    return ret;
+  }
 
-    if (!source) return 3;
-    if (verbose)
-      pixInfo(source, "source image:");
+  // Threads with no page to code run the stripes and row bands of the pages
+  // still being coded (see jbig2_parallel_for), so any page may use them all.
+  opts.stripe_threads = nthreads;
+  setRowBandRunner(leptonica_parallel_for, opts.stripe_threads);
+  if (symbol_mode) opts.symbols = jbig2_symbols_new(threshold, weight);
 
-    PIX *pixl, *gray, *pixt;
-    if ((pixl = pixRemoveColormap(source, REMOVE_CMAP_BASED_ON_SRC)) == NULL) {
-      fprintf(stderr, "Failed to remove colormap from %s\n", argv[i]);
-      return 1;
+  // Find all the pages first, so that they can be handed out to the workers.
+  // The lines of a manifest start from opts, which is complete by now.
+  struct page_list list;
+  list.pages = NULL;
+  list.npages = 0;
+  list.capacity = 0;
+  list.shared = NULL;
+  list.nshared = 0;
+  list.stdin_used = false;
+  list.stats = stats;
+  char *manifest_text = NULL;
+  struct encode_options *line_opts = NULL;
+  if (manifest) {
+    const int status = read_manifest(manifest, &opts,
+                                     symbol_mode || refine > 0, &list,
+                                     &manifest_text, &line_opts);
+    if (status) return status;
+    if (!list.npages) {
+      fprintf(stderr, "No pages in the manifest\n");
+      return 4;
     }
-    pixDestroy(&source);
-    pageno++;
-
-    if (pixl->d > 1) {
-      if (pixl->d > 8) {
-        gray = pixConvertRGBToGrayFast(pixl);
-        if (!gray) return 1;
-      } else {
-        gray = pixClone(pixl);
-      }
-      if (up2) {
-        pixt = pixScaleGray2xLIThresh(gray, bw_threshold);
-      } else if (up4) {
-        pixt = pixScaleGray4xLIThresh(gray, bw_threshold);
-      } else {
-        pixt = pixThresholdToBinary(gray, bw_threshold);
+  }
+  for (; i < argc; ++i) {
+    const int status = add_input(&list, argv[i], &opts, NULL);
+    if (status) return status;
+  }
+  struct page *const pages = list.pages;
+  const int npages = list.npages;
+  struct journal *journal = NULL;
+  if (journal_path) {
+    for (int p = 0; p < npages; ++p) {
+      if (!basename && !pages[p].output) {
+        fprintf(stderr, "--journal needs each page written to a file of its "
+                        "own, with -b or -o\n");
+        return 6;
       }
-      pixDestroy(&gray);
-    } else {
-      pixt = pixClone(pixl);
     }
-    if (verbose)
-      pixInfo(pixt, "thresholded image:");
+    journal = journal_open(journal_path);
+    if (!journal) return 1;
+  }
 
-    pixDestroy(&pixl);
+  // Pages streamed to stdout have to be coded one after another.
+  if (stream && !basename) nthreads = 1;
+  struct jbig2enc_ctx **ctxs =
+      (struct jbig2enc_ctx **) calloc(nthreads, sizeof(struct jbig2enc_ctx *));
+  if (!ctxs) abort();
 
-    int length;
-    uint8_t *ret;
-    ret = jbig2_encode_generic(pixt, !pdfmode, 0, 0, duplicate_line_removal,
-                               &length);
-    if (0 > write_all(1, ret, length))
-      abort();
-    return 0;
+  struct batch b;
+  b.opts = &opts;
+  b.pages = pages;
+  b.ctxs = ctxs;
+  b.fd = -1;
+  b.written = 0;
+  b.offsets = NULL;
+  b.segnum = 0;
+  b.reference = -1;
+  b.npages = npages;
+  // Pages written to files of their own are finished in any order.
+  bool own_files = nthreads > 1 && !multipage && !xobjects && !framed &&
+                   !symbol_mode && estimate <= 0;
+  for (int p = 0; p < npages && own_files; ++p)
+    own_files = basename || pages[p].output;
+  b.order = own_files ? order_pages(pages, npages) : NULL;
+  b.journal = journal;
+  b.readahead = nthreads > 1 ? nthreads : 0;
+  b.prefetch = b.readahead ? input_ranges(&b) : NULL;
+  if (multipage) {
+    size_t length;
+    uint8_t *const header = jbig2_file_header(npages, &length);
+    b.fd = open_output(basename, ".jb2");
+    if (b.fd < 0) return 1;
+    if (write_all(b.fd, header, length) < 0) abort();
+    free(header);
+  }
+  if (xobjects) {
+    b.offsets = (uint64_t *) calloc(npages + 1, sizeof(uint64_t));
+    if (!b.offsets) abort();
+    b.fd = open_output(basename, ".xobj");
+    if (b.fd < 0) return 1;
+  }
+  if (framed) {
+    b.offsets = (uint64_t *) calloc(npages + 1, sizeof(uint64_t));
+    if (!b.offsets) abort();
+    b.fd = open_output(basename, ".frames");
+    if (b.fd < 0) return 1;
+    if (write_frame_header(&b) < 0) abort();
+  }
+  int result = jbig2_parallel_for_window(nthreads, npages, max_inflight,
+                                         encode_page_job,
+                                         symbol_mode ? classify_page_done
+                                         : refine > 0 ? match_page_done
+                                                      : write_page_done, &b);
+  if (refine > 0 && result == 0) {
+    result = jbig2_parallel_for_window(nthreads, npages, max_inflight,
+                                       encode_refine_page_job,
+                                       write_page_done, &b);
+  }
+  if (symbol_mode && result == 0) {
+    // All the pages have been classified: the dictionary goes first, and then
+    // the pages which refer to it.
+    size_t length;
+    uint8_t *const dict = jbig2_encode_symbol_dictionary(worker_ctx(&b, 0),
+                                                         opts.symbols,
+                                                         &length);
+    if (!dict) {
+      fprintf(stderr, "symbol dictionary too large\n");
+      return 3;
+    }
+    if (verbose)
+      fprintf(stderr, "symbol dictionary: %lu bytes\n",
+              (unsigned long) length);
+    if (multipage) {
+      if (write_all(b.fd, dict, length) < 0) abort();
+      b.segnum = 1;
+    } else {
+      const int fd = open_output(basename, ".sym");
+      if (fd < 0) return 1;
+      if (write_all(fd, dict, length) < 0 || close(fd) < 0) abort();
+    }
+    free(dict);
+    result = jbig2_parallel_for_window(nthreads, npages, max_inflight,
+                                       encode_symbol_page_job,
+                                       write_page_done, &b);
+  }
+  if (multipage) {
+    // A file cut short by a failed page is left without its end.
+    if (result == 0) {
+      size_t length;
+      uint8_t *const trailer = jbig2_file_trailer(b.segnum, &length);
+      if (write_all(b.fd, trailer, length) < 0) abort();
+      free(trailer);
+    }
+    if (close_page(basename, b.fd) < 0) abort();
+  }
+  if (xobjects) {
+    // as with multipage, a file cut short has no index
+    if (result == 0 && write_xobject_index(&b) < 0) abort();
+    if (close_page(basename, b.fd) < 0) abort();
+    free(b.offsets);
+  }
+  if (framed) {
+    if (result == 0 && write_frame_index(&b) < 0) abort();
+    if (close_page(basename, b.fd) < 0) abort();
+    free(b.offsets);
   }
-}
 
+  for (int t = 0; t < nthreads; ++t) {
+    if (!ctxs[t]) continue;
+    jbig2enc_dealloc(ctxs[t]);
+    free(ctxs[t]);
+  }
+  free(ctxs);
+  // Pages after a failed one are never written.
+  for (int p = 0; p < npages; ++p) {
+    jbig2_symbols_page_free(pages[p].components);
+    pixDestroy(&pages[p].bw);
+    free(pages[p].row_hashes);
+    free(pages[p].data);
+    release_input(&pages[p]);
+  }
+  for (int i = 0; i < list.nshared; ++i)
+    unmap_input(list.shared[i].data, list.shared[i].size,
+                list.shared[i].mapped);
+  free(list.shared);
+  jbig2_symbols_free(opts.symbols);
+  // the symbols may still hold image data charged to the pages
+  for (int p = 0; p < npages; ++p) free(pages[p].stats);
+  free(pages);
+  free(b.order);
+  free(b.prefetch);
+  journal_close(journal);
+  free(line_opts);
+  free(manifest_text);
+  jbig2_cache_free(opts.cache);
+  jbig2_budget_free(opts.budget);
+  emptyPixDataCache();
+  return result;
+}
@@ -16,10 +16,19 @@
 // limitations under the License.
 
 #include "jbig2arith.h"
+#include "cpufeatures.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#if defined(__linux__)
+#include <pthread.h>
+#include <sys/mman.h>
+#endif
 
 #define u64 uint64_t
 #define u32 uint32_t
@@ -38,7 +47,8 @@
 // -----------------------------------------------------------------------------
 struct context {
   u16 qe;
-  u8 mps, lps;
+  u8 mps, lps;  // next state after coding an MPS or an LPS
+  u8 bit;  // the value of the MPS in this state
 };
 
 // -----------------------------------------------------------------------------
@@ -47,64 +57,69 @@ struct context {
 struct context ctbl[] = {
   // This is the standard state table from
   // Table E.1 of the standard. The switch has been omitted and
-  // those states are included below
+  // those states are included below. The first 46 states have an MPS of 0
+  // and the other 46 have an MPS of 1 (M).
 #define STATETABLE \
-  {0x5601, F( 1), SWITCH(F( 1))},\
-  {0x3401, F( 2), F( 6)},\
-  {0x1801, F( 3), F( 9)},\
-  {0x0ac1, F( 4), F(12)},\
-  {0x0521, F( 5), F(29)},\
-  {0x0221, F(38), F(33)},\
-  {0x5601, F( 7), SWITCH(F( 6))},\
-  {0x5401, F( 8), F(14)},\
-  {0x4801, F( 9), F(14)},\
-  {0x3801, F(10), F(14)},\
-  {0x3001, F(11), F(17)},\
-  {0x2401, F(12), F(18)},\
-  {0x1c01, F(13), F(20)},\
-  {0x1601, F(29), F(21)},\
-  {0x5601, F(15), SWITCH(F(14))},\
-  {0x5401, F(16), F(14)},\
-  {0x5101, F(17), F(15)},\
-  {0x4801, F(18), F(16)},\
-  {0x3801, F(19), F(17)},\
-  {0x3401, F(20), F(18)},\
-  {0x3001, F(21), F(19)},\
-  {0x2801, F(22), F(19)},\
-  {0x2401, F(23), F(20)},\
-  {0x2201, F(24), F(21)},\
-  {0x1c01, F(25), F(22)},\
-  {0x1801, F(26), F(23)},\
-  {0x1601, F(27), F(24)},\
-  {0x1401, F(28), F(25)},\
-  {0x1201, F(29), F(26)},\
-  {0x1101, F(30), F(27)},\
-  {0x0ac1, F(31), F(28)},\
-  {0x09c1, F(32), F(29)},\
-  {0x08a1, F(33), F(30)},\
-  {0x0521, F(34), F(31)},\
-  {0x0441, F(35), F(32)},\
-  {0x02a1, F(36), F(33)},\
-  {0x0221, F(37), F(34)},\
-  {0x0141, F(38), F(35)},\
-  {0x0111, F(39), F(36)},\
-  {0x0085, F(40), F(37)},\
-  {0x0049, F(41), F(38)},\
-  {0x0025, F(42), F(39)},\
-  {0x0015, F(43), F(40)},\
-  {0x0009, F(44), F(41)},\
-  {0x0005, F(45), F(42)},\
-  {0x0001, F(45), F(43)},
+  {0x5601, F( 1), SWITCH(F( 1)), M},\
+  {0x3401, F( 2), F( 6), M},\
+  {0x1801, F( 3), F( 9), M},\
+  {0x0ac1, F( 4), F(12), M},\
+  {0x0521, F( 5), F(29), M},\
+  {0x0221, F(38), F(33), M},\
+  {0x5601, F( 7), SWITCH(F( 6)), M},\
+  {0x5401, F( 8), F(14), M},\
+  {0x4801, F( 9), F(14), M},\
+  {0x3801, F(10), F(14), M},\
+  {0x3001, F(11), F(17), M},\
+  {0x2401, F(12), F(18), M},\
+  {0x1c01, F(13), F(20), M},\
+  {0x1601, F(29), F(21), M},\
+  {0x5601, F(15), SWITCH(F(14)), M},\
+  {0x5401, F(16), F(14), M},\
+  {0x5101, F(17), F(15), M},\
+  {0x4801, F(18), F(16), M},\
+  {0x3801, F(19), F(17), M},\
+  {0x3401, F(20), F(18), M},\
+  {0x3001, F(21), F(19), M},\
+  {0x2801, F(22), F(19), M},\
+  {0x2401, F(23), F(20), M},\
+  {0x2201, F(24), F(21), M},\
+  {0x1c01, F(25), F(22), M},\
+  {0x1801, F(26), F(23), M},\
+  {0x1601, F(27), F(24), M},\
+  {0x1401, F(28), F(25), M},\
+  {0x1201, F(29), F(26), M},\
+  {0x1101, F(30), F(27), M},\
+  {0x0ac1, F(31), F(28), M},\
+  {0x09c1, F(32), F(29), M},\
+  {0x08a1, F(33), F(30), M},\
+  {0x0521, F(34), F(31), M},\
+  {0x0441, F(35), F(32), M},\
+  {0x02a1, F(36), F(33), M},\
+  {0x0221, F(37), F(34), M},\
+  {0x0141, F(38), F(35), M},\
+  {0x0111, F(39), F(36), M},\
+  {0x0085, F(40), F(37), M},\
+  {0x0049, F(41), F(38), M},\
+  {0x0025, F(42), F(39), M},\
+  {0x0015, F(43), F(40), M},\
+  {0x0009, F(44), F(41), M},\
+  {0x0005, F(45), F(42), M},\
+  {0x0001, F(45), F(43), M},
 #undef F
 #define F(x) x
 #define SWITCH(x) (x + 46)
+#define M 0
   STATETABLE
+#undef M
 #undef SWITCH
 #undef F
 
 #define F(x) (x + 46)
 #define SWITCH(x) ((x) - 46)
+#define M 1
   STATETABLE
+#undef M
 #undef SWITCH
 #undef F
 };
@@ -122,56 +137,259 @@ struct context ctbl[] = {
 #define unlikely(x)     x
 #endif
 
+#ifdef JBIG2_CODER_STATS
+#define COUNT(field, n) (ctx->stats.field += (n))
+#else
+#define COUNT(field, n)
+#endif
+
+#ifdef JBIG2_CODER_STATS
+// -----------------------------------------------------------------------------
+// Returns the number of contexts whose state has been changed since the last
+// _reset
+// -----------------------------------------------------------------------------
+static u64
+count_contexts(const struct jbig2enc_ctx *ctx) {
+  u64 n = 0;
+  u64 dirty = ctx->context_dirty;
+  for (int block = 0; dirty; ++block, dirty >>= 1) {
+    if (!(dirty & 1)) continue;
+    const u8 *const p = ctx->context + (block << JBIG2_CTX_BLOCK_BITS);
+    for (int i = 0; i < 1 << JBIG2_CTX_BLOCK_BITS; ++i) n += p[i] != 0;
+  }
+  if (ctx->intctx_dirty) {
+    for (int i = 0; i < 13 * 512; ++i) n += (&ctx->intctx[0][0])[i] != 0;
+  }
+  return n;
+}
+
+// see comments in .h file
+void
+jbig2enc_getstats(const struct jbig2enc_ctx *ctx,
+                  struct jbig2enc_stats *stats) {
+  *stats = ctx->stats;
+  stats->contexts += count_contexts(ctx);
+}
+#endif
+
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+#define HAVE_HUGEPAGES
+#define HUGE_PAGE_BYTES (2 << 20)
+
+// -----------------------------------------------------------------------------
+// The context tables backed by huge pages (see jbig2enc_use_hugepages). Free
+// tables are linked through their first bytes.
+// -----------------------------------------------------------------------------
+static bool use_hugepages = false;
+static u8 *free_tables = NULL;
+static pthread_mutex_t tables_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// -----------------------------------------------------------------------------
+// Map HUGE_PAGE_BYTES on a huge page boundary, with an explicit huge page if
+// the system has any reserved, otherwise asking for a transparent one. Returns
+// NULL on failure.
+// -----------------------------------------------------------------------------
+static u8 *
+map_huge_page() {
+#ifdef MAP_HUGETLB
+  void *map = mmap(NULL, HUGE_PAGE_BYTES, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (map != MAP_FAILED) return (u8 *) map;
+#endif
+  // map twice the size and trim it to the boundary
+  u8 *const twice = (u8 *) mmap(NULL, 2 * HUGE_PAGE_BYTES,
+                                PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (twice == (u8 *) MAP_FAILED) return NULL;
+  u8 *const aligned = (u8 *) (((size_t) twice + HUGE_PAGE_BYTES - 1) &
+                              ~(size_t) (HUGE_PAGE_BYTES - 1));
+  if (aligned > twice) munmap(twice, aligned - twice);
+  munmap(aligned + HUGE_PAGE_BYTES, twice + HUGE_PAGE_BYTES - aligned);
+  madvise(aligned, HUGE_PAGE_BYTES, MADV_HUGEPAGE);
+  return aligned;
+}
+
+// -----------------------------------------------------------------------------
+// Returns a context table from the huge pages, or NULL if there is none
+// -----------------------------------------------------------------------------
+static u8 *
+take_huge_table() {
+  pthread_mutex_lock(&tables_mutex);
+  if (!free_tables) {
+    u8 *const page = map_huge_page();
+    if (page) {
+      for (int i = HUGE_PAGE_BYTES / JBIG2_MAX_CTX - 1; i >= 0; --i) {
+        u8 *const table = page + i * JBIG2_MAX_CTX;
+        *(u8 **) table = free_tables;
+        free_tables = table;
+      }
+    }
+  }
+  u8 *const table = free_tables;
+  if (table) free_tables = *(u8 **) table;
+  pthread_mutex_unlock(&tables_mutex);
+  return table;
+}
+
+static void
+give_huge_table(u8 *table) {
+  pthread_mutex_lock(&tables_mutex);
+  *(u8 **) table = free_tables;
+  free_tables = table;
+  pthread_mutex_unlock(&tables_mutex);
+}
+#endif
+
+// see comments in .h file
+bool
+jbig2enc_use_hugepages(bool on) {
+#ifdef HAVE_HUGEPAGES
+  use_hugepages = on;
+  return true;
+#else
+  return !on;
+#endif
+}
+
 // see comments in .h file
 void
 jbig2enc_init(struct jbig2enc_ctx *ctx) {
+  ctx->context = NULL;
+  ctx->context_huge = false;
+#ifdef HAVE_HUGEPAGES
+  if (use_hugepages) {
+    ctx->context = take_huge_table();
+    ctx->context_huge = ctx->context != NULL;
+  }
+#endif
+  if (!ctx->context) {
+    ctx->context = (u8 *) malloc(JBIG2_MAX_CTX);
+    if (!ctx->context) abort();
+  }
   memset(ctx->context, 0, JBIG2_MAX_CTX);
   memset(ctx->intctx, 0, 13 * 512);
+  ctx->context_dirty = 0;
+  ctx->intctx_dirty = false;
   ctx->a = 0x8000;
   ctx->c = 0;
   ctx->ct = 12;
   ctx->bp = -1;
   ctx->b = 0;
+  ctx->outbuf = NULL;
+  ctx->outbuf_capacity = 0;
   ctx->outbuf_used = 0;
-  ctx->outbuf = (u8 *) malloc(JBIG2_OUTPUTBUFFER_SIZE);
-  ctx->output_chunks = NULL;
-  ctx->output_chunks_size = ctx->output_chunks_capacity = 0;
+  ctx->outbuf_reserved = 0;
+  ctx->sink = NULL;
+  ctx->sink_opaque = NULL;
+  ctx->sink_error = false;
   ctx->iaidctx = NULL;
+#ifdef JBIG2_CODER_STATS
+  memset(&ctx->stats, 0, sizeof(ctx->stats));
+#endif
 }
 
 // see comments in .h file
 void
-jbig2enc_dealloc(struct jbig2enc_ctx *ctx) {
-  for (size_t i = 0; i < ctx->output_chunks_size; ++i) {
-    free(ctx->output_chunks[i]);
+jbig2enc_reset(struct jbig2enc_ctx *ctx) {
+  COUNT(contexts, count_contexts(ctx));
+  // a context entry is only written when the state changes, and that marks its
+  // block as dirty (see encode_bit)
+  u64 dirty = ctx->context_dirty;
+  for (int block = 0; dirty; ++block, dirty >>= 1) {
+    if (dirty & 1) {
+      memset(ctx->context + (block << JBIG2_CTX_BLOCK_BITS), 0,
+             1 << JBIG2_CTX_BLOCK_BITS);
+    }
   }
-  free(ctx->output_chunks);
+  ctx->context_dirty = 0;
+  if (ctx->intctx_dirty) memset(ctx->intctx, 0, 13 * 512);
+  ctx->intctx_dirty = false;
+  ctx->a = 0x8000;
+  ctx->c = 0;
+  ctx->ct = 12;
+  ctx->bp = -1;
+  ctx->b = 0;
+  ctx->outbuf_used = 0;
+  ctx->outbuf_reserved = 0;
+  ctx->sink = NULL;
+  ctx->sink_opaque = NULL;
+  ctx->sink_error = false;
+  free(ctx->iaidctx);
+  ctx->iaidctx = NULL;
+}
+
+// see comments in .h file
+void
+jbig2enc_dealloc(struct jbig2enc_ctx *ctx) {
   free(ctx->outbuf);
   free(ctx->iaidctx);
+#ifdef HAVE_HUGEPAGES
+  if (ctx->context_huge) {
+    give_huge_table(ctx->context);
+    return;
+  }
+#endif
+  free(ctx->context);
+}
+
+// -----------------------------------------------------------------------------
+// Make sure that the output buffer has room for at least size bytes
+// -----------------------------------------------------------------------------
+static void
+outbuf_grow(struct jbig2enc_ctx *ctx, size_t size) {
+  if (size <= ctx->outbuf_capacity) return;
+  size_t capacity = ctx->outbuf_capacity ? ctx->outbuf_capacity
+                                      : JBIG2_OUTPUTBUFFER_SIZE;
+  while (capacity < size) capacity <<= 1;
+  ctx->outbuf = (u8 *) realloc(ctx->outbuf, capacity);
+  if (!ctx->outbuf) abort();
+  ctx->outbuf_capacity = capacity;
 }
 
 // -----------------------------------------------------------------------------
-// Emit a byte from the compressor by appending to the current output buffer.
-// If the buffer is full, allocate a new one
+// Pass the contents of the output buffer to the sink and empty it
+// -----------------------------------------------------------------------------
+static void
+outbuf_drain(struct jbig2enc_ctx *ctx) {
+  if (ctx->outbuf_used > ctx->outbuf_reserved && !ctx->sink_error) {
+    if (ctx->sink(ctx->sink_opaque, ctx->outbuf + ctx->outbuf_reserved,
+                  ctx->outbuf_used - ctx->outbuf_reserved)) {
+      ctx->sink_error = true;
+    }
+  }
+  ctx->outbuf_used = ctx->outbuf_reserved = 0;
+}
+
+// -----------------------------------------------------------------------------
+// Emit a byte from the compressor by appending to the output buffer. If the
+// buffer is full, double its size, or with a sink, pass it on and empty it
 // -----------------------------------------------------------------------------
 static void inline
 emit(struct jbig2enc_ctx *restrict ctx) {
-  if (unlikely(ctx->outbuf_used == JBIG2_OUTPUTBUFFER_SIZE)) {
-    if (ctx->output_chunks_size == ctx->output_chunks_capacity) {
-      if (ctx->output_chunks_capacity < 16) ctx->output_chunks_capacity = 16;
-      while (ctx->output_chunks_size >= ctx->output_chunks_capacity) {
-        ctx->output_chunks_capacity <<= 1;
-      }
-      ctx->output_chunks = (u8 **) realloc(
-          ctx->output_chunks,
-          ctx->output_chunks_capacity * sizeof *ctx->output_chunks);
-    }
-    ctx->output_chunks[ctx->output_chunks_size++] = ctx->outbuf;
-    ctx->outbuf = (u8 *) malloc(JBIG2_OUTPUTBUFFER_SIZE);
-    ctx->outbuf_used = 0;
+  if (unlikely(ctx->outbuf_used == ctx->outbuf_capacity)) {
+    if (ctx->sink) outbuf_drain(ctx);
+    outbuf_grow(ctx, ctx->outbuf_used + 1);
   }
 
   ctx->outbuf[ctx->outbuf_used++] = ctx->b;
+  COUNT(bytes, 1);
+}
+
+// see comments in .h file
+void
+jbig2enc_putbytes(struct jbig2enc_ctx *ctx, const u8 *data, size_t length) {
+  while (length > 0) {
+    if (ctx->outbuf_used == ctx->outbuf_capacity) {
+      if (ctx->sink) outbuf_drain(ctx);
+      outbuf_grow(ctx, ctx->outbuf_used + (ctx->sink ? 1 : length));
+    }
+    size_t n = ctx->outbuf_capacity - ctx->outbuf_used;
+    if (n > length) n = length;
+    memcpy(ctx->outbuf + ctx->outbuf_used, data, n);
+    ctx->outbuf_used += n;
+    data += n;
+    length -= n;
+  }
 }
 
 // -----------------------------------------------------------------------------
@@ -179,6 +397,7 @@ emit(struct jbig2enc_ctx *restrict ctx) {
 // -----------------------------------------------------------------------------
 static void
 byteout(struct jbig2enc_ctx *restrict ctx) {
+  COUNT(byteouts, 1);
   if (ctx->b == 0xff) goto rblock;
 
   if (ctx->c < 0x8000000) goto lblock;
@@ -187,6 +406,7 @@ byteout(struct jbig2enc_ctx *restrict ctx) {
   ctx->c &= 0x7ffffff;
 
 rblock:
+  COUNT(stuffed, 1);
   if (ctx->bp >= 0) {
 #ifdef TRACE
     printf("emit %x\n", ctx->b);
@@ -213,14 +433,51 @@ lblock:
   return;
 }
 
+// -----------------------------------------------------------------------------
+// Shift A and C left by shift bits, calling BYTEOUT whenever CT reaches zero.
+// This is the same as shift rounds of the RENORME loop from the standard.
+// -----------------------------------------------------------------------------
+static inline void
+renorm_shift(struct jbig2enc_ctx *restrict ctx, int shift) {
+  COUNT(renorm_shifts, shift);
+  ctx->a <<= shift;
+  while (unlikely(shift >= ctx->ct)) {
+    ctx->c <<= ctx->ct;
+    shift -= ctx->ct;
+    byteout(ctx);
+  }
+  ctx->c <<= shift;
+  ctx->ct -= shift;
+}
+
+// -----------------------------------------------------------------------------
+// The RENORME procedure from the standard. Rather than shifting one bit at a
+// time until the top bit of A is set, the number of bits is found by counting
+// the leading zeros of A.
+// -----------------------------------------------------------------------------
+static inline void
+renorme(struct jbig2enc_ctx *restrict ctx) {
+#ifdef BRANCH_OPT
+  renorm_shift(ctx, __builtin_clz((u32) ctx->a) - 16);
+#else
+  int shift = 0;
+  while (!(ctx->a & (0x8000 >> shift))) shift++;
+  renorm_shift(ctx, shift);
+#endif
+}
+
 // -----------------------------------------------------------------------------
 // A merging of the ENCODE, CODELPS and CODEMPS procedures from the standard
+//
+// Each change of the state of a context marks its block of ctx->context as
+// dirty, for jbig2enc_reset. This is only done on the renormalisation path,
+// which is the only one changing the state. (When context is ctx->intctx,
+// some block is marked for nothing, which is harmless.)
 // -----------------------------------------------------------------------------
-static void
+static inline void
 encode_bit(struct jbig2enc_ctx *restrict ctx, u8 *restrict context, u32 ctxnum, u8 d) {
-  const u8 i = context[ctxnum];
-  const u8 mps = i > 46 ? 1 : 0;
-  const u16 qe = ctbl[i].qe;
+  const struct context *const state = &ctbl[context[ctxnum]];
+  const u16 qe = state->qe;
 
 #ifdef CODER_DEBUGGING
     fprintf(stderr, "B: %d %d %d %d\n", ctxnum, qe, ctx->a, d);
@@ -228,57 +485,98 @@ encode_bit(struct jbig2enc_ctx *restrict ctx, u8 *restrict context, u32 ctxnum,
 
 #ifdef TRACE
   static int ec = 0;
-  printf("%d\t%d %d %x %x %x %d %x %d\n", ec++, i, mps, qe, ctx->a, ctx->c, ctx->ct, ctx->b, ctx->bp);
+  printf("%d\t%d %d %x %x %x %d %x %d\n", ec++, context[ctxnum], state->bit, qe, ctx->a, ctx->c, ctx->ct, ctx->b, ctx->bp);
 #endif
 
-  if (unlikely(d != mps)) goto codelps;
+  COUNT(bits, 1);
+  ctx->a -= qe;
+  if (likely(d == state->bit)) {
 #ifdef SURPRISE_MAP
-  {
-  u8 b = static_cast<unsigned char>
-    (((static_cast<float>(qe) / 0xac02) * 255));
-  write(3, &b, 1);
-  }
+    {
+    u8 b = static_cast<unsigned char>
+      (((static_cast<float>(qe) / 0xac02) * 255));
+    write(3, &b, 1);
+    }
 #endif
-  ctx->a -= qe;
-  if (unlikely((ctx->a & 0x8000) == 0)) {
-    if (unlikely(ctx->a < qe)) {
+    if (likely(ctx->a & 0x8000)) {
+      ctx->c += qe;
+      return;
+    }
+    if (ctx->a < qe) {
       ctx->a = qe;
     } else {
       ctx->c += qe;
     }
-    context[ctxnum] = ctbl[i].mps;
-    goto renorme;
+    context[ctxnum] = state->mps;
+    ctx->context_dirty |= (u64) 1 << (ctxnum >> JBIG2_CTX_BLOCK_BITS);
   } else {
-    ctx->c += qe;
-  }
-
-  return;
-
-codelps:
 #ifdef SURPRISE_MAP
-  {
-  u8 b = static_cast<unsigned char>
-    ((1.0f - (static_cast<float>(qe) / 0xac02)) * 255);
-  write(3, &b, 1);
-  }
+    {
+    u8 b = static_cast<unsigned char>
+      ((1.0f - (static_cast<float>(qe) / 0xac02)) * 255);
+    write(3, &b, 1);
+    }
 #endif
-  ctx->a -= qe;
-  if (ctx->a < qe) {
-    ctx->c += qe;
-  } else {
-    ctx->a = qe;
+    if (ctx->a < qe) {
+      ctx->c += qe;
+    } else {
+      ctx->a = qe;
+    }
+    COUNT(lps, 1);
+    context[ctxnum] = state->lps;
+    ctx->context_dirty |= (u64) 1 << (ctxnum >> JBIG2_CTX_BLOCK_BITS);
   }
-  context[ctxnum] = ctbl[i].lps;
 
-renorme:
-  do {
-    ctx->a <<= 1;
-    ctx->c <<= 1;
-    ctx->ct -= 1;
-    if (unlikely(!ctx->ct)) {
-      byteout(ctx);
+  renorme(ctx);
+}
+
+// -----------------------------------------------------------------------------
+// Encode n bits of value d, all in context ctxnum. This gives exactly the same
+// output as calling encode_bit n times, but while d is the MPS of the context,
+// the MPS codings which don't need renormalisation, and so don't change the
+// state of the context, are done as a single multiplication.
+// -----------------------------------------------------------------------------
+static void
+encode_run(struct jbig2enc_ctx *restrict ctx, u8 *restrict context,
+           u32 ctxnum, u8 d, int n) {
+  while (n > 0) {
+    const struct context *const state = &ctbl[context[ctxnum]];
+    if (state->bit != d) {
+      // d is the LPS of this context
+      encode_bit(ctx, context, ctxnum, d);
+      n--;
+      continue;
+    }
+    const u16 qe = state->qe;
+    // number of MPS codings before A drops below 0x8000
+    const int k = (ctx->a - 0x8000) / qe;
+    if (k >= n) {
+      COUNT(bits, n);
+      ctx->a -= n * qe;
+      ctx->c += n * qe;
+      return;
     }
-  } while ((ctx->a & 0x8000) == 0);
+    COUNT(bits, k);
+    ctx->a -= k * qe;
+    ctx->c += k * qe;
+    encode_bit(ctx, context, ctxnum, d);
+    n -= k + 1;
+  }
+}
+
+static inline void
+encode_zero_run(struct jbig2enc_ctx *restrict ctx, u8 *restrict context,
+                u32 ctxnum, int n) {
+  encode_run(ctx, context, ctxnum, 0, n);
+}
+
+// see comments in .h file
+void
+jbig2enc_bits(struct jbig2enc_ctx *restrict ctx, int ctxnum,
+              const u8 *restrict bits, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    encode_bit(ctx, ctx->context, ctxnum, bits[i]);
+  }
 }
 
 // -----------------------------------------------------------------------------
@@ -319,133 +617,1026 @@ jbig2enc_final(struct jbig2enc_ctx *restrict ctx) {
 }
 
 // see comments in .h file
-unsigned
+size_t
 jbig2enc_datasize(const struct jbig2enc_ctx *ctx) {
-  return JBIG2_OUTPUTBUFFER_SIZE * ctx->output_chunks_size + ctx->outbuf_used;
+  return ctx->outbuf_used - ctx->outbuf_reserved;
 }
 
 // see comments in .h file
 void
 jbig2enc_tobuffer(const struct jbig2enc_ctx *restrict ctx, u8 *restrict buffer) {
-  int j = 0;
-  for (size_t i = 0; i < ctx->output_chunks_size; ++i) {
-    memcpy(&buffer[j], ctx->output_chunks[i], JBIG2_OUTPUTBUFFER_SIZE);
-    j += JBIG2_OUTPUTBUFFER_SIZE;
+  memcpy(buffer, ctx->outbuf + ctx->outbuf_reserved,
+         ctx->outbuf_used - ctx->outbuf_reserved);
+}
+
+// see comments in .h file
+void
+jbig2enc_reserve(struct jbig2enc_ctx *ctx, size_t size) {
+  outbuf_grow(ctx, size);
+  ctx->outbuf_used = ctx->outbuf_reserved = size;
+}
+
+// see comments in .h file
+void
+jbig2enc_setsink(struct jbig2enc_ctx *ctx, jbig2enc_sink sink, void *opaque) {
+  ctx->sink = sink;
+  ctx->sink_opaque = opaque;
+  ctx->sink_error = false;
+}
+
+// see comments in .h file
+int
+jbig2enc_flush(struct jbig2enc_ctx *ctx) {
+  if (ctx->sink) outbuf_drain(ctx);
+  return ctx->sink_error ? -1 : 0;
+}
+
+// see comments in .h file
+u8 *
+jbig2enc_takebuffer(struct jbig2enc_ctx *ctx, size_t extra) {
+  // Trim the spare half of the last doubling, if any.
+  u8 *const ret = (u8 *) realloc(ctx->outbuf, ctx->outbuf_used + extra);
+  if (!ret) abort();
+  ctx->outbuf = NULL;
+  ctx->outbuf_capacity = 0;
+  jbig2enc_reset(ctx);
+  return ret;
+}
+
+// -----------------------------------------------------------------------------
+// Encode the low n bits of v, from the top one, in the context of an integer
+// coding procedure, updating PREV as described in A.2
+// -----------------------------------------------------------------------------
+static void
+encode_int_bits(struct jbig2enc_ctx *restrict ctx, u8 *restrict context,
+                u32 *prev, u32 v, int n) {
+  for (int i = n - 1; i >= 0; --i) {
+    const u8 bit = (v >> i) & 1;
+    encode_bit(ctx, context, *prev, bit);
+    if (*prev & 0x100) {
+      *prev = (((*prev << 1) | bit) & 0x1ff) | 0x100;
+    } else {
+      *prev = (*prev << 1) | bit;
+    }
   }
+}
 
-  memcpy(&buffer[j], ctx->outbuf, ctx->outbuf_used);
+// The ranges of the integer coding: a value in [low, low + 2^bits) is coded as
+// its sign, a prefix of ones and zero (which is just five ones for the last
+// range) and then its offset from low in bits bits (Table A.1)
+static const struct intencrange {
+  u32 low;
+  int prefix;  // the number of ones of the prefix
+  int bits;
+} intencrange[] = {
+  {0, 0, 2},
+  {4, 1, 4},
+  {20, 2, 6},
+  {84, 3, 8},
+  {340, 4, 12},
+  {4436, 5, 32},
+};
+
+// see comments in .h file
+void
+jbig2enc_int(struct jbig2enc_ctx *restrict ctx, int proc, int value) {
+  u8 *const context = ctx->intctx[proc];
+  ctx->intctx_dirty = true;
+  const u32 sign = value < 0;
+  const u32 magnitude = sign ? -(u32) value : value;
+
+  int i = 0;
+  while (i < 5 && magnitude >= intencrange[i + 1].low) i++;
+  const struct intencrange *const range = &intencrange[i];
+
+  u32 prev = 1;
+  encode_int_bits(ctx, context, &prev, sign, 1);
+  // the prefix ones, and the zero ending all but the longest one
+  const u32 prefix = ((1u << range->prefix) - 1) << (range->prefix < 5);
+  encode_int_bits(ctx, context, &prev, prefix,
+                  range->prefix + (range->prefix < 5));
+  encode_int_bits(ctx, context, &prev, magnitude - range->low, range->bits);
+}
+
+// see comments in .h file
+void
+jbig2enc_oob(struct jbig2enc_ctx *restrict ctx, int proc) {
+  u8 *const context = ctx->intctx[proc];
+  ctx->intctx_dirty = true;
+  // a negative zero
+  u32 prev = 1;
+  encode_int_bits(ctx, context, &prev, 1, 1);
+  encode_int_bits(ctx, context, &prev, 0, 1);
+  encode_int_bits(ctx, context, &prev, 0, 2);
+}
+
+// see comments in .h file
+void
+jbig2enc_iaid(struct jbig2enc_ctx *restrict ctx, int symcodelen, int value) {
+  if (!ctx->iaidctx) {
+    ctx->iaidctx = (u8 *) calloc(1 << symcodelen, 1);
+    if (!ctx->iaidctx) abort();
+  }
+  u32 prev = 1;
+  for (int i = symcodelen - 1; i >= 0; --i) {
+    const u8 bit = (value >> i) & 1;
+    encode_bit(ctx, ctx->iaidctx, prev, bit);
+    prev = (prev << 1) | bit;
+  }
+}
+
+// These are the contexts used for the TPGD bits of each template (6.2.5.7)
+static const u32 tpgd_contexts[4] = {0x9b25, 0x0795, 0x00e5, 0x0195};
+
+// -----------------------------------------------------------------------------
+// The shapes of the generic region templates, with the AT pixels in their
+// nominal positions (6.2.5.3). Rows 1 and 2 of a template are the pixels
+// x - left .. x + right of the rows one and two above; row 0 is the pixels
+// x - left .. x - 1 of this row. Template 3 has no pixels two rows up.
+//
+// The context is made from the rows (row 2 in the top bits) with the pixels of
+// each row from right to left, which is the numbering the decoder uses, as the
+// TPGD contexts depend on it.
+// -----------------------------------------------------------------------------
+template <int GBTEMPLATE>
+struct generic_template {
+  static const int left2 = GBTEMPLATE == 3 ? 0 : GBTEMPLATE == 0 ? 2 : 1;
+  static const int right2 = GBTEMPLATE == 3 ? -1 : GBTEMPLATE == 2 ? 1 : 2;
+  static const int left1 = GBTEMPLATE == 0 || GBTEMPLATE == 3 ? 3 : 2;
+  static const int right1 = GBTEMPLATE <= 1 ? 3 : 2;
+  static const int left0 = GBTEMPLATE == 1 ? 3 : GBTEMPLATE == 2 ? 2 : 4;
+  // the number of pixels in each row
+  static const int bits2 = left2 + right2 + 1;
+  static const int bits1 = left1 + right1 + 1;
+  static const int bits0 = left0;
+};
+
+// -----------------------------------------------------------------------------
+// The context bits for the pixels of each word of a row are taken from 64-bit
+// windows over the row (r3) and the two rows above it (r2, then r1). In each
+// window, bits 63..60 are the last four pixels of the previous word, bits
+// 59..28 are the current word and bits 27..0 are the start of the next word,
+// so pixel j of the current word is at bit 59 - j. No template reaches further
+// than 4 pixels to the left or 3 to the right.
+// -----------------------------------------------------------------------------
+static inline u64
+row_window(u32 prev, u32 word, u32 next) {
+  return ((u64) prev << 60) | ((u64) word << 28) | (next >> 4);
 }
 
-// This is the context used for the TPGD bits
-#define TPGDCTX 0x9b25
+// -----------------------------------------------------------------------------
+// Whether none of the pixels in the templates of the pixels of a word are set,
+// so that they are all zero pixels in context 0. This is most of a typical
+// page.
+// -----------------------------------------------------------------------------
+template <int GBTEMPLATE>
+static inline bool
+blank_word(u64 r1, u64 r2, u64 r3) {
+  typedef generic_template<GBTEMPLATE> t;
+  const u64 mask2 = t::bits2 ? (1ULL << (t::bits2 + 31)) - 1 : 0;
+  const u64 mask1 = (1ULL << (t::bits1 + 31)) - 1;
+  const u64 mask0 = (1ULL << (t::left0 + 32)) - 1;
+  return ((r1 >> (28 - t::right2)) & mask2) == 0 &&
+         ((r2 >> (28 - t::right1)) & mask1) == 0 &&
+         ((r3 >> 28) & mask0) == 0;
+}
+
+// -----------------------------------------------------------------------------
+// Whether all the pixels of a word and of their templates are set, so that
+// they are all one pixels in the context with every bit set: solid black, as
+// in the borders of many scans and in inverted text.
+// -----------------------------------------------------------------------------
+template <int GBTEMPLATE>
+static inline bool
+solid_word(u64 r1, u64 r2, u64 r3) {
+  typedef generic_template<GBTEMPLATE> t;
+  const u64 mask2 = t::bits2 ? (1ULL << (t::bits2 + 31)) - 1 : 0;
+  const u64 mask1 = (1ULL << (t::bits1 + 31)) - 1;
+  const u64 mask0 = (1ULL << (t::left0 + 32)) - 1;
+  return ((r1 >> (28 - t::right2)) & mask2) == mask2 &&
+         ((r2 >> (28 - t::right1)) & mask1) == mask1 &&
+         ((r3 >> 28) & mask0) == mask0;
+}
+
+// -----------------------------------------------------------------------------
+// The context of pixel j of the current word of the windows
+// -----------------------------------------------------------------------------
+template <int GBTEMPLATE>
+static inline u32
+pixel_context(u64 r1, u64 r2, u64 r3, int j) {
+  typedef generic_template<GBTEMPLATE> t;
+  return (((r1 >> (59 - t::right2 - j)) & ((1 << t::bits2) - 1))
+             << (t::bits1 + t::bits0)) |
+         (((r2 >> (59 - t::right1 - j)) & ((1 << t::bits1) - 1))
+             << t::bits0) |
+         ((r3 >> (60 - j)) & ((1 << t::bits0) - 1));
+}
+
+// -----------------------------------------------------------------------------
+// Code one row of a generic region (no TPGD) with template GBTEMPLATE. row3 is
+// the row itself, row2 and row1 are the rows one and two above it, which are
+// all zero above the top of the image. Each row must be padded with a zero word
+// after its words_per_row words, so that there are no border cases in the loop.
+// -----------------------------------------------------------------------------
+template <int GBTEMPLATE>
+static inline void
+encode_generic_row(struct jbig2enc_ctx *restrict ctx, u8 *restrict context,
+                   const u32 *restrict row1, const u32 *restrict row2,
+                   const u32 *restrict row3, int mx, unsigned words_per_row) {
+  int x = 0;
+
+  // the w* values contain the previous, current and next words of each row:
+  // w1 is from two rows up etc.
+  u32 w1p = 0, w2p = 0, w3p = 0;
+  u32 w1 = row1[0];
+  u32 w2 = row2[0];
+  u32 w3 = row3[0];
+
+  for (unsigned wordno = 0; wordno < words_per_row; ++wordno, x += 32) {
+    const u32 w1n = row1[wordno + 1];
+    const u32 w2n = row2[wordno + 1];
+    const u32 w3n = row3[wordno + 1];
+    const u64 r1 = row_window(w1p, w1, w1n);
+    const u64 r2 = row_window(w2p, w2, w2n);
+    const u64 r3 = row_window(w3p, w3, w3n);
+    int n = mx - x < 32 ? mx - x : 32;
+
+    if (blank_word<GBTEMPLATE>(r1, r2, r3)) {
+      encode_zero_run(ctx, context, 0, n);
+      n = 0;
+    } else if (solid_word<GBTEMPLATE>(r1, r2, r3)) {
+      encode_run(ctx, context, pixel_context<GBTEMPLATE>(r1, r2, r3, 0), 1,
+                 n);
+      n = 0;
+    }
+
+    for (int j = 0; j < n; ++j) {
+      const u32 tval = pixel_context<GBTEMPLATE>(r1, r2, r3, j);
+      const u8 v = (r3 >> (59 - j)) & 1;
+
+      //fprintf(stderr, "%d %d %d\n", x + j, tval, v);
+      encode_bit(ctx, context, tval, v);
+    }
+
+    w1p = w1 & 15;
+    w2p = w2 & 15;
+    w3p = w3 & 15;
+    w1 = w1n;
+    w2 = w2n;
+    w3 = w3n;
+  }
+}
+
+// -----------------------------------------------------------------------------
+// Copy a row of n words from src to dst (if dst isn't NULL), and return true
+// if it is the same as the row at prev. The comparison is done on the words as
+// they are copied, so that the row is only read once. There is no early exit:
+// rows which differ mostly do so in their first few words, but then coding the
+// row costs far more than the comparison, while duplicate rows, which are
+// worth finding fast, have to be read to the end anyway. The SSE2 code is only
+// run if cpuGetLevel() allows it, a call per row which returns a cached value.
+// -----------------------------------------------------------------------------
+static inline bool
+copy_row_same(u32 *restrict dst, const u32 *restrict src,
+              const u32 *restrict prev, unsigned n) {
+  unsigned i = 0;
+  u32 diff = 0;
+#if defined(__SSE2__)
+  if (cpuGetLevel() >= L_CPU_SSE2) {
+    __m128i vdiff = _mm_setzero_si128();
+    for (; i + 4 <= n; i += 4) {
+      const __m128i w = _mm_loadu_si128((const __m128i *) (src + i));
+      if (dst) _mm_storeu_si128((__m128i *) (dst + i), w);
+      vdiff = _mm_or_si128(vdiff, _mm_xor_si128(
+          w, _mm_loadu_si128((const __m128i *) (prev + i))));
+    }
+    diff = _mm_movemask_epi8(_mm_cmpeq_epi8(vdiff, _mm_setzero_si128())) ^
+           0xffff;
+  }
+#endif
+  for (; i < n; ++i) {
+    const u32 w = src[i];
+    if (dst) dst[i] = w;
+    diff |= w ^ prev[i];
+  }
+  return diff == 0;
+}
+
+// -----------------------------------------------------------------------------
+// Code the TPGD bit for a row which is (ltp = 1) or isn't a copy of the
+// previous one. Returns true if the row itself needs to be coded.
+// -----------------------------------------------------------------------------
+template <int GBTEMPLATE>
+static inline bool
+encode_tpgd(struct jbig2enc_ctx *restrict ctx, u8 *restrict context,
+            u8 *restrict ltp, u8 new_ltp) {
+  const u8 sltp = *ltp ^ new_ltp;
+  *ltp = new_ltp;
+  encode_bit(ctx, context, tpgd_contexts[GBTEMPLATE], sltp);
+  return !new_ltp;
+}
+
+// -----------------------------------------------------------------------------
+// The coding loops are templates over the generic region template and TPGD,
+// and are picked once per image, so that each combination has a loop with no
+// per-row or per-pixel tests of the options. They all work on the padded rows
+// of a jbig2enc_rows, so there isn't a variant for unpadded rows.
+// -----------------------------------------------------------------------------
 
 // -----------------------------------------------------------------------------
 // This is designed for Leptonica's 1bpp packed format images. Each row is some
 // number of 32-bit words. Pixels are in native-byte-order in each word.
+//
+// The rows are copied, one at a time, into the padded ring buffer of a
+// jbig2enc_rows (see encode_generic_row), so that the coding loop has no
+// border cases. Copying a row is cheap next to coding it.
 // -----------------------------------------------------------------------------
-void
-jbig2enc_bitimage(struct jbig2enc_ctx *restrict ctx, const u8 *restrict idata,
-                  int mx, int my, bool duplicate_line_removal) {
-  const u32 *restrict data = (u32 *) idata;
+template <int GBTEMPLATE, bool TPGD>
+static void
+encode_image(struct jbig2enc_ctx *restrict ctx, const u32 *restrict data,
+             int my, struct jbig2enc_rows *restrict rows) {
   u8 *const context = ctx->context;
-  const unsigned words_per_row = (mx + 31) / 32;
+  const int mx = rows->mx;
+  const unsigned words_per_row = rows->words_per_row;
   const unsigned bytes_per_row = words_per_row * 4;
+  u32 *const ring[3] = {rows->ring, rows->ring + (words_per_row + 1),
+                        rows->ring + 2 * (words_per_row + 1)};
 
-  u8 ltp = 0, sltp = 0;
+  u8 ltp = 0;
 
   for (int y = 0; y < my; ++y) {
-    int x = 0;
+    u32 *const row3 = ring[y % 3];
+    const u32 *const row2 = ring[(y + 2) % 3];
+    const u32 *const row1 = ring[(y + 1) % 3];
 
-    // the c* values store the context bits for each row. The template is fixed
-    // as template 0 with the floating bits in the default locations.
-    u16 c1, c2, c3;
-    // the w* values contain words from each of the rows: w1 is from two rows
-    // up etc. The next bit to roll onto the context values are kept at the top
-    // of these words.
-    u32 w1, w2, w3;
-    w1 = w2 = w3 = 0;
+    if (TPGD) {
+      // it's possible that the last row was the same as this row
+      const u8 same = copy_row_same(row3, &data[(size_t) y * words_per_row],
+                                    row2, words_per_row) && y >= 1;
+      if (!encode_tpgd<GBTEMPLATE>(ctx, context, &ltp, same)) continue;
+    } else {
+      memcpy(row3, &data[(size_t) y * words_per_row], bytes_per_row);
+    }
 
-    if (y >= 2) w1 = data[(y - 2) * words_per_row];
-    if (y >= 1) {
-      w2 = data[(y - 1) * words_per_row];
+    encode_generic_row<GBTEMPLATE>(ctx, context, row1, row2, row3, mx,
+                                   words_per_row);
+  }
+}
 
-      if (duplicate_line_removal) {
-        // it's possible that the last row was the same as this row
-        if (memcmp(&data[y * words_per_row], &data[(y - 1) * words_per_row],
-                   bytes_per_row) == 0) {
-          sltp = ltp ^ 1;
-          ltp = 1;
-        } else {
-          sltp = ltp;
-          ltp = 0;
-        }
+// -----------------------------------------------------------------------------
+// Code the row stored at jbig2enc_rows_next
+// -----------------------------------------------------------------------------
+template <int GBTEMPLATE, bool TPGD>
+static void
+encode_next_row(struct jbig2enc_ctx *restrict ctx,
+                struct jbig2enc_rows *restrict rows) {
+  const int y = rows->y;
+  const unsigned wpr = rows->words_per_row;
+  const u32 *const row3 = rows->ring + (y % 3) * (wpr + 1);
+  const u32 *const row2 = rows->ring + ((y + 2) % 3) * (wpr + 1);
+  const u32 *const row1 = rows->ring + ((y + 1) % 3) * (wpr + 1);
+  rows->y++;
+
+  if (TPGD) {
+    // it's possible that the last row was the same as this row
+    const u8 same = y >= 1 && copy_row_same(NULL, row3, row2, wpr);
+    if (!encode_tpgd<GBTEMPLATE>(ctx, ctx->context, &rows->ltp, same)) return;
+  }
+
+  encode_generic_row<GBTEMPLATE>(ctx, ctx->context, row1, row2, row3, rows->mx,
+                                 wpr);
+}
+
+typedef void (*image_kernel)(struct jbig2enc_ctx *restrict ctx,
+                             const u32 *restrict data, int my,
+                             struct jbig2enc_rows *restrict rows);
+
+// indexed by template and TPGD
+static const image_kernel image_kernels[4][2] = {
+  {encode_image<0, false>, encode_image<0, true>},
+  {encode_image<1, false>, encode_image<1, true>},
+  {encode_image<2, false>, encode_image<2, true>},
+  {encode_image<3, false>, encode_image<3, true>},
+};
+
+static const jbig2enc_row_kernel row_kernels[4][2] = {
+  {encode_next_row<0, false>, encode_next_row<0, true>},
+  {encode_next_row<1, false>, encode_next_row<1, true>},
+  {encode_next_row<2, false>, encode_next_row<2, true>},
+  {encode_next_row<3, false>, encode_next_row<3, true>},
+};
+
+// see comments in .h file
+void
+jbig2enc_bitimage(struct jbig2enc_ctx *restrict ctx, const u8 *restrict idata,
+                  int mx, int my, bool duplicate_line_removal,
+                  int gbtemplate) {
+  if (gbtemplate < 0 || gbtemplate > 3) abort();
+  struct jbig2enc_rows rows;
+  jbig2enc_rows_init(&rows, mx, duplicate_line_removal, gbtemplate);
+  image_kernels[gbtemplate][duplicate_line_removal](ctx, (const u32 *) idata,
+                                                     my, &rows);
+  jbig2enc_rows_dealloc(&rows);
+}
+
+// -----------------------------------------------------------------------------
+// Code a row of each of K generic regions at once, each with its own context
+// (see jbig2enc_bitimage_interleaved), as encode_generic_row does for one. The
+// streams take turns bit by bit: each coding is a chain of dependent steps
+// (state, Qe, A and C, renormalisation), but those of different streams are
+// independent of each other, so the CPU can work on K of them at a time.
+// -----------------------------------------------------------------------------
+template <int GBTEMPLATE, int K>
+static void
+encode_generic_rows_interleaved(struct jbig2enc_ctx *const *ctxs,
+                                const u32 *const *row1s,
+                                const u32 *const *row2s,
+                                const u32 *const *row3s, int mx,
+                                unsigned words_per_row) {
+  u32 w1p[K], w2p[K], w3p[K], w1[K], w2[K], w3[K];
+  for (int k = 0; k < K; ++k) {
+    w1p[k] = w2p[k] = w3p[k] = 0;
+    w1[k] = row1s[k][0];
+    w2[k] = row2s[k][0];
+    w3[k] = row3s[k][0];
+  }
+  int x = 0;
+
+  for (unsigned wordno = 0; wordno < words_per_row; ++wordno, x += 32) {
+    const int n = mx - x < 32 ? mx - x : 32;
+    u64 r1[K], r2[K], r3[K];
+    bool busy[K];
+    bool any = false;
+    for (int k = 0; k < K; ++k) {
+      const u32 w1n = row1s[k][wordno + 1];
+      const u32 w2n = row2s[k][wordno + 1];
+      const u32 w3n = row3s[k][wordno + 1];
+      r1[k] = row_window(w1p[k], w1[k], w1n);
+      r2[k] = row_window(w2p[k], w2[k], w2n);
+      r3[k] = row_window(w3p[k], w3[k], w3n);
+      busy[k] = false;
+      if (blank_word<GBTEMPLATE>(r1[k], r2[k], r3[k])) {
+        encode_zero_run(ctxs[k], ctxs[k]->context, 0, n);
+      } else if (solid_word<GBTEMPLATE>(r1[k], r2[k], r3[k])) {
+        encode_run(ctxs[k], ctxs[k]->context,
+                   pixel_context<GBTEMPLATE>(r1[k], r2[k], r3[k], 0), 1, n);
+      } else {
+        busy[k] = true;
       }
+      any |= busy[k];
+      w1p[k] = w1[k] & 15;
+      w2p[k] = w2[k] & 15;
+      w3p[k] = w3[k] & 15;
+      w1[k] = w1n;
+      w2[k] = w2n;
+      w3[k] = w3n;
     }
-    if (duplicate_line_removal) {
-      encode_bit(ctx, context, TPGDCTX, sltp);
-      if (ltp) continue;
+    if (!any) continue;
+
+    for (int j = 0; j < n; ++j) {
+      for (int k = 0; k < K; ++k) {
+        if (!busy[k]) continue;
+        encode_bit(ctxs[k], ctxs[k]->context,
+                   pixel_context<GBTEMPLATE>(r1[k], r2[k], r3[k], j),
+                   (r3[k] >> (59 - j)) & 1);
+      }
     }
-    w3 = data[y * words_per_row];
+  }
+}
 
-    // the top three bits are the start of the context c1
-    c1 = w1 >> 29;
-    c2 = w2 >> 28;
-    // and we need to remove the used bits from the w* vars
-    w1 <<= 3;
-    w2 <<= 4;
-    c3 = 0;
-    for (x = 0; x < mx; ++x) {
-      const u16 tval = (c1 << 11) | (c2 << 4) | c3;
-      const u8 v = (w3 & 0x80000000) >> 31;
+typedef void (*interleaved_kernel)(struct jbig2enc_ctx *const *ctxs,
+                                   const u32 *const *row1s,
+                                   const u32 *const *row2s,
+                                   const u32 *const *row3s, int mx,
+                                   unsigned words_per_row);
 
-      //fprintf(stderr, "%d %d %d %d\n", x, y, tval, v);
-      encode_bit(ctx, context, tval, v);
-      c1 <<= 1;
-      c2 <<= 1;
-      c3 <<= 1;
-      c1 |= (w1 & 0x80000000) >> 31;
-      c2 |= (w2 & 0x80000000) >> 31;
-      c3 |= v;
-      const int m = x % 32;
-      if (m == 28 && y >= 2) {
-        // need to roll in another word from two lines up
-        const unsigned wordno = (x / 32) + 1;
-        if (wordno >= words_per_row) {
-          w1 = 0;
-        } else {
-          w1 = data[(y - 2) * words_per_row + wordno];
-        }
-      } else {
-        w1 <<= 1;
-      }
+// indexed by template and the number of streams - 1
+static const interleaved_kernel
+interleaved_kernels[4][JBIG2_INTERLEAVE_MAX] = {
+  {encode_generic_rows_interleaved<0, 1>, encode_generic_rows_interleaved<0, 2>,
+   encode_generic_rows_interleaved<0, 3>, encode_generic_rows_interleaved<0, 4>},
+  {encode_generic_rows_interleaved<1, 1>, encode_generic_rows_interleaved<1, 2>,
+   encode_generic_rows_interleaved<1, 3>, encode_generic_rows_interleaved<1, 4>},
+  {encode_generic_rows_interleaved<2, 1>, encode_generic_rows_interleaved<2, 2>,
+   encode_generic_rows_interleaved<2, 3>, encode_generic_rows_interleaved<2, 4>},
+  {encode_generic_rows_interleaved<3, 1>, encode_generic_rows_interleaved<3, 2>,
+   encode_generic_rows_interleaved<3, 3>, encode_generic_rows_interleaved<3, 4>},
+};
 
-      if (m == 27 && y >= 1) {
-        // need to roll in another word from the last line
-        const unsigned wordno = (x / 32) + 1;
-        if (wordno >= words_per_row) {
-          w2 = 0;
-        } else {
-          w2 = data[(y - 1) * words_per_row + wordno];
-        }
+// see comments in .h file
+void
+jbig2enc_bitimage_interleaved(struct jbig2enc_ctx *const *ctxs,
+                              const uint8_t *const *idata, int mx,
+                              const int *my, int n,
+                              bool duplicate_line_removal, int gbtemplate) {
+  if (gbtemplate < 0 || gbtemplate > 3 || n < 1 || n > JBIG2_INTERLEAVE_MAX)
+    abort();
+  const unsigned wpr = (mx + 31) / 32;
+  const unsigned stride = wpr + 1;
+  // a ring of three padded rows for each stream, as for encode_image
+  u32 *const ring = (u32 *) calloc(3 * stride * n, sizeof(u32));
+  if (!ring) abort();
+  u8 ltp[JBIG2_INTERLEAVE_MAX] = {0};
+  const u32 tpgd_context = tpgd_contexts[gbtemplate];
+  int rows = 0;
+  for (int k = 0; k < n; ++k) rows = my[k] > rows ? my[k] : rows;
+
+  for (int y = 0; y < rows; ++y) {
+    // the streams with a row y to code, packed to the front
+    struct jbig2enc_ctx *act_ctxs[JBIG2_INTERLEAVE_MAX];
+    const u32 *row1s[JBIG2_INTERLEAVE_MAX], *row2s[JBIG2_INTERLEAVE_MAX];
+    const u32 *row3s[JBIG2_INTERLEAVE_MAX];
+    int nact = 0;
+    for (int k = 0; k < n; ++k) {
+      if (y >= my[k]) continue;
+      u32 *const base = ring + 3 * stride * k;
+      u32 *const row3 = base + (y % 3) * stride;
+      const u32 *const row2 = base + ((y + 2) % 3) * stride;
+      const u32 *const src = (const u32 *) idata[k] + (size_t) y * wpr;
+      if (duplicate_line_removal) {
+        // it's possible that the last row was the same as this row
+        const u8 same = copy_row_same(row3, src, row2, wpr) && y >= 1;
+        const u8 sltp = ltp[k] ^ same;
+        ltp[k] = same;
+        encode_bit(ctxs[k], ctxs[k]->context, tpgd_context, sltp);
+        if (same) continue;
       } else {
-        w2 <<= 1;
+        memcpy(row3, src, wpr * sizeof(u32));
       }
+      act_ctxs[nact] = ctxs[k];
+      row1s[nact] = base + ((y + 1) % 3) * stride;
+      row2s[nact] = row2;
+      row3s[nact] = row3;
+      ++nact;
+    }
+    if (nact) {
+      interleaved_kernels[gbtemplate][nact - 1](act_ctxs, row1s, row2s, row3s,
+                                                mx, wpr);
+    }
+  }
+  free(ring);
+}
+
+// see comments in .h file
+void
+jbig2enc_rows_init(struct jbig2enc_rows *rows, int mx,
+                   bool duplicate_line_removal, int gbtemplate) {
+  if (gbtemplate < 0 || gbtemplate > 3) abort();
+  rows->mx = mx;
+  rows->words_per_row = (mx + 31) / 32;
+  rows->encode_row = row_kernels[gbtemplate][duplicate_line_removal];
+  rows->y = 0;
+  rows->ltp = 0;
+  // Each row has a zero word after it, and the rows which haven't been
+  // stored yet are zero, like the rows above the top of the image.
+  rows->ring = (u32 *) calloc(3 * (rows->words_per_row + 1), sizeof(u32));
+  if (!rows->ring) abort();
+}
+
+// see comments in .h file
+u32 *
+jbig2enc_rows_next(struct jbig2enc_rows *rows) {
+  return rows->ring + (rows->y % 3) * (rows->words_per_row + 1);
+}
+
+// see comments in .h file
+void
+jbig2enc_rows_encode(struct jbig2enc_ctx *restrict ctx,
+                     struct jbig2enc_rows *restrict rows) {
+  rows->encode_row(ctx, rows);
+}
 
-      if (m == 31) {
-        // need to roll in another word from this line
-        const unsigned wordno = (x / 32) + 1;
-        if (wordno >= words_per_row) {
-          w3 = 0;
-        } else {
-          w3 = data[y * words_per_row + wordno];
-        }
+// see comments in .h file
+void
+jbig2enc_rows_skip(struct jbig2enc_rows *rows) {
+  rows->y++;
+}
+
+// see comments in .h file
+void
+jbig2enc_rows_dealloc(struct jbig2enc_rows *rows) {
+  free(rows->ring);
+  rows->ring = NULL;
+}
+
+// -----------------------------------------------------------------------------
+// Code one row of a generic refinement region with template GRTEMPLATE. row is
+// the row itself and above the one above it; ref_above, ref and ref_below are
+// the rows of the reference around it. All are zero outside the image and are
+// padded with a zero word, as for encode_generic_row, whose 64-bit windows this
+// uses: pixel j of the current word is bit 59 - j of each window, and the
+// three pixels x - 1, x, x + 1 are bits 2..0 of the window shifted by 58 - j.
+//
+// The templates are those of 6.3.5.3: GRTEMPLATE 0 has the pixel left of this
+// one, the three above it (the top left one is the AT pixel RA1) and the 3x3
+// square of the reference around it (the top left corner is RA2). GRTEMPLATE
+// 1 has the same pixels of the image, but of the square only the middle row
+// and column and the bottom right corner. The order of the pixels in the
+// context is free, as without TPGR no context number is fixed by the standard.
+// -----------------------------------------------------------------------------
+template <int GRTEMPLATE>
+static inline void
+encode_refine_row(struct jbig2enc_ctx *restrict ctx, u8 *restrict context,
+                  const u32 *restrict above, const u32 *restrict row,
+                  const u32 *restrict ref_above, const u32 *restrict ref,
+                  const u32 *restrict ref_below, int mx,
+                  unsigned words_per_row) {
+  u32 w1p = 0, w0p = 0, rpp = 0, rcp = 0, rnp = 0;
+  u32 w1 = above[0], w0 = row[0];
+  u32 rp = ref_above[0], rc = ref[0], rn = ref_below[0];
+  int x = 0;
+
+  for (unsigned wordno = 0; wordno < words_per_row; ++wordno, x += 32) {
+    const u32 w1n = above[wordno + 1], w0n = row[wordno + 1];
+    const u32 rpn = ref_above[wordno + 1], rcn = ref[wordno + 1];
+    const u32 rnn = ref_below[wordno + 1];
+    const u64 i1 = ((u64) w1p << 60) | ((u64) w1 << 28) | (w1n >> 4);
+    const u64 i0 = ((u64) w0p << 60) | ((u64) w0 << 28) | (w0n >> 4);
+    const u64 r1 = ((u64) rpp << 60) | ((u64) rp << 28) | (rpn >> 4);
+    const u64 r0 = ((u64) rcp << 60) | ((u64) rc << 28) | (rcn >> 4);
+    const u64 r2 = ((u64) rnp << 60) | ((u64) rn << 28) | (rnn >> 4);
+    int n = mx - x < 32 ? mx - x : 32;
+
+    // Pixels -1 .. 32 of every row are bits 60..27: if they are all zero, so
+    // are all the pixels of the word and their contexts.
+    if ((((i1 | i0 | r1 | r0 | r2) >> 27) & ((1ULL << 34) - 1)) == 0) {
+      encode_zero_run(ctx, context, 0, n);
+      n = 0;
+    }
+
+    for (int j = 0; j < n; ++j) {
+      const int s = 58 - j;
+      u32 tval = ((i0 >> (s + 2)) & 1) | (((i1 >> s) & 7) << 1);
+      if (GRTEMPLATE == 0) {
+        tval |= (((r2 >> s) & 7) << 4) | (((r0 >> s) & 7) << 7) |
+                (((r1 >> s) & 7) << 10);
       } else {
-        w3 <<= 1;
+        tval |= (((r2 >> s) & 3) << 4) | (((r0 >> s) & 7) << 6) |
+                (((r1 >> (s + 1)) & 1) << 9);
       }
+      encode_bit(ctx, context, tval, (i0 >> (s + 1)) & 1);
+    }
+
+    w1p = w1 & 15;
+    w0p = w0 & 15;
+    rpp = rp & 15;
+    rcp = rc & 15;
+    rnp = rn & 15;
+    w1 = w1n;
+    w0 = w0n;
+    rp = rpn;
+    rc = rcn;
+    rn = rnn;
+  }
+}
 
-      c1 &= 31;
-      c2 &= 127;
-      c3 &= 15;
+// see comments in .h file
+void
+jbig2enc_refine(struct jbig2enc_ctx *restrict ctx, const u8 *restrict idata,
+                const u8 *restrict rdata, int mx, int my, int grtemplate) {
+  if (grtemplate < 0 || grtemplate > 1) abort();
+  const u32 *const data = (const u32 *) idata;
+  const u32 *const refdata = (const u32 *) rdata;
+  const unsigned wpr = (mx + 31) / 32;
+  const unsigned stride = wpr + 1;
+  // Two rows of the image and three of the reference, padded as for
+  // encode_image; the rows above the top and below the bottom are zero.
+  u32 *const ring = (u32 *) calloc(5 * stride, sizeof(u32));
+  if (!ring) abort();
+  u32 *const rows[2] = {ring, ring + stride};
+  u32 *const refs[3] = {ring + 2 * stride, ring + 3 * stride,
+                        ring + 4 * stride};
+  if (my > 0) memcpy(refs[0], refdata, wpr * sizeof(u32));
+
+  for (int y = 0; y < my; ++y) {
+    u32 *const row = rows[y & 1];
+    u32 *const ref_below = refs[(y + 1) % 3];
+    memcpy(row, &data[y * wpr], wpr * sizeof(u32));
+    if (y + 1 < my) {
+      memcpy(ref_below, &refdata[(y + 1) * wpr], wpr * sizeof(u32));
+    } else {
+      memset(ref_below, 0, wpr * sizeof(u32));
     }
+    if (grtemplate == 0) {
+      encode_refine_row<0>(ctx, ctx->context, rows[(y + 1) & 1], row,
+                           refs[(y + 2) % 3], refs[y % 3], ref_below, mx, wpr);
+    } else {
+      encode_refine_row<1>(ctx, ctx->context, rows[(y + 1) & 1], row,
+                           refs[(y + 2) % 3], refs[y % 3], ref_below, mx, wpr);
+    }
+  }
+  free(ring);
+}
+
+// -----------------------------------------------------------------------------
+// The decoder
+//
+// It follows the software conventions of the standard (E.3.5): C holds the
+// coded bits inverted, its top 16 bits are compared with A, and BYTEIN reads
+// the byte after a 0xff as 7 bits of data, or stops at a marker (a byte above
+// 0x8f), after which the coded bits are taken to be all 1s.
+// -----------------------------------------------------------------------------
+
+static inline u8
+decoder_byte(const struct jbig2dec_ctx *ctx, size_t pos) {
+  return pos < ctx->length ? ctx->data[pos] : 0xff;
+}
+
+// -----------------------------------------------------------------------------
+// The BYTEIN procedure from the standard
+// -----------------------------------------------------------------------------
+static void
+bytein(struct jbig2dec_ctx *restrict ctx) {
+  if (decoder_byte(ctx, ctx->bp) == 0xff) {
+    if (decoder_byte(ctx, ctx->bp + 1) > 0x8f) {
+      ctx->ct = 8;
+    } else {
+      ctx->bp++;
+      ctx->c += 0xfe00 - (decoder_byte(ctx, ctx->bp) << 9);
+      ctx->ct = 7;
+    }
+  } else {
+    ctx->bp++;
+    ctx->c += 0xff00 - (decoder_byte(ctx, ctx->bp) << 8);
+    ctx->ct = 8;
+  }
+}
+
+// -----------------------------------------------------------------------------
+// A merging of the DECODE, MPS_EXCHANGE, LPS_EXCHANGE and RENORMD procedures
+// from the standard. The switch of the MPS is in the next states of ctbl, as
+// for encode_bit.
+// -----------------------------------------------------------------------------
+static inline u8
+decode_bit(struct jbig2dec_ctx *restrict ctx, u8 *restrict context,
+           u32 ctxnum) {
+  const struct context *const state = &ctbl[context[ctxnum]];
+  const u32 qe = state->qe;
+  u8 d;
+
+  ctx->a -= qe;
+  if (likely((ctx->c >> 16) < ctx->a)) {
+    if (likely(ctx->a & 0x8000)) return state->bit;
+    if (ctx->a < qe) {
+      d = !state->bit;
+      context[ctxnum] = state->lps;
+    } else {
+      d = state->bit;
+      context[ctxnum] = state->mps;
+    }
+  } else {
+    ctx->c -= ctx->a << 16;
+    if (ctx->a < qe) {
+      d = state->bit;
+      context[ctxnum] = state->mps;
+    } else {
+      d = !state->bit;
+      context[ctxnum] = state->lps;
+    }
+    ctx->a = qe;
+  }
+
+  do {
+    if (ctx->ct == 0) bytein(ctx);
+    ctx->a <<= 1;
+    ctx->c <<= 1;
+    ctx->ct--;
+  } while (!(ctx->a & 0x8000));
+  return d;
+}
+
+// -----------------------------------------------------------------------------
+// Decode up to n pixels in context ctxnum for as long as they are 0. Returns
+// the number of 0 pixels; if that is less than n, the pixel after them was a 1
+// and has been decoded too. As in encode_run, the MPS decodings which don't
+// need renormalisation leave the state as it is, and while 0 is the MPS, the
+// number of them in a row is found from A, C and Qe at once.
+// -----------------------------------------------------------------------------
+static inline int
+decode_zero_run(struct jbig2dec_ctx *restrict ctx, u8 *restrict context,
+                u32 ctxnum, int n) {
+  int i = 0;
+  while (i < n) {
+    const struct context *const state = &ctbl[context[ctxnum]];
+    const u32 qe = state->qe;
+    const u32 chigh = ctx->c >> 16;
+    if (state->bit == 0 && chigh + qe < ctx->a) {
+      // each step takes qe from A, which must stay above both C and 0x7fff
+      int k = (ctx->a - 0x8000) / qe;
+      const int k2 = (ctx->a - chigh - 1) / qe;
+      if (k2 < k) k = k2;
+      if (k > n - i) k = n - i;
+      ctx->a -= k * qe;
+      i += k;
+      if (i == n) break;
+    }
+    if (decode_bit(ctx, context, ctxnum)) return i;
+    i++;
+  }
+  return n;
+}
+
+// -----------------------------------------------------------------------------
+// The pixels of each generic region template (6.2.5.3, figures 3 to 6), with
+// the AT pixels in their nominal positions, as offsets (dx, dy) from the pixel
+// being decoded, in the order of the bits of the context from bit 0 up. The
+// decoder makes its contexts from these alone, rather than with the encoder's
+// generic_template and pixel_context, so that a mistake in the context layout
+// of the encoder shows up as a mismatch with --verify.
+// -----------------------------------------------------------------------------
+struct template_pixel {
+  int dx, dy;
+};
+
+static const int template_pixel_count[4] = {16, 13, 10, 10};
+
+static const struct template_pixel template_pixels[4][16] = {
+  {{-1, 0}, {-2, 0}, {-3, 0}, {-4, 0}, {3, -1}, {2, -1}, {1, -1}, {0, -1},
+   {-1, -1}, {-2, -1}, {-3, -1}, {2, -2}, {1, -2}, {0, -2}, {-1, -2},
+   {-2, -2}},
+  {{-1, 0}, {-2, 0}, {-3, 0}, {3, -1}, {2, -1}, {1, -1}, {0, -1}, {-1, -1},
+   {-2, -1}, {2, -2}, {1, -2}, {0, -2}, {-1, -2}},
+  {{-1, 0}, {-2, 0}, {2, -1}, {1, -1}, {0, -1}, {-1, -1}, {-2, -1}, {1, -2},
+   {0, -2}, {-1, -2}},
+  {{-1, 0}, {-2, 0}, {-3, 0}, {-4, 0}, {2, -1}, {1, -1}, {0, -1}, {-1, -1},
+   {-2, -1}, {-3, -1}},
+};
+
+// -----------------------------------------------------------------------------
+// A template made ready for decoding. In each row, the pixels of every template
+// are neighbours which are also neighbours in the context, so each row gives a
+// run of bits of the context, taken from the window of the row (see
+// row_window) with one shift and mask.
+// -----------------------------------------------------------------------------
+struct context_run {
+  int dx;  // the offset of the pixel in the lowest bit of the run
+  int bit;  // where that bit goes in the context
+  u32 mask;  // of the bits of the run, 0 if the row has no pixels
+};
+
+struct decoder_template {
+  struct context_run runs[3];  // of the row itself, and one and two above
+  u64 above1, above2;  // the bits of the windows of the rows one and two
+                       // above which are in the templates of the pixels of a
+                       // word
+};
+
+static void
+make_decoder_template(int gbtemplate, struct decoder_template *t) {
+  memset(t, 0, sizeof(*t));
+  for (int k = 0; k < template_pixel_count[gbtemplate]; ++k) {
+    const struct template_pixel p = template_pixels[gbtemplate][k];
+    struct context_run *const run = &t->runs[-p.dy];
+    const int length = __builtin_popcount(run->mask);
+    if (!length) {
+      run->dx = p.dx;
+      run->bit = k;
+    } else if (p.dx != run->dx - length || k != run->bit + length) {
+      abort();  // not a run
+    }
+    run->mask |= 1u << length;
+    for (int j = 0; j < 32; ++j) {
+      if (p.dy == -1) t->above1 |= 1ULL << (59 - j - p.dx);
+      if (p.dy == -2) t->above2 |= 1ULL << (59 - j - p.dx);
+    }
+  }
+}
+
+// -----------------------------------------------------------------------------
+// The context of pixel j of the current word of the windows, r1 and r2 being
+// the rows two and one above and r3 the row being decoded
+// -----------------------------------------------------------------------------
+static inline u32
+decoder_context(const struct decoder_template *t, u64 r1, u64 r2, u64 r3,
+                int j) {
+  const struct context_run *const runs = t->runs;
+  return (((u32) (r3 >> (59 - j - runs[0].dx)) & runs[0].mask)
+             << runs[0].bit) |
+         (((u32) (r2 >> (59 - j - runs[1].dx)) & runs[1].mask)
+             << runs[1].bit) |
+         (((u32) (r1 >> (59 - j - runs[2].dx)) & runs[2].mask)
+             << runs[2].bit);
+}
+
+// -----------------------------------------------------------------------------
+// Decode one row of a generic region (no TPGD) into row3, from the rows one
+// and two above it (row2 and row1), padded as for encode_generic_row. The
+// context of each pixel is made by decoder_context, with the window of this
+// row filled in as its pixels are decoded. Where the template above is blank
+// and the row is blank so far, the pixels are in context 0 up to the first 1
+// and are decoded as a run.
+// -----------------------------------------------------------------------------
+static inline void
+decode_generic_row(struct jbig2dec_ctx *restrict ctx, u8 *restrict context,
+                   const struct decoder_template *t,
+                   const u32 *restrict row1, const u32 *restrict row2,
+                   u32 *restrict row3, int mx, unsigned words_per_row) {
+  // a copy, which can be kept in registers across the writes to the contexts
+  const struct decoder_template tpl = *t;
+  u32 w1p = 0, w2p = 0, w3p = 0;
+  int x = 0;
+
+  for (unsigned wordno = 0; wordno < words_per_row; ++wordno, x += 32) {
+    const u64 r1 = row_window(w1p, row1[wordno], row1[wordno + 1]);
+    const u64 r2 = row_window(w2p, row2[wordno], row2[wordno + 1]);
+    u64 r3 = (u64) w3p << 60;
+    const int n = mx - x < 32 ? mx - x : 32;
+    int j = 0;
+
+    if (w3p == 0 && (r1 & tpl.above2) == 0 && (r2 & tpl.above1) == 0) {
+      j = decode_zero_run(ctx, context, 0, n);
+      if (j < n) r3 |= 1ULL << (59 - j++);
+    }
+    for (; j < n; ++j) {
+      const u32 tval = decoder_context(&tpl, r1, r2, r3, j);
+      if (decode_bit(ctx, context, tval)) r3 |= 1ULL << (59 - j);
+    }
+
+    const u32 w3 = (u32) (r3 >> 28);
+    row3[wordno] = w3;
+    w1p = row1[wordno] & 15;
+    w2p = row2[wordno] & 15;
+    w3p = w3 & 15;
   }
 }
+
+// -----------------------------------------------------------------------------
+// Decode an image into data (see jbig2dec_bitimage), a row at a time into a
+// ring of three padded rows, as encode_image codes it
+// -----------------------------------------------------------------------------
+template <int GBTEMPLATE, bool TPGD>
+static void
+decode_image(struct jbig2dec_ctx *restrict ctx, u32 *restrict data, int mx,
+             int my) {
+  u8 *const context = ctx->context;
+  const unsigned words_per_row = (mx + 31) / 32;
+  const unsigned stride = words_per_row + 1;
+  u32 *const ring = (u32 *) calloc(3 * stride, sizeof(u32));
+  if (!ring) abort();
+  u8 ltp = 0;
+  struct decoder_template t;
+  make_decoder_template(GBTEMPLATE, &t);
+
+  for (int y = 0; y < my; ++y) {
+    u32 *const row3 = ring + (y % 3) * stride;
+    const u32 *const row2 = ring + ((y + 2) % 3) * stride;
+    const u32 *const row1 = ring + ((y + 1) % 3) * stride;
+
+    if (TPGD) {
+      ltp ^= decode_bit(ctx, context, tpgd_contexts[GBTEMPLATE]);
+    }
+    if (TPGD && ltp) {
+      // a copy of the row above, which is zero above the top
+      memcpy(row3, row2, words_per_row * sizeof(u32));
+    } else {
+      decode_generic_row(ctx, context, &t, row1, row2, row3, mx,
+                         words_per_row);
+    }
+    memcpy(&data[(size_t) y * words_per_row], row3,
+           words_per_row * sizeof(u32));
+  }
+  free(ring);
+}
+
+typedef void (*decode_kernel)(struct jbig2dec_ctx *restrict ctx,
+                              u32 *restrict data, int mx, int my);
+
+// indexed by template and TPGD
+static const decode_kernel decode_kernels[4][2] = {
+  {decode_image<0, false>, decode_image<0, true>},
+  {decode_image<1, false>, decode_image<1, true>},
+  {decode_image<2, false>, decode_image<2, true>},
+  {decode_image<3, false>, decode_image<3, true>},
+};
+
+// see comments in .h file
+void
+jbig2dec_init(struct jbig2dec_ctx *ctx, const u8 *data, size_t length) {
+  ctx->context = (u8 *) calloc(JBIG2_MAX_CTX, 1);
+  if (!ctx->context) abort();
+  ctx->data = data;
+  ctx->length = length;
+  ctx->bp = 0;
+  ctx->c = (decoder_byte(ctx, 0) ^ 0xff) << 16;
+  bytein(ctx);
+  ctx->c <<= 7;
+  ctx->ct -= 7;
+  ctx->a = 0x8000;
+}
+
+// see comments in .h file
+void
+jbig2dec_bitimage(struct jbig2dec_ctx *restrict ctx, u8 *restrict data,
+                  int mx, int my, bool duplicate_line_removal,
+                  int gbtemplate) {
+  if (gbtemplate < 0 || gbtemplate > 3) abort();
+  decode_kernels[gbtemplate][duplicate_line_removal](ctx, (u32 *) data, mx,
+                                                      my);
+}
+
+// see comments in .h file
+void
+jbig2dec_dealloc(struct jbig2dec_ctx *ctx) {
+  free(ctx->context);
+  ctx->context = NULL;
+}
@@ -26,6 +26,8 @@
 #include <sys/types.h>
 
 #define JBIG2_MAX_CTX 65536
+// context is cleared by _reset in blocks of 1 << JBIG2_CTX_BLOCK_BITS bytes
+#define JBIG2_CTX_BLOCK_BITS 10
 #define JBIG2_OUTPUTBUFFER_SIZE 20 * 1024
 
 #ifdef _MSC_VER
@@ -36,14 +38,42 @@
 //#define CODER_DEBUGGING
 //#define SYM_DEBUGGING
 //#define SYMBOL_COMPRESSION_DEBUGGING
+// count what the coder does (see jbig2enc_getstats); costs a little speed
+//#define JBIG2_CODER_STATS
+
+// -----------------------------------------------------------------------------
+// A sink receives the coded bytes as they are produced (see _setsink). Returns
+// 0 on success; after a failure it isn't called again.
+// -----------------------------------------------------------------------------
+typedef int (*jbig2enc_sink)(void *opaque, const uint8_t *data, size_t length);
+
+#ifdef JBIG2_CODER_STATS
+// -----------------------------------------------------------------------------
+// Counts of the work done by the arithmetic coder, to tell which pages are
+// bound by it and to check optimisations of it. Only built in with
+// JBIG2_CODER_STATS defined, which every file including this must agree on.
+// -----------------------------------------------------------------------------
+struct jbig2enc_stats {
+  uint64_t bits;  // decisions coded, including those of runs of zeros
+  uint64_t lps;  // of those, codings of the less probable symbol
+  uint64_t renorm_shifts;  // bits by which A and C were shifted by RENORME
+  uint64_t byteouts;  // calls of BYTEOUT
+  uint64_t stuffed;  // bytes of 0xff after which a bit was stuffed
+  uint64_t bytes;  // bytes output by the coder
+  uint64_t contexts;  // contexts whose state changed, summed over the images
+};
+#endif
 
 // -----------------------------------------------------------------------------
 // This is the context for the arithmetic encoder used in JBIG2. The coder is a
 // state machine and there are many different states used - one for coding
 // images, many more for coding numbers etc.
 //
-// When outputting data, the bytes are collected into chunks of size
-// JBIG2_OUTPUTBUFFER_SIZE. These are chained in a linked list.
+// When outputting data, the bytes are collected into a single buffer which
+// starts at JBIG2_OUTPUTBUFFER_SIZE bytes and doubles in size when it fills up.
+// Space for headers can be reserved at its start, so that the finished stream
+// can be handed over to the caller without copying it. If a sink is set, the
+// buffer doesn't grow: it is passed to the sink and emptied whenever it fills.
 // -----------------------------------------------------------------------------
 struct jbig2enc_ctx {
   // these are the current state of the arithmetic coder
@@ -52,16 +82,25 @@ struct jbig2enc_ctx {
   uint8_t ct, b;
   int bp;
 
-  // This is a list of output chunks, not including the current one
-  uint8_t **output_chunks;
-  size_t output_chunks_size;
-  size_t output_chunks_capacity;
-  uint8_t *outbuf;  // this is the current output chunk
-  int outbuf_used;  // number of bytes used in outbuf
-  uint8_t context[JBIG2_MAX_CTX];  // state machine context for encoding images
+  uint8_t *outbuf;  // the output buffer, NULL until the first byte
+  size_t outbuf_capacity;  // size of outbuf
+  size_t outbuf_used;  // number of bytes used in outbuf, including reserved ones
+  size_t outbuf_reserved;  // number of bytes at the start of outbuf not coded
+  jbig2enc_sink sink;  // if not NULL, where the output goes (see _setsink)
+  void *sink_opaque;  // first argument of sink
+  bool sink_error;  // true once sink has failed
+  uint64_t context_dirty;  // bit i is set if block i of context may be non-zero
+  bool intctx_dirty;  // true if intctx may be non-zero
+  uint8_t *context;  // state machine context for encoding images,
+                    // JBIG2_MAX_CTX bytes (see jbig2enc_use_hugepages)
+  bool context_huge;  // true if context is from the huge page tables
   uint8_t intctx[13][512];  // 512 bytes of context indexes for each of 13 different int decodings
-                            // this data is also used for refinement coding
+                            // this data is also used for refinement coding.
+                            // Coders using it must set intctx_dirty.
   uint8_t *iaidctx;  // size of this context not known at construction time
+#ifdef JBIG2_CODER_STATS
+  struct jbig2enc_stats stats;  // since _init (see _getstats)
+#endif
 };
 
 // these are the proc numbers for encoding different classes of integers
@@ -81,12 +120,40 @@ enum {
   JBIG2_IARI
 };
 
+// -----------------------------------------------------------------------------
+// Encode an integer with the integer arithmetic coding procedure proc (one of
+// the JBIG2_IA* values above) (Annex A.2)
+// -----------------------------------------------------------------------------
+void jbig2enc_int(struct jbig2enc_ctx *__restrict__ ctx, int proc, int value);
+
+// -----------------------------------------------------------------------------
+// Encode an OOB value (e.g. the end of a height class or of a strip) with the
+// integer arithmetic coding procedure proc
+// -----------------------------------------------------------------------------
+void jbig2enc_oob(struct jbig2enc_ctx *__restrict__ ctx, int proc);
+
+// -----------------------------------------------------------------------------
+// Encode a symbol ID as symcodelen bits (Annex A.3). The contexts for it are
+// allocated by the first call after _init or _reset, so symcodelen must be the
+// same for all the calls in between.
+// -----------------------------------------------------------------------------
+void jbig2enc_iaid(struct jbig2enc_ctx *__restrict__ ctx, int symcodelen,
+                   int value);
+
+// -----------------------------------------------------------------------------
+// Code the n decisions bits[0..n) (each 0 or 1) one by one, all in generic
+// region context ctxnum. This is the coder on its own, without any image, for
+// measuring it (see jbig2micro.cc). Call _final afterwards.
+// -----------------------------------------------------------------------------
+void jbig2enc_bits(struct jbig2enc_ctx *__restrict__ ctx, int ctxnum,
+                   const uint8_t *__restrict__ bits, size_t n);
+
 // -----------------------------------------------------------------------------
 // Returns the number of bytes of output in the given context
 //
 // Before doing this you should make sure that the coder is _flush()'ed
 // -----------------------------------------------------------------------------
-unsigned jbig2enc_datasize(const struct jbig2enc_ctx *ctx);
+size_t jbig2enc_datasize(const struct jbig2enc_ctx *ctx);
 
 // -----------------------------------------------------------------------------
 // Writes the output of the given context to a buffer. The buffer must be at
@@ -95,6 +162,48 @@ unsigned jbig2enc_datasize(const struct jbig2enc_ctx *ctx);
 void jbig2enc_tobuffer(const struct jbig2enc_ctx *__restrict__ ctx,
                        uint8_t *__restrict__ buffer);
 
+// -----------------------------------------------------------------------------
+// Leave the first size bytes of the output buffer free for the caller, e.g. for
+// the headers of the segment the coded data will be in. Must be called before
+// anything is coded into the context. These bytes are not included in _datasize
+// or _tobuffer.
+// -----------------------------------------------------------------------------
+void jbig2enc_reserve(struct jbig2enc_ctx *ctx, size_t size);
+
+// -----------------------------------------------------------------------------
+// Hand the output buffer over to the caller, who must free it. It holds the
+// reserved bytes (uninitialised) followed by the coded data, and has room for
+// extra more bytes after them. The context is reset (see _reset) and starts a
+// new buffer on its next output.
+//
+// Before doing this you should make sure that the coder is _flush()'ed
+// -----------------------------------------------------------------------------
+uint8_t *jbig2enc_takebuffer(struct jbig2enc_ctx *ctx, size_t extra);
+
+// -----------------------------------------------------------------------------
+// Send the output of the context to sink instead of collecting it all in
+// memory. Must be called before anything is coded into the context. The bytes
+// are passed to sink each time the output buffer (at least
+// JBIG2_OUTPUTBUFFER_SIZE bytes) fills up, and the rest when _flush is called.
+// _reset removes the sink.
+// -----------------------------------------------------------------------------
+void jbig2enc_setsink(struct jbig2enc_ctx *ctx, jbig2enc_sink sink,
+                      void *opaque);
+
+// -----------------------------------------------------------------------------
+// Pass any bytes still in the output buffer to the sink. Call this after
+// _final. Returns 0, or -1 if the sink has failed at any point.
+// -----------------------------------------------------------------------------
+int jbig2enc_flush(struct jbig2enc_ctx *ctx);
+
+// -----------------------------------------------------------------------------
+// Append length bytes to the output, as if they had been coded. This is for
+// the coders of other region types (see jbig2mmr.h), so that they can use the
+// same output buffer, reserved space and sink. Don't call _final for them.
+// -----------------------------------------------------------------------------
+void jbig2enc_putbytes(struct jbig2enc_ctx *ctx, const uint8_t *data,
+                       size_t length);
+
 // -----------------------------------------------------------------------------
 // This function takes almost the same arguments as _image, above. But in this
 // case the data pointer points to packed data.
@@ -102,18 +211,131 @@ void jbig2enc_tobuffer(const struct jbig2enc_ctx *__restrict__ ctx,
 // This is designed for Leptonica's 1bpp packed format images. Each row is some
 // number of 32-bit words.
 //
+// gbtemplate is the generic region template (0..3) with the AT pixels in their
+// nominal positions. Template 0 compresses best; templates 2 and 3 have only
+// 10-bit contexts and are cheaper to code.
+//
 // *The pad bits at the end of each line must be zero.*
 // -----------------------------------------------------------------------------
 void jbig2enc_bitimage(struct jbig2enc_ctx *__restrict__ ctx,
                        const uint8_t *__restrict__ data, int mx, int my,
-                       bool duplicate_line_removal);
+                       bool duplicate_line_removal, int gbtemplate);
+
+// Most images jbig2enc_bitimage_interleaved codes at once
+#define JBIG2_INTERLEAVE_MAX 4
+
+// -----------------------------------------------------------------------------
+// Code n (1..JBIG2_INTERLEAVE_MAX) images of the same width mx as generic
+// regions of their own: image k, of my[k] rows at data[k], into ctxs[k]. The
+// output of each is the same as from jbig2enc_bitimage, but the bits of the
+// images are coded in turn in a single loop, so that their codings overlap in
+// the CPU. That makes a single thread code several stripes of a page faster
+// than one after another. Call _final on each context afterwards.
+//
+// *The pad bits at the end of each line must be zero.*
+// -----------------------------------------------------------------------------
+void jbig2enc_bitimage_interleaved(struct jbig2enc_ctx *const *ctxs,
+                                   const uint8_t *const *data, int mx,
+                                   const int *my, int n,
+                                   bool duplicate_line_removal,
+                                   int gbtemplate);
 
+struct jbig2enc_rows;
+
+// A coding loop for one row, specialised for the template and TPGD
+typedef void (*jbig2enc_row_kernel)(struct jbig2enc_ctx *__restrict__ ctx,
+                                    struct jbig2enc_rows *__restrict__ rows);
+
+// -----------------------------------------------------------------------------
+// State for coding a 1bpp image one row at a time with jbig2enc_rows_*, so
+// that the image never has to be in memory as a whole. The last three rows are
+// kept in a ring buffer, each followed by a zero word, so that the coder needs
+// no checks for the borders of the image.
+// -----------------------------------------------------------------------------
+struct jbig2enc_rows {
+  int mx;  // width of the image
+  unsigned words_per_row;
+  jbig2enc_row_kernel encode_row;  // picked by _rows_init
+  int y;  // number of the next row
+  uint8_t ltp;  // TPGD state
+  uint32_t *ring;  // 3 rows of words_per_row words
+};
+
+// -----------------------------------------------------------------------------
+// Set up for coding a generic region of width mx row by row. Output is the
+// same as from jbig2enc_bitimage.
+// -----------------------------------------------------------------------------
+void jbig2enc_rows_init(struct jbig2enc_rows *rows, int mx,
+                        bool duplicate_line_removal, int gbtemplate);
+
+// -----------------------------------------------------------------------------
+// Returns where the next row must be stored before calling _rows_encode: the
+// words_per_row words of it, in Leptonica's 1bpp packed format. *The pad bits
+// at the end of the row must be zero.*
+// -----------------------------------------------------------------------------
+uint32_t *jbig2enc_rows_next(struct jbig2enc_rows *rows);
+
+// -----------------------------------------------------------------------------
+// Code the row stored at _rows_next into ctx
+// -----------------------------------------------------------------------------
+void jbig2enc_rows_encode(struct jbig2enc_ctx *__restrict__ ctx,
+                          struct jbig2enc_rows *__restrict__ rows);
+
+// -----------------------------------------------------------------------------
+// Take the row stored at _rows_next as the context of the rows after it
+// without coding it, e.g. to code only some bands of an image
+// -----------------------------------------------------------------------------
+void jbig2enc_rows_skip(struct jbig2enc_rows *rows);
+
+void jbig2enc_rows_dealloc(struct jbig2enc_rows *rows);
+
+// -----------------------------------------------------------------------------
+// Code an image of mx x my pixels as a generic refinement region (6.3) of the
+// reference image, which has the same size and is at no offset from it. Both
+// are in the packed format of jbig2enc_bitimage. grtemplate is 0 (13 pixels,
+// with the AT pixels in their nominal positions) or 1 (10 pixels, cheaper).
+// There is no TPGR. Call _final afterwards.
+//
+// *The pad bits at the end of each line must be zero.*
+// -----------------------------------------------------------------------------
+void jbig2enc_refine(struct jbig2enc_ctx *__restrict__ ctx,
+                     const uint8_t *__restrict__ data,
+                     const uint8_t *__restrict__ reference, int mx, int my,
+                     int grtemplate);
+
+#ifdef JBIG2_CODER_STATS
+// -----------------------------------------------------------------------------
+// Get the counts of everything coded with ctx since _init, including the image
+// being coded. The difference of two calls gives the counts of what was coded
+// in between.
+// -----------------------------------------------------------------------------
+void jbig2enc_getstats(const struct jbig2enc_ctx *ctx,
+                       struct jbig2enc_stats *stats);
+#endif
+
+// -----------------------------------------------------------------------------
+// Take the context tables (the JBIG2_MAX_CTX bytes of context) of the contexts
+// initialised from now on from memory backed by huge pages, or stop doing so.
+// The coder hits the table at random, so with 4 KiB pages it misses the TLB
+// often. The tables are carved out of 2 MiB mappings, which are kept for the
+// next contexts when theirs are deallocated. Returns false if huge pages
+// aren't supported here (only Linux has them), when nothing changes.
+// -----------------------------------------------------------------------------
+bool jbig2enc_use_hugepages(bool on);
 
 // -----------------------------------------------------------------------------
 // Init a new context
 // -----------------------------------------------------------------------------
 void jbig2enc_init(struct jbig2enc_ctx *ctx);
 
+// -----------------------------------------------------------------------------
+// Reset a context so that it can be used to encode another image. The output
+// buffer is kept for reuse and its contents are discarded. Only the parts of
+// the coding contexts which the last image changed are cleared, so this is
+// much cheaper than _dealloc and _init, especially for small images.
+// -----------------------------------------------------------------------------
+void jbig2enc_reset(struct jbig2enc_ctx *ctx);
+
 // -----------------------------------------------------------------------------
 // Destroy a context
 // -----------------------------------------------------------------------------
@@ -124,4 +346,38 @@ void jbig2enc_dealloc(struct jbig2enc_ctx *ctx);
 // -----------------------------------------------------------------------------
 void jbig2enc_final(struct jbig2enc_ctx *ctx);
 
+// -----------------------------------------------------------------------------
+// The arithmetic decoder (Annex E.3), for generic regions only. It shares the
+// state table with the encoder, and is for checking the output of the encoder
+// (see jbig2_decode_generic in jbig2enc.h) and for measuring it against it.
+// -----------------------------------------------------------------------------
+struct jbig2dec_ctx {
+  const uint8_t *data;  // the coded data; bytes past its end read as 0xff
+  size_t length;
+  size_t bp;  // position of the current byte, B
+  uint32_t c;
+  uint32_t a;
+  int ct;
+  uint8_t *context;  // JBIG2_MAX_CTX bytes of context states
+};
+
+// -----------------------------------------------------------------------------
+// Init a decoder for the length bytes of coded data at data (INITDEC), with
+// all the contexts in their initial state
+// -----------------------------------------------------------------------------
+void jbig2dec_init(struct jbig2dec_ctx *ctx, const uint8_t *data,
+                   size_t length);
+
+// -----------------------------------------------------------------------------
+// Decode a generic region of mx x my pixels (the inverse of jbig2enc_bitimage)
+// into data, in the same packed format, with the pad bits at the end of each
+// line cleared. gbtemplate and duplicate_line_removal must be those it was
+// coded with, and the AT pixels must be in their nominal positions.
+// -----------------------------------------------------------------------------
+void jbig2dec_bitimage(struct jbig2dec_ctx *__restrict__ ctx,
+                       uint8_t *__restrict__ data, int mx, int my,
+                       bool duplicate_line_removal, int gbtemplate);
+
+void jbig2dec_dealloc(struct jbig2dec_ctx *ctx);
+
 #endif  // EXPERIMENTAL_USERS_AGL_JBIG2ENC_JBIG2ENC_H__
@@ -0,0 +1,462 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// -----------------------------------------------------------------------------
+// jbig2bench: times the stages of the jbig2 pipeline on a corpus of pages, or
+// on synthetic bitmaps, so that changes to the decoders and the coder can be
+// measured. Build it with c-bench.sh.
+//
+// The stages are those of encode_page in jbig2.cc, which they have to be kept
+// in sync with.
+// -----------------------------------------------------------------------------
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#if !defined(WIN32)
+#include <sys/resource.h>
+#include <sys/time.h>
+#endif
+
+#include <allheaders.h>
+#include <pix.h>
+
+#include "jbig2arith.h"
+#include "jbig2enc.h"
+#include "jbig2synth.h"
+
+static void
+usage(const char *argv0) {
+  fprintf(stderr, "Usage: %s [options] <files or directories...>\n", argv0);
+  fprintf(stderr, "       %s [options] --synthetic <kind>:<width>x<height>...\n",
+          argv0);
+  fprintf(stderr, "Runs the jbig2 pipeline on each page and reports the time "
+                  "of each stage.\n");
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr, "  -n <count>: run each page this many times (def: 5)\n");
+  fprintf(stderr, "  -d -g <template> --mmr -p -T <bw threshold> -2 -4: as for jbig2\n");
+  fprintf(stderr, "  -g all: run the pages with each of the generic region templates\n"
+                  "     and compare their speed and sizes\n");
+  fprintf(stderr, "  --hugepages: as for jbig2\n");
+  fprintf(stderr, "  --synthetic: the arguments are bitmaps to generate; kind is\n"
+                  "     blank, text, halftone or random\n");
+}
+
+// -----------------------------------------------------------------------------
+// The stages timed
+// -----------------------------------------------------------------------------
+enum {
+  STAGE_READ = 0,  // file into memory
+  STAGE_DECODE,  // pixReadMem
+  STAGE_THRESHOLD,  // pixConvertTo1Transfer: thresholding or upscaling to 1 bpp
+  STAGE_ENCODE,  // generic region coding
+  STAGE_SERIALIZE,  // the segment headers and the output of the stream
+  NSTAGES
+};
+
+static const char *const stage_names[NSTAGES] = {
+  "read", "decode", "thresh", "encode", "serial",
+};
+
+struct bench_options {
+  int repeat;
+  bool duplicate_line_removal;
+  int gbtemplate;
+  bool mmr;
+  bool pdfmode;
+  int bw_threshold;
+  bool up2, up4;
+  FILE *out;  // where the streams are written, or NULL
+};
+
+// -----------------------------------------------------------------------------
+// Returns a monotonic time in seconds
+// -----------------------------------------------------------------------------
+static double
+now() {
+#if defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+#else
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+#endif
+}
+
+// -----------------------------------------------------------------------------
+// Returns the peak resident set size of the process in KiB, or 0 if unknown
+// -----------------------------------------------------------------------------
+static long
+peak_rss_kib() {
+#if defined(WIN32)
+  return 0;
+#else
+  struct rusage ru;
+  if (getrusage(RUSAGE_SELF, &ru) < 0) return 0;
+#if defined(__APPLE__)
+  return ru.ru_maxrss / 1024;  // bytes there
+#else
+  return ru.ru_maxrss;
+#endif
+#endif
+}
+
+// -----------------------------------------------------------------------------
+// The totals for one page, or for all of them
+// -----------------------------------------------------------------------------
+struct result {
+  double seconds[NSTAGES];  // summed over all runs
+  double pixels;  // of the 1 bpp image, summed over all runs
+  long bytes;  // of the output of one run
+  int runs;
+};
+
+static void
+print_result(const char *name, const struct result *r) {
+  double total = 0;
+  printf("%-32s", name);
+  for (int s = 0; s < NSTAGES; ++s) {
+    printf(" %7.2f", r->seconds[s] * 1e3 / r->runs);
+    total += r->seconds[s];
+  }
+  printf(" %8.2f %8.1f %9ld\n", total * 1e3 / r->runs,
+         total > 0 ? r->pixels / total * 1e-6 : 0.0, r->bytes);
+}
+
+static void
+print_header() {
+  printf("%-32s", "page (times in ms per run)");
+  for (int s = 0; s < NSTAGES; ++s) printf(" %7s", stage_names[s]);
+  printf(" %8s %8s %9s\n", "total", "Mpix/s", "bytes");
+}
+
+// -----------------------------------------------------------------------------
+// Read the whole of filename into a malloced buffer. Returns NULL on error.
+// -----------------------------------------------------------------------------
+static uint8_t *
+read_file(const char *filename, size_t *size) {
+  FILE *fp = fopen(filename, "rb");
+  if (!fp) return NULL;
+  size_t capacity = 1 << 16;
+  uint8_t *data = (uint8_t *) malloc(capacity);
+  if (!data) abort();
+  *size = 0;
+  size_t got;
+  while ((got = fread(data + *size, 1, capacity - *size, fp)) > 0) {
+    *size += got;
+    if (*size == capacity) {
+      capacity *= 2;
+      data = (uint8_t *) realloc(data, capacity);
+      if (!data) abort();
+    }
+  }
+  fclose(fp);
+  return data;
+}
+
+// -----------------------------------------------------------------------------
+// Encode bw as a full page and add its time and size to r
+// -----------------------------------------------------------------------------
+static void
+time_encode(const struct bench_options *opts, struct jbig2enc_ctx *ctx,
+            PIX *bw, struct result *r) {
+  double t = now();
+  size_t length;
+  uint8_t *data = jbig2_encode_generic_ctx(ctx, bw, !opts->pdfmode, 0, 0,
+                                           opts->duplicate_line_removal,
+                                           opts->gbtemplate, opts->mmr,
+                                           &length);
+  r->seconds[STAGE_ENCODE] += now() - t;
+  if (!data) abort();
+
+  // The headers are written by the coder into the same buffer, so all that is
+  // left is what jbig2 does next: write the stream out.
+  t = now();
+  if (opts->out) fwrite(data, 1, length, opts->out);
+  free(data);
+  r->seconds[STAGE_SERIALIZE] += now() - t;
+  r->bytes = length;
+  r->pixels += (double) bw->w * bw->h;
+  r->runs++;
+}
+
+// -----------------------------------------------------------------------------
+// Run the whole pipeline on filename opts->repeat times. Returns 0 on success.
+// -----------------------------------------------------------------------------
+static int
+bench_file(const struct bench_options *opts, struct jbig2enc_ctx *ctx,
+           const char *filename, struct result *r) {
+  memset(r, 0, sizeof(*r));
+  for (int run = 0; run < opts->repeat; ++run) {
+    double t = now();
+    size_t size;
+    uint8_t *input = read_file(filename, &size);
+    if (!input) {
+      fprintf(stderr, "Unable to read \"%s\"\n", filename);
+      return 1;
+    }
+    r->seconds[STAGE_READ] += now() - t;
+
+    t = now();
+    PIX *source = pixReadMem(input, size);
+    r->seconds[STAGE_DECODE] += now() - t;
+    free(input);
+    if (!source) {
+      fprintf(stderr, "Unable to decode \"%s\"\n", filename);
+      return 1;
+    }
+
+    t = now();
+    PIX *bw = pixConvertTo1Transfer(&source, opts->bw_threshold,
+                                    opts->up2 ? 2 : opts->up4 ? 4 : 1);
+    r->seconds[STAGE_THRESHOLD] += now() - t;
+    if (!bw) {
+      fprintf(stderr, "Unable to convert \"%s\" to 1 bpp\n", filename);
+      return 1;
+    }
+
+    time_encode(opts, ctx, bw, r);
+    pixDestroy(&bw);
+  }
+  return 0;
+}
+
+// -----------------------------------------------------------------------------
+// Encode the synthetic page described by spec ("<kind>:<w>x<h>")
+// opts->repeat times. Returns 0 on success.
+// -----------------------------------------------------------------------------
+static int
+bench_synthetic(const struct bench_options *opts, struct jbig2enc_ctx *ctx,
+                const char *spec, struct result *r) {
+  memset(r, 0, sizeof(*r));
+  char kind[32];
+  int w, h;
+  if (sscanf(spec, "%31[a-z]:%dx%d", kind, &w, &h) != 3 || w <= 0 || h <= 0) {
+    fprintf(stderr, "Bad synthetic page: \"%s\"\n", spec);
+    return 1;
+  }
+  PIX *bw = jbig2_make_synthetic(kind, w, h);
+  if (!bw) {
+    fprintf(stderr, "Unknown synthetic page kind: \"%s\"\n", kind);
+    return 1;
+  }
+  for (int run = 0; run < opts->repeat; ++run) time_encode(opts, ctx, bw, r);
+  pixDestroy(&bw);
+  return 0;
+}
+
+// -----------------------------------------------------------------------------
+// Run every page and print its result, adding them up in total. Returns the
+// number of pages which failed.
+// -----------------------------------------------------------------------------
+static int
+bench_pages(const struct bench_options *opts, struct jbig2enc_ctx *ctx,
+            bool synthetic, char *const *names, int n, struct result *total) {
+  memset(total, 0, sizeof(*total));
+  int failed = 0;
+
+  print_header();
+  for (int k = 0; k < n; ++k) {
+    struct result r;
+    const int ret = synthetic ? bench_synthetic(opts, ctx, names[k], &r)
+                              : bench_file(opts, ctx, names[k], &r);
+    if (ret) {
+      failed++;
+    } else {
+      print_result(names[k], &r);
+      for (int s = 0; s < NSTAGES; ++s) total->seconds[s] += r.seconds[s];
+      total->pixels += r.pixels;
+      total->bytes += r.bytes;
+      total->runs += r.runs;
+    }
+  }
+
+  if (total->runs) {
+    // per run of the whole corpus
+    const int runs = total->runs;
+    total->runs = opts->repeat;
+    print_result("total", total);
+    total->runs = runs;
+  }
+  return failed;
+}
+
+static int
+compare_names(const void *a, const void *b) {
+  return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+// -----------------------------------------------------------------------------
+// Append path to *names, or if it is a directory, the files in it, sorted by
+// name
+// -----------------------------------------------------------------------------
+static void
+add_input(char *name, char ***names, int *n, int *capacity) {
+  if (*n == *capacity) {
+    *capacity = *capacity ? *capacity * 2 : 16;
+    *names = (char **) realloc(*names, sizeof(char *) * *capacity);
+    if (!*names) abort();
+  }
+  (*names)[(*n)++] = name;
+}
+
+static void
+add_inputs(const char *path, char ***names, int *n, int *capacity) {
+  struct stat st;
+  DIR *dir = NULL;
+  if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) dir = opendir(path);
+  if (!dir) {
+    char *name = strdup(path);
+    if (!name) abort();
+    add_input(name, names, n, capacity);
+    return;
+  }
+
+  const int first = *n;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] == '.') continue;
+    char *name = (char *) malloc(strlen(path) + strlen(entry->d_name) + 2);
+    if (!name) abort();
+    sprintf(name, "%s/%s", path, entry->d_name);
+    add_input(name, names, n, capacity);
+  }
+  closedir(dir);
+  qsort(*names + first, *n - first, sizeof(char *), compare_names);
+}
+
+int
+main(int argc, char **argv) {
+  struct bench_options opts;
+  opts.repeat = 5;
+  opts.duplicate_line_removal = false;
+  opts.gbtemplate = 0;
+  opts.mmr = false;
+  opts.pdfmode = false;
+  opts.bw_threshold = 188;
+  opts.up2 = opts.up4 = false;
+  bool synthetic = false;
+  bool all_templates = false;
+  bool hugepages = false;
+  int i;
+
+  for (i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+      usage(argv[0]);
+      return 0;
+    } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      opts.repeat = atoi(argv[++i]);
+      if (opts.repeat < 1) {
+        fprintf(stderr, "Invalid repeat count: %s\n", argv[i]);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "-T") == 0 && i + 1 < argc) {
+      opts.bw_threshold = atoi(argv[++i]);
+      if (opts.bw_threshold < 0 || opts.bw_threshold > 255) {
+        fprintf(stderr, "Invalid bw threshold: (0..255)\n");
+        return 11;
+      }
+    } else if (strcmp(argv[i], "-d") == 0) {
+      opts.duplicate_line_removal = true;
+    } else if (strcmp(argv[i], "-g") == 0 && i + 1 < argc) {
+      ++i;
+      if (strcmp(argv[i], "all") == 0) {
+        all_templates = true;
+      } else {
+        opts.gbtemplate = atoi(argv[i]);
+        if (opts.gbtemplate < 0 || opts.gbtemplate > 3 || argv[i][1]) {
+          fprintf(stderr, "Invalid generic region template: %s\n", argv[i]);
+          return 1;
+        }
+      }
+    } else if (strcmp(argv[i], "--mmr") == 0) {
+      opts.mmr = true;
+    } else if (strcmp(argv[i], "-p") == 0) {
+      opts.pdfmode = true;
+    } else if (strcmp(argv[i], "-2") == 0) {
+      opts.up2 = true;
+    } else if (strcmp(argv[i], "-4") == 0) {
+      opts.up4 = true;
+    } else if (strcmp(argv[i], "--hugepages") == 0) {
+      hugepages = true;
+    } else if (strcmp(argv[i], "--synthetic") == 0) {
+      synthetic = true;
+    } else {
+      break;
+    }
+  }
+  if (i == argc) {
+    usage(argv[0]);
+    return 4;
+  }
+  if (opts.up2 && opts.up4) {
+    fprintf(stderr, "Can't have both -2 and -4!\n");
+    return 6;
+  }
+
+  char **names = NULL;
+  int n = 0, capacity = 0;
+  for (; i < argc; ++i) add_inputs(argv[i], &names, &n, &capacity);
+  opts.out = fopen("/dev/null", "wb");
+
+  // As jbig2 does
+  setPixDataCache(256 << 20);
+  if (hugepages &&
+      (setPixDataHugePages(1) || !jbig2enc_use_hugepages(true))) {
+    fprintf(stderr, "--hugepages is not supported here\n");
+    return 1;
+  }
+
+  struct jbig2enc_ctx ctx;
+  jbig2enc_init(&ctx);
+  int failed = 0;
+
+  if (all_templates) {
+    // The trade-off of each template against template 0: encode time and
+    // size of the whole corpus
+    struct result totals[4];
+    for (int t = 0; t < 4; ++t) {
+      opts.gbtemplate = t;
+      printf("template %d\n", t);
+      failed = bench_pages(&opts, &ctx, synthetic, names, n, &totals[t]);
+      printf("\n");
+    }
+    printf("%-10s %10s %8s %10s %8s\n", "template", "encode ms", "speed",
+           "bytes", "size");
+    for (int t = 0; t < 4; ++t) {
+      const double ms = totals[t].seconds[STAGE_ENCODE] * 1e3 / opts.repeat;
+      const double ms0 = totals[0].seconds[STAGE_ENCODE] * 1e3 / opts.repeat;
+      printf("%-10d %10.2f %7.2fx %10ld %7.2f%%\n", t, ms,
+             ms > 0 ? ms0 / ms : 0.0, totals[t].bytes,
+             totals[0].bytes ? 100.0 * totals[t].bytes / totals[0].bytes : 0.0);
+    }
+  } else {
+    struct result total;
+    failed = bench_pages(&opts, &ctx, synthetic, names, n, &total);
+  }
+
+  for (int k = 0; k < n; ++k) free(names[k]);
+  free(names);
+  jbig2enc_dealloc(&ctx);
+  if (opts.out) fclose(opts.out);
+
+  printf("pages: %d ok, %d failed; runs per page: %d; peak RSS: %ld KiB\n",
+         n - failed, failed, opts.repeat, peak_rss_kib());
+  return failed ? 1 : 0;
+}
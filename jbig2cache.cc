@@ -0,0 +1,424 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "jbig2cache.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <allheaders.h>
+#include <pix.h>
+
+#if defined(WIN32)
+#define JBIG2_NO_THREADS 1
+#define WINBINARY O_BINARY
+#else
+#include <pthread.h>
+#define WINBINARY 0
+#endif
+
+#if JBIG2_NO_THREADS
+#define CACHE_LOCK(c)
+#define CACHE_UNLOCK(c)
+#else
+#define CACHE_LOCK(c) pthread_mutex_lock(&(c)->mutex)
+#define CACHE_UNLOCK(c) pthread_mutex_unlock(&(c)->mutex)
+#endif
+
+#define u64 uint64_t
+#define u32 uint32_t
+#define u8  uint8_t
+
+// -----------------------------------------------------------------------------
+// XXH64, which hashes several GB/s, so that looking a page up costs little
+// next to encoding it. The input is read as little endian words; images are
+// hashed as the words of the host, so keys aren't portable between hosts of
+// different byte orders.
+// -----------------------------------------------------------------------------
+static const u64 PRIME64_1 = 0x9e3779b185ebca87ULL;
+static const u64 PRIME64_2 = 0xc2b2ae3d27d4eb4fULL;
+static const u64 PRIME64_3 = 0x165667b19e3779f9ULL;
+static const u64 PRIME64_4 = 0x85ebca77c2b2ae63ULL;
+static const u64 PRIME64_5 = 0x27d4eb2f165667c5ULL;
+
+static inline u64
+rotl64(u64 x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline u64
+read64(const u8 *p) {
+  u64 v = 0;
+  for (int i = 7; i >= 0; --i) v = (v << 8) | p[i];
+  return v;
+}
+
+static inline u64
+read32(const u8 *p) {
+  return (u64) p[0] | (u64) p[1] << 8 | (u64) p[2] << 16 | (u64) p[3] << 24;
+}
+
+static inline u64
+xxh64_round(u64 acc, u64 input) {
+  acc += input * PRIME64_2;
+  acc = rotl64(acc, 31);
+  return acc * PRIME64_1;
+}
+
+static inline u64
+xxh64_merge(u64 acc, u64 val) {
+  acc ^= xxh64_round(0, val);
+  return acc * PRIME64_1 + PRIME64_4;
+}
+
+static u64
+xxh64(const void *data, size_t len, u64 seed) {
+  const u8 *p = (const u8 *) data;
+  const u8 *const end = p + len;
+  u64 h;
+  if (len >= 32) {
+    u64 v1 = seed + PRIME64_1 + PRIME64_2;
+    u64 v2 = seed + PRIME64_2;
+    u64 v3 = seed;
+    u64 v4 = seed - PRIME64_1;
+    for (; p + 32 <= end; p += 32) {
+      v1 = xxh64_round(v1, read64(p));
+      v2 = xxh64_round(v2, read64(p + 8));
+      v3 = xxh64_round(v3, read64(p + 16));
+      v4 = xxh64_round(v4, read64(p + 24));
+    }
+    h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+    h = xxh64_merge(h, v1);
+    h = xxh64_merge(h, v2);
+    h = xxh64_merge(h, v3);
+    h = xxh64_merge(h, v4);
+  } else {
+    h = seed + PRIME64_5;
+  }
+  h += len;
+
+  for (; p + 8 <= end; p += 8) {
+    h ^= xxh64_round(0, read64(p));
+    h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+  }
+  if (p + 4 <= end) {
+    h ^= read32(p) * PRIME64_1;
+    h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+    p += 4;
+  }
+  for (; p < end; ++p) {
+    h ^= *p * PRIME64_5;
+    h = rotl64(h, 11) * PRIME64_1;
+  }
+
+  h ^= h >> 33;
+  h *= PRIME64_2;
+  h ^= h >> 29;
+  h *= PRIME64_3;
+  h ^= h >> 32;
+  return h;
+}
+
+// see comments in .h file
+void
+jbig2_cache_key(struct Pix *bw, const void *params, size_t params_size,
+                struct jbig2_cache_key *key) {
+  pixSetPadBits(bw, 0);
+  const u32 dims[3] = {bw->w, bw->h, bw->d};
+  for (int i = 0; i < 2; ++i) {
+    u64 seed = xxh64(params, params_size, i);
+    seed = xxh64(dims, sizeof(dims), seed);
+    key->hash[i] = xxh64(bw->data, (size_t) bw->h * bw->wpl * 4, seed);
+  }
+}
+
+// see comments in .h file
+void
+jbig2_cache_hash(const void *data, size_t length,
+                 struct jbig2_cache_key *key) {
+  for (int i = 0; i < 2; ++i) key->hash[i] = xxh64(data, length, i);
+}
+
+// -----------------------------------------------------------------------------
+// A stream held in memory: in a chain of its hash bucket, and in the list of
+// all entries from the most to the least recently used
+// -----------------------------------------------------------------------------
+struct entry {
+  struct jbig2_cache_key key;
+  u8 *data;
+  size_t length;
+  struct entry *chain;
+  struct entry *prev, *next;
+};
+
+struct jbig2_cache {
+  size_t max_bytes;
+  char *dir;  // or NULL
+
+#if !JBIG2_NO_THREADS
+  pthread_mutex_t mutex;
+#endif
+  // everything below is protected by mutex
+  size_t used;  // bytes of the entries, with their data
+  struct entry **buckets;
+  int nbuckets;  // a power of two
+  int nentries;
+  struct entry *head, *tail;  // most and least recently used
+  unsigned tmpcount;  // for the names of temporary files
+};
+
+// see comments in .h file
+struct jbig2_cache *
+jbig2_cache_new(size_t max_bytes, const char *dir) {
+  struct jbig2_cache *const cache =
+      (struct jbig2_cache *) calloc(1, sizeof(*cache));
+  if (!cache) abort();
+  cache->max_bytes = max_bytes;
+  cache->dir = dir ? strdup(dir) : NULL;
+#if !JBIG2_NO_THREADS
+  pthread_mutex_init(&cache->mutex, NULL);
+#endif
+  cache->nbuckets = 256;
+  cache->buckets = (struct entry **) calloc(cache->nbuckets,
+                                            sizeof(struct entry *));
+  if (!cache->buckets) abort();
+  return cache;
+}
+
+// see comments in .h file
+void
+jbig2_cache_free(struct jbig2_cache *cache) {
+  if (!cache) return;
+  for (struct entry *e = cache->head, *next; e; e = next) {
+    next = e->next;
+    free(e->data);
+    free(e);
+  }
+#if !JBIG2_NO_THREADS
+  pthread_mutex_destroy(&cache->mutex);
+#endif
+  free(cache->buckets);
+  free(cache->dir);
+  free(cache);
+}
+
+static inline bool
+same_key(const struct jbig2_cache_key *a, const struct jbig2_cache_key *b) {
+  return a->hash[0] == b->hash[0] && a->hash[1] == b->hash[1];
+}
+
+static struct entry **
+bucket(struct jbig2_cache *cache, const struct jbig2_cache_key *key) {
+  return &cache->buckets[key->hash[0] & (cache->nbuckets - 1)];
+}
+
+// -----------------------------------------------------------------------------
+// Take e out of the list of recently used entries, or put it at its head
+// -----------------------------------------------------------------------------
+static void
+unlink_entry(struct jbig2_cache *cache, struct entry *e) {
+  if (e->prev) e->prev->next = e->next; else cache->head = e->next;
+  if (e->next) e->next->prev = e->prev; else cache->tail = e->prev;
+}
+
+static void
+push_entry(struct jbig2_cache *cache, struct entry *e) {
+  e->prev = NULL;
+  e->next = cache->head;
+  if (cache->head) cache->head->prev = e; else cache->tail = e;
+  cache->head = e;
+}
+
+// -----------------------------------------------------------------------------
+// Find key in memory and make it the most recently used. Called with the lock
+// held.
+// -----------------------------------------------------------------------------
+static struct entry *
+find_entry(struct jbig2_cache *cache, const struct jbig2_cache_key *key) {
+  for (struct entry *e = *bucket(cache, key); e; e = e->chain) {
+    if (same_key(&e->key, key)) {
+      unlink_entry(cache, e);
+      push_entry(cache, e);
+      return e;
+    }
+  }
+  return NULL;
+}
+
+static void
+drop_entry(struct jbig2_cache *cache, struct entry *e) {
+  struct entry **p = bucket(cache, &e->key);
+  while (*p != e) p = &(*p)->chain;
+  *p = e->chain;
+  unlink_entry(cache, e);
+  cache->used -= sizeof(struct entry) + e->length;
+  cache->nentries--;
+  free(e->data);
+  free(e);
+}
+
+// -----------------------------------------------------------------------------
+// Keep a copy of data in memory, dropping the least recently used entries to
+// make room. Called with the lock held.
+// -----------------------------------------------------------------------------
+static void
+add_entry(struct jbig2_cache *cache, const struct jbig2_cache_key *key,
+          const u8 *data, size_t length) {
+  const size_t size = sizeof(struct entry) + length;
+  if (size > cache->max_bytes || find_entry(cache, key)) return;
+  while (cache->used + size > cache->max_bytes) {
+    drop_entry(cache, cache->tail);
+  }
+
+  if (cache->nentries >= cache->nbuckets) {
+    // Rehash into twice as many buckets.
+    const int nbuckets = cache->nbuckets * 2;
+    struct entry **const buckets =
+        (struct entry **) calloc(nbuckets, sizeof(struct entry *));
+    if (!buckets) abort();
+    for (struct entry *e = cache->head; e; e = e->next) {
+      struct entry **const b = &buckets[e->key.hash[0] & (nbuckets - 1)];
+      e->chain = *b;
+      *b = e;
+    }
+    free(cache->buckets);
+    cache->buckets = buckets;
+    cache->nbuckets = nbuckets;
+  }
+
+  struct entry *const e = (struct entry *) malloc(sizeof(struct entry));
+  if (!e) abort();
+  e->key = *key;
+  e->data = (u8 *) malloc(length ? length : 1);
+  if (!e->data) abort();
+  memcpy(e->data, data, length);
+  e->length = length;
+  struct entry **const b = bucket(cache, key);
+  e->chain = *b;
+  *b = e;
+  push_entry(cache, e);
+  cache->used += size;
+  cache->nentries++;
+}
+
+// -----------------------------------------------------------------------------
+// The file of key in the directory; the caller must free the name
+// -----------------------------------------------------------------------------
+static char *
+entry_filename(const struct jbig2_cache *cache,
+               const struct jbig2_cache_key *key) {
+  char *filename = (char *) malloc(strlen(cache->dir) + 40);
+  if (!filename) abort();
+  sprintf(filename, "%s/%016llx%016llx.jb2", cache->dir,
+          (unsigned long long) key->hash[0],
+          (unsigned long long) key->hash[1]);
+  return filename;
+}
+
+static u8 *
+read_entry(const struct jbig2_cache *cache, const struct jbig2_cache_key *key,
+           size_t *length) {
+  char *const filename = entry_filename(cache, key);
+  const int fd = open(filename, O_RDONLY | WINBINARY);
+  free(filename);
+  if (fd < 0) return NULL;
+
+  u8 *data = NULL;
+  struct stat st;
+  if (fstat(fd, &st) == 0 && st.st_size > 0 &&
+      (unsigned long long) st.st_size <= (size_t) -1) {
+    data = (u8 *) malloc(st.st_size);
+    if (!data) abort();
+    ssize_t got = 0;
+    while (got < st.st_size) {
+      const ssize_t n = read(fd, data + got, st.st_size - got);
+      if (n <= 0) break;
+      got += n;
+    }
+    if (got == st.st_size) {
+      *length = got;
+    } else {
+      free(data);
+      data = NULL;
+    }
+  }
+  close(fd);
+  return data;
+}
+
+static void
+write_entry(struct jbig2_cache *cache, const struct jbig2_cache_key *key,
+            const u8 *data, size_t length) {
+  char *const filename = entry_filename(cache, key);
+  char *const tmpname = (char *) malloc(strlen(filename) + 32);
+  if (!tmpname) abort();
+  CACHE_LOCK(cache);
+  const unsigned count = cache->tmpcount++;
+  CACHE_UNLOCK(cache);
+  sprintf(tmpname, "%s.%d.%u.tmp", filename, (int) getpid(), count);
+
+  const int fd = open(tmpname, O_WRONLY | O_CREAT | O_EXCL | WINBINARY, 0644);
+  if (fd >= 0) {
+    size_t done = 0;
+    while (done < length) {
+      const ssize_t n = write(fd, data + done, length - done);
+      if (n <= 0) break;
+      done += n;
+    }
+    if (close(fd) < 0 || done < length || rename(tmpname, filename) < 0) {
+      unlink(tmpname);
+    }
+  }
+  free(tmpname);
+  free(filename);
+}
+
+// see comments in .h file
+u8 *
+jbig2_cache_get(struct jbig2_cache *cache, const struct jbig2_cache_key *key,
+                size_t *length) {
+  CACHE_LOCK(cache);
+  const struct entry *const e = find_entry(cache, key);
+  if (e) {
+    u8 *const ret = (u8 *) malloc(e->length ? e->length : 1);
+    if (!ret) abort();
+    memcpy(ret, e->data, e->length);
+    *length = e->length;
+    CACHE_UNLOCK(cache);
+    return ret;
+  }
+  CACHE_UNLOCK(cache);
+
+  if (!cache->dir) return NULL;
+  u8 *const ret = read_entry(cache, key, length);
+  if (ret) {
+    CACHE_LOCK(cache);
+    add_entry(cache, key, ret, *length);
+    CACHE_UNLOCK(cache);
+  }
+  return ret;
+}
+
+// see comments in .h file
+void
+jbig2_cache_put(struct jbig2_cache *cache, const struct jbig2_cache_key *key,
+                const u8 *data, size_t length) {
+  CACHE_LOCK(cache);
+  add_entry(cache, key, data, length);
+  CACHE_UNLOCK(cache);
+  if (cache->dir) write_entry(cache, key, data, length);
+}
@@ -0,0 +1,86 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef JBIG2ENC_JBIG2CACHE_H__
+#define JBIG2ENC_JBIG2CACHE_H__
+
+#include <stddef.h>
+#if defined(sun)
+#include <sys/types.h>
+#else
+#include <stdint.h>
+#endif
+
+struct Pix;
+
+// -----------------------------------------------------------------------------
+// A content-addressed cache of encoded pages: the key is a 128-bit hash of the
+// thresholded 1 bpp image and of everything else which goes into its stream
+// (options, resolution), and the value is the stream. Repeated pages (blank
+// sheets, forms, the same page in several documents) are then only encoded
+// once.
+//
+// Entries are kept in memory, the least recently used being dropped beyond a
+// given number of bytes, and/or in a directory, as one file per entry named
+// after the key. The directory can be shared by any number of processes:
+// files are written under a temporary name and renamed into place.
+//
+// All the functions can be called from several threads at once.
+// -----------------------------------------------------------------------------
+struct jbig2_cache;
+
+struct jbig2_cache_key {
+  uint64_t hash[2];
+};
+
+// -----------------------------------------------------------------------------
+// Create a cache holding up to max_bytes of streams in memory (0 for none)
+// and, if dir is not NULL, in the existing directory dir
+// -----------------------------------------------------------------------------
+struct jbig2_cache *jbig2_cache_new(size_t max_bytes, const char *dir);
+
+void jbig2_cache_free(struct jbig2_cache *cache);
+
+// -----------------------------------------------------------------------------
+// Compute the key of a 1 bpp image, to be encoded with the settings held in
+// the params_size bytes at params (which must not contain uninitialised
+// padding). This sets the pad bits of bw to zero, as the encoder does.
+// -----------------------------------------------------------------------------
+void jbig2_cache_key(struct Pix *bw, const void *params, size_t params_size,
+                     struct jbig2_cache_key *key);
+
+// -----------------------------------------------------------------------------
+// Hash length bytes at data into key, as for the images: to check that a file
+// is still what it was (see --journal in jbig2.cc). Unlike image keys, these
+// are the same on every host.
+// -----------------------------------------------------------------------------
+void jbig2_cache_hash(const void *data, size_t length,
+                      struct jbig2_cache_key *key);
+
+// -----------------------------------------------------------------------------
+// Look key up, in memory and then in the directory. Returns NULL if it isn't
+// there.
+//
+// WARNING: returns a malloced buffer which the caller must free
+// -----------------------------------------------------------------------------
+uint8_t *jbig2_cache_get(struct jbig2_cache *cache,
+                         const struct jbig2_cache_key *key, size_t *length);
+
+// -----------------------------------------------------------------------------
+// Store the stream of length bytes at data under key (in memory and in the
+// directory). Failing to write to the directory isn't an error.
+// -----------------------------------------------------------------------------
+void jbig2_cache_put(struct jbig2_cache *cache,
+                     const struct jbig2_cache_key *key, const uint8_t *data,
+                     size_t length);
+
+#endif  // JBIG2ENC_JBIG2CACHE_H__
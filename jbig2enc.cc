@@ -15,8 +15,13 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#if !defined(WIN32)
+#include <sys/time.h>
+#endif
 
 #include <allheaders.h>
 #include <pix.h>
@@ -34,8 +39,12 @@
 #define u8  uint8_t
 
 #include "jbig2arith.h"
+#include "jbig2enc.h"
+#include "jbig2mmr.h"
+#include "jbig2pool.h"
 #include "jbig2structs.h"
 #include "jbig2segments.h"
+#include "jbig2sym.h"
 
 #ifdef __MINGW32__
 unsigned short my_htons(unsigned short x) {
@@ -49,94 +58,967 @@ unsigned long my_htonl(unsigned long x) {
 
 #define SEGMENT(x) x.write(ret + offset); offset += x.size();
 
+// -----------------------------------------------------------------------------
+// Returns a monotonic time in seconds, for the coders with a deadline
+// -----------------------------------------------------------------------------
+static double
+seconds() {
+#if defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+#else
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+#endif
+}
+
+// -----------------------------------------------------------------------------
+// The length field of a segment header is 32 bits, and 0xffffffff in it means
+// that the length is unknown (see jbig2_encode_generic_sink), so this is the
+// most data a segment of known length can have.
+// -----------------------------------------------------------------------------
+#define MAX_SEGMENT_DATA 0xfffffffeu
+
+// -----------------------------------------------------------------------------
+// The number of bytes of a generic region segment header: templates 1..3 have
+// a single AT pixel, so only the first two of the a* bytes are written, and
+// MMR regions have none.
+// -----------------------------------------------------------------------------
+static int
+generic_region_size(const int gbtemplate, const bool mmr) {
+  return sizeof(struct jbig2_generic_region) - (mmr ? 8 : gbtemplate ? 6 : 0);
+}
+
+// -----------------------------------------------------------------------------
+// Code a generic region of w x h pixels at data into ctx, with MMR or with the
+// arithmetic coder
+// -----------------------------------------------------------------------------
+static void
+encode_region(struct jbig2enc_ctx *ctx, const u32 *data, const int w,
+              const int h, const bool duplicate_line_removal,
+              const int gbtemplate, const bool mmr) {
+  if (mmr) {
+    jbig2enc_mmrimage(ctx, (const u8 *) data, w, h);
+  } else {
+    jbig2enc_bitimage(ctx, (const u8 *) data, w, h, duplicate_line_removal,
+                      gbtemplate);
+    jbig2enc_final(ctx);
+  }
+}
+
+// -----------------------------------------------------------------------------
+// The smallest rectangle holding all the black pixels of an image, and the
+// pixels in it as an image of their own. Only this rectangle is coded as the
+// generic region: the rest of the page is left to the default pixel value of
+// the page, white, so that blank margins cost neither bytes nor coding time.
+// -----------------------------------------------------------------------------
+struct ink_box {
+  int x, y, w, h;  // w and h are 0 if the image is blank
+  const u32 *data;  // the rows of the rectangle, (w + 31) / 32 words each
+  u32 *copy;  // where data points if the rows had to be moved, or NULL
+};
+
+// -----------------------------------------------------------------------------
+// Store the w pixels from pixel x on of row, a row of wpl words, in out, (w +
+// 31) / 32 words with zero pad bits
+// -----------------------------------------------------------------------------
+static inline void
+shift_row(const u32 *const row, const int wpl, const int x, const int w,
+          u32 *const out) {
+  const int words = (w + 31) / 32;
+  if (!words) return;
+  const int skip = x / 32;
+  const int shift = x & 31;
+  const u32 *const in = row + skip;
+  if (!shift) {
+    memcpy(out, in, sizeof(u32) * words);
+  } else {
+    for (int i = 0; i < words; ++i) {
+      out[i] = in[i] << shift;
+      if (skip + i + 1 < wpl) out[i] |= in[i + 1] >> (32 - shift);
+    }
+  }
+  if (w & 31) out[words - 1] &= ~0u << (32 - (w & 31));
+}
+
+// -----------------------------------------------------------------------------
+// Copy the rectangle of w x h pixels at (x, y) of bw into a malloced image of
+// its own, (w + 31) / 32 words per row, with zero pad bits
+// -----------------------------------------------------------------------------
+static u32 *
+copy_rect(const struct Pix *const bw, const int x, const int y, const int w,
+          const int h) {
+  const int wpl = bw->wpl;
+  const int words = (w + 31) / 32;
+  const size_t size = (size_t) words * h;
+  u32 *const copy = (u32 *) malloc(sizeof(u32) * (size ? size : 1));
+  if (!copy) abort();
+  for (int row = 0; row < h; ++row) {
+    shift_row(bw->data + (size_t) (y + row) * wpl, wpl, x, w,
+              copy + (size_t) row * words);
+  }
+  return copy;
+}
+
+// -----------------------------------------------------------------------------
+// Point box->data at the rows of the box of bw, copying them if they don't
+// start at the left of bw or would be too wide
+// -----------------------------------------------------------------------------
+static void
+ink_rows(const struct Pix *const bw, struct ink_box *box) {
+  const int wpl = bw->wpl;
+  const int words = (box->w + 31) / 32;
+  if (!box->x && words == wpl) {
+    // the rows already have the right width and start
+    box->data = bw->data + (size_t) box->y * wpl;
+    return;
+  }
+
+  // shift the rows of the box to the left
+  box->copy = copy_rect(bw, box->x, box->y, box->w, box->h);
+  box->data = box->copy;
+}
+
+// -----------------------------------------------------------------------------
+// Find the ink box of bw, whose pad bits must be zero: the rows are ORed
+// together a word at a time, which gives the rows and the columns holding
+// black pixels in a single pass. Free box->copy when done.
+// -----------------------------------------------------------------------------
+static void
+find_ink(const struct Pix *const bw, struct ink_box *box) {
+  const int wpl = bw->wpl;
+  const int height = bw->h;
+  u32 *const columns = (u32 *) calloc(wpl ? wpl : 1, sizeof(u32));
+  if (!columns) abort();
+  int top = -1, bottom = -1;
+  for (int y = 0; y < height; ++y) {
+    const u32 *const row = bw->data + (size_t) y * wpl;
+    u32 any = 0;
+    for (int i = 0; i < wpl; ++i) {
+      columns[i] |= row[i];
+      any |= row[i];
+    }
+    if (any) {
+      if (top < 0) top = y;
+      bottom = y;
+    }
+  }
+
+  box->copy = NULL;
+  box->data = NULL;
+  if (top < 0) {
+    free(columns);
+    box->x = box->y = box->w = box->h = 0;
+    return;
+  }
+  int first = 0, last = wpl - 1;
+  while (!columns[first]) first++;
+  while (!columns[last]) last--;
+  const int left = first * 32 + __builtin_clz(columns[first]);
+  const int right = last * 32 + 31 - __builtin_ctz(columns[last]);
+  free(columns);
+
+  box->x = left;
+  box->y = top;
+  box->w = right - left + 1;
+  box->h = bottom - top + 1;
+  ink_rows(bw, box);
+}
+
+// -----------------------------------------------------------------------------
+// As find_ink, but taking the box from the runs of bw. The rows are only made
+// if rows is set: MMR codes the box from the runs.
+// -----------------------------------------------------------------------------
+static void
+runs_ink(struct Pix *const bw, const struct jbig2_runs *runs,
+         struct ink_box *box, const bool rows) {
+  box->copy = NULL;
+  box->data = NULL;
+  if (runs->top < 0) {
+    box->x = box->y = box->w = box->h = 0;
+    return;
+  }
+  box->x = runs->left;
+  box->y = runs->top;
+  box->w = runs->right - runs->left + 1;
+  box->h = runs->bottom - runs->top + 1;
+  if (rows) ink_rows(bw, box);
+}
+
 // see comments in .h file
-u8 *
-jbig2_encode_generic(struct Pix *const bw, const bool full_headers, const int xres,
-                     const int yres, const bool duplicate_line_removal,
-                     int *const length) {
-  int segnum = 0;
+double
+jbig2_duplicate_row_ratio(struct Pix *const bw,
+                          const struct jbig2_runs *runs) {
+  // Only the rows from the first to the last black pixel are coded (see
+  // find_ink), so the repeats are counted within them.
+  if (runs) {
+    // a row is the same as the row above if it has the same changes
+    if (runs->top < 0) return 0;
+    int repeats = 0;
+    for (int y = runs->top + 1; y <= runs->bottom; ++y) {
+      const size_t n = runs->start[y + 1] - runs->start[y];
+      repeats += n == runs->start[y] - runs->start[y - 1] &&
+                 !memcmp(runs->changes + runs->start[y],
+                         runs->changes + runs->start[y - 1], sizeof(int) * n);
+    }
+    return (double) repeats / (runs->bottom - runs->top + 1);
+  }
 
-  if (!bw) return NULL;
   pixSetPadBits(bw, 0);
+  const int wpl = bw->wpl;
+  int top = -1, bottom = -1;
+  int repeats = 0, repeats_to_bottom = 0;
+  bool ink = false;  // whether the row has black pixels
+  for (int y = 0; y < (int) bw->h; ++y) {
+    const u32 *const row = bw->data + (size_t) y * wpl;
+    const bool same = y > 0 && !memcmp(row, row - wpl, sizeof(u32) * wpl);
+    if (!same) {
+      u32 any = 0;
+      for (int i = 0; i < wpl; ++i) any |= row[i];
+      ink = any != 0;
+    }
+    if (same && top >= 0) repeats++;
+    if (ink) {
+      if (top < 0) top = y;
+      bottom = y;
+      repeats_to_bottom = repeats;
+    }
+  }
+  return top < 0 ? 0 : (double) repeats_to_bottom / (bottom - top + 1);
+}
 
-  struct jbig2_file_header header;
-  if (full_headers) {
-    memset(&header, 0, sizeof(header));
-    header.n_pages = htonl(1);
-    header.organisation_type = 1;
-    memcpy(&header.id, JBIG2_FILE_MAGIC, 8);
+// -----------------------------------------------------------------------------
+// The 8 neighbours of the 32 pixels of word i of row, whose rows above and
+// below are given (all white past the edges of the image), as bit planes: bit
+// k of n[d] is that neighbour of pixel k in direction d.
+// -----------------------------------------------------------------------------
+static inline void
+neighbours(const u32 *above, const u32 *row, const u32 *below, const int i,
+           const int words, u32 n[8]) {
+  const u32 *const rows[3] = {above, row, below};
+  u32 west[3], east[3];
+  for (int r = 0; r < 3; ++r) {
+    const u32 w = rows[r][i];
+    west[r] = w >> 1 | (i ? rows[r][i - 1] << 31 : 0);
+    east[r] = w << 1 | (i + 1 < words ? rows[r][i + 1] >> 31 : 0);
   }
+  n[0] = west[0];
+  n[1] = above[i];
+  n[2] = east[0];
+  n[3] = west[1];
+  n[4] = east[1];
+  n[5] = west[2];
+  n[6] = below[i];
+  n[7] = east[2];
+}
 
-  // setup compression
-  struct jbig2enc_ctx ctx;
-  jbig2enc_init(&ctx);
+// -----------------------------------------------------------------------------
+// The black pixels of word i of row with exactly one black neighbour, and in
+// *lone those with none
+// -----------------------------------------------------------------------------
+static inline u32
+single_neighbour(const u32 *above, const u32 *row, const u32 *below,
+                 const int i, const int words, u32 *lone) {
+  u32 n[8];
+  neighbours(above, row, below, i, words, n);
+  u32 ones = 0, twos = 0;
+  for (int d = 0; d < 8; ++d) {
+    twos |= ones & n[d];
+    ones |= n[d];
+  }
+  *lone = row[i] & ~ones;
+  return row[i] & ones & ~twos;
+}
 
-  Segment seg, seg2, endseg;
+// -----------------------------------------------------------------------------
+// The rows around the row being despeckled. The rows are decided from copies,
+// so that a row written back doesn't change the decisions for the rows after
+// it.
+// -----------------------------------------------------------------------------
+struct speck_rows {
+  int wpl, height;
+  u32 mask;  // of the pixels of the last word of a row
+  u32 *zero;  // a white row, for the rows past the edges
+  u32 *orig[4];  // row y of the image at orig[y % 4], with zero pad bits
+  u32 *single[3];  // its pixels with a single neighbour at single[y % 3]
+};
+
+static inline const u32 *
+speck_orig(const struct speck_rows *rows, const int y) {
+  return y < 0 || y >= rows->height ? rows->zero : rows->orig[y % 4];
+}
+
+static inline const u32 *
+speck_single(const struct speck_rows *rows, const int y) {
+  return y < 0 || y >= rows->height ? rows->zero : rows->single[y % 3];
+}
+
+// Copy row y of bw, if there is one
+static void
+speck_load(struct speck_rows *rows, struct Pix *const bw, const int y) {
+  if (y >= rows->height) return;
+  u32 *const row = rows->orig[y % 4];
+  memcpy(row, bw->data + (size_t) y * rows->wpl, sizeof(u32) * rows->wpl);
+  row[rows->wpl - 1] &= rows->mask;
+}
+
+// Find the pixels of row y with a single neighbour, once rows y - 1 to y + 1
+// have been copied
+static void
+speck_find_single(struct speck_rows *rows, const int y) {
+  if (y >= rows->height) return;
+  u32 *const single = rows->single[y % 3];
+  u32 lone;
+  for (int i = 0; i < rows->wpl; ++i) {
+    single[i] = single_neighbour(speck_orig(rows, y - 1), speck_orig(rows, y),
+                                 speck_orig(rows, y + 1), i, rows->wpl, &lone);
+  }
+}
+
+// see comments in .h file
+int
+jbig2_despeckle(struct Pix *const bw, const int size) {
+  struct speck_rows rows;
+  rows.wpl = bw->wpl;
+  rows.height = bw->h;
+  rows.mask = bw->w & 31 ? ~0u << (32 - (bw->w & 31)) : ~0u;
+  if (!rows.wpl || !rows.height) return 0;
+  const int wpl = rows.wpl;
+  u32 *const buf = (u32 *) calloc((size_t) wpl * 8, sizeof(u32));
+  if (!buf) abort();
+  rows.zero = buf;
+  for (int r = 0; r < 4; ++r) rows.orig[r] = buf + (size_t) wpl * (1 + r);
+  for (int r = 0; r < 3; ++r) rows.single[r] = buf + (size_t) wpl * (5 + r);
+
+  int removed = 0;
+  speck_load(&rows, bw, 0);
+  speck_load(&rows, bw, 1);
+  if (size >= 2) speck_find_single(&rows, 0);
+  for (int y = 0; y < rows.height; ++y) {
+    speck_load(&rows, bw, y + 2);
+    if (size >= 2) speck_find_single(&rows, y + 1);
+    const u32 *const above = speck_orig(&rows, y - 1);
+    const u32 *const row = speck_orig(&rows, y);
+    const u32 *const below = speck_orig(&rows, y + 1);
+    u32 *const out = bw->data + (size_t) y * wpl;
+    for (int i = 0; i < wpl; ++i) {
+      u32 speck;
+      const u32 single = single_neighbour(above, row, below, i, wpl, &speck);
+      if (size >= 2 && single) {
+        // a pair: the one neighbour of the pixel has no other
+        u32 n[8], s[8];
+        neighbours(above, row, below, i, wpl, n);
+        neighbours(speck_single(&rows, y - 1), speck_single(&rows, y),
+                   speck_single(&rows, y + 1), i, wpl, s);
+        u32 pair = 0;
+        for (int d = 0; d < 8; ++d) pair |= n[d] & s[d];
+        speck |= single & pair;
+      }
+      removed += __builtin_popcount(speck);
+      out[i] = row[i] & ~speck;
+    }
+  }
+  free(buf);
+  return removed;
+}
+
+// -----------------------------------------------------------------------------
+// Fill in the file header, page information and generic region header (apart
+// from the size and position of the region) for a page of width x height
+// pixels made of generic regions
+// -----------------------------------------------------------------------------
+static void
+generic_headers(const int width, const int height, const int xres,
+                const int yres, const bool duplicate_line_removal,
+                const int gbtemplate, const bool mmr,
+                struct jbig2_file_header *header,
+                struct jbig2_page_info *pageinfo,
+                struct jbig2_generic_region *genreg) {
+  memset(header, 0, sizeof(*header));
+  header->n_pages = htonl(1);
+  header->organisation_type = 1;
+  memcpy(&header->id, JBIG2_FILE_MAGIC, 8);
+
+  memset(pageinfo, 0, sizeof(*pageinfo));
+  pageinfo->width = htonl(width);
+  pageinfo->height = htonl(height);
+  pageinfo->xres = htonl(xres);
+  pageinfo->yres = htonl(yres);
+  pageinfo->is_lossless = 1;
+
+  memset(genreg, 0, sizeof(*genreg));
+  if (mmr) {
+    // no TPGD, template or AT pixels
+    genreg->mmr = 1;
+    return;
+  }
+  if (duplicate_line_removal) {
+    genreg->tpgdon = true;
+  }
+  genreg->gbtemplate = gbtemplate;
+  // the nominal AT pixels, which are what the coder uses
+  if (gbtemplate == 0) {
+    genreg->a1x = 3;
+    genreg->a1y = -1;
+    genreg->a2x = -3;
+    genreg->a2y = -1;
+    genreg->a3x = 2;
+    genreg->a3y = -2;
+    genreg->a4x = -2;
+    genreg->a4y = -2;
+  } else {
+    genreg->a1x = gbtemplate == 1 ? 3 : 2;
+    genreg->a1y = -1;
+  }
+}
+
+// -----------------------------------------------------------------------------
+// Build a JBIG2 stream for a page of width x height pixels from already encoded
+// generic region data. The rectangle of region_width x region_height pixels at
+// (region_x, region_y) is made of nstripes immediate generic regions, each
+// stripe_height rows high (apart from the last one) and stripe i is stored in
+// data[i]. With no stripes, the page is blank. If stripe_y isn't NULL, stripe
+// i is instead rows stripe_y[i] to stripe_y[i + 1] - 1 of the rectangle. If
+// stripe_mmr isn't NULL, it says which stripes are coded with MMR, and the
+// rest are coded with gbtemplate whatever mmr is.
+//
+// If buffer is NULL, a new buffer is allocated for the stream. Otherwise the
+// stream is built in buffer, which must be large enough. Stripe data which is
+// already at its place in buffer (see generic_header_size) isn't copied.
+//
+// Returns NULL, and frees buffer, if a stripe is too long for a segment.
+// -----------------------------------------------------------------------------
+static u8 *
+generic_stream(const int width, const int height, const int region_x,
+               const int region_y, const int region_width,
+               const int region_height, const bool full_headers,
+               const int xres, const int yres,
+               const bool duplicate_line_removal, const int gbtemplate,
+               const bool mmr, const bool *const stripe_mmr,
+               const int nstripes, const int stripe_height,
+               const int *const stripe_y, u8 *const *const data,
+               const size_t *const datasize, u8 *buffer,
+               size_t *const length) {
+  int segnum = 0;
+
+  // the region headers for each coder: [0] arithmetic, [1] MMR
+  struct jbig2_file_header header;
   jbig2_page_info pageinfo;
-  memset(&pageinfo, 0, sizeof(pageinfo));
-  jbig2_generic_region genreg;
-  memset(&genreg, 0, sizeof(genreg));
+  jbig2_generic_region genregs[2];
+  int genreg_sizes[2];
+  for (int m = 0; m < 2; ++m) {
+    generic_headers(width, height, xres, yres, duplicate_line_removal,
+                    gbtemplate, m, &header, &pageinfo, &genregs[m]);
+    genreg_sizes[m] = generic_region_size(gbtemplate, m);
+  }
 
+  Segment seg, seg2, endseg;
   seg.number = segnum;
   segnum++;
   seg.type = segment_page_information;
   seg.page = 1;
   seg.len = sizeof(struct jbig2_page_info);
-  pageinfo.width = htonl(bw->w);
-  pageinfo.height = htonl(bw->h);
-  pageinfo.xres = htonl(xres ? xres : bw->xres);
-  pageinfo.yres = htonl(yres ? yres : bw->yres);
-  pageinfo.is_lossless = 1;
+
+  seg2.type = segment_imm_generic_region;
+  seg2.page = 1;
+
+  size_t totalsize = seg.size() + sizeof(pageinfo) +
+                     (full_headers ? sizeof(header) : 0);
+  for (int i = 0; i < nstripes; ++i) {
+    const int genreg_size = genreg_sizes[stripe_mmr ? stripe_mmr[i] : mmr];
+    if (datasize[i] > MAX_SEGMENT_DATA - genreg_size) {
+      free(buffer);
+      return NULL;
+    }
+    seg2.len = genreg_size + datasize[i];
+    totalsize += seg2.size() + genreg_size + datasize[i];
+  }
+
+  endseg.number = segnum + nstripes;
+  endseg.page = 1;
+  if (full_headers) totalsize += 2 * endseg.size();
+
+  u8 *const ret = buffer ? buffer : (u8 *) malloc(totalsize);
+  if (!ret) abort();
+  size_t offset = 0;
+
+#define F(x) memcpy(ret + offset, &x, sizeof(x)) ; offset += sizeof(x)
+  if (full_headers) {
+    F(header);
+  }
+  SEGMENT(seg);
+  F(pageinfo);
+  for (int i = 0; i < nstripes; ++i) {
+    const int y = stripe_y ? stripe_y[i] : i * stripe_height;
+    const int h = stripe_y ? stripe_y[i + 1] - y
+                : i == nstripes - 1 ? region_height - y : stripe_height;
+    const int m = stripe_mmr ? stripe_mmr[i] : mmr;
+    const int genreg_size = genreg_sizes[m];
+    jbig2_generic_region genreg = genregs[m];
+    seg2.number = segnum;
+    segnum++;
+    seg2.len = genreg_size + datasize[i];
+    genreg.width = htonl(region_width);
+    genreg.height = htonl(h);
+    genreg.x = htonl(region_x);
+    genreg.y = htonl(region_y + y);
+    SEGMENT(seg2);
+    memcpy(ret + offset, &genreg, genreg_size);
+    offset += genreg_size;
+    if (data[i] != ret + offset) memcpy(ret + offset, data[i], datasize[i]);
+    offset += datasize[i];
+  }
+
+  if (full_headers) {
+    endseg.type = segment_end_of_page;
+    SEGMENT(endseg);
+    endseg.number += 1;
+    endseg.type = segment_end_of_file;
+    SEGMENT(endseg);
+  }
+
+  if (totalsize != offset) abort();
+
+  *length = offset;
+
+  return ret;
+}
+
+// -----------------------------------------------------------------------------
+// The number of bytes before the data of the first stripe in the streams
+// built by generic_stream, and the number of bytes after the last one.
+// -----------------------------------------------------------------------------
+static int
+generic_header_size(const bool full_headers, const int gbtemplate,
+                    const bool mmr) {
+  Segment seg;
+  seg.page = 1;
+  return (full_headers ? sizeof(struct jbig2_file_header) : 0) +
+         seg.size() + sizeof(struct jbig2_page_info) +
+         seg.size() + generic_region_size(gbtemplate, mmr);
+}
+
+static int
+generic_trailer_size(const bool full_headers) {
+  Segment seg;
+  seg.page = 1;
+  return full_headers ? 2 * seg.size() : 0;
+}
+
+// see comments in .h file
+u8 *
+jbig2_encode_generic_ctx(struct jbig2enc_ctx *ctx, struct Pix *const bw,
+                         const bool full_headers, const int xres,
+                         const int yres, const bool duplicate_line_removal,
+                         const int gbtemplate, const bool mmr,
+                         size_t *const length) {
+  return jbig2_encode_generic_runs(ctx, bw, NULL, full_headers, xres, yres,
+                                   duplicate_line_removal, gbtemplate, mmr,
+                                   length);
+}
+
+// see comments in .h file
+u8 *
+jbig2_encode_generic_runs(struct jbig2enc_ctx *ctx, struct Pix *const bw,
+                          const struct jbig2_runs *runs,
+                          const bool full_headers, const int xres,
+                          const int yres, const bool duplicate_line_removal,
+                          const int gbtemplate, const bool mmr,
+                          size_t *const length) {
+  if (!bw) return NULL;
+  pixSetPadBits(bw, 0);
 
 #ifdef SURPRISE_MAP
   dprintf(3, "P5\n%d %d 255\n", bw->w, bw->h);
 #endif
 
-  jbig2enc_bitimage(&ctx, (u8 *) bw->data, bw->w, bw->h, duplicate_line_removal);
-  jbig2enc_final(&ctx);
-  const int datasize = jbig2enc_datasize(&ctx);
+  struct ink_box box;
+  if (runs) {
+    runs_ink(bw, runs, &box, !mmr);
+  } else {
+    find_ink(bw, &box);
+  }
+  if (!box.w) {
+    return generic_stream(bw->w, bw->h, 0, 0, 0, 0, full_headers,
+                          xres ? xres : bw->xres, yres ? yres : bw->yres,
+                          duplicate_line_removal, gbtemplate, mmr, NULL, 0, 0,
+                          NULL, NULL, NULL, NULL, length);
+  }
+
+  // The coded data goes straight after space for the headers, and the stream
+  // is built around it in the coder's own output buffer.
+  const int header_size = generic_header_size(full_headers, gbtemplate, mmr);
+  jbig2enc_reserve(ctx, header_size);
+  if (runs && mmr) {
+    jbig2enc_mmrruns(ctx, runs, box.x, box.y, box.w, box.h);
+  } else {
+    encode_region(ctx, box.data, box.w, box.h, duplicate_line_removal,
+                  gbtemplate, mmr);
+  }
+  free(box.copy);
+  const size_t datasize = jbig2enc_datasize(ctx);
+  u8 *const buffer =
+      jbig2enc_takebuffer(ctx, generic_trailer_size(full_headers));
+  u8 *data = buffer + header_size;
 
-  seg2.number = segnum;
-  segnum++;
+  return generic_stream(bw->w, bw->h, box.x, box.y, box.w, box.h,
+                        full_headers, xres ? xres : bw->xres,
+                        yres ? yres : bw->yres, duplicate_line_removal,
+                        gbtemplate, mmr, NULL, 1, box.h, NULL, &data,
+                        &datasize, buffer, length);
+}
+
+// -----------------------------------------------------------------------------
+// Read the next row of the image being coded by jbig2_encode_generic_rows into
+// row, clearing its pad bits as pixSetPadBits does for the other entry points
+// -----------------------------------------------------------------------------
+static int
+read_row(jbig2_row_reader reader, void *opaque, const int width, u32 *row) {
+  if (reader(opaque, row)) return -1;
+  if (width & 31) {
+    row[(width + 31) / 32 - 1] &= 0xffffffff << (32 - (width & 31));
+  }
+  return 0;
+}
+
+// see comments in .h file
+u8 *
+jbig2_encode_generic_rows(struct jbig2enc_ctx *ctx, const int width,
+                          const int height, const bool full_headers,
+                          const int xres, const int yres,
+                          const bool duplicate_line_removal,
+                          const int gbtemplate, jbig2_row_reader reader,
+                          jbig2_row_rewind rewind, void *opaque,
+                          size_t *const length) {
+  const int words = (width + 31) / 32;
+  u32 *const row = (u32 *) malloc(sizeof(u32) * (words ? words : 1));
+  u32 *const columns = (u32 *) calloc(words ? words : 1, sizeof(u32));
+  if (!row || !columns) abort();
+
+  // The ink box is found as find_ink does, which takes a pass over the whole
+  // image. Without rewind, the rows from the first black pixel on are kept for
+  // coding after it; with it, they are read again instead, so that the image
+  // is never held.
+  u32 *kept = NULL;
+  size_t nkept = 0, kept_size = 0;
+  int top = -1, bottom = -1;
+  bool failed = false;
+  for (int y = 0; y < height; ++y) {
+    if (read_row(reader, opaque, width, row)) {
+      failed = true;
+      break;
+    }
+    u32 any = 0;
+    for (int i = 0; i < words; ++i) {
+      columns[i] |= row[i];
+      any |= row[i];
+    }
+    if (any) {
+      if (top < 0) top = y;
+      bottom = y;
+    }
+    if (top < 0 || rewind) continue;
+    if (nkept == kept_size) {
+      kept_size = kept_size ? kept_size * 2 : 64;
+      if (kept_size > (size_t) (height - top)) kept_size = height - top;
+      kept = (u32 *) realloc(kept, sizeof(u32) * words * kept_size);
+      if (!kept) abort();
+    }
+    memcpy(kept + nkept++ * words, row, sizeof(u32) * words);
+  }
+  if (failed || top < 0) {
+    free(row);
+    free(columns);
+    free(kept);
+    if (failed) return NULL;
+    return generic_stream(width, height, 0, 0, 0, 0, full_headers, xres, yres,
+                          duplicate_line_removal, gbtemplate, false, NULL, 0,
+                          0, NULL, NULL, NULL, NULL, length);
+  }
+
+  int first = 0, last = words - 1;
+  while (!columns[first]) first++;
+  while (!columns[last]) last--;
+  const int left = first * 32 + __builtin_clz(columns[first]);
+  const int right = last * 32 + 31 - __builtin_ctz(columns[last]);
+  const int w = right - left + 1, h = bottom - top + 1;
+
+  struct jbig2enc_rows rows;
+  jbig2enc_rows_init(&rows, w, duplicate_line_removal, gbtemplate);
+  const int header_size = generic_header_size(full_headers, gbtemplate, false);
+  jbig2enc_reserve(ctx, header_size);
+  failed = rewind && rewind(opaque);
+  for (int y = rewind ? 0 : top; y <= bottom && !failed; ++y) {
+    const u32 *in = row;
+    if (rewind) {
+      failed = read_row(reader, opaque, width, row) != 0;
+      if (failed || y < top) continue;
+    } else {
+      in = kept + (size_t) (y - top) * words;
+    }
+    shift_row(in, words, left, w, jbig2enc_rows_next(&rows));
+    jbig2enc_rows_encode(ctx, &rows);
+  }
+  jbig2enc_rows_dealloc(&rows);
+  free(row);
+  free(columns);
+  free(kept);
+  if (failed) {
+    jbig2enc_reset(ctx);
+    return NULL;
+  }
+  jbig2enc_final(ctx);
+  const size_t datasize = jbig2enc_datasize(ctx);
+  u8 *const buffer =
+      jbig2enc_takebuffer(ctx, generic_trailer_size(full_headers));
+  u8 *data = buffer + header_size;
+
+  return generic_stream(width, height, left, top, w, h, full_headers, xres,
+                        yres, duplicate_line_removal, gbtemplate, false, NULL,
+                        1, h, NULL, &data, &datasize, buffer, length);
+}
+
+
+// -----------------------------------------------------------------------------
+// Returns b with its bits in the opposite order
+// -----------------------------------------------------------------------------
+static inline u8
+reverse_bits(u8 b) {
+  b = (u8) ((b & 0xf0) >> 4 | (b & 0x0f) << 4);
+  b = (u8) ((b & 0xcc) >> 2 | (b & 0x33) << 2);
+  return (u8) ((b & 0xaa) >> 1 | (b & 0x55) << 1);
+}
+
+// -----------------------------------------------------------------------------
+// A raw 1 bpp image (see jbig2_encode_generic_raw)
+// -----------------------------------------------------------------------------
+struct raw_image {
+  const u8 *rows;
+  size_t stride;
+  int width, height;
+  int row_bytes;  // bytes holding the pixels of each row
+  u8 last_mask;  // the bits of the last of them which are pixels
+  bool lsb_first;
+};
+
+// -----------------------------------------------------------------------------
+// Byte i of row, a row of image, with the first pixel in the top bit and zero
+// pad bits; 0 past the end of the row
+// -----------------------------------------------------------------------------
+static inline u8
+raw_byte(const struct raw_image *image, const u8 *row, const int i) {
+  if (i >= image->row_bytes) return 0;
+  u8 b = row[i];
+  if (image->lsb_first) b = reverse_bits(b);
+  return i == image->row_bytes - 1 ? b & image->last_mask : b;
+}
+
+// -----------------------------------------------------------------------------
+// Store the w pixels of row from pixel x on in out, in Leptonica's packed
+// format with zero pad bits
+// -----------------------------------------------------------------------------
+static void
+raw_row(const struct raw_image *image, const u8 *row, const int x,
+        const int w, u32 *out) {
+  const int words = (w + 31) / 32;
+  const int first = x / 8;
+  const int shift = x & 7;
+  for (int i = 0; i < words; ++i) {
+    const int j = first + i * 4;
+    u32 word;
+    if (!shift && !image->lsb_first && j + 4 < image->row_bytes) {
+      word = (u32) row[j] << 24 | (u32) row[j + 1] << 16 |
+             (u32) row[j + 2] << 8 | row[j + 3];
+    } else {
+      u64 v = 0;
+      for (int k = 0; k < 5; ++k) v = v << 8 | raw_byte(image, row, j + k);
+      word = (u32) (v >> (8 - shift));
+    }
+    out[i] = word;
+  }
+  if (w & 31) out[words - 1] &= 0xffffffff << (32 - (w & 31));
+}
+
+// -----------------------------------------------------------------------------
+// Find the bounding box of the black pixels of image (as find_ink). box->data
+// isn't set: the rows are read with raw_row.
+// -----------------------------------------------------------------------------
+static void
+find_raw_ink(const struct raw_image *image, struct ink_box *box) {
+  const int n = image->row_bytes;
+  u8 *const columns = (u8 *) calloc(n ? n : 1, 1);
+  if (!columns) abort();
+  box->data = NULL;
+  box->copy = NULL;
+  int top = -1, bottom = -1;
+  for (int y = 0; y < image->height; ++y) {
+    const u8 *const row = image->rows + y * image->stride;
+    u8 any = 0;
+    for (int i = 0; i < n - 1; ++i) {
+      columns[i] |= row[i];
+      any |= row[i];
+    }
+    // the pad bits are masked where the bit order doesn't matter
+    const u8 last = row[n - 1] & (image->lsb_first
+                                      ? reverse_bits(image->last_mask)
+                                      : image->last_mask);
+    columns[n - 1] |= last;
+    any |= last;
+    if (any) {
+      if (top < 0) top = y;
+      bottom = y;
+    }
+  }
+  if (top < 0) {
+    free(columns);
+    box->x = box->y = box->w = box->h = 0;
+    return;
+  }
+  int first = 0, last = n - 1;
+  while (!columns[first]) first++;
+  while (!columns[last]) last--;
+  u8 left = columns[first], right = columns[last];
+  if (image->lsb_first) {
+    left = reverse_bits(left);
+    right = reverse_bits(right);
+  }
+  free(columns);
+  box->x = first * 8 + __builtin_clz((u32) left << 24);
+  box->y = top;
+  box->w = last * 8 + 7 - __builtin_ctz(right) - box->x + 1;
+  box->h = bottom - top + 1;
+}
+
+// see comments in .h file
+u8 *
+jbig2_encode_generic_raw(struct jbig2enc_ctx *ctx, const u8 *rows,
+                         const size_t stride, const int width,
+                         const int height, const int bit_order,
+                         const bool full_headers, const int xres,
+                         const int yres, const bool duplicate_line_removal,
+                         const int gbtemplate, size_t *const length) {
+  if (!rows || width <= 0 || height <= 0 ||
+      stride < ((size_t) width + 7) / 8) {
+    return NULL;
+  }
+  struct raw_image image;
+  image.rows = rows;
+  image.stride = stride;
+  image.width = width;
+  image.height = height;
+  image.row_bytes = (width + 7) / 8;
+  image.last_mask = width & 7 ? 0xff << (8 - (width & 7)) : 0xff;
+  image.lsb_first = bit_order == JBIG2_LSB_FIRST;
+
+  struct ink_box box;
+  find_raw_ink(&image, &box);
+  if (!box.w) {
+    return generic_stream(width, height, 0, 0, 0, 0, full_headers, xres, yres,
+                          duplicate_line_removal, gbtemplate, false, NULL, 0,
+                          0, NULL, NULL, NULL, NULL, length);
+  }
+
+  const int header_size = generic_header_size(full_headers, gbtemplate, false);
+  jbig2enc_reserve(ctx, header_size);
+  struct jbig2enc_rows coder;
+  jbig2enc_rows_init(&coder, box.w, duplicate_line_removal, gbtemplate);
+  for (int y = box.y; y < box.y + box.h; ++y) {
+    raw_row(&image, rows + y * stride, box.x, box.w,
+            jbig2enc_rows_next(&coder));
+    jbig2enc_rows_encode(ctx, &coder);
+  }
+  jbig2enc_rows_dealloc(&coder);
+  jbig2enc_final(ctx);
+  const size_t datasize = jbig2enc_datasize(ctx);
+  u8 *const buffer =
+      jbig2enc_takebuffer(ctx, generic_trailer_size(full_headers));
+  u8 *data = buffer + header_size;
+
+  return generic_stream(width, height, box.x, box.y, box.w, box.h,
+                        full_headers, xres, yres, duplicate_line_removal,
+                        gbtemplate, false, NULL, 1, box.h, NULL, &data,
+                        &datasize, buffer, length);
+}
+
+// see comments in .h file
+int
+jbig2_encode_generic_sink(struct jbig2enc_ctx *ctx, struct Pix *const bw,
+                          const bool full_headers, const int xres,
+                          const int yres, const bool duplicate_line_removal,
+                          const int gbtemplate, const bool mmr,
+                          jbig2enc_sink sink, void *opaque) {
+  if (!bw) return -1;
+  pixSetPadBits(bw, 0);
+
+  struct jbig2_file_header header;
+  jbig2_page_info pageinfo;
+  jbig2_generic_region genreg;
+  generic_headers(bw->w, bw->h, xres ? xres : bw->xres,
+                  yres ? yres : bw->yres, duplicate_line_removal, gbtemplate,
+                  mmr, &header, &pageinfo, &genreg);
+  struct ink_box box;
+  find_ink(bw, &box);
+  genreg.width = htonl(box.w);
+  genreg.height = htonl(box.h);
+  genreg.x = htonl(box.x);
+  genreg.y = htonl(box.y);
+
+  Segment seg, seg2, endseg;
+  seg.number = 0;
+  seg.type = segment_page_information;
+  seg.page = 1;
+  seg.len = sizeof(struct jbig2_page_info);
+  // The length of the data is not known until it has all been written, so the
+  // region is terminated by an end marker and its row count instead (7.2.7).
+  seg2.number = 1;
   seg2.type = segment_imm_generic_region;
   seg2.page = 1;
-  seg2.len = sizeof(genreg) + datasize;
-
-  endseg.number = segnum;
-  segnum++;
+  seg2.len = 0xffffffff;
+  // a blank page is just the page information
+  endseg.number = box.w ? 2 : 1;
   endseg.page = 1;
 
-  genreg.width = htonl(bw->w);
-  genreg.height = htonl(bw->h);
-  if (duplicate_line_removal) {
-    genreg.tpgdon = true;
-  }
-  genreg.a1x = 3;
-  genreg.a1y = -1;
-  genreg.a2x = -3;
-  genreg.a2y = -1;
-  genreg.a3x = 2;
-  genreg.a3y = -2;
-  genreg.a4x = -2;
-  genreg.a4y = -2;
-
-  const int totalsize = seg.size() + sizeof(pageinfo) + seg2.size() +
-                        sizeof(genreg) + datasize +
-                        (full_headers ? (sizeof(header) + 2*endseg.size()) : 0);
-  u8 *const ret = (u8 *) malloc(totalsize);
+  u8 ret[128];  // the headers before and the segments after the coded data
+  if (generic_header_size(full_headers, gbtemplate, mmr) > (int) sizeof(ret))
+    abort();
   int offset = 0;
-
-#define F(x) memcpy(ret + offset, &x, sizeof(x)) ; offset += sizeof(x)
   if (full_headers) {
     F(header);
   }
   SEGMENT(seg);
   F(pageinfo);
-  SEGMENT(seg2);
-  F(genreg);
-  jbig2enc_tobuffer(&ctx, ret + offset);
-  offset += datasize;
+  if (box.w) {
+    SEGMENT(seg2);
+    memcpy(ret + offset, &genreg, generic_region_size(gbtemplate, mmr));
+    offset += generic_region_size(gbtemplate, mmr);
+  }
+  if (sink(opaque, ret, offset)) {
+    free(box.copy);
+    jbig2enc_reset(ctx);
+    return -1;
+  }
+
+  offset = 0;
+  if (box.w) {
+    jbig2enc_setsink(ctx, sink, opaque);
+    encode_region(ctx, box.data, box.w, box.h, duplicate_line_removal,
+                  gbtemplate, mmr);
+    free(box.copy);
+    // Arithmetically coded data always ends with the 0xffac marker. After MMR
+    // data, the marker is 0x0000, which can't occur in it.
+    if (mmr) {
+      static const u8 mmr_marker[2] = {0x00, 0x00};
+      jbig2enc_putbytes(ctx, mmr_marker, 2);
+    }
+    int result = jbig2enc_flush(ctx);
+    jbig2enc_reset(ctx);
+    if (result) return result;
 
+    const u32 rows = htonl(box.h);
+    F(rows);
+  }
   if (full_headers) {
     endseg.type = segment_end_of_page;
     SEGMENT(endseg);
@@ -144,12 +1026,1164 @@ jbig2_encode_generic(struct Pix *const bw, const bool full_headers, const int xr
     endseg.type = segment_end_of_file;
     SEGMENT(endseg);
   }
+  return sink(opaque, ret, offset) ? -1 : 0;
+}
 
-  if (totalsize != offset) abort();
+// -----------------------------------------------------------------------------
+// State shared by the workers encoding the stripes of one page
+// -----------------------------------------------------------------------------
+struct stripe_batch {
+  const u32 *rows;  // of the ink box of the page
+  int width, height;
+  int stripe_height;
+  bool duplicate_line_removal;
+  int gbtemplate;
+  bool mmr;
+  int nstripes;
+  int interleave;  // stripes coded together by each job
+  struct jbig2enc_ctx *ctxs;  // interleave per worker thread
+  u8 **data;  // encoded data of each stripe
+  size_t *datasize;
+  bool *stripe_mmr;  // with a deadline, which stripes were coded with MMR;
+                     // else NULL
+  double start;  // with a deadline, when coding started
+  double budget;  // and the seconds it has
+};
+
+// -----------------------------------------------------------------------------
+// Code the stripes index * interleave ... of a stripe_batch
+// -----------------------------------------------------------------------------
+static void
+encode_stripe(void *arg, int index, int worker) {
+  struct stripe_batch *const b = (struct stripe_batch *) arg;
+  struct jbig2enc_ctx *const ctxs = &b->ctxs[worker * b->interleave];
+  const int words = (b->width + 31) / 32;
+  const int first = index * b->interleave;
+  const int n = b->nstripes - first < b->interleave ? b->nstripes - first
+                                                    : b->interleave;
+  const u8 *data[JBIG2_INTERLEAVE_MAX] = {NULL};
+  int heights[JBIG2_INTERLEAVE_MAX] = {0};
+  struct jbig2enc_ctx *ctxps[JBIG2_INTERLEAVE_MAX] = {NULL};
+  for (int k = 0; k < n; ++k) {
+    const int y = (first + k) * b->stripe_height;
+    data[k] = (const u8 *) (b->rows + (size_t) y * words);
+    heights[k] = b->height - y < b->stripe_height ? b->height - y
+                                                  : b->stripe_height;
+    ctxps[k] = &ctxs[k];
+  }
+
+  // With a deadline, once the stripes started before these have taken so long
+  // that coding all of them at that speed would miss it, the rest are coded
+  // with MMR. The stripes of other threads still being coded make this a
+  // little late, never early.
+  bool mmr = b->mmr;
+  if (b->stripe_mmr) {
+    mmr = b->budget <= 0 ||
+          (first > 0 &&
+           (seconds() - b->start) * b->nstripes / first > b->budget);
+    for (int k = 0; k < n; ++k) b->stripe_mmr[first + k] = mmr;
+  }
+
+  if (n == 1 || mmr) {
+    for (int k = 0; k < n; ++k) {
+      encode_region(&ctxs[k], (const u32 *) data[k], b->width, heights[k],
+                    b->duplicate_line_removal, b->gbtemplate, mmr);
+    }
+  } else {
+    jbig2enc_bitimage_interleaved(ctxps, data, b->width, heights, n,
+                                  b->duplicate_line_removal, b->gbtemplate);
+    for (int k = 0; k < n; ++k) jbig2enc_final(&ctxs[k]);
+  }
+  for (int k = 0; k < n; ++k) {
+    const int i = first + k;
+    b->datasize[i] = jbig2enc_datasize(&ctxs[k]);
+    b->data[i] = (u8 *) malloc(b->datasize[i]);
+    jbig2enc_tobuffer(&ctxs[k], b->data[i]);
+    jbig2enc_reset(&ctxs[k]);
+  }
+}
 
+// see comments in .h file
+u8 *
+jbig2_encode_generic_striped(struct Pix *const bw, const bool full_headers,
+                             const int xres, const int yres,
+                             const bool duplicate_line_removal,
+                             const int gbtemplate, const bool mmr,
+                             const int stripe_height, int nthreads,
+                             int interleave, const double budget,
+                             int *const path, size_t *const length) {
+  if (!bw) return NULL;
+  const bool deadline = budget >= 0 && !mmr;
+  if (path) *path = mmr ? JBIG2_PATH_MMR : JBIG2_PATH_ARITH;
+  if (stripe_height <= 0 || stripe_height >= (int) bw->h) {
+    struct jbig2enc_ctx ctx;
+    jbig2enc_init(&ctx);
+    u8 *const ret =
+        deadline ? jbig2_encode_generic_deadline(&ctx, bw, full_headers, xres,
+                                                 yres, duplicate_line_removal,
+                                                 gbtemplate, budget, path,
+                                                 length)
+                 : jbig2_encode_generic_ctx(&ctx, bw, full_headers, xres,
+                                            yres, duplicate_line_removal,
+                                            gbtemplate, mmr, length);
+    jbig2enc_dealloc(&ctx);
+    return ret;
+  }
+  const double start = seconds();
+  pixSetPadBits(bw, 0);
+
+  struct ink_box box;
+  find_ink(bw, &box);
+  const int nstripes = (box.h + stripe_height - 1) / stripe_height;
+  if (mmr || interleave < 1) interleave = 1;
+  if (interleave > JBIG2_INTERLEAVE_MAX) interleave = JBIG2_INTERLEAVE_MAX;
+  const int njobs = (nstripes + interleave - 1) / interleave;
+  if (nthreads > njobs) nthreads = njobs;
+  if (nthreads < 1) nthreads = 1;
+
+  struct stripe_batch b;
+  b.rows = box.data;
+  b.width = box.w;
+  b.height = box.h;
+  b.stripe_height = stripe_height;
+  b.duplicate_line_removal = duplicate_line_removal;
+  b.gbtemplate = gbtemplate;
+  b.mmr = mmr;
+  b.nstripes = nstripes;
+  b.interleave = interleave;
+  const int nctxs = nthreads * interleave;
+  b.ctxs = (struct jbig2enc_ctx *) malloc(sizeof(struct jbig2enc_ctx) *
+                                          nctxs);
+  b.data = (u8 **) malloc(sizeof(u8 *) * nstripes);
+  b.datasize = (size_t *) malloc(sizeof(size_t) * nstripes);
+  b.stripe_mmr = deadline ? (bool *) malloc(sizeof(bool) * (nstripes + 1))
+                          : NULL;
+  b.start = start;
+  b.budget = budget;
+  for (int t = 0; t < nctxs; ++t) jbig2enc_init(&b.ctxs[t]);
+
+  jbig2_parallel_for(nthreads, njobs, encode_stripe, NULL, &b);
+  if (deadline && nstripes) {
+    int nmmr = 0;
+    for (int i = 0; i < nstripes; ++i) nmmr += b.stripe_mmr[i];
+    *path = !nmmr ? JBIG2_PATH_ARITH : nmmr == nstripes ? JBIG2_PATH_MMR
+                                                         : JBIG2_PATH_SWITCHED;
+  }
+
+  for (int t = 0; t < nctxs; ++t) jbig2enc_dealloc(&b.ctxs[t]);
+  free(b.ctxs);
+  free(box.copy);
+
+  u8 *const ret = generic_stream(bw->w, bw->h, box.x, box.y, box.w, box.h,
+                                 full_headers,
+                                 xres ? xres : bw->xres,
+                                 yres ? yres : bw->yres,
+                                 duplicate_line_removal, gbtemplate, mmr,
+                                 b.stripe_mmr, nstripes, stripe_height, NULL,
+                                 b.data, b.datasize, NULL, length);
+  for (int i = 0; i < nstripes; ++i) free(b.data[i]);
+  free(b.data);
+  free(b.datasize);
+  free(b.stripe_mmr);
+  return ret;
+}
+
+// Rows of the ink box in each of the bands jbig2_encode_generic_halftone
+// classifies
+#define HALFTONE_BAND_ROWS 32
+
+// Rows of the ink box coded by jbig2_encode_generic_deadline between looks
+// at the clock: the first look is the earliest the speed is judged by
+#define DEADLINE_CHECK_ROWS 64
+
+// see comments in .h file
+u8 *
+jbig2_encode_generic_deadline(struct jbig2enc_ctx *ctx, struct Pix *const bw,
+                              const bool full_headers, const int xres,
+                              const int yres,
+                              const bool duplicate_line_removal,
+                              const int gbtemplate, const double budget,
+                              int *const path, size_t *const length) {
+  if (!bw) return NULL;
+  const double start = seconds();
+  pixSetPadBits(bw, 0);
+
+  struct ink_box box;
+  find_ink(bw, &box);
+  *path = JBIG2_PATH_ARITH;
+  if (!box.w) {
+    return generic_stream(bw->w, bw->h, 0, 0, 0, 0, full_headers,
+                          xres ? xres : bw->xres, yres ? yres : bw->yres,
+                          duplicate_line_removal, gbtemplate, false, NULL, 0,
+                          0, NULL, NULL, NULL, NULL, length);
+  }
+
+  // Code the rows arithmetically, as jbig2_encode_generic_ctx does, until the
+  // time they have taken says that the whole box would take longer than the
+  // budget; the rows from there on are a second region, coded with MMR.
+  const int header_size = generic_header_size(full_headers, gbtemplate,
+                                              false);
+  const int words = (box.w + 31) / 32;
+  int split = 0;  // rows coded arithmetically
+  if (budget > 0) {
+    jbig2enc_reserve(ctx, header_size);
+    struct jbig2enc_rows rows;
+    jbig2enc_rows_init(&rows, box.w, duplicate_line_removal, gbtemplate);
+    while (split < box.h) {
+      memcpy(jbig2enc_rows_next(&rows), box.data + (size_t) split * words,
+             sizeof(u32) * words);
+      jbig2enc_rows_encode(ctx, &rows);
+      split++;
+      if (split % DEADLINE_CHECK_ROWS == 0 && split < box.h &&
+          (seconds() - start) * box.h / split > budget)
+        break;
+    }
+    jbig2enc_rows_dealloc(&rows);
+    jbig2enc_final(ctx);
+  }
+
+  if (split == box.h) {
+    // in time: the same stream as from jbig2_encode_generic_ctx
+    free(box.copy);
+    const size_t datasize = jbig2enc_datasize(ctx);
+    u8 *const buffer =
+        jbig2enc_takebuffer(ctx, generic_trailer_size(full_headers));
+    u8 *data = buffer + header_size;
+    return generic_stream(bw->w, bw->h, box.x, box.y, box.w, box.h,
+                          full_headers, xres ? xres : bw->xres,
+                          yres ? yres : bw->yres, duplicate_line_removal,
+                          gbtemplate, false, NULL, 1, box.h, NULL, &data,
+                          &datasize, buffer, length);
+  }
+
+  *path = split ? JBIG2_PATH_SWITCHED : JBIG2_PATH_MMR;
+  u8 *data[2] = {NULL, NULL};
+  size_t datasize[2] = {0, 0};
+  bool stripe_mmr[2] = {false, true};
+  int n = 0;
+  if (split) {
+    datasize[n] = jbig2enc_datasize(ctx);
+    u8 *const buffer = jbig2enc_takebuffer(ctx, 0);
+    data[n] = (u8 *) malloc(datasize[n] ? datasize[n] : 1);
+    if (!data[n]) abort();
+    memcpy(data[n], buffer + header_size, datasize[n]);
+    free(buffer);
+    n++;
+  }
+  jbig2enc_mmrimage(ctx, (const u8 *) (box.data + (size_t) split * words),
+                    box.w, box.h - split);
+  datasize[n] = jbig2enc_datasize(ctx);
+  data[n] = (u8 *) malloc(datasize[n] ? datasize[n] : 1);
+  if (!data[n]) abort();
+  jbig2enc_tobuffer(ctx, data[n]);
+  jbig2enc_reset(ctx);
+  free(box.copy);
+  n++;
+
+  u8 *const ret = generic_stream(bw->w, bw->h, box.x, box.y, box.w, box.h,
+                                 full_headers, xres ? xres : bw->xres,
+                                 yres ? yres : bw->yres,
+                                 duplicate_line_removal, gbtemplate, false,
+                                 split ? stripe_mmr : stripe_mmr + 1, n,
+                                 split ? split : box.h, NULL, data, datasize,
+                                 NULL, length);
+  for (int i = 0; i < n; ++i) free(data[i]);
+  return ret;
+}
+
+// -----------------------------------------------------------------------------
+// The number of pixels in the row of words words at row which differ from the
+// pixel to their left, taking the pixel left of the row as white
+// -----------------------------------------------------------------------------
+static int
+count_transitions(const u32 *row, const int words) {
+  int n = 0;
+  u32 left = 0;  // the word before: its last pixel is the one left of row[i]
+  for (int i = 0; i < words; ++i) {
+    n += __builtin_popcount(row[i] ^ (row[i] >> 1 | left << 31));
+    left = row[i];
+  }
+  return n;
+}
+
+// see comments in .h file
+u8 *
+jbig2_encode_generic_halftone(struct jbig2enc_ctx *ctx, struct Pix *const bw,
+                              const bool full_headers, const int xres,
+                              const int yres,
+                              const bool duplicate_line_removal,
+                              const int gbtemplate, const double min_density,
+                              int *const mmr_rows, size_t *const length) {
+  if (!bw) return NULL;
+  pixSetPadBits(bw, 0);
+  if (mmr_rows) *mmr_rows = 0;
+
+  struct ink_box box;
+  find_ink(bw, &box);
+
+  // the regions: runs of bands of the same kind, region i being rows
+  // region_y[i] to region_y[i + 1] - 1 of the ink box
+  const int words = (box.w + 31) / 32;
+  const int nbands = (box.h + HALFTONE_BAND_ROWS - 1) / HALFTONE_BAND_ROWS;
+  int *const region_y = (int *) malloc(sizeof(int) * (nbands + 1));
+  bool *const region_mmr = (bool *) malloc(sizeof(bool) * (nbands + 1));
+  if (!region_y || !region_mmr) abort();
+  int nregions = 0;
+  for (int band = 0; band < nbands; ++band) {
+    const int y = band * HALFTONE_BAND_ROWS;
+    const int h = box.h - y < HALFTONE_BAND_ROWS ? box.h - y
+                                                 : HALFTONE_BAND_ROWS;
+    // a band with any row denser than MMR is worth is left to the arithmetic
+    // coder too, so that one at the edge of a fine dither isn't coded with MMR
+    // for being only partly in it
+    const int most = (int) (JBIG2_HALFTONE_MMR_MAX_DENSITY * box.w);
+    size_t transitions = 0;
+    bool dense = false;
+    for (int row = y; row < y + h; ++row) {
+      const int n = count_transitions(box.data + (size_t) row * words, words);
+      transitions += n;
+      dense |= n >= most;
+    }
+    const bool mmr = !dense && transitions >= min_density * box.w * h;
+    if (mmr && mmr_rows) *mmr_rows += h;
+    if (!nregions || region_mmr[nregions - 1] != mmr) {
+      region_y[nregions] = y;
+      region_mmr[nregions] = mmr;
+      nregions++;
+    }
+  }
+  region_y[nregions] = box.h;
+
+  // Without halftones, the stream of jbig2_encode_generic_ctx, coded in the
+  // coder's own buffer as there. Else each region is coded with a context of
+  // its own, as the stripes of jbig2_encode_generic_striped are.
+  u8 **const data = (u8 **) malloc(sizeof(u8 *) * (nregions + 1));
+  size_t *const datasize = (size_t *) malloc(sizeof(size_t) * (nregions + 1));
+  if (!data || !datasize) abort();
+  u8 *buffer = NULL;
+  if (nregions == 1 && !region_mmr[0]) {
+    const int header_size = generic_header_size(full_headers, gbtemplate,
+                                                false);
+    jbig2enc_reserve(ctx, header_size);
+    encode_region(ctx, box.data, box.w, box.h, duplicate_line_removal,
+                  gbtemplate, false);
+    datasize[0] = jbig2enc_datasize(ctx);
+    buffer = jbig2enc_takebuffer(ctx, generic_trailer_size(full_headers));
+    data[0] = buffer + header_size;
+  } else {
+    for (int i = 0; i < nregions; ++i) {
+      encode_region(ctx, box.data + (size_t) region_y[i] * words, box.w,
+                    region_y[i + 1] - region_y[i], duplicate_line_removal,
+                    gbtemplate, region_mmr[i]);
+      datasize[i] = jbig2enc_datasize(ctx);
+      data[i] = (u8 *) malloc(datasize[i] ? datasize[i] : 1);
+      if (!data[i]) abort();
+      jbig2enc_tobuffer(ctx, data[i]);
+      jbig2enc_reset(ctx);
+    }
+  }
+  free(box.copy);
+
+  u8 *const ret = generic_stream(bw->w, bw->h, box.x, box.y, box.w, box.h,
+                                 full_headers, xres ? xres : bw->xres,
+                                 yres ? yres : bw->yres,
+                                 duplicate_line_removal, gbtemplate, false,
+                                 region_mmr, nregions, 0, region_y, data,
+                                 datasize, buffer, length);
+  if (!buffer) {
+    for (int i = 0; i < nregions; ++i) free(data[i]);
+  }
+  free(data);
+  free(datasize);
+  free(region_y);
+  free(region_mmr);
+  return ret;
+}
+
+// -----------------------------------------------------------------------------
+// A sink which only counts the bytes, so that nothing is kept in memory
+// -----------------------------------------------------------------------------
+static int
+count_sink(void *opaque, const u8 *, size_t length) {
+  *(long *) opaque += length;
+  return 0;
+}
+
+// Rows in each of the bands sampled by jbig2_estimate_size
+#define ESTIMATE_BAND_ROWS 32
+
+// see comments in .h file
+int
+jbig2_estimate_size(struct jbig2enc_ctx *ctx, struct Pix *const bw,
+                    const bool full_headers,
+                    const bool duplicate_line_removal, const int gbtemplate,
+                    const bool mmr, const double fraction, int *const error) {
+  *error = 0;
+  if (!bw) return -1;
+  pixSetPadBits(bw, 0);
+
+  struct ink_box box;
+  find_ink(bw, &box);
+  const int overhead = generic_header_size(full_headers, gbtemplate, mmr) +
+                       generic_trailer_size(full_headers);
+  if (!box.w) {
+    // just the page information (see generic_stream)
+    Segment seg;
+    seg.page = 1;
+    return overhead - seg.size() - generic_region_size(gbtemplate, mmr);
+  }
+
+  long counted = 0;
+  jbig2enc_setsink(ctx, count_sink, &counted);
+  const int nbands = (box.h + ESTIMATE_BAND_ROWS - 1) / ESTIMATE_BAND_ROWS;
+  int nsampled = (int) ceil(fraction * nbands);
+  if (nsampled < 8) nsampled = 8;
+  if (mmr || nsampled >= nbands) {
+    // MMR is cheap enough to be coded whole
+    encode_region(ctx, box.data, box.w, box.h, duplicate_line_removal,
+                  gbtemplate, mmr);
+    jbig2enc_flush(ctx);
+    jbig2enc_reset(ctx);
+    free(box.copy);
+    return overhead + counted;
+  }
+
+  // Code one band from each of nsampled equal parts of the box, as if they
+  // followed one another, each after the two rows above it (which are the
+  // context of its first rows, but aren't coded), and scale the bytes per row
+  // to the whole box. Bands at the same place in each part would keep hitting
+  // the same place in regular layouts, such as lines of text, so the band in
+  // each part is picked at random (but the same on every run).
+  u32 random = 0x9e3779b9u ^ box.h;
+  struct jbig2enc_rows rows;
+  jbig2enc_rows_init(&rows, box.w, duplicate_line_removal, gbtemplate);
+  const unsigned words = rows.words_per_row;
+  double sum = 0, sum2 = 0;  // of the bytes per row of each band
+  long coded = 0;
+  for (int i = 0; i < nsampled; ++i) {
+    const int first = (int) ((long) i * nbands / nsampled);
+    const int end = (int) ((long) (i + 1) * nbands / nsampled);
+    random = random * 1664525 + 1013904223;
+    const int y0 = (first + (int) ((random >> 8) % (end - first))) *
+                   ESTIMATE_BAND_ROWS;
+    const int y1 = y0 + ESTIMATE_BAND_ROWS < box.h ? y0 + ESTIMATE_BAND_ROWS
+                                                   : box.h;
+    for (int y = y0 < 2 ? 0 : y0 - 2; y < y0; ++y) {
+      memcpy(jbig2enc_rows_next(&rows), box.data + (size_t) y * words,
+             sizeof(u32) * words);
+      jbig2enc_rows_skip(&rows);
+    }
+    for (int y = y0; y < y1; ++y) {
+      memcpy(jbig2enc_rows_next(&rows), box.data + (size_t) y * words,
+             sizeof(u32) * words);
+      jbig2enc_rows_encode(ctx, &rows);
+    }
+    const long total = counted + jbig2enc_datasize(ctx);
+    const double rate = (double) (total - coded) / (y1 - y0);
+    coded = total;
+    sum += rate;
+    sum2 += rate * rate;
+  }
+  jbig2enc_rows_dealloc(&rows);
+  jbig2enc_final(ctx);
+  jbig2enc_flush(ctx);
+  jbig2enc_reset(ctx);
+  free(box.copy);
+
+  // The bands are a sample of the bands of the box, taken without
+  // replacement: the error is twice the standard error of the total.
+  const double mean = sum / nsampled;
+  double variance = (sum2 - sum * mean) / (nsampled - 1);
+  if (variance < 0) variance = 0;
+  const double se = box.h * sqrt(variance / nsampled *
+                                 (nbands - nsampled) / (nbands - 1));
+  *error = (int) ceil(2 * se);
+  return overhead + (int) (mean * box.h + 0.5) + (counted - coded);
+}
+
+// see comments in .h file
+u8 *
+jbig2_encode_generic(struct Pix *const bw, const bool full_headers, const int xres,
+                     const int yres, const bool duplicate_line_removal,
+                     size_t *const length) {
+  if (!bw) return NULL;
+
+  // setup compression
+  struct jbig2enc_ctx ctx;
+  jbig2enc_init(&ctx);
+
+  u8 *const ret = jbig2_encode_generic_ctx(&ctx, bw, full_headers, xres, yres,
+                                           duplicate_line_removal, 0, false,
+                                           length);
   jbig2enc_dealloc(&ctx);
 
+  return ret;
+}
+
+// see comments in .h file
+u8 *
+jbig2_encode_from_buffer(const u8 *data, const size_t size,
+                         const int bw_threshold, const bool full_headers,
+                         const int xres, const int yres,
+                         const bool duplicate_line_removal,
+                         size_t *const length) {
+  PIX *source = pixReadMem(data, size);
+  if (!source) return NULL;
+  PIX *bw = pixConvertTo1Transfer(&source, bw_threshold, 1);
+  if (!bw) return NULL;
+
+  u8 *const ret = jbig2_encode_generic(bw, full_headers, xres, yres,
+                                       duplicate_line_removal, length);
+  pixDestroy(&bw);
+  return ret;
+}
+
+// -----------------------------------------------------------------------------
+// Build the symbol dictionary segment, numbered 0 and with no page
+// association, around the data of nsymbols symbols coded into ctx (all of
+// which are exported). ctx is reset.
+// -----------------------------------------------------------------------------
+static u8 *
+symbol_dictionary_segment(struct jbig2enc_ctx *ctx, const int nsymbols,
+                          size_t *const length) {
+  jbig2enc_final(ctx);
+
+  struct jbig2_symbol_dict dict;
+  memset(&dict, 0, sizeof(dict));
+  // template 0 with the nominal AT pixels, as jbig2enc_bitimage
+  dict.a1x = 3;
+  dict.a1y = -1;
+  dict.a2x = -3;
+  dict.a2y = -1;
+  dict.a3x = 2;
+  dict.a3y = -2;
+  dict.a4x = -2;
+  dict.a4y = -2;
+  dict.exsyms = htonl(nsymbols);
+  dict.newsyms = htonl(nsymbols);
+
+  Segment seg;
+  seg.number = 0;
+  seg.type = segment_symbol_table;
+  seg.page = 0;
+  if (jbig2enc_datasize(ctx) > MAX_SEGMENT_DATA - sizeof(dict)) {
+    jbig2enc_reset(ctx);
+    return NULL;
+  }
+  seg.len = sizeof(dict) + jbig2enc_datasize(ctx);
+
+  const size_t totalsize = seg.size() + seg.len;
+  u8 *const ret = (u8 *) malloc(totalsize);
+  if (!ret) abort();
+  size_t offset = 0;
+  SEGMENT(seg);
+  F(dict);
+  jbig2enc_tobuffer(ctx, ret + offset);
+  offset += jbig2enc_datasize(ctx);
+  jbig2enc_reset(ctx);
+
+  if (totalsize != offset) abort();
+
   *length = offset;
+  return ret;
+}
+
+// see comments in .h file
+u8 *
+jbig2_encode_symbol_dictionary(struct jbig2enc_ctx *ctx,
+                               struct jbig2_symbols *symbols,
+                               size_t *const length) {
+  const int nsymbols = jbig2_symbols_encode_dictionary(symbols, ctx);
+  return symbol_dictionary_segment(ctx, nsymbols, length);
+}
 
+// see comments in .h file
+u8 *
+jbig2_encode_symbol_page(struct jbig2enc_ctx *ctx,
+                         struct jbig2_symbols *symbols, const int pageno,
+                         const bool duplicate_line_removal,
+                         const int gbtemplate, const bool mmr,
+                         size_t *const length) {
+  int width, height, xres, yres;
+  jbig2_symbols_page_info(symbols, pageno, &width, &height, &xres, &yres);
+  struct jbig2_file_header header;
+  struct jbig2_page_info pageinfo;
+  struct jbig2_generic_region genreg;
+  generic_headers(width, height, xres, yres, duplicate_line_removal,
+                  gbtemplate, mmr, &header, &pageinfo, &genreg);
+  // every instance of a symbol is drawn as the first one of its class
+  pageinfo.is_lossless = 0;
+  const int genreg_size = generic_region_size(gbtemplate, mmr);
+
+  struct jbig2_text_region textreg;
+  memset(&textreg, 0, sizeof(textreg));
+  textreg.width = htonl(width);
+  textreg.height = htonl(height);
+  // arithmetic coding, no refinement, REFCORNER BOTTOMLEFT, strips of 1 row
+  struct jbig2_text_region_syminsts syminsts;
+
+  Segment seg, textseg, genseg;
+  seg.number = 1;
+  seg.type = segment_page_information;
+  seg.page = 1;
+  seg.len = sizeof(pageinfo);
+  textseg.number = 2;
+  textseg.type = segment_imm_text_region;
+  textseg.page = 1;
+  textseg.nreferred = 1;
+  textseg.referred_to[0] = 0;
+  genseg.number = 3;
+  genseg.type = segment_imm_generic_region;
+  genseg.page = 1;
+
+  // The text region is coded after the space for the headers before it.
+  const int header_size = seg.size() + sizeof(pageinfo) + textseg.size() +
+                          sizeof(textreg) + sizeof(syminsts);
+  jbig2enc_reserve(ctx, header_size);
+  syminsts.sbnuminstances =
+      htonl(jbig2_symbols_encode_text(symbols, ctx, pageno));
+  jbig2enc_final(ctx);
+  if (jbig2enc_datasize(ctx) >
+      MAX_SEGMENT_DATA - sizeof(textreg) - sizeof(syminsts)) {
+    jbig2enc_reset(ctx);
+    jbig2_symbols_page_done(symbols, pageno);
+    return NULL;
+  }
+  textseg.len = sizeof(textreg) + sizeof(syminsts) + jbig2enc_datasize(ctx);
+  size_t totalsize = header_size + jbig2enc_datasize(ctx);
+  u8 *ret = jbig2enc_takebuffer(ctx, 0);
+
+  PIX *const residual = jbig2_symbols_residual(symbols, pageno);
+  struct ink_box box;
+  box.w = 0;
+  if (residual) find_ink(residual, &box);
+  if (box.w) {
+    encode_region(ctx, box.data, box.w, box.h, duplicate_line_removal,
+                  gbtemplate, mmr);
+    free(box.copy);
+    if (jbig2enc_datasize(ctx) > MAX_SEGMENT_DATA - genreg_size) {
+      jbig2enc_reset(ctx);
+      jbig2_symbols_page_done(symbols, pageno);
+      free(ret);
+      return NULL;
+    }
+    genseg.len = genreg_size + jbig2enc_datasize(ctx);
+    ret = (u8 *) realloc(ret, totalsize + genseg.size() + genseg.len);
+    if (!ret) abort();
+    size_t offset = totalsize;
+    genreg.width = htonl(box.w);
+    genreg.height = htonl(box.h);
+    genreg.x = htonl(box.x);
+    genreg.y = htonl(box.y);
+    SEGMENT(genseg);
+    memcpy(ret + offset, &genreg, genreg_size);
+    offset += genreg_size;
+    jbig2enc_tobuffer(ctx, ret + offset);
+    jbig2enc_reset(ctx);
+    totalsize += genseg.size() + genseg.len;
+  }
+  jbig2_symbols_page_done(symbols, pageno);
+
+  size_t offset = 0;
+  SEGMENT(seg);
+  F(pageinfo);
+  SEGMENT(textseg);
+  F(textreg);
+  F(syminsts);
+  if (offset != (size_t) header_size) abort();
+
+  *length = totalsize;
+  return ret;
+}
+
+// -----------------------------------------------------------------------------
+// Refinement of near-duplicate pages
+// -----------------------------------------------------------------------------
+
+// Rows of a page which are the same as in its reference are left out of the
+// refinement regions, but a gap of at most this many of them between rows
+// which differ is coded as part of one region: it costs less than the headers
+// of another one.
+#define REFINE_BAND_GAP 16
+
+// see comments in .h file
+u64 *
+jbig2_row_hashes(struct Pix *const bw) {
+  pixSetPadBits(bw, 0);
+  const int wpl = bw->wpl;
+  u64 *const hashes = (u64 *) malloc(sizeof(u64) * (bw->h ? bw->h : 1));
+  if (!hashes) abort();
+  for (int y = 0; y < (int) bw->h; ++y) {
+    // FNV-1a over the words: a collision only makes a page look more like its
+    // reference than it is, and the rows are compared again when it's coded
+    const u32 *const row = bw->data + (size_t) y * wpl;
+    u64 hash = 0xcbf29ce484222325ULL;
+    u32 any = 0;
+    for (int i = 0; i < wpl; ++i) {
+      hash = (hash ^ row[i]) * 0x100000001b3ULL;
+      any |= row[i];
+    }
+    hashes[y] = any ? hash | 1 : 0;
+  }
+  return hashes;
+}
+
+// see comments in .h file
+double
+jbig2_row_match_ratio(const u64 *a, const u64 *b, const int height) {
+  // Blank rows are hashed to 0, and rows blank on both pages are left out:
+  // any two pages with wide margins would look alike otherwise.
+  int same = 0, rows = 0;
+  for (int y = 0; y < height; ++y) {
+    if (!(a[y] | b[y])) continue;
+    rows++;
+    same += a[y] == b[y];
+  }
+  return rows ? (double) same / rows : 1;
+}
+
+// see comments in .h file
+u8 *
+jbig2_encode_reference_dictionary(struct jbig2enc_ctx *ctx,
+                                  const struct Pix *const bw,
+                                  size_t *const length) {
+  struct ink_box box;
+  find_ink(bw, &box);
+  // one height class of one symbol, coded as in jbig2_symbols_encode_dictionary
+  if (box.w) {
+    jbig2enc_int(ctx, JBIG2_IADH, box.h);
+    jbig2enc_int(ctx, JBIG2_IADW, box.w);
+    jbig2enc_bitimage(ctx, (const u8 *) box.data, box.w, box.h, false, 0);
+    jbig2enc_oob(ctx, JBIG2_IADW);
+    free(box.copy);
+  }
+  const int nsymbols = box.w ? 1 : 0;
+  jbig2enc_int(ctx, JBIG2_IAEX, 0);
+  jbig2enc_int(ctx, JBIG2_IAEX, nsymbols);
+  return symbol_dictionary_segment(ctx, nsymbols, length);
+}
+
+// -----------------------------------------------------------------------------
+// Find the columns from *left to *right in which rows y0..y1 of a and b
+// differ
+// -----------------------------------------------------------------------------
+static void
+diff_columns(const struct Pix *const a, const struct Pix *const b,
+             const int y0, const int y1, int *left, int *right) {
+  const int wpl = a->wpl;
+  u32 *const columns = (u32 *) calloc(wpl, sizeof(u32));
+  if (!columns) abort();
+  for (int y = y0; y <= y1; ++y) {
+    const u32 *const ra = a->data + (size_t) y * wpl;
+    const u32 *const rb = b->data + (size_t) y * wpl;
+    for (int i = 0; i < wpl; ++i) columns[i] |= ra[i] ^ rb[i];
+  }
+  int first = 0, last = wpl - 1;
+  while (!columns[first]) first++;
+  while (!columns[last]) last--;
+  *left = first * 32 + __builtin_clz(columns[first]);
+  *right = last * 32 + 31 - __builtin_ctz(columns[last]);
+  free(columns);
+}
+
+// see comments in .h file
+u8 *
+jbig2_encode_refined_page(struct jbig2enc_ctx *ctx,
+                          const struct Pix *const bw,
+                          const struct Pix *const reference,
+                          const int grtemplate, size_t *const length) {
+  if (bw->w != reference->w || bw->h != reference->h || bw->d != 1 ||
+      reference->d != 1 || grtemplate < 0 || grtemplate > 1)
+    return NULL;
+  const int width = bw->w, height = bw->h, wpl = bw->wpl;
+
+  struct jbig2_page_info pageinfo;
+  memset(&pageinfo, 0, sizeof(pageinfo));
+  pageinfo.width = htonl(width);
+  pageinfo.height = htonl(height);
+  pageinfo.xres = htonl(bw->xres);
+  pageinfo.yres = htonl(bw->yres);
+  pageinfo.is_lossless = 1;
+
+  // The text region draws the reference as it is, where it was found (see
+  // jbig2_encode_reference_dictionary).
+  struct ink_box box;
+  find_ink(reference, &box);
+  free(box.copy);
+  struct jbig2_text_region textreg;
+  memset(&textreg, 0, sizeof(textreg));
+  textreg.width = htonl(width);
+  textreg.height = htonl(height);
+  // arithmetic coding, no refinement, REFCORNER BOTTOMLEFT, strips of 1 row
+  struct jbig2_text_region_syminsts syminsts;
+  syminsts.sbnuminstances = htonl(box.w ? 1 : 0);
+
+  Segment seg, textseg;
+  seg.number = 1;
+  seg.type = segment_page_information;
+  seg.page = 1;
+  seg.len = sizeof(pageinfo);
+  textseg.number = 2;
+  textseg.type = segment_imm_text_region;
+  textseg.page = 1;
+  textseg.nreferred = 1;
+  textseg.referred_to[0] = 0;
+
+  const int header_size = seg.size() + sizeof(pageinfo) + textseg.size() +
+                          sizeof(textreg) + sizeof(syminsts);
+  jbig2enc_reserve(ctx, header_size);
+  jbig2enc_int(ctx, JBIG2_IADT, 0);
+  if (box.w) {
+    jbig2enc_int(ctx, JBIG2_IADT, box.y + box.h - 1);
+    jbig2enc_int(ctx, JBIG2_IAFS, box.x);
+    jbig2enc_iaid(ctx, 0, 0);
+    jbig2enc_oob(ctx, JBIG2_IADS);
+  }
+  jbig2enc_final(ctx);
+  textseg.len = sizeof(textreg) + sizeof(syminsts) + jbig2enc_datasize(ctx);
+  size_t totalsize = header_size + jbig2enc_datasize(ctx);
+  u8 *ret = jbig2enc_takebuffer(ctx, 0);
+
+  // Then each band of rows in which the page differs from the reference is an
+  // immediate refinement region referring to no other region, so that its
+  // reference is what the text region left in the page buffer there.
+  struct jbig2_refinement_region refreg;
+  memset(&refreg, 0, sizeof(refreg));
+  refreg.comb_operator = 4;  // REPLACE
+  refreg.grtemplate = grtemplate;
+  // the nominal AT pixels, which are what the coder uses
+  refreg.ra1x = refreg.ra1y = refreg.ra2x = refreg.ra2y = -1;
+  const int refreg_size = sizeof(refreg) - (grtemplate ? 4 : 0);
+  unsigned segnum = 3;
+  for (int y = 0; y < height; ) {
+    if (!memcmp(bw->data + (size_t) y * wpl, reference->data + (size_t) y * wpl,
+                sizeof(u32) * wpl)) {
+      y++;
+      continue;
+    }
+    const int top = y;
+    int bottom = y;
+    for (++y; y < height && y - bottom <= REFINE_BAND_GAP; ++y) {
+      if (memcmp(bw->data + (size_t) y * wpl, reference->data + (size_t) y * wpl,
+                 sizeof(u32) * wpl))
+        bottom = y;
+    }
+    y = bottom + 1;
+    int left, right;
+    diff_columns(bw, reference, top, bottom, &left, &right);
+    const int w = right - left + 1, h = bottom - top + 1;
+
+    u32 *const image = copy_rect(bw, left, top, w, h);
+    u32 *const refimage = copy_rect(reference, left, top, w, h);
+    jbig2enc_refine(ctx, (const u8 *) image, (const u8 *) refimage, w, h,
+                    grtemplate);
+    jbig2enc_final(ctx);
+    free(image);
+    free(refimage);
+    if (jbig2enc_datasize(ctx) > MAX_SEGMENT_DATA - refreg_size) {
+      jbig2enc_reset(ctx);
+      free(ret);
+      return NULL;
+    }
+
+    Segment refseg;
+    refseg.number = segnum++;
+    refseg.type = segment_imm_lossless_refinement_region;
+    refseg.page = 1;
+    refseg.len = refreg_size + jbig2enc_datasize(ctx);
+    ret = (u8 *) realloc(ret, totalsize + refseg.size() + refseg.len);
+    if (!ret) abort();
+    size_t offset = totalsize;
+    refreg.width = htonl(w);
+    refreg.height = htonl(h);
+    refreg.x = htonl(left);
+    refreg.y = htonl(top);
+    SEGMENT(refseg);
+    memcpy(ret + offset, &refreg, refreg_size);
+    offset += refreg_size;
+    jbig2enc_tobuffer(ctx, ret + offset);
+    jbig2enc_reset(ctx);
+    totalsize += refseg.size() + refseg.len;
+  }
+  if (segnum > 3) {
+    // the refinement regions replace what the text region drew
+    pageinfo.contains_refinements = 1;
+    pageinfo.operator_override = 1;
+  }
+
+  size_t offset = 0;
+  SEGMENT(seg);
+  F(pageinfo);
+  SEGMENT(textseg);
+  F(textreg);
+  F(syminsts);
+  if (offset != (size_t) header_size) abort();
+
+  *length = totalsize;
+  return ret;
+}
+
+// see comments in .h file
+u8 *
+jbig2_file_header(const unsigned npages, size_t *const length) {
+  struct jbig2_file_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(&header.id, JBIG2_FILE_MAGIC, 8);
+  header.organisation_type = 1;
+  header.n_pages = htonl(npages);
+
+  u8 *const ret = (u8 *) malloc(sizeof(header));
+  memcpy(ret, &header, sizeof(header));
+  *length = sizeof(header);
+  return ret;
+}
+
+// see comments in .h file
+u8 *
+jbig2_file_page(const u8 *data, const size_t length, const unsigned pageno,
+                const unsigned ref_base, unsigned *const segnum,
+                size_t *const out_length) {
+  // Find the size of the result first: the page association and the referred
+  // to segment numbers of every segment header may grow.
+  Segment seg;
+  unsigned first = 0;  // number of the first segment of the stream
+  int nsegments = 0;
+  size_t totalsize = 0;
+  for (size_t offset = 0; offset < length; ++nsegments) {
+    const unsigned size = seg.read(data + offset, length - offset);
+    if (!size || seg.page > 1 || seg.len == 0xffffffff ||
+        seg.len > length - offset - size)
+      return NULL;
+    if (seg.type == segment_end_of_page || seg.type == segment_end_of_file)
+      return NULL;  // made with full_headers
+    if (nsegments == 0) first = seg.number;
+    if (seg.number != first + nsegments) return NULL;
+    seg.number = *segnum + nsegments;
+    if (seg.page) seg.page = pageno;
+    for (int r = 0; r < seg.nreferred; ++r) {
+      if (seg.referred_to[r] < first) seg.referred_to[r] += ref_base;
+    }
+    totalsize += seg.size() + seg.len;
+    offset += size + seg.len;
+  }
+  Segment endseg;
+  endseg.number = *segnum + nsegments;
+  endseg.type = segment_end_of_page;
+  endseg.page = pageno;
+  totalsize += endseg.size();
+
+  u8 *const ret = (u8 *) malloc(totalsize);
+  if (!ret) abort();
+  size_t offset = 0;
+  for (size_t i = 0; i < length; ) {
+    const unsigned size = seg.read(data + i, length - i);
+    seg.number += *segnum - first;
+    if (seg.page) seg.page = pageno;
+    // segments outside the stream are already in the file
+    for (int r = 0; r < seg.nreferred; ++r) {
+      if (seg.referred_to[r] >= first) {
+        seg.referred_to[r] += *segnum - first;
+      } else {
+        seg.referred_to[r] += ref_base;
+      }
+    }
+    SEGMENT(seg);
+    memcpy(ret + offset, data + i + size, seg.len);
+    offset += seg.len;
+    i += size + seg.len;
+  }
+  SEGMENT(endseg);
+  *segnum = endseg.number + 1;
+
+  if (totalsize != offset) abort();
+
+  *out_length = offset;
+  return ret;
+}
+
+// see comments in .h file
+u8 *
+jbig2_file_trailer(const unsigned segnum, size_t *const length) {
+  Segment endseg;
+  endseg.number = segnum;
+  endseg.type = segment_end_of_file;
+
+  u8 *const ret = (u8 *) malloc(endseg.size());
+  endseg.write(ret);
+  *length = endseg.size();
+  return ret;
+}
+
+// see comments in .h file
+u8 *
+jbig2_pdf_xobject(const u8 *data, const size_t length,
+                  size_t *const out_length) {
+  Segment seg;
+  const unsigned size = seg.read(data, length);
+  if (!size || seg.type != segment_page_information ||
+      seg.len < sizeof(struct jbig2_page_info) ||
+      seg.len > length - size)
+    return NULL;
+  struct jbig2_page_info pageinfo;
+  memcpy(&pageinfo, data + size, sizeof(pageinfo));
+
+  char dict[256];
+  const int dictsize =
+      snprintf(dict, sizeof(dict),
+               "<< /Type /XObject /Subtype /Image /Width %u /Height %u "
+               "/ColorSpace /DeviceGray /BitsPerComponent 1 "
+               "/Filter /JBIG2Decode /Length %lu >>\nstream\n",
+               ntohl(pageinfo.width), ntohl(pageinfo.height),
+               (unsigned long) length);
+  static const char endstream[] = "\nendstream\n";
+  const size_t totalsize = dictsize + length + sizeof(endstream) - 1;
+
+  u8 *const ret = (u8 *) malloc(totalsize);
+  if (!ret) abort();
+  memcpy(ret, dict, dictsize);
+  memcpy(ret + dictsize, data, length);
+  memcpy(ret + dictsize + length, endstream, sizeof(endstream) - 1);
+  *out_length = totalsize;
+  return ret;
+}
+
+// -----------------------------------------------------------------------------
+// OR the 1 bpp image src, whose pad bits are zero, into dst at (x, y), where
+// it must fit. Only the words with pixels of src set are written, so the words
+// which would lie past the end of a row of dst are never touched.
+// -----------------------------------------------------------------------------
+static void
+or_image(struct Pix *dst, const int x, const int y, const struct Pix *src) {
+  const int shift = x & 31;
+  for (unsigned sy = 0; sy < src->h; ++sy) {
+    u32 *const d = dst->data + (size_t) (y + sy) * dst->wpl + x / 32;
+    const u32 *const s = src->data + (size_t) sy * src->wpl;
+    for (unsigned i = 0; i < src->wpl; ++i) {
+      if (!s[i]) continue;
+      d[i] |= s[i] >> shift;
+      const u32 spill = shift ? s[i] << (32 - shift) : 0;
+      if (spill) d[i + 1] |= spill;
+    }
+  }
+}
+
+// see comments in .h file
+struct Pix *
+jbig2_decode_generic(const u8 *data, const size_t length,
+                     const bool full_headers) {
+  size_t offset = 0;
+  if (full_headers) {
+    // only sequential files, with a page count or without
+    if (length < 9 || memcmp(data, JBIG2_FILE_MAGIC, 8) || !(data[8] & 1))
+      return NULL;
+    offset = data[8] & 2 ? 9 : 13;
+  }
+
+  PIX *page = NULL;
+  Segment seg;
+  while (offset < length) {
+    const unsigned size = seg.read(data + offset, length - offset);
+    if (!size) break;
+    offset += size;
+    const u8 *const body = data + offset;
+    const size_t avail = length - offset;
+    if (seg.len != 0xffffffff && seg.len > avail) break;
+    size_t len = seg.len;
+
+    if (seg.type == segment_page_information) {
+      struct jbig2_page_info pageinfo;
+      if (page || len < sizeof(pageinfo)) break;
+      memcpy(&pageinfo, body, sizeof(pageinfo));
+      if (pageinfo.default_pixel || ntohl(pageinfo.height) == 0xffffffff)
+        break;
+      page = pixCreate(ntohl(pageinfo.width), ntohl(pageinfo.height), 1);
+      if (!page) return NULL;
+    } else if (seg.type == segment_imm_generic_region) {
+      struct jbig2_generic_region genreg;
+      const size_t at_offset = offsetof(struct jbig2_generic_region, a1x);
+      if (!page || avail < at_offset) break;
+      memset(&genreg, 0, sizeof(genreg));
+      memcpy(&genreg, body, avail < sizeof(genreg) ? avail : sizeof(genreg));
+      const int gbtemplate = genreg.gbtemplate;
+      const size_t genreg_size = generic_region_size(gbtemplate, genreg.mmr);
+      if (avail < genreg_size) break;
+      // the AT pixels must be where the coder has them
+      struct jbig2_file_header header;
+      struct jbig2_page_info pageinfo;
+      struct jbig2_generic_region nominal;
+      generic_headers(0, 0, 0, 0, false, gbtemplate, false, &header,
+                      &pageinfo, &nominal);
+      if (genreg.mmr || (genreg.comb_operator & 7) != 0 ||
+          memcmp(&genreg.a1x, &nominal.a1x, genreg_size - at_offset) != 0)
+        break;
+      const u8 *const coded = body + genreg_size;
+      size_t coded_length;
+      u32 height = ntohl(genreg.height);
+      if (len == 0xffffffff) {
+        // the coded data ends with the 0xffac marker, and the row count
+        // follows it
+        size_t end = 0;
+        while (end + 1 < avail - genreg_size &&
+               !(coded[end] == 0xff && coded[end + 1] == 0xac))
+          ++end;
+        if (end + 6 > avail - genreg_size) break;
+        coded_length = end + 2;
+        u32 rows;
+        memcpy(&rows, coded + coded_length, 4);
+        height = ntohl(rows);
+        len = genreg_size + coded_length + 4;
+      } else {
+        if (len < genreg_size) break;
+        coded_length = len - genreg_size;
+      }
+      const u32 width = ntohl(genreg.width);
+      const u32 x = ntohl(genreg.x), y = ntohl(genreg.y);
+      if (x > page->w || width > page->w - x || y > page->h ||
+          height > page->h - y)
+        break;
+      PIX *region = pixCreate(width, height, 1);
+      if (!region) break;
+      struct jbig2dec_ctx dec;
+      jbig2dec_init(&dec, coded, coded_length);
+      jbig2dec_bitimage(&dec, (u8 *) region->data, width, height,
+                        genreg.tpgdon, gbtemplate);
+      jbig2dec_dealloc(&dec);
+      or_image(page, x, y, region);
+      pixDestroy(&region);
+    } else if (seg.type == segment_end_of_page ||
+               seg.type == segment_end_of_file) {
+      if (!page) break;
+    } else {
+      break;
+    }
+    offset += len;
+  }
+
+  if (offset != length) pixDestroy(&page);
+  return page;
+}
+
+// see comments in .h file
+int
+jbig2_verify_generic(const u8 *data, const size_t length,
+                     const bool full_headers, struct Pix *const bw) {
+  PIX *page = jbig2_decode_generic(data, length, full_headers);
+  if (!page) return -1;
+  int ret = 0;
+  if (page->w != bw->w || page->h != bw->h || bw->d != 1) {
+    ret = 1;
+  } else {
+    const unsigned full = page->w / 32;
+    const u32 mask = page->w & 31 ? 0xffffffff << (32 - (page->w & 31)) : 0;
+    for (unsigned y = 0; y < page->h && !ret; ++y) {
+      const u32 *const a = page->data + (size_t) y * page->wpl;
+      const u32 *const b = bw->data + (size_t) y * bw->wpl;
+      u32 diff = 0;
+      for (unsigned i = 0; i < full; ++i) diff |= a[i] ^ b[i];
+      if (mask) diff |= (a[full] ^ b[full]) & mask;
+      ret = diff != 0;
+    }
+  }
+  pixDestroy(&page);
   return ret;
 }
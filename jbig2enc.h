@@ -41,18 +41,38 @@
 #endif
 
 struct Pix;
+struct jbig2enc_ctx;
+struct jbig2_runs;
+
+// see jbig2arith.h
+typedef int (*jbig2enc_sink)(void *opaque, const uint8_t *data, size_t length);
 
 // WARNING: returns a malloced buffer which the caller must free
 // -----------------------------------------------------------------------------
 
+// -----------------------------------------------------------------------------
+// Sizes
+//
+// A page can be up to 2^31 - 1 pixels wide and high (the Pix of Leptonica
+// holds them as int), but the rows of the images read from files must also
+// fit 2^31 bits each: 32 bpp color images can be up to 67108863 pixels wide.
+// Image data and output streams are sized with size_t, so they can be over
+// 4 GiB with 64-bit pointers.
+//
+// The data length in a segment header is 32 bits, though, so a region whose
+// coded data is 4 GiB or more can't be written with a known length. The
+// functions below returning a stream then return NULL instead; the page can
+// still be coded with jbig2_encode_generic_sink, which has no such limit.
+// -----------------------------------------------------------------------------
 
 // -----------------------------------------------------------------------------
 // Single page compression
 // -----------------------------------------------------------------------------
 
 // -----------------------------------------------------------------------------
-// Encode an image as a single generic region. This is lossless. It should not
-// be used for images as half-tone coding is not implemented.
+// Encode an image as a single generic region, with template 0. This is
+// lossless. It should not be used for images as half-tone coding is not
+// implemented.
 //
 // see argument comments for jbig2_init
 // duplicate_line_removal: turning this on
@@ -66,6 +86,460 @@ uint8_t *
 jbig2_encode_generic(struct Pix *const bw, const bool full_headers,
                      const int xres, const int yres,
                      const bool duplicate_line_removal,
-                     int *const length);
+                     size_t *const length);
+
+// -----------------------------------------------------------------------------
+// As above, but encodes using the given arithmetic coder context instead of
+// setting up a new one. The context must have been set up with jbig2enc_init
+// and it is reset before returning, so a single context can be reused to
+// encode any number of pages.
+//
+// gbtemplate: the generic region template, 0..3. Templates 1..3 code a few
+// percent larger than template 0, but have smaller contexts and are faster:
+// 2 and 3 use 10 bits of context (1 KiB of coder state instead of 64 KiB).
+// mmr: code the region with MMR (G4) instead (see jbig2mmr.h), which is much
+// faster again but larger. duplicate_line_removal and gbtemplate are then not
+// used.
+//
+// The region only covers the bounding box of the black pixels, the rest of the
+// page being white; a blank page is just the page information segment.
+//
+// WARNING: returns a malloced buffer which the caller must free
+// -----------------------------------------------------------------------------
+uint8_t *
+jbig2_encode_generic_ctx(struct jbig2enc_ctx *ctx, struct Pix *const bw,
+                         const bool full_headers, const int xres,
+                         const int yres, const bool duplicate_line_removal,
+                         const int gbtemplate, const bool mmr,
+                         size_t *const length);
+
+// -----------------------------------------------------------------------------
+// As jbig2_encode_generic_ctx, but taking the ink box of bw from its runs (see
+// jbig2mmr.h) rather than scanning it again, and with MMR coding the runs
+// themselves rather than the rows of the box. runs may be NULL.
+// -----------------------------------------------------------------------------
+uint8_t *
+jbig2_encode_generic_runs(struct jbig2enc_ctx *ctx, struct Pix *const bw,
+                          const struct jbig2_runs *runs,
+                          const bool full_headers, const int xres,
+                          const int yres, const bool duplicate_line_removal,
+                          const int gbtemplate, const bool mmr,
+                          size_t *const length);
+
+// -----------------------------------------------------------------------------
+// The fraction of the coded rows of bw (those from its first to its last black
+// pixel) which are the same as the row above, which TPGD (duplicate line
+// removal) codes with a single bit. 0 for a blank image. If runs isn't NULL,
+// the rows are compared by their runs rather than by scanning bw.
+// -----------------------------------------------------------------------------
+double
+jbig2_duplicate_row_ratio(struct Pix *const bw,
+                          const struct jbig2_runs *runs);
+
+// -----------------------------------------------------------------------------
+// Remove the specks of bw, as scanner noise leaves: the groups of at most size
+// (1 or 2) black pixels, 8-connected, with only white around them. The pixels
+// are worked out a word of 32 at a time, from the three rows around each row
+// (five for pairs), in the same pass which clears the pad bits. Returns the
+// number of pixels removed.
+// -----------------------------------------------------------------------------
+int
+jbig2_despeckle(struct Pix *const bw, const int size);
+
+// -----------------------------------------------------------------------------
+// As jbig2_encode_generic_ctx, but rather than returning the stream, passes it
+// to sink as it is coded, so that it can be written out before the whole page
+// is done. Since the length of the coded data isn't known up front, the region
+// segment uses the unknown data length form (0xffffffff in the segment header,
+// with the data terminated by an end marker and the row count).
+//
+// Returns 0 on success, or -1 if sink failed.
+// -----------------------------------------------------------------------------
+int
+jbig2_encode_generic_sink(struct jbig2enc_ctx *ctx, struct Pix *const bw,
+                          const bool full_headers, const int xres,
+                          const int yres, const bool duplicate_line_removal,
+                          const int gbtemplate, const bool mmr,
+                          jbig2enc_sink sink, void *opaque);
+
+// -----------------------------------------------------------------------------
+// Called by jbig2_encode_generic_rows for each row of the image, from the top.
+// It must store the row in row, in Leptonica's 1bpp packed format
+// ((width + 31) / 32 words). Returns 0 on success.
+// -----------------------------------------------------------------------------
+typedef int (*jbig2_row_reader)(void *opaque, uint32_t *row);
+
+// -----------------------------------------------------------------------------
+// Called by jbig2_encode_generic_rows to start reading the image again from
+// the top row. Returns 0 on success.
+// -----------------------------------------------------------------------------
+typedef int (*jbig2_row_rewind)(void *opaque);
+
+// -----------------------------------------------------------------------------
+// As jbig2_encode_generic_ctx without MMR, but for an image of width x height
+// pixels which is read one row at a time with reader. xres and yres are used
+// as they are. The output is the same as from jbig2_encode_generic_ctx.
+//
+// The ink box of the image is only known once every row has been read. With
+// rewind, the image is then read a second time, up to the last black pixel,
+// to code the box, so that it never has to be in memory as a whole. Without
+// it (rewind is NULL), the rows from the first black pixel on are kept from
+// the first reading: this reads the image only once, but holds it at 1bpp.
+//
+// Returns NULL if reader or rewind failed.
+//
+// WARNING: returns a malloced buffer which the caller must free
+// -----------------------------------------------------------------------------
+uint8_t *
+jbig2_encode_generic_rows(struct jbig2enc_ctx *ctx, const int width,
+                          const int height, const bool full_headers,
+                          const int xres, const int yres,
+                          const bool duplicate_line_removal,
+                          const int gbtemplate, jbig2_row_reader reader,
+                          jbig2_row_rewind rewind, void *opaque,
+                          size_t *const length);
+
+// -----------------------------------------------------------------------------
+// The order of the pixels in each byte of a raw image (see
+// jbig2_encode_generic_raw)
+// -----------------------------------------------------------------------------
+enum {
+  JBIG2_MSB_FIRST = 0,  // the first pixel in the top bit, as in PBM
+  JBIG2_LSB_FIRST = 1   // the first pixel in the bottom bit
+};
+
+// -----------------------------------------------------------------------------
+// As jbig2_encode_generic_ctx without MMR, but for a 1 bpp image of width x
+// height pixels which is given as rows of bytes (1 is black), each stride bytes
+// after the one before, in the bit_order above. This needs no Pix: the rows are
+// read straight into the coder, and the pad bits at the end of each row can be
+// anything, since they are masked off rather than cleared. rows is only read.
+// xres and yres are used as they are.
+//
+// WARNING: returns a malloced buffer which the caller must free
+// -----------------------------------------------------------------------------
+uint8_t *
+jbig2_encode_generic_raw(struct jbig2enc_ctx *ctx, const uint8_t *rows,
+                         const size_t stride, const int width,
+                         const int height, const int bit_order,
+                         const bool full_headers, const int xres,
+                         const int yres, const bool duplicate_line_removal,
+                         const int gbtemplate, size_t *const length);
+
+// -----------------------------------------------------------------------------
+// As jbig2_encode_generic, but splits the bounding box of the black pixels into
+// horizontal stripes of stripe_height rows. Each stripe is a separate immediate generic region at its
+// own y offset and is encoded with its own context, using up to nthreads
+// threads. This costs a few bytes per stripe, but a single huge page can be
+// encoded on several cores.
+//
+// Each thread codes interleave (1..JBIG2_INTERLEAVE_MAX) stripes at a time in
+// a single loop (see jbig2enc_bitimage_interleaved), which may hide the
+// latency of the coder on a core with few threads to run. The output is the
+// same for any interleave. It is ignored with mmr.
+//
+// If stripe_height is <= 0 or not less than the height of the page, this is
+// exactly the same as jbig2_encode_generic_ctx.
+//
+// budget: if >= 0 (and not mmr), the seconds coding may take: once the
+// stripes started so far show that coding them all would take longer, the
+// rest are coded with MMR. Without stripes, this is
+// jbig2_encode_generic_deadline. *path, if path isn't NULL, is set to which
+// coders were used.
+//
+// WARNING: returns a malloced buffer which the caller must free
+// -----------------------------------------------------------------------------
+uint8_t *
+jbig2_encode_generic_striped(struct Pix *const bw, const bool full_headers,
+                             const int xres, const int yres,
+                             const bool duplicate_line_removal,
+                             const int gbtemplate, const bool mmr,
+                             const int stripe_height, int nthreads,
+                             int interleave, const double budget,
+                             int *const path, size_t *const length);
+
+// -----------------------------------------------------------------------------
+// The coders a page with a deadline was coded with
+// -----------------------------------------------------------------------------
+enum {
+  JBIG2_PATH_ARITH = 0,  // the arithmetic coder, for all of it
+  JBIG2_PATH_SWITCHED,  // the arithmetic coder, then MMR for the rest
+  JBIG2_PATH_MMR,  // MMR, for all of it
+};
+
+// -----------------------------------------------------------------------------
+// As jbig2_encode_generic_ctx without MMR, but for a page which must be coded
+// within budget seconds. The rows are coded arithmetically, and the time taken
+// looked at every few dozen of them: once it says that the whole page would
+// take longer than budget, the rest of the rows are a second region, coded
+// with MMR, which is many times faster. With a budget of 0 or less, the page
+// is coded with MMR. A page coded in time is exactly as from
+// jbig2_encode_generic_ctx. *path is set to which coders were used.
+//
+// WARNING: returns a malloced buffer which the caller must free
+// -----------------------------------------------------------------------------
+uint8_t *
+jbig2_encode_generic_deadline(struct jbig2enc_ctx *ctx, struct Pix *const bw,
+                              const bool full_headers, const int xres,
+                              const int yres,
+                              const bool duplicate_line_removal,
+                              const int gbtemplate, const double budget,
+                              int *const path, size_t *const length);
+
+// Density of a band from which jbig2_encode_generic_halftone leaves it to the
+// arithmetic coder: there MMR has so many runs to code that it is no faster,
+// and its output is many times larger
+#define JBIG2_HALFTONE_MMR_MAX_DENSITY 0.3
+
+// -----------------------------------------------------------------------------
+// As jbig2_encode_generic_ctx without MMR, but for a page which may have
+// halftoned or dithered pictures in it, which the arithmetic coder codes
+// several times slower per pixel than text, as it mispredicts most of their
+// pixels. The ink box is taken in bands of a few dozen rows, and the density
+// of each, the fraction of its pixels which differ from the one to their left
+// (counted a word at a time), found. The bands with a density of at least
+// min_density, and below JBIG2_HALFTONE_MMR_MAX_DENSITY, are coded with MMR,
+// which codes the runs of a coarse halftone screen several times faster. Each
+// run of bands of one kind is a region of its own. A page with no such band is
+// exactly as from jbig2_encode_generic_ctx. *mmr_rows, if mmr_rows isn't
+// NULL, is set to the number of rows coded with MMR.
+//
+// Text has a density of about 0.05 at 300 dpi, but up to 0.3 at 150 dpi, so
+// min_density must be above that of the text of the pages.
+//
+// WARNING: returns a malloced buffer which the caller must free
+// -----------------------------------------------------------------------------
+uint8_t *
+jbig2_encode_generic_halftone(struct jbig2enc_ctx *ctx, struct Pix *const bw,
+                              const bool full_headers, const int xres,
+                              const int yres,
+                              const bool duplicate_line_removal,
+                              const int gbtemplate, const double min_density,
+                              int *const mmr_rows, size_t *const length);
+
+// -----------------------------------------------------------------------------
+// Estimate the length of the stream jbig2_encode_generic_ctx would return for
+// bw, for a fraction of the work: only about fraction (0..1) of the rows are
+// coded, in bands spread evenly over the page, each with the contexts left by
+// the bands before it, and the coded bytes are only counted. This is for
+// choosing between JBIG2 and other encodings of an image without coding it
+// whole.
+//
+// Returns the estimate, and sets *error to a bound on how far the length may
+// be from it (twice the standard error of the estimate). Blank pages, a
+// fraction too large to save anything and MMR are coded whole, and their
+// estimate is exact. The context is reset before returning.
+// -----------------------------------------------------------------------------
+int
+jbig2_estimate_size(struct jbig2enc_ctx *ctx, struct Pix *const bw,
+                    const bool full_headers,
+                    const bool duplicate_line_removal, const int gbtemplate,
+                    const bool mmr, const double fraction, int *const error);
+
+// -----------------------------------------------------------------------------
+// Decode a PNG or PNM image held in memory (size bytes at data), threshold it
+// to 1 bpp like the jbig2 program does (pixels darker than bw_threshold are
+// black) and encode it as with jbig2_encode_generic, with template 0. No file is involved, so
+// images can be taken straight from a pipe or another library.
+//
+// Returns NULL if the image can't be decoded.
+//
+// WARNING: returns a malloced buffer which the caller must free
+// -----------------------------------------------------------------------------
+uint8_t *
+jbig2_encode_from_buffer(const uint8_t *data, const size_t size,
+                         const int bw_threshold, const bool full_headers,
+                         const int xres, const int yres,
+                         const bool duplicate_line_removal,
+                         size_t *const length);
+
+// -----------------------------------------------------------------------------
+// Symbol coding (see jbig2sym.h)
+// -----------------------------------------------------------------------------
+struct jbig2_symbols;
+
+// -----------------------------------------------------------------------------
+// Encode the symbol dictionary of all the pages added to symbols, as segment 0
+// with no page association. This is the JBIG2Globals stream of the pages in a
+// PDF, or goes before the first page of a file (see jbig2_file_page).
+//
+// WARNING: returns a malloced buffer which the caller must free
+// -----------------------------------------------------------------------------
+uint8_t *
+jbig2_encode_symbol_dictionary(struct jbig2enc_ctx *ctx,
+                               struct jbig2_symbols *symbols,
+                               size_t *const length);
+
+// -----------------------------------------------------------------------------
+// Encode page pageno of symbols, after its dictionary, as a stream without
+// file headers (as with full_headers false): the page information (segment
+// 1), the text region placing its symbols (segment 2, referring to the
+// dictionary) and, if some of the page couldn't be coded as symbols, a generic
+// region of the rest (segment 3), coded as with jbig2_encode_generic_ctx. What
+// symbols keeps for the page is freed (see jbig2_symbols_page_done).
+//
+// Different pages may be encoded at the same time, with different contexts.
+//
+// WARNING: returns a malloced buffer which the caller must free
+// -----------------------------------------------------------------------------
+uint8_t *
+jbig2_encode_symbol_page(struct jbig2enc_ctx *ctx,
+                         struct jbig2_symbols *symbols, const int pageno,
+                         const bool duplicate_line_removal,
+                         const int gbtemplate, const bool mmr,
+                         size_t *const length);
+
+// -----------------------------------------------------------------------------
+// Refinement of near-duplicate pages (scanned forms, slide decks): a page
+// which is nearly the same as an earlier one, its reference, is coded as the
+// reference, drawn by a text region from a symbol dictionary holding just that
+// bitmap, and refinement regions (6.3) of the bands of rows in which it
+// differs, so that runs of rows which are the same aren't coded at all.
+//
+// As the dictionary must be in the globals, this is only for multi-page files
+// (see below), with the dictionary in the stream of the reference page: its
+// stream is the dictionary followed by its own page, refined against itself.
+// -----------------------------------------------------------------------------
+
+// -----------------------------------------------------------------------------
+// A hash of each row of bw, for comparing pages with jbig2_row_match_ratio.
+// This sets the pad bits of bw to zero.
+//
+// WARNING: returns a malloced array of bw->h hashes which the caller must free
+// -----------------------------------------------------------------------------
+uint64_t *
+jbig2_row_hashes(struct Pix *bw);
+
+// -----------------------------------------------------------------------------
+// The fraction of the rows of two pages of the given height, from their
+// jbig2_row_hashes, which are the same, not counting the rows which are blank
+// on both
+// -----------------------------------------------------------------------------
+double
+jbig2_row_match_ratio(const uint64_t *a, const uint64_t *b, const int height);
+
+// -----------------------------------------------------------------------------
+// Encode the symbol dictionary of a reference page, as segment 0 with no page
+// association: a single symbol of the smallest rectangle holding its black
+// pixels (none if it is blank). The pad bits of bw must be zero, as
+// jbig2_row_hashes leaves them: bw is only read, so that the pages refining it
+// can be coded from other threads at the same time.
+//
+// WARNING: returns a malloced buffer which the caller must free
+// -----------------------------------------------------------------------------
+uint8_t *
+jbig2_encode_reference_dictionary(struct jbig2enc_ctx *ctx,
+                                  const struct Pix *bw, size_t *const length);
+
+// -----------------------------------------------------------------------------
+// Encode bw as a stream without file headers (as with full_headers false)
+// refining reference, a page of the same size: the page information (segment
+// 1), the text region drawing the symbol of reference (segment 2, referring to
+// the dictionary as segment 0) and the refinement regions, from segment 3,
+// with template grtemplate (0 or 1, see jbig2enc_refine). Returns NULL if the
+// pages differ in size. As with jbig2_encode_reference_dictionary, the pad bits
+// of both pages must be zero and neither is written to.
+//
+// WARNING: returns a malloced buffer which the caller must free
+// -----------------------------------------------------------------------------
+uint8_t *
+jbig2_encode_refined_page(struct jbig2enc_ctx *ctx, const struct Pix *bw,
+                          const struct Pix *reference, const int grtemplate,
+                          size_t *const length);
+
+// -----------------------------------------------------------------------------
+// Multi-page files
+//
+// Each page is encoded on its own with full_headers false, and the resulting
+// streams are then joined into a single sequential JBIG2 file: the file header
+// from jbig2_file_header, every page from jbig2_file_page in order and finally
+// the end of file segment from jbig2_file_trailer. Nothing needs to be held
+// besides the page being written, so the file can be written as the pages are
+// finished.
+// -----------------------------------------------------------------------------
+
+// -----------------------------------------------------------------------------
+// The file header of a sequential file of npages pages
+//
+// WARNING: returns a malloced buffer which the caller must free
+// -----------------------------------------------------------------------------
+uint8_t *
+jbig2_file_header(const unsigned npages, size_t *const length);
+
+// -----------------------------------------------------------------------------
+// Rewrite a page stream built with full_headers false (length bytes at data),
+// in which all the segments are associated with page 1 (or with no page) and
+// numbered in order, as page number pageno (from 1) of a file: the segments
+// are renumbered from *segnum, those of page 1 are associated with pageno, and
+// they are followed by an end of page segment. *segnum is advanced past the
+// segments written. References to segments numbered below the first one of
+// the stream, which are earlier in the file (see
+// jbig2_encode_symbol_dictionary), are offset by ref_base.
+//
+// Returns NULL if data isn't such a stream, or has a segment of unknown length
+// (see jbig2_encode_generic_sink).
+//
+// WARNING: returns a malloced buffer which the caller must free
+// -----------------------------------------------------------------------------
+uint8_t *
+jbig2_file_page(const uint8_t *data, const size_t length, const unsigned pageno,
+                const unsigned ref_base, unsigned *const segnum,
+                size_t *const out_length);
+
+// -----------------------------------------------------------------------------
+// The end of file segment, numbered segnum (the *segnum left by the last call
+// to jbig2_file_page)
+//
+// WARNING: returns a malloced buffer which the caller must free
+// -----------------------------------------------------------------------------
+uint8_t *
+jbig2_file_trailer(const unsigned segnum, size_t *const length);
+
+// -----------------------------------------------------------------------------
+// Wrap a page stream built with full_headers false (length bytes at data) as
+// the body of a PDF image XObject:
+//
+//   << /Type /XObject /Subtype /Image /Width <w> /Height <h>
+//      /ColorSpace /DeviceGray /BitsPerComponent 1 /Filter /JBIG2Decode
+//      /Length <length> >>
+//   stream
+//   <data>
+//   endstream
+//
+// with the size of the page from its page information segment, which the
+// stream must start with. Only the object number and the "obj" and "endobj"
+// around it are left for the PDF writer to add. Returns NULL if data doesn't
+// start with a page information segment.
+//
+// WARNING: returns a malloced buffer which the caller must free
+// -----------------------------------------------------------------------------
+uint8_t *
+jbig2_pdf_xobject(const uint8_t *data, const size_t length,
+                  size_t *const out_length);
+
+// -----------------------------------------------------------------------------
+// Decoding, to check the output of the encoder
+//
+// Decode a page stream of generic regions as made by the functions above
+// (with full_headers as it was made with): the page information segment, the
+// immediate generic regions, arithmetically coded with the nominal AT pixels
+// and drawn with OR, and the end of page and end of file segments. The regions
+// may be of unknown length (see jbig2_encode_generic_sink).
+//
+// Returns NULL if the stream has anything else, such as MMR or text regions,
+// or is damaged.
+// -----------------------------------------------------------------------------
+struct Pix *
+jbig2_decode_generic(const uint8_t *data, const size_t length,
+                     const bool full_headers);
+
+// -----------------------------------------------------------------------------
+// Decode a page stream with jbig2_decode_generic and compare it with bw, the
+// image it was made from, a word at a time. Returns 0 if they are the same, 1
+// if they differ, or -1 if the stream can't be decoded.
+// -----------------------------------------------------------------------------
+int
+jbig2_verify_generic(const uint8_t *data, const size_t length,
+                     const bool full_headers, struct Pix *const bw);
 
 #endif  // JBIG2ENC_JBIG2_H__
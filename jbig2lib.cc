@@ -0,0 +1,225 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "jbig2lib.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <allheaders.h>
+#include <pix.h>
+
+#include "jbig2arith.h"
+#include "jbig2enc.h"
+
+#define u32 uint32_t
+#define u8  uint8_t
+
+struct jbig2_encoder {
+  struct jbig2enc_ctx ctx;  // reused from image to image
+  bool full_headers;
+  bool duplicate_line_removal;
+  int gbtemplate;
+  bool mmr;
+  int bw_threshold;
+  int upscale;
+  int xres, yres;
+  u8 *output;  // of the last image, or NULL
+  size_t length;
+  const char *error;  // of the last call which failed
+};
+
+// -----------------------------------------------------------------------------
+// Record msg as the error of enc and return -1
+// -----------------------------------------------------------------------------
+static int
+fail(struct jbig2_encoder *enc, const char *msg) {
+  enc->error = msg;
+  return -1;
+}
+
+// see comments in .h file
+int
+jbig2_encoder_api_version(void) {
+  return JBIG2_ENCODER_API_VERSION;
+}
+
+// see comments in .h file
+struct jbig2_encoder *
+jbig2_encoder_new(void) {
+  struct jbig2_encoder *const enc =
+      (struct jbig2_encoder *) malloc(sizeof(struct jbig2_encoder));
+  if (!enc) return NULL;
+  jbig2enc_init(&enc->ctx);
+  enc->full_headers = true;
+  enc->duplicate_line_removal = false;
+  enc->gbtemplate = 0;
+  enc->mmr = false;
+  enc->bw_threshold = 188;
+  enc->upscale = 1;
+  enc->xres = enc->yres = 0;
+  enc->output = NULL;
+  enc->length = 0;
+  enc->error = "no error";
+  return enc;
+}
+
+// see comments in .h file
+void
+jbig2_encoder_free(struct jbig2_encoder *enc) {
+  if (!enc) return;
+  jbig2enc_dealloc(&enc->ctx);
+  free(enc->output);
+  free(enc);
+}
+
+// see comments in .h file
+int
+jbig2_encoder_set(struct jbig2_encoder *enc, int setting, int value) {
+  switch (setting) {
+    case JBIG2_ENCODER_FULL_HEADERS:
+    case JBIG2_ENCODER_TPGD:
+    case JBIG2_ENCODER_MMR:
+      if (value != 0 && value != 1) return fail(enc, "value not 0 or 1");
+      if (setting == JBIG2_ENCODER_FULL_HEADERS) {
+        enc->full_headers = value;
+      } else if (setting == JBIG2_ENCODER_TPGD) {
+        enc->duplicate_line_removal = value;
+      } else {
+        enc->mmr = value;
+      }
+      return 0;
+    case JBIG2_ENCODER_TEMPLATE:
+      if (value < 0 || value > 3) return fail(enc, "template not 0..3");
+      enc->gbtemplate = value;
+      return 0;
+    case JBIG2_ENCODER_BW_THRESHOLD:
+      if (value < 0 || value > 255) return fail(enc, "threshold not 0..255");
+      enc->bw_threshold = value;
+      return 0;
+    case JBIG2_ENCODER_UPSCALE:
+      if (value != 1 && value != 2 && value != 4) {
+        return fail(enc, "upscale factor not 1, 2 or 4");
+      }
+      enc->upscale = value;
+      return 0;
+    case JBIG2_ENCODER_XRES:
+    case JBIG2_ENCODER_YRES:
+      if (value < 0) return fail(enc, "negative resolution");
+      if (setting == JBIG2_ENCODER_XRES) {
+        enc->xres = value;
+      } else {
+        enc->yres = value;
+      }
+      return 0;
+    default:
+      return fail(enc, "unknown setting");
+  }
+}
+
+// -----------------------------------------------------------------------------
+// Threshold source (which is consumed) to 1 bpp and encode it as the new
+// output of enc
+// -----------------------------------------------------------------------------
+static int
+encode_pix(struct jbig2_encoder *enc, PIX *source) {
+  jbig2_encoder_reset(enc);
+  PIX *bw = pixConvertTo1Transfer(&source, enc->bw_threshold, enc->upscale);
+  if (!bw) return fail(enc, "cannot convert the image to 1 bpp");
+  enc->output = jbig2_encode_generic_ctx(&enc->ctx, bw, enc->full_headers,
+                                         enc->xres, enc->yres,
+                                         enc->duplicate_line_removal,
+                                         enc->gbtemplate, enc->mmr,
+                                         &enc->length);
+  pixDestroy(&bw);
+  if (!enc->output) return fail(enc, "cannot encode the image");
+  return 0;
+}
+
+// see comments in .h file
+int
+jbig2_encoder_encode_image(struct jbig2_encoder *enc, const uint8_t *data,
+                           size_t size) {
+  l_int32 format;
+  if (size < 12 || findFileFormatBuffer(data, &format) ||
+      (format != IFF_PNG && format != IFF_PNM && format != IFF_PNM_GZ)) {
+    return fail(enc, "not a PNG or PNM image");
+  }
+  PIX *const source = pixReadMem(data, size);
+  if (!source) return fail(enc, "cannot decode the image");
+  return encode_pix(enc, source);
+}
+
+// see comments in .h file
+int
+jbig2_encoder_encode_pixels(struct jbig2_encoder *enc, const uint8_t *pixels,
+                            int width, int height, int bpp, size_t stride) {
+  if (bpp != 1 && bpp != 8 && bpp != 32) return fail(enc, "bpp not 1, 8 or 32");
+  if (width <= 0 || height <= 0) return fail(enc, "empty image");
+  const size_t row_bytes = ((size_t) width * bpp + 7) / 8;
+  if (!pixels || stride < row_bytes) return fail(enc, "stride too small");
+  if (bpp == 1 && !enc->mmr) {
+    // coded straight from the rows
+    jbig2_encoder_reset(enc);
+    enc->output = jbig2_encode_generic_raw(&enc->ctx, pixels, stride, width,
+                                           height, JBIG2_MSB_FIRST,
+                                           enc->full_headers, enc->xres,
+                                           enc->yres,
+                                           enc->duplicate_line_removal,
+                                           enc->gbtemplate, &enc->length);
+    if (!enc->output) return fail(enc, "cannot encode the image");
+    return 0;
+  }
+  PIX *const source = pixCreate(width, height, bpp);
+  if (!source) return fail(enc, "out of memory");
+
+  // Leptonica keeps the pixels of each word from its top bit down, so the
+  // bytes of a row go into the words big-endian, whatever the depth.
+  for (int y = 0; y < height; ++y) {
+    const u8 *const src = pixels + (size_t) y * stride;
+    u32 *const dst = source->data + (size_t) y * source->wpl;
+    size_t i = 0;
+    for (; i + 4 <= row_bytes; i += 4) {
+      dst[i / 4] = (u32) src[i] << 24 | (u32) src[i + 1] << 16 |
+                   (u32) src[i + 2] << 8 | src[i + 3];
+    }
+    if (i < row_bytes) {
+      u32 word = 0;
+      for (int k = 0; i + k < row_bytes; ++k) {
+        word |= (u32) src[i + k] << (24 - 8 * k);
+      }
+      dst[i / 4] = word;
+    }
+  }
+  return encode_pix(enc, source);
+}
+
+// see comments in .h file
+const uint8_t *
+jbig2_encoder_output(const struct jbig2_encoder *enc, size_t *length) {
+  *length = enc->output ? enc->length : 0;
+  return enc->output;
+}
+
+// see comments in .h file
+void
+jbig2_encoder_reset(struct jbig2_encoder *enc) {
+  free(enc->output);
+  enc->output = NULL;
+  enc->length = 0;
+}
+
+// see comments in .h file
+const char *
+jbig2_encoder_error(const struct jbig2_encoder *enc) {
+  return enc->error;
+}
@@ -0,0 +1,134 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef JBIG2ENC_JBIG2LIB_H__
+#define JBIG2ENC_JBIG2LIB_H__
+
+// -----------------------------------------------------------------------------
+// The C API of libjbig2enc (built by c-lib.sh), for encoding images in the
+// calling process rather than by running jbig2 on files, e.g. from Python
+// with ctypes or cffi. Only plain C types are used, so that the functions can
+// be called as they are declared here.
+//
+// An encoder holds the coder state and the output of the last image, and is
+// reused for any number of images. There is no global state: different
+// encoders can be used by different threads at the same time, but each one
+// by a single thread at a time.
+//
+// Functions returning int return 0 on success and -1 on error; the message
+// is then given by jbig2_encoder_error.
+// -----------------------------------------------------------------------------
+
+#include <stddef.h>
+#if defined(sun)
+#include <sys/types.h>
+#else
+#include <stdint.h>
+#endif
+
+#if defined(_WIN32) && defined(JBIG2_BUILD_DLL)
+#define JBIG2_API __declspec(dllexport)
+#elif defined(__GNUC__)
+#define JBIG2_API __attribute__((visibility("default")))
+#else
+#define JBIG2_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Changes only if the API changes incompatibly
+#define JBIG2_ENCODER_API_VERSION 1
+
+struct jbig2_encoder;
+
+// -----------------------------------------------------------------------------
+// The settings of an encoder (see jbig2_encoder_set). They are given by number
+// so that new ones can be added without changing the API.
+// -----------------------------------------------------------------------------
+enum {
+  JBIG2_ENCODER_FULL_HEADERS = 1,  // 1 (def) for a JBIG2 file, 0 for the
+                                   // stream of a PDF image (as jbig2 -p)
+  JBIG2_ENCODER_TPGD = 2,  // 1 to use TPGD (duplicate line removal, as -d)
+  JBIG2_ENCODER_TEMPLATE = 3,  // the generic region template, 0 (def) ..3
+  JBIG2_ENCODER_MMR = 4,  // 1 to code with MMR (G4) instead, as --mmr
+  JBIG2_ENCODER_BW_THRESHOLD = 5,  // 0..255: gray samples below it are
+                                   // black (def: 188)
+  JBIG2_ENCODER_UPSCALE = 6,  // 1 (def), 2 or 4: upscale gray and color
+                              // images before thresholding (as -2 and -4)
+  JBIG2_ENCODER_XRES = 7,  // resolution in the page information, in dpi;
+  JBIG2_ENCODER_YRES = 8   // 0 (def) for that of the image
+};
+
+// -----------------------------------------------------------------------------
+// Returns JBIG2_ENCODER_API_VERSION of the library
+// -----------------------------------------------------------------------------
+JBIG2_API int jbig2_encoder_api_version(void);
+
+// -----------------------------------------------------------------------------
+// Returns a new encoder with the default settings, or NULL if out of memory
+// -----------------------------------------------------------------------------
+JBIG2_API struct jbig2_encoder *jbig2_encoder_new(void);
+
+JBIG2_API void jbig2_encoder_free(struct jbig2_encoder *enc);
+
+// -----------------------------------------------------------------------------
+// Change one of the JBIG2_ENCODER_* settings, for the images encoded after it
+// -----------------------------------------------------------------------------
+JBIG2_API int jbig2_encoder_set(struct jbig2_encoder *enc, int setting,
+                                int value);
+
+// -----------------------------------------------------------------------------
+// Encode a PNG or PNM image held in the size bytes at data as a single page
+// -----------------------------------------------------------------------------
+JBIG2_API int jbig2_encoder_encode_image(struct jbig2_encoder *enc,
+                                         const uint8_t *data, size_t size);
+
+// -----------------------------------------------------------------------------
+// Encode an image of width x height pixels at pixels, each row starting stride
+// bytes after the previous one, as a single page. bpp is
+//
+//   1: 8 pixels to a byte, the first one in the top bit; 1 is black (as PBM)
+//   8: a gray sample per byte, 0 being black (as PGM)
+//   32: 4 bytes per pixel, red, green, blue and one which isn't used
+//
+// 8 and 32 bpp images are thresholded with JBIG2_ENCODER_BW_THRESHOLD, as the
+// jbig2 program does. The pixels are only read.
+// -----------------------------------------------------------------------------
+JBIG2_API int jbig2_encoder_encode_pixels(struct jbig2_encoder *enc,
+                                          const uint8_t *pixels, int width,
+                                          int height, int bpp, size_t stride);
+
+// -----------------------------------------------------------------------------
+// Returns the JBIG2 stream of the last image encoded and sets *length to its
+// size, or returns NULL if there is none. The stream belongs to the encoder: it
+// stays valid until the next image is encoded, or _reset or _free is called.
+// -----------------------------------------------------------------------------
+JBIG2_API const uint8_t *jbig2_encoder_output(const struct jbig2_encoder *enc,
+                                              size_t *length);
+
+// -----------------------------------------------------------------------------
+// Free the output of the last image. The settings are kept.
+// -----------------------------------------------------------------------------
+JBIG2_API void jbig2_encoder_reset(struct jbig2_encoder *enc);
+
+// -----------------------------------------------------------------------------
+// Returns a message saying why the last call returning -1 failed
+// -----------------------------------------------------------------------------
+JBIG2_API const char *jbig2_encoder_error(const struct jbig2_encoder *enc);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // JBIG2ENC_JBIG2LIB_H__
@@ -0,0 +1,411 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// -----------------------------------------------------------------------------
+// jbig2micro: microbenchmarks of the arithmetic coder, of the pixel kernels
+// of the pipeline and of the built-in decoder (a baseline for the coder),
+// each on synthetic input of a fixed size, so that a change to one kernel can
+// be judged by a repeatable number. Where jbig2bench times
+// whole pages, this times single functions. Build it with c-micro.sh, which
+// makes the static line kernels of leptonica.c callable from here.
+//
+// Each benchmark is run once to warm up and then -n times; the fastest run
+// is reported, in ns and (on x86, in TSC reference cycles) cycles per unit:
+// per coded bit for the coder, per output byte for jbig2enc_tobuffer and per
+// pixel for everything else.
+// -----------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if !defined(WIN32)
+#include <sys/time.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC
+#endif
+
+#include <allheaders.h>
+#include <pix.h>
+
+#include "jbig2arith.h"
+#include "jbig2synth.h"
+
+static void
+usage(const char *argv0) {
+  fprintf(stderr, "Usage: %s [options] [<benchmark name prefixes>...]\n",
+          argv0);
+  fprintf(stderr, "Times the coder and the pixel kernels on synthetic input. "
+                  "With no names,\nall the benchmarks are run.\n");
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr, "  -n <count>: timed runs of each benchmark (def: 10)\n");
+  fprintf(stderr, "  -l: list the benchmarks\n");
+}
+
+// -----------------------------------------------------------------------------
+// Returns a monotonic time in seconds
+// -----------------------------------------------------------------------------
+static double
+now() {
+#if defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+#else
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+#endif
+}
+
+static inline uint64_t
+cycles() {
+#ifdef HAVE_RDTSC
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+// The size of the synthetic pages: A4 at 300 dpi
+enum { PAGE_W = 2480, PAGE_H = 3508 };
+
+// Decisions coded by each run of the coder benchmarks
+enum { CODER_BITS = 1 << 22 };
+
+// -----------------------------------------------------------------------------
+// The inputs shared by the benchmarks, made once by make_inputs
+// -----------------------------------------------------------------------------
+struct inputs {
+  uint8_t *bits[4];  // CODER_BITS decisions of each LPS probability
+  PIX *bw[3];  // blank, text and random 1 bpp pages
+  PIX *gray4, *gray8;  // a text page as 4 and 8 bpp gray
+  PIX *gray_half, *gray_quarter;  // 8 bpp sources for 2x and 4x upscaling
+  PIX *rgb;  // 32 bpp
+  PIX *cmapped;  // 8 bpp with a gray colormap
+  PIX *out1;  // 1 bpp page for the outputs of the line kernels
+  struct jbig2enc_ctx ctx;
+  uint8_t *buffer;  // for jbig2enc_tobuffer
+  uint8_t *coded[3];  // the bw pages coded, for the decoder
+  size_t coded_length[3];
+};
+
+static struct inputs in;
+
+static const double lps_probability[4] = {0.5, 0.1, 0.01, 0.001};
+static const char *const bw_kinds[3] = {"blank", "text", "random"};
+
+// -----------------------------------------------------------------------------
+// Make a gray page of depth d (4, 8 or 32) from the 1 bpp page bw, with the
+// edges of the ink softened by noise, as a scan would have
+// -----------------------------------------------------------------------------
+static PIX *
+make_gray(PIX *bw, int w, int h, int d) {
+  PIX *pix = pixCreate(w, h, d);
+  if (!pix) abort();
+  uint32_t state = 0x9e3779b9;
+  const int max = d == 4 ? 15 : 255;
+  for (int y = 0; y < h; ++y) {
+    const uint32_t *src = bw->data + (y * bw->h / h) * bw->wpl;
+    uint32_t *line = pix->data + y * pix->wpl;
+    for (int x = 0; x < w; ++x) {
+      const int sx = x * bw->w / w;
+      const bool black = (src[sx >> 5] >> (31 - (sx & 31))) & 1;
+      const int noise = jbig2_next_random(&state) % (max / 4 + 1);
+      const int v = black ? noise : max - noise;
+      if (d == 4) {
+        SET_DATA_QBIT(line, x, v);
+      } else if (d == 8) {
+        SET_DATA_BYTE(line, x, v);
+      } else {
+        line[x] = ((uint32_t) v << 24) | ((uint32_t) v << 16) |
+                  ((uint32_t) (max - v / 2) << 8);
+      }
+    }
+  }
+  return pix;
+}
+
+static void
+make_inputs() {
+  for (int k = 0; k < 4; ++k) {
+    in.bits[k] = (uint8_t *) malloc(CODER_BITS);
+    if (!in.bits[k]) abort();
+    uint32_t state = 0x2545f491 + k;
+    const uint32_t limit = (uint32_t) (lps_probability[k] * 4294967295.0);
+    for (int i = 0; i < CODER_BITS; ++i) {
+      in.bits[k][i] = jbig2_next_random(&state) < limit;
+    }
+  }
+  for (int k = 0; k < 3; ++k) {
+    in.bw[k] = jbig2_make_synthetic(bw_kinds[k], PAGE_W, PAGE_H);
+    if (!in.bw[k]) abort();
+  }
+  in.gray4 = make_gray(in.bw[1], PAGE_W, PAGE_H, 4);
+  in.gray8 = make_gray(in.bw[1], PAGE_W, PAGE_H, 8);
+  in.gray_half = make_gray(in.bw[1], PAGE_W / 2, PAGE_H / 2, 8);
+  in.gray_quarter = make_gray(in.bw[1], PAGE_W / 4, PAGE_H / 4, 8);
+  in.rgb = make_gray(in.bw[1], PAGE_W, PAGE_H, 32);
+  in.cmapped = pixCopy(NULL, in.gray8);
+  PIXCMAP *cmap = pixcmapCreate(8);
+  for (int v = 0; v < 256; ++v) pixcmapAddColor(cmap, v, v, v);
+  pixSetColormap(in.cmapped, cmap);
+  in.out1 = pixCreate(PAGE_W, PAGE_H, 1);
+  if (!in.cmapped || !in.out1) abort();
+
+  // a coded text page for jbig2enc_tobuffer
+  jbig2enc_init(&in.ctx);
+  jbig2enc_bitimage(&in.ctx, (const uint8_t *) in.bw[1]->data, PAGE_W, PAGE_H,
+                    false, 0);
+  jbig2enc_final(&in.ctx);
+  in.buffer = (uint8_t *) malloc(jbig2enc_datasize(&in.ctx));
+  if (!in.buffer) abort();
+
+  // the bw pages coded for the decoder, which must give them back
+  for (int k = 0; k < 3; ++k) {
+    struct jbig2enc_ctx ctx;
+    jbig2enc_init(&ctx);
+    jbig2enc_bitimage(&ctx, (const uint8_t *) in.bw[k]->data, PAGE_W, PAGE_H,
+                      false, 0);
+    jbig2enc_final(&ctx);
+    in.coded_length[k] = jbig2enc_datasize(&ctx);
+    in.coded[k] = (uint8_t *) malloc(in.coded_length[k]);
+    if (!in.coded[k]) abort();
+    jbig2enc_tobuffer(&ctx, in.coded[k]);
+    jbig2enc_dealloc(&ctx);
+    struct jbig2dec_ctx dec;
+    jbig2dec_init(&dec, in.coded[k], in.coded_length[k]);
+    jbig2dec_bitimage(&dec, (uint8_t *) in.out1->data, PAGE_W, PAGE_H, false,
+                      0);
+    jbig2dec_dealloc(&dec);
+    if (memcmp(in.out1->data, in.bw[k]->data,
+               (size_t) in.bw[k]->wpl * 4 * PAGE_H)) {
+      fprintf(stderr, "the decoder doesn't give the %s page back\n",
+              bw_kinds[k]);
+      abort();
+    }
+  }
+}
+
+static void
+free_inputs() {
+  for (int k = 0; k < 4; ++k) free(in.bits[k]);
+  for (int k = 0; k < 3; ++k) pixDestroy(&in.bw[k]);
+  pixDestroy(&in.gray4);
+  pixDestroy(&in.gray8);
+  pixDestroy(&in.gray_half);
+  pixDestroy(&in.gray_quarter);
+  pixDestroy(&in.rgb);
+  pixDestroy(&in.cmapped);
+  pixDestroy(&in.out1);
+  jbig2enc_dealloc(&in.ctx);
+  free(in.buffer);
+  for (int k = 0; k < 3; ++k) free(in.coded[k]);
+}
+
+// -----------------------------------------------------------------------------
+// The benchmarks. Each does one run and returns the number of units done.
+// -----------------------------------------------------------------------------
+
+// encode_bit, and with it byteout and emit, on CODER_BITS decisions in one
+// context, an LPS probability of lps_probability[k]
+static double
+run_coder(int k) {
+  struct jbig2enc_ctx ctx;
+  jbig2enc_init(&ctx);
+  jbig2enc_bits(&ctx, 0, in.bits[k], CODER_BITS);
+  jbig2enc_final(&ctx);
+  jbig2enc_dealloc(&ctx);
+  return CODER_BITS;
+}
+
+static double
+run_bitimage(int k) {
+  struct jbig2enc_ctx ctx;
+  jbig2enc_init(&ctx);
+  jbig2enc_bitimage(&ctx, (const uint8_t *) in.bw[k]->data, PAGE_W, PAGE_H,
+                    false, 0);
+  jbig2enc_final(&ctx);
+  jbig2enc_dealloc(&ctx);
+  return (double) PAGE_W * PAGE_H;
+}
+
+// jbig2dec_bitimage on the page run_bitimage codes, into out1
+static double
+run_decode(int k) {
+  struct jbig2dec_ctx dec;
+  jbig2dec_init(&dec, in.coded[k], in.coded_length[k]);
+  jbig2dec_bitimage(&dec, (uint8_t *) in.out1->data, PAGE_W, PAGE_H, false, 0);
+  jbig2dec_dealloc(&dec);
+  return (double) PAGE_W * PAGE_H;
+}
+
+static double
+run_tobuffer(int) {
+  jbig2enc_tobuffer(&in.ctx, in.buffer);
+  return jbig2enc_datasize(&in.ctx);
+}
+
+// thresholdToBinaryLineLow on every line of a page of depth d (4 or 8)
+static double
+run_threshold(int d) {
+  PIX *gray = d == 4 ? in.gray4 : in.gray8;
+  const int thresh = d == 4 ? 8 : 128;
+  for (int y = 0; y < PAGE_H; ++y) {
+    thresholdToBinaryLineLow(in.out1->data + y * in.out1->wpl, PAGE_W,
+                             gray->data + y * gray->wpl, d, thresh);
+  }
+  return (double) PAGE_W * PAGE_H;
+}
+
+// scaleGray{2,4}xLIThreshLineLow, the fused upscale and threshold, by factor f
+// to a full page; the units are the output pixels
+static double
+run_upscale(int f) {
+  PIX *gray = f == 2 ? in.gray_half : in.gray_quarter;
+  const int ws = gray->w, hs = gray->h, wpld = in.out1->wpl;
+  for (int i = 0; i < hs; ++i) {
+    uint32_t *lined = in.out1->data + f * i * wpld;
+    uint32_t *lines = gray->data + i * gray->wpl;
+    if (f == 2) {
+      scaleGray2xLIThreshLineLow(lined, wpld, lines, ws, gray->wpl,
+                                 i == hs - 1, 128);
+    } else {
+      scaleGray4xLIThreshLineLow(lined, wpld, lines, ws, gray->wpl,
+                                 i == hs - 1, 128);
+    }
+  }
+  return (double) f * ws * f * hs;
+}
+
+static double
+run_rgb_to_gray(int) {
+  PIX *gray = pixConvertRGBToGrayFast(in.rgb);
+  if (!gray) abort();
+  pixDestroy(&gray);
+  return (double) PAGE_W * PAGE_H;
+}
+
+static double
+run_remove_colormap(int) {
+  PIX *gray = pixRemoveColormap(in.cmapped, REMOVE_CMAP_BASED_ON_SRC);
+  if (!gray) abort();
+  pixDestroy(&gray);
+  return (double) PAGE_W * PAGE_H;
+}
+
+struct benchmark {
+  const char *name;
+  const char *unit;
+  double (*run)(int arg);
+  int arg;
+};
+
+static const struct benchmark benchmarks[] = {
+  {"coder/p0.5", "bit", run_coder, 0},
+  {"coder/p0.1", "bit", run_coder, 1},
+  {"coder/p0.01", "bit", run_coder, 2},
+  {"coder/p0.001", "bit", run_coder, 3},
+  {"bitimage/blank", "pixel", run_bitimage, 0},
+  {"bitimage/text", "pixel", run_bitimage, 1},
+  {"bitimage/random", "pixel", run_bitimage, 2},
+  {"decode/blank", "pixel", run_decode, 0},
+  {"decode/text", "pixel", run_decode, 1},
+  {"decode/random", "pixel", run_decode, 2},
+  {"tobuffer", "byte", run_tobuffer, 0},
+  {"threshold/4bpp", "pixel", run_threshold, 4},
+  {"threshold/8bpp", "pixel", run_threshold, 8},
+  {"upscale/2x", "pixel", run_upscale, 2},
+  {"upscale/4x", "pixel", run_upscale, 4},
+  {"rgbtogray", "pixel", run_rgb_to_gray, 0},
+  {"removecmap", "pixel", run_remove_colormap, 0},
+};
+
+static const int nbenchmarks = sizeof(benchmarks) / sizeof(benchmarks[0]);
+
+// -----------------------------------------------------------------------------
+// Returns true if the benchmark name starts with one of the n prefixes, or if
+// there are none
+// -----------------------------------------------------------------------------
+static bool
+selected(const char *name, char *const *prefixes, int n) {
+  if (n == 0) return true;
+  for (int k = 0; k < n; ++k) {
+    if (strncmp(name, prefixes[k], strlen(prefixes[k])) == 0) return true;
+  }
+  return false;
+}
+
+int
+main(int argc, char **argv) {
+  int repeat = 10;
+  int i;
+
+  for (i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+      usage(argv[0]);
+      return 0;
+    } else if (strcmp(argv[i], "-l") == 0) {
+      for (int b = 0; b < nbenchmarks; ++b) printf("%s\n", benchmarks[b].name);
+      return 0;
+    } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      repeat = atoi(argv[++i]);
+      if (repeat < 1) {
+        fprintf(stderr, "Invalid repeat count: %s\n", argv[i]);
+        return 1;
+      }
+    } else {
+      break;
+    }
+  }
+  char *const *prefixes = argv + i;
+  const int nprefixes = argc - i;
+
+  make_inputs();
+  printf("%-20s %6s %10s %10s %10s\n", "benchmark", "unit", "ms/run",
+         "ns/unit", "cycles/unit");
+  int ran = 0;
+  for (int b = 0; b < nbenchmarks; ++b) {
+    const struct benchmark *bench = &benchmarks[b];
+    if (!selected(bench->name, prefixes, nprefixes)) continue;
+    bench->run(bench->arg);  // warm up the caches and the allocator
+    double best = 0, units = 0;
+    uint64_t best_cycles = 0;
+    for (int run = 0; run < repeat; ++run) {
+      const uint64_t c = cycles();
+      const double t = now();
+      units = bench->run(bench->arg);
+      const double seconds = now() - t;
+      if (run == 0 || seconds < best) {
+        best = seconds;
+        best_cycles = cycles() - c;
+      }
+    }
+    printf("%-20s %6s %10.3f %10.3f", bench->name, bench->unit, best * 1e3,
+           units > 0 ? best * 1e9 / units : 0.0);
+#ifdef HAVE_RDTSC
+    printf(" %10.3f\n", units > 0 ? best_cycles / units : 0.0);
+#else
+    printf(" %10s\n", "-");
+#endif
+    ran++;
+  }
+  free_inputs();
+
+  if (!ran) {
+    fprintf(stderr, "No benchmark matches\n");
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,712 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "jbig2mmr.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "jbig2arith.h"
+
+#define u32 uint32_t
+#define u16 uint16_t
+#define u8  uint8_t
+
+#if defined(__GNUC__)
+#define clz32(x) __builtin_clz(x)
+#else
+static inline int
+clz32(u32 x) {
+  int n = 0;
+  while (!(x & 0x80000000u)) {
+    x <<= 1;
+    n++;
+  }
+  return n;
+}
+#endif
+
+// -----------------------------------------------------------------------------
+// A code of the T.4 tables: the bits are the low len bits of code
+// -----------------------------------------------------------------------------
+struct mmr_code {
+  u16 code;
+  u8 len;
+};
+
+// Terminating codes for runs of 0..63 pixels (T.4, table 2)
+static const struct mmr_code white_terminating[64] = {
+  {0x35, 8}, {0x07, 6}, {0x07, 4}, {0x08, 4}, {0x0b, 4}, {0x0c, 4},
+  {0x0e, 4}, {0x0f, 4}, {0x13, 5}, {0x14, 5}, {0x07, 5}, {0x08, 5},
+  {0x08, 6}, {0x03, 6}, {0x34, 6}, {0x35, 6}, {0x2a, 6}, {0x2b, 6},
+  {0x27, 7}, {0x0c, 7}, {0x08, 7}, {0x17, 7}, {0x03, 7}, {0x04, 7},
+  {0x28, 7}, {0x2b, 7}, {0x13, 7}, {0x24, 7}, {0x18, 7}, {0x02, 8},
+  {0x03, 8}, {0x1a, 8}, {0x1b, 8}, {0x12, 8}, {0x13, 8}, {0x14, 8},
+  {0x15, 8}, {0x16, 8}, {0x17, 8}, {0x28, 8}, {0x29, 8}, {0x2a, 8},
+  {0x2b, 8}, {0x2c, 8}, {0x2d, 8}, {0x04, 8}, {0x05, 8}, {0x0a, 8},
+  {0x0b, 8}, {0x52, 8}, {0x53, 8}, {0x54, 8}, {0x55, 8}, {0x24, 8},
+  {0x25, 8}, {0x58, 8}, {0x59, 8}, {0x5a, 8}, {0x5b, 8}, {0x4a, 8},
+  {0x4b, 8}, {0x32, 8}, {0x33, 8}, {0x34, 8},
+};
+
+static const struct mmr_code black_terminating[64] = {
+  {0x37, 10}, {0x02, 3}, {0x03, 2}, {0x02, 2}, {0x03, 3}, {0x03, 4},
+  {0x02, 4}, {0x03, 5}, {0x05, 6}, {0x04, 6}, {0x04, 7}, {0x05, 7},
+  {0x07, 7}, {0x04, 8}, {0x07, 8}, {0x18, 9}, {0x17, 10}, {0x18, 10},
+  {0x08, 10}, {0x67, 11}, {0x68, 11}, {0x6c, 11}, {0x37, 11}, {0x28, 11},
+  {0x17, 11}, {0x18, 11}, {0xca, 12}, {0xcb, 12}, {0xcc, 12}, {0xcd, 12},
+  {0x68, 12}, {0x69, 12}, {0x6a, 12}, {0x6b, 12}, {0xd2, 12}, {0xd3, 12},
+  {0xd4, 12}, {0xd5, 12}, {0xd6, 12}, {0xd7, 12}, {0x6c, 12}, {0x6d, 12},
+  {0xda, 12}, {0xdb, 12}, {0x54, 12}, {0x55, 12}, {0x56, 12}, {0x57, 12},
+  {0x64, 12}, {0x65, 12}, {0x52, 12}, {0x53, 12}, {0x24, 12}, {0x37, 12},
+  {0x38, 12}, {0x27, 12}, {0x28, 12}, {0x58, 12}, {0x59, 12}, {0x2b, 12},
+  {0x2c, 12}, {0x5a, 12}, {0x66, 12}, {0x67, 12},
+};
+
+// Make-up codes for runs of 64, 128, ... 1728 pixels (T.4, table 3)
+static const struct mmr_code white_makeup[27] = {
+  {0x1b, 5}, {0x12, 5}, {0x17, 6}, {0x37, 7}, {0x36, 8}, {0x37, 8},
+  {0x64, 8}, {0x65, 8}, {0x68, 8}, {0x67, 8}, {0xcc, 9}, {0xcd, 9},
+  {0xd2, 9}, {0xd3, 9}, {0xd4, 9}, {0xd5, 9}, {0xd6, 9}, {0xd7, 9},
+  {0xd8, 9}, {0xd9, 9}, {0xda, 9}, {0xdb, 9}, {0x98, 9}, {0x99, 9},
+  {0x9a, 9}, {0x18, 6}, {0x9b, 9},
+};
+
+static const struct mmr_code black_makeup[27] = {
+  {0x0f, 10}, {0xc8, 12}, {0xc9, 12}, {0x5b, 12}, {0x33, 12}, {0x34, 12},
+  {0x35, 12}, {0x6c, 13}, {0x6d, 13}, {0x4a, 13}, {0x4b, 13}, {0x4c, 13},
+  {0x4d, 13}, {0x72, 13}, {0x73, 13}, {0x74, 13}, {0x75, 13}, {0x76, 13},
+  {0x77, 13}, {0x52, 13}, {0x53, 13}, {0x54, 13}, {0x55, 13}, {0x5a, 13},
+  {0x5b, 13}, {0x64, 13}, {0x65, 13},
+};
+
+// Make-up codes for runs of 1792, 1856, ... 2560 pixels of either colour
+// (T.4, table 4)
+static const struct mmr_code extended_makeup[13] = {
+  {0x08, 11}, {0x0c, 11}, {0x0d, 11}, {0x12, 12}, {0x13, 12}, {0x14, 12},
+  {0x15, 12}, {0x16, 12}, {0x17, 12}, {0x1c, 12}, {0x1d, 12}, {0x1e, 12},
+  {0x1f, 12},
+};
+
+// Vertical mode codes for a1 - b1 = -3..3 (T.4, table 4)
+static const struct mmr_code vertical[7] = {
+  {0x02, 7}, {0x02, 6}, {0x02, 3}, {0x01, 1}, {0x03, 3}, {0x03, 6},
+  {0x03, 7},
+};
+
+static const struct mmr_code pass_code = {0x1, 4};
+static const struct mmr_code horizontal_code = {0x1, 3};
+static const struct mmr_code eol_code = {0x1, 12};
+
+// -----------------------------------------------------------------------------
+// The bits are collected in a small buffer, which is appended to the output of
+// the context when it fills up.
+// -----------------------------------------------------------------------------
+#define MMR_BUFFER_SIZE 4096
+
+struct mmr_writer {
+  struct jbig2enc_ctx *ctx;
+  u32 bits;  // the low nbits bits are still to be written
+  int nbits;
+  int used;
+  u8 buffer[MMR_BUFFER_SIZE];
+};
+
+static inline void
+put_code(struct mmr_writer *w, struct mmr_code c) {
+  w->bits = (w->bits << c.len) | c.code;
+  w->nbits += c.len;
+  while (w->nbits >= 8) {
+    w->nbits -= 8;
+    w->buffer[w->used++] = w->bits >> w->nbits;
+    if (w->used == MMR_BUFFER_SIZE) {
+      jbig2enc_putbytes(w->ctx, w->buffer, w->used);
+      w->used = 0;
+    }
+  }
+}
+
+// -----------------------------------------------------------------------------
+// Code a run of n pixels of the given colour (1 for black) for horizontal mode
+// -----------------------------------------------------------------------------
+static void
+put_run(struct mmr_writer *w, int black, int n) {
+  while (n >= 2560 + 64) {
+    put_code(w, extended_makeup[12]);
+    n -= 2560;
+  }
+  if (n >= 64) {
+    const int m = n >> 6;
+    if (m <= 27) {
+      put_code(w, black ? black_makeup[m - 1] : white_makeup[m - 1]);
+    } else {
+      put_code(w, extended_makeup[m - 28]);
+    }
+    n &= 63;
+  }
+  put_code(w, black ? black_terminating[n] : white_terminating[n]);
+}
+
+// Number of entries at the end of each list of changes, all at the width of
+// the row, so that the coding loop can look ahead without checking the end
+#define MMR_SENTINELS 4
+
+// -----------------------------------------------------------------------------
+// Find the changing elements of a row of width w: the pixels which aren't the
+// same colour as the pixel before them, where the pixel before the row is
+// white. They are found a word at a time: the bits of row ^ (row >> 1) are the
+// changes, which are counted off with count-leading-zeros. Changes are stored
+// in changes, followed by the sentinels, and the number of them is returned.
+// Changes at even indices are to black, those at odd indices to white.
+// -----------------------------------------------------------------------------
+static int
+find_changes(const u32 *row, int w, int *changes) {
+  const int words = (w + 31) / 32;
+  int n = 0;
+  u32 last = 0;  // the last pixel of the previous word, in bit 31
+  for (int i = 0; i < words; ++i) {
+    const u32 word = row[i];
+    u32 diff = word ^ ((word >> 1) | last);
+    last = word << 31;
+    while (diff) {
+      const int b = clz32(diff);
+      changes[n++] = i * 32 + b;
+      diff ^= 0x80000000u >> b;
+    }
+  }
+  // the pad bits are white, which adds a change at w after a black pixel
+  if (n && changes[n - 1] >= w) n--;
+  for (int i = 0; i < MMR_SENTINELS; ++i) changes[n + i] = w;
+  return n;
+}
+
+// -----------------------------------------------------------------------------
+// Code a row with the two-dimensional coding of T.4 (4.2), given the changes of
+// it (a) and of the row above it (b), as made by find_changes
+// -----------------------------------------------------------------------------
+static void
+code_row(struct mmr_writer *wr, const int *a, const int *b, int w) {
+  int a0 = -1;  // the imaginary white pixel before the row
+  int color = 0;  // of a0; 1 for black
+  int ia = 0;  // index in a of a1, the first change after a0
+  int ib = 0;  // index in b of the first change after a0
+
+  while (a0 < w) {
+    while (b[ib] <= a0) ib++;
+    // b1 is the first change after a0 to the opposite colour of a0
+    const int i = (ib & 1) == color ? ib : ib + 1;
+    const int b1 = b[i], b2 = b[i + 1];
+    const int a1 = a[ia];
+
+    if (b2 < a1) {
+      put_code(wr, pass_code);
+      a0 = b2;
+    } else if (a1 - b1 >= -3 && a1 - b1 <= 3) {
+      put_code(wr, vertical[a1 - b1 + 3]);
+      a0 = a1;
+      color ^= 1;
+      ia++;
+    } else {
+      const int a2 = a[ia + 1];
+      put_code(wr, horizontal_code);
+      put_run(wr, color, a1 - (a0 < 0 ? 0 : a0));
+      put_run(wr, color ^ 1, a2 - a1);
+      a0 = a2;
+      ia += 2;
+    }
+  }
+}
+
+// -----------------------------------------------------------------------------
+// Start and finish the output of an image coded into ctx
+// -----------------------------------------------------------------------------
+static struct mmr_writer *
+new_writer(struct jbig2enc_ctx *ctx) {
+  struct mmr_writer *const wr =
+      (struct mmr_writer *) malloc(sizeof(struct mmr_writer));
+  if (!wr) abort();
+  wr->ctx = ctx;
+  wr->bits = 0;
+  wr->nbits = 0;
+  wr->used = 0;
+  return wr;
+}
+
+static void
+finish_writer(struct mmr_writer *wr) {
+  // EOFB, padded with zero bits to a byte
+  put_code(wr, eol_code);
+  put_code(wr, eol_code);
+  if (wr->nbits) {
+    const struct mmr_code pad = {0, (u8) (8 - wr->nbits)};
+    put_code(wr, pad);
+  }
+  jbig2enc_putbytes(wr->ctx, wr->buffer, wr->used);
+  free(wr);
+}
+
+// see comments in .h file
+void
+jbig2enc_mmrimage(struct jbig2enc_ctx *ctx, const u8 *data, int mx, int my) {
+  const u32 *const rows = (const u32 *) data;
+  const int words_per_row = (mx + 31) / 32;
+  // the changes of each row can number up to mx, plus the sentinels
+  int *const lists = (int *) malloc(sizeof(int) * 2 * (mx + MMR_SENTINELS));
+  if (!lists) abort();
+  int *ref = lists;
+  int *cur = lists + mx + MMR_SENTINELS;
+  // the row above the first one is white: it has no changes
+  for (int i = 0; i < MMR_SENTINELS; ++i) ref[i] = mx;
+
+  struct mmr_writer *const wr = new_writer(ctx);
+  for (int y = 0; y < my; ++y) {
+    find_changes(rows + (size_t) y * words_per_row, mx, cur);
+    code_row(wr, cur, ref, mx);
+    int *const t = ref;
+    ref = cur;
+    cur = t;
+  }
+  finish_writer(wr);
+  free(lists);
+}
+
+// see comments in .h file
+void
+jbig2enc_mmrruns(struct jbig2enc_ctx *ctx, const struct jbig2_runs *runs,
+                 int x, int y, int w, int h) {
+  int *const lists = (int *) malloc(sizeof(int) * 2 * (w + MMR_SENTINELS));
+  if (!lists) abort();
+  int *ref = lists;
+  int *cur = lists + w + MMR_SENTINELS;
+  for (int i = 0; i < MMR_SENTINELS; ++i) ref[i] = w;
+
+  struct mmr_writer *const wr = new_writer(ctx);
+  for (int row = y; row < y + h; ++row) {
+    // no change is left of x; one at x + w is after a black pixel at the
+    // right edge, which the white pad bits would end
+    const int *const changes = runs->changes + runs->start[row];
+    const int count = (int) (runs->start[row + 1] - runs->start[row]);
+    int n = 0;
+    while (n < count && changes[n] - x < w) {
+      cur[n] = changes[n] - x;
+      n++;
+    }
+    for (int i = 0; i < MMR_SENTINELS; ++i) cur[n + i] = w;
+    code_row(wr, cur, ref, w);
+    int *const t = ref;
+    ref = cur;
+    cur = t;
+  }
+  finish_writer(wr);
+  free(lists);
+}
+
+// see comments in .h file
+struct jbig2_runs *
+jbig2_runs_new(const uint32_t *rows, int w, int h, int wpl) {
+  struct jbig2_runs *const runs =
+      (struct jbig2_runs *) malloc(sizeof(struct jbig2_runs));
+  if (!runs) abort();
+  runs->width = w;
+  runs->height = h;
+  runs->start = (size_t *) malloc(sizeof(size_t) * (h + 1));
+  if (!runs->start) abort();
+  // Text is a few changes per word at most: start with room for one change
+  // in 8 pixels, and grow as needed. find_changes writes a full row of
+  // changes and the sentinels, so that much is always kept free.
+  size_t capacity = (size_t) w * h / 8 + w + MMR_SENTINELS;
+  runs->changes = (int *) malloc(sizeof(int) * capacity);
+  if (!runs->changes) abort();
+  runs->top = runs->bottom = -1;
+  runs->left = w;
+  runs->right = -1;
+
+  size_t n = 0;
+  for (int y = 0; y < h; ++y) {
+    if (n + w + MMR_SENTINELS > capacity) {
+      capacity = capacity * 2 + w + MMR_SENTINELS;
+      runs->changes = (int *) realloc(runs->changes, sizeof(int) * capacity);
+      if (!runs->changes) abort();
+    }
+    runs->start[y] = n;
+    int *const changes = runs->changes + n;
+    const int count = find_changes(rows + (size_t) y * wpl, w, changes);
+    n += count;
+    if (!count) continue;
+    if (runs->top < 0) runs->top = y;
+    runs->bottom = y;
+    if (changes[0] < runs->left) runs->left = changes[0];
+    // an odd number of changes leaves the row black to its end
+    const int right = count & 1 ? w - 1 : changes[count - 1] - 1;
+    if (right > runs->right) runs->right = right;
+  }
+  runs->start[h] = n;
+  if (runs->top < 0) runs->left = 0;
+  return runs;
+}
+
+// see comments in .h file
+void
+jbig2_runs_free(struct jbig2_runs *runs) {
+  if (!runs) return;
+  free(runs->changes);
+  free(runs->start);
+  free(runs);
+}
+
+// -----------------------------------------------------------------------------
+// Decoding. The codes are looked up by the next bits of the data: a table for
+// each colour of run maps the next RUN_LOOKUP_BITS bits to the length of the
+// run (or make-up) of the code they start with, and the length of that code.
+// Another maps the next MODE_LOOKUP_BITS bits to the 2D mode of the code they
+// start with.
+// -----------------------------------------------------------------------------
+#define RUN_LOOKUP_BITS 13
+#define MODE_LOOKUP_BITS 7
+
+enum {
+  RUN_INVALID = -1,
+  RUN_EOL = -2,
+};
+
+// modes 0..6 are vertical, with a1 - b1 = -3..3
+enum {
+  MODE_PASS = 7,
+  MODE_HORIZONTAL,
+  MODE_EXTENSION,  // of uncompressed mode, which isn't supported
+  MODE_INVALID,
+};
+
+struct mmr_lookup {
+  int16_t value;
+  u8 len;
+};
+
+struct ccitt_tables {
+  struct mmr_lookup runs[2][1 << RUN_LOOKUP_BITS];  // white, black
+  struct mmr_lookup modes[1 << MODE_LOOKUP_BITS];
+  u8 reverse[256];  // the bits of each byte in the reverse order
+};
+
+static void
+fill_lookup(struct mmr_lookup *table, int bits, struct mmr_code c,
+            int value) {
+  const int shift = bits - c.len;
+  for (int i = 0; i < 1 << shift; ++i) {
+    table[(c.code << shift) | i].value = value;
+    table[(c.code << shift) | i].len = c.len;
+  }
+}
+
+static const struct ccitt_tables *
+build_ccitt_tables() {
+  struct ccitt_tables *const t =
+      (struct ccitt_tables *) malloc(sizeof(struct ccitt_tables));
+  if (!t) abort();
+  for (int c = 0; c < 2; ++c) {
+    struct mmr_lookup *const runs = t->runs[c];
+    for (int i = 0; i < 1 << RUN_LOOKUP_BITS; ++i) {
+      runs[i].value = RUN_INVALID;
+      runs[i].len = 0;
+    }
+    const struct mmr_code *const terminating =
+        c ? black_terminating : white_terminating;
+    const struct mmr_code *const makeup = c ? black_makeup : white_makeup;
+    for (int n = 0; n < 64; ++n)
+      fill_lookup(runs, RUN_LOOKUP_BITS, terminating[n], n);
+    for (int m = 0; m < 27; ++m)
+      fill_lookup(runs, RUN_LOOKUP_BITS, makeup[m], (m + 1) * 64);
+    for (int m = 0; m < 13; ++m)
+      fill_lookup(runs, RUN_LOOKUP_BITS, extended_makeup[m], 1792 + m * 64);
+    fill_lookup(runs, RUN_LOOKUP_BITS, eol_code, RUN_EOL);
+  }
+  for (int i = 0; i < 1 << MODE_LOOKUP_BITS; ++i) {
+    t->modes[i].value = MODE_INVALID;
+    t->modes[i].len = 0;
+  }
+  for (int k = 0; k < 7; ++k)
+    fill_lookup(t->modes, MODE_LOOKUP_BITS, vertical[k], k);
+  fill_lookup(t->modes, MODE_LOOKUP_BITS, pass_code, MODE_PASS);
+  fill_lookup(t->modes, MODE_LOOKUP_BITS, horizontal_code, MODE_HORIZONTAL);
+  const struct mmr_code extension_code = {0x1, 7};
+  fill_lookup(t->modes, MODE_LOOKUP_BITS, extension_code, MODE_EXTENSION);
+  for (int b = 0; b < 256; ++b) {
+    u8 r = 0;
+    for (int i = 0; i < 8; ++i) r |= ((b >> i) & 1) << (7 - i);
+    t->reverse[b] = r;
+  }
+  return t;
+}
+
+// built on first use, and kept for the life of the process
+static const struct ccitt_tables *
+ccitt_tables() {
+  static const struct ccitt_tables *const tables = build_ccitt_tables();
+  return tables;
+}
+
+// -----------------------------------------------------------------------------
+// The data is read into a 64-bit buffer, a byte at a time. Past the end, it
+// reads as zeros, which are counted so that running off the end is found.
+// -----------------------------------------------------------------------------
+struct mmr_reader {
+  const u8 *p, *end;
+  uint64_t bits;  // the next nbits bits of the data, from the top bit
+  int nbits;
+  size_t overrun;  // bytes read past the end
+  const u8 *reverse;  // with lsb_first, else NULL
+};
+
+static inline void
+refill(struct mmr_reader *r) {
+  while (r->nbits <= 56) {
+    u8 byte = 0;
+    if (r->p < r->end) {
+      byte = *r->p++;
+      if (r->reverse) byte = r->reverse[byte];
+    } else {
+      r->overrun++;
+    }
+    r->bits |= (uint64_t) byte << (56 - r->nbits);
+    r->nbits += 8;
+  }
+}
+
+// the next n (1..32) bits, with at least 32 in the buffer
+static inline u32
+peek_bits(const struct mmr_reader *r, int n) {
+  return (u32) (r->bits >> (64 - n));
+}
+
+static inline void
+skip_bits(struct mmr_reader *r, int n) {
+  r->bits <<= n;
+  r->nbits -= n;
+  if (r->nbits < 32) refill(r);
+}
+
+// whether more bits have been used than the data has
+static inline bool
+past_end(const struct mmr_reader *r) {
+  return r->overrun * 8 > (size_t) r->nbits;
+}
+
+// -----------------------------------------------------------------------------
+// Read the codes of a run of one colour: any make-up codes, then a terminating
+// code. Returns its length, or -1.
+// -----------------------------------------------------------------------------
+static int
+read_run(struct mmr_reader *r, const struct mmr_lookup *table) {
+  int run = 0;
+  for (;;) {
+    const struct mmr_lookup e = table[peek_bits(r, RUN_LOOKUP_BITS)];
+    if (e.value < 0) return -1;
+    skip_bits(r, e.len);
+    run += e.value;
+    if (e.value < 64) return run;
+  }
+}
+
+// -----------------------------------------------------------------------------
+// Decode a row coded 1D into its changes (as from find_changes, though a
+// change may be at w), of which there are at most max. Returns the number of
+// them, or -1.
+// -----------------------------------------------------------------------------
+static int
+decode_row_1d(struct mmr_reader *r, const struct ccitt_tables *t, int *a,
+              int w, int max) {
+  int n = 0, x = 0, color = 0;
+  while (x < w) {
+    const int run = read_run(r, t->runs[color]);
+    if (run < 0 || run > w - x || n == max) return -1;
+    x += run;
+    a[n++] = x;
+    color ^= 1;
+  }
+  return n;
+}
+
+// -----------------------------------------------------------------------------
+// Decode a row coded 2D against the changes of the row above it (b, as from
+// find_changes) into its changes (a), of which there are at most max: the
+// reverse of code_row. Returns the number of them, or -1.
+// -----------------------------------------------------------------------------
+static int
+decode_row_2d(struct mmr_reader *r, const struct ccitt_tables *t,
+              const int *b, int *a, int w, int max) {
+  int a0 = -1;
+  int color = 0;
+  int ib = 0;
+  int n = 0;
+
+  while (a0 < w) {
+    while (b[ib] <= a0) ib++;
+    const int i = (ib & 1) == color ? ib : ib + 1;
+    const int b1 = b[i], b2 = b[i + 1];
+    const struct mmr_lookup m = t->modes[peek_bits(r, MODE_LOOKUP_BITS)];
+    if (m.value >= MODE_EXTENSION) return -1;
+    skip_bits(r, m.len);
+
+    if (m.value == MODE_PASS) {
+      a0 = b2;
+    } else if (m.value == MODE_HORIZONTAL) {
+      const int run1 = read_run(r, t->runs[color]);
+      const int run2 = read_run(r, t->runs[color ^ 1]);
+      const int a1 = (a0 < 0 ? 0 : a0) + run1;
+      if (run1 < 0 || run2 < 0 || a1 > w || run2 > w - a1 || n + 2 > max)
+        return -1;
+      a[n++] = a1;
+      a[n++] = a1 + run2;
+      a0 = a1 + run2;
+    } else {
+      // a0 is -1 before the first code of a row, but a1 can't be
+      const int a1 = b1 + m.value - 3;
+      if (a1 < (a0 < 0 ? 0 : a0) || a1 > w || n == max) return -1;
+      a[n++] = a1;
+      a0 = a1;
+      color ^= 1;
+    }
+  }
+  return n;
+}
+
+// -----------------------------------------------------------------------------
+// Set the black runs of a row, given its changes, the spans between them
+// being filled a word at a time
+// -----------------------------------------------------------------------------
+static void
+fill_row(u32 *row, const int *a, int n) {
+  for (int i = 0; i < n; i += 2) {
+    const int x0 = a[i], x1 = a[i + 1];
+    if (x0 >= x1) continue;
+    const int w0 = x0 >> 5, w1 = (x1 - 1) >> 5;
+    const u32 m0 = 0xffffffffu >> (x0 & 31);
+    const u32 m1 = 0xffffffffu << (31 - ((x1 - 1) & 31));
+    if (w0 == w1) {
+      row[w0] |= m0 & m1;
+    } else {
+      row[w0] |= m0;
+      for (int k = w0 + 1; k < w1; ++k) row[k] = 0xffffffffu;
+      row[w1] |= m1;
+    }
+  }
+}
+
+// -----------------------------------------------------------------------------
+// The state of decoding an image, between its rows
+// -----------------------------------------------------------------------------
+struct jbig2_ccitt_decoder {
+  const struct ccitt_tables *tables;
+  struct mmr_reader r;
+  enum jbig2_ccitt_coding coding;
+  bool t4_2d;
+  bool byte_align;
+  int w;
+  int max;  // changes in a row
+  int *lists;
+  int *ref, *cur;  // the changes of the row above and of this row
+  bool ended;  // an EOFB or RTC was found: the rows after it are white
+};
+
+// see comments in .h file
+struct jbig2_ccitt_decoder *
+jbig2_ccitt_decoder_new(const u8 *data, size_t length,
+                        enum jbig2_ccitt_coding coding, bool t4_2d,
+                        bool byte_align, bool lsb_first, int w) {
+  struct jbig2_ccitt_decoder *const dec =
+      (struct jbig2_ccitt_decoder *) malloc(sizeof(*dec));
+  if (!dec) abort();
+  dec->tables = ccitt_tables();
+  dec->coding = coding;
+  dec->t4_2d = coding == JBIG2_CCITT_T4 && t4_2d;
+  dec->byte_align = byte_align || coding == JBIG2_CCITT_MH;
+  dec->w = w;
+  // Changes can repeat (runs of no pixels), but every code moves on along
+  // the row or adds a change, so a row can't have more than this.
+  dec->max = 2 * w + 2;
+  dec->lists = (int *) malloc(sizeof(int) * 2 * (dec->max + MMR_SENTINELS));
+  if (!dec->lists) abort();
+  dec->ref = dec->lists;
+  dec->cur = dec->lists + dec->max + MMR_SENTINELS;
+  for (int i = 0; i < MMR_SENTINELS; ++i) dec->ref[i] = w;
+  dec->ended = false;
+
+  struct mmr_reader *const r = &dec->r;
+  r->p = data;
+  r->end = data + length;
+  r->bits = 0;
+  r->nbits = 0;
+  r->overrun = 0;
+  r->reverse = lsb_first ? dec->tables->reverse : NULL;
+  refill(r);
+  return dec;
+}
+
+// see comments in .h file
+int
+jbig2_ccitt_decoder_row(struct jbig2_ccitt_decoder *dec, u32 *row) {
+  memset(row, 0, sizeof(u32) * ((dec->w + 31) / 32));
+  if (dec->ended) return 0;
+  struct mmr_reader *const r = &dec->r;
+  if (dec->byte_align) skip_bits(r, r->nbits & 7);
+  // After alignment no code starts with more than 7 zeros, so 11 of them
+  // start an EOL, after any fill bits. A second one (after its tag bit)
+  // makes an EOFB or an RTC, which ends the data.
+  if (peek_bits(r, 11) == 0) {
+    while (!peek_bits(r, 1) && !past_end(r)) skip_bits(r, 1);
+    skip_bits(r, 1);
+    if (dec->t4_2d ? peek_bits(r, 13) == 0x1001 : peek_bits(r, 12) == 1) {
+      dec->ended = true;
+      return past_end(r) ? -1 : 0;
+    }
+  }
+  bool two_d = dec->coding == JBIG2_CCITT_T6;
+  if (dec->t4_2d) {
+    two_d = !peek_bits(r, 1);
+    skip_bits(r, 1);
+  }
+  int n = two_d ? decode_row_2d(r, dec->tables, dec->ref, dec->cur, dec->w,
+                                dec->max)
+                : decode_row_1d(r, dec->tables, dec->cur, dec->w, dec->max);
+  if (n < 0 || past_end(r)) return -1;
+  // changes at w change nothing, and find_changes never has them
+  while (n && dec->cur[n - 1] >= dec->w) n--;
+  for (int i = 0; i < MMR_SENTINELS; ++i) dec->cur[n + i] = dec->w;
+  fill_row(row, dec->cur, n);
+  int *const tmp = dec->ref;
+  dec->ref = dec->cur;
+  dec->cur = tmp;
+  return 0;
+}
+
+// see comments in .h file
+void
+jbig2_ccitt_decoder_free(struct jbig2_ccitt_decoder *dec) {
+  if (!dec) return;
+  free(dec->lists);
+  free(dec);
+}
+
+// see comments in .h file
+int
+jbig2_ccitt_decode(const u8 *data, size_t length,
+                   enum jbig2_ccitt_coding coding, bool t4_2d,
+                   bool lsb_first, int w, int h, u32 *rows, int wpl) {
+  struct jbig2_ccitt_decoder *const dec =
+      jbig2_ccitt_decoder_new(data, length, coding, t4_2d, false, lsb_first,
+                              w);
+  int status = 0;
+  for (int y = 0; y < h && status == 0; ++y)
+    status = jbig2_ccitt_decoder_row(dec, rows + (size_t) y * wpl);
+  jbig2_ccitt_decoder_free(dec);
+  return status;
+}
@@ -0,0 +1,135 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef JBIG2ENC_JBIG2MMR_H__
+#define JBIG2ENC_JBIG2MMR_H__
+
+#include <stddef.h>
+#if defined(sun)
+#include <sys/types.h>
+#else
+#include <stdint.h>
+#endif
+
+struct jbig2enc_ctx;
+
+// -----------------------------------------------------------------------------
+// An MMR coder for generic regions (6.2.6): each row is coded against the one
+// above it with the two-dimensional codes of T.6 (G4 fax), so coding costs a
+// few operations per change of colour rather than an arithmetic coding step
+// per pixel. The output is typically a few tens of percent larger than from
+// the arithmetic coder, but it is made many times faster.
+// -----------------------------------------------------------------------------
+
+// -----------------------------------------------------------------------------
+// Code an image of mx x my pixels in Leptonica's 1bpp packed format (as for
+// jbig2enc_bitimage) with MMR, appending the bytes to the output of ctx (see
+// jbig2enc_putbytes). The data ends with an EOFB and is padded to a byte.
+//
+// *The pad bits at the end of each line must be zero.*
+// -----------------------------------------------------------------------------
+void jbig2enc_mmrimage(struct jbig2enc_ctx *ctx, const uint8_t *data, int mx,
+                       int my);
+
+// -----------------------------------------------------------------------------
+// The rows of a 1 bpp image as runs: the changing elements of each row, which
+// are the pixels not the same colour as the pixel before them (the pixel
+// before the row being white), at even indices changes to black and at odd
+// ones to white. They are found once, a word at a time with
+// count-leading-zeros, and then serve the stages which would otherwise scan
+// the bitmap again: the ink box and the count of repeated rows for TPGD (see
+// jbig2_encode_generic_runs and jbig2_duplicate_row_ratio), and MMR, which
+// codes exactly these changes.
+// -----------------------------------------------------------------------------
+struct jbig2_runs {
+  int width, height;
+  int *changes;  // of all the rows, one after the other
+  size_t *start;  // height + 1 entries: the changes of row y are
+                  // changes[start[y]] ... changes[start[y + 1] - 1]
+  int top, bottom;  // the first and last rows with black pixels, or -1
+  int left, right;  // the first and last columns with black pixels (0 and -1
+                    // if there are none)
+};
+
+// -----------------------------------------------------------------------------
+// Find the runs of an image of w x h pixels at rows, in Leptonica's 1 bpp
+// packed format with wpl words per row.
+//
+// *The pad bits at the end of each row must be zero.*
+//
+// WARNING: returns a malloced structure which the caller must free with
+// jbig2_runs_free
+// -----------------------------------------------------------------------------
+struct jbig2_runs *jbig2_runs_new(const uint32_t *rows, int w, int h, int wpl);
+void jbig2_runs_free(struct jbig2_runs *runs);
+
+// -----------------------------------------------------------------------------
+// As jbig2enc_mmrimage, for the rectangle of w x h pixels at (x, y) of the
+// image of runs, which must hold all its black pixels (as its ink box does)
+// -----------------------------------------------------------------------------
+void jbig2enc_mmrruns(struct jbig2enc_ctx *ctx, const struct jbig2_runs *runs,
+                      int x, int y, int w, int h);
+
+// -----------------------------------------------------------------------------
+// The codings of CCITT fax data which jbig2_ccitt_decode reads, as found in
+// TIFF files (the Compression tag)
+// -----------------------------------------------------------------------------
+enum jbig2_ccitt_coding {
+  JBIG2_CCITT_MH,  // T.4 one-dimensional (modified Huffman) rows, each
+                   // starting at a byte, without EOLs: TIFF compression 2
+  JBIG2_CCITT_T4,  // T.4 (G3) rows, after EOLs: TIFF compression 3
+  JBIG2_CCITT_T6,  // T.6 (G4, the same as MMR): TIFF compression 4
+};
+
+// -----------------------------------------------------------------------------
+// Decode length bytes of CCITT fax data, coded with coding, into an image of
+// w x h pixels at rows, in Leptonica's 1 bpp packed format with wpl words per
+// row: the black runs are 1, and filled a span of words at a time. The
+// reference line of the first row is white.
+//
+// t4_2d: with JBIG2_CCITT_T4, each EOL is followed by a bit telling whether
+// the row is coded 2D, as with T.6 (TIFF T4Options bit 0)
+// lsb_first: the bits of each byte are read from the least significant one
+// (TIFF FillOrder 2)
+//
+// EOLs are skipped wherever a row starts with one. An EOFB or RTC ends the
+// image early, leaving the rows after it white.
+// Returns 0, or -1 if the data is corrupt or cut short.
+// -----------------------------------------------------------------------------
+int jbig2_ccitt_decode(const uint8_t *data, size_t length,
+                       enum jbig2_ccitt_coding coding, bool t4_2d,
+                       bool lsb_first, int w, int h, uint32_t *rows, int wpl);
+
+// -----------------------------------------------------------------------------
+// As jbig2_ccitt_decode, but a row at a time, for images which are coded as
+// they are read. With byte_align, each row starts at a byte (PDF
+// EncodedByteAlign), as the rows of JBIG2_CCITT_MH always do.
+//
+// WARNING: returns a malloced decoder which the caller must free with
+// jbig2_ccitt_decoder_free. data must last as long as it.
+// -----------------------------------------------------------------------------
+struct jbig2_ccitt_decoder;
+
+struct jbig2_ccitt_decoder *
+jbig2_ccitt_decoder_new(const uint8_t *data, size_t length,
+                        enum jbig2_ccitt_coding coding, bool t4_2d,
+                        bool byte_align, bool lsb_first, int w);
+
+// -----------------------------------------------------------------------------
+// Decode the next row into row, (w + 31) / 32 words, all of which are
+// written. Returns 0, or -1 if the data is corrupt or cut short.
+// -----------------------------------------------------------------------------
+int jbig2_ccitt_decoder_row(struct jbig2_ccitt_decoder *dec, uint32_t *row);
+
+void jbig2_ccitt_decoder_free(struct jbig2_ccitt_decoder *dec);
+
+#endif  // JBIG2ENC_JBIG2MMR_H__
@@ -0,0 +1,521 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "jbig2pool.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#if defined(WIN32)
+#define JBIG2_NO_THREADS 1
+#else
+#include <pthread.h>
+#endif
+
+#if defined(__linux__) && !JBIG2_NO_THREADS
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#define JBIG2_HAVE_AFFINITY 1
+#endif
+
+#if JBIG2_NO_THREADS
+#define POOL_LOCK(p)
+#define POOL_UNLOCK(p)
+#define POOL_WAIT(p)
+#define POOL_WAKE(p)
+#else
+#define POOL_LOCK(p) pthread_mutex_lock(&(p)->mutex)
+#define POOL_UNLOCK(p) pthread_mutex_unlock(&(p)->mutex)
+#define POOL_WAIT(p) pthread_cond_wait(&(p)->changed, &(p)->mutex)
+#define POOL_WAKE(p) pthread_cond_broadcast(&(p)->changed)
+#endif
+
+// -----------------------------------------------------------------------------
+// State shared by all threads of one jbig2_parallel_for call. Everything below
+// mutex is protected by it.
+// -----------------------------------------------------------------------------
+struct pool {
+  jbig2_pool_fn fn;
+  jbig2_pool_done_fn done;
+  void *arg;
+  int count;
+  int window;  // most jobs started and not through done, or 0 for any number
+  int slots;  // the worker numbers which can be given out: nthreads
+
+#if !JBIG2_NO_THREADS
+  pthread_mutex_t mutex;
+  pthread_cond_t changed;  // signalled as next_done moves on, and as helpers
+                           // leave
+#endif
+  int next;  // next job to hand out
+  int next_done;  // next job to call done for, once done has returned for
+                  // all the jobs before it
+  bool flushing;  // true while some thread is calling done
+  int result;  // first non-zero result of done, stops the pool
+  bool *finished;  // finished[i] is true once job i has returned
+  int running;  // jobs started which haven't returned
+  int workers;  // worker numbers given out so far
+  int helpers;  // threads of other pools running jobs of this one
+  int node;  // NUMA node of the thread which started it, or -1 if not pinned
+  struct pool *next_open;  // in open_pools
+};
+
+#if !JBIG2_NO_THREADS
+// -----------------------------------------------------------------------------
+// Work stealing: a pool started from within a job of another pool (say, the
+// stripes of a page) starts no threads of its own. Instead it is put on
+// open_pools, and the threads of any pool which have no jobs of their own left
+// run its jobs, until it has handed out all of them. That way a single large
+// page at the end of a batch is coded by all the threads rather than one. The
+// list and helping are protected by steal_mutex, which is taken before the
+// mutex of any pool.
+// -----------------------------------------------------------------------------
+static pthread_mutex_t steal_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t steal_changed = PTHREAD_COND_INITIALIZER;
+static struct pool *open_pools = NULL;
+
+// non-zero while the thread is running a job of some pool
+static __thread int in_job = 0;
+#endif
+
+// NUMA node this thread is pinned to, or -1 (see jbig2_pool_set_affinity)
+#if !JBIG2_NO_THREADS
+static __thread int thread_node = -1;
+#else
+static const int thread_node = -1;
+#endif
+
+#if JBIG2_HAVE_AFFINITY
+// -----------------------------------------------------------------------------
+// The CPUs to pin workers to, in the order they are given out: worker k goes
+// to affinity_cpus[k % naffinity_cpus], on node affinity_nodes[same]. Set
+// before any pool is started, and only read after.
+// -----------------------------------------------------------------------------
+static int naffinity_cpus = 0;  // 0 if not pinning
+static int affinity_cpus[CPU_SETSIZE];
+static int affinity_nodes[CPU_SETSIZE];
+static int numa_nodes = 0;  // 0 until found
+
+// -----------------------------------------------------------------------------
+// Read a cpulist file of sysfs ("0-3,8-11") into set. Returns false if it
+// can't be read.
+// -----------------------------------------------------------------------------
+static bool
+read_cpulist(const char *path, cpu_set_t *set) {
+  FILE *const f = fopen(path, "r");
+  if (!f) return false;
+  CPU_ZERO(set);
+  unsigned first, last;
+  char sep;
+  for (;;) {
+    if (fscanf(f, "%u", &first) != 1) break;
+    last = first;
+    if (fscanf(f, "%c", &sep) == 1 && sep == '-') {
+      if (fscanf(f, "%u", &last) != 1) break;
+      if (fscanf(f, "%c", &sep) != 1) sep = '\n';
+    }
+    for (unsigned c = first; c <= last && c < CPU_SETSIZE; ++c)
+      CPU_SET(c, set);
+    if (sep != ',') break;
+  }
+  fclose(f);
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+// Find the node of each CPU the process may use, in cpu_node (-1 for those it
+// may not), and return the number of nodes with such CPUs. Without NUMA
+// information all of them are on node 0.
+// -----------------------------------------------------------------------------
+static int
+find_cpu_nodes(int cpu_node[CPU_SETSIZE]) {
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed)) return 0;
+  int nnodes = 0;
+  for (int c = 0; c < CPU_SETSIZE; ++c)
+    cpu_node[c] = CPU_ISSET(c, &allowed) ? 0 : -1;
+  // Node numbers may have gaps; the nodes used are renumbered from 0.
+  for (int n = 0; n < 1024; ++n) {
+    char path[64];
+    cpu_set_t set;
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", n);
+    if (!read_cpulist(path, &set)) continue;
+    CPU_AND(&set, &set, &allowed);
+    if (!CPU_COUNT(&set)) continue;
+    for (int c = 0; c < CPU_SETSIZE; ++c)
+      if (CPU_ISSET(c, &set)) cpu_node[c] = nnodes;
+    ++nnodes;
+  }
+  return nnodes ? nnodes : 1;
+}
+
+// -----------------------------------------------------------------------------
+// Pin the calling thread to the CPU for worker
+// -----------------------------------------------------------------------------
+static void
+pin_worker(int worker) {
+  if (!naffinity_cpus) return;
+  const int slot = worker % naffinity_cpus;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(affinity_cpus[slot], &set);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0)
+    thread_node = affinity_nodes[slot];
+}
+#elif !JBIG2_NO_THREADS
+static void
+pin_worker(int) {}
+#endif
+
+// see comments in .h file
+bool
+jbig2_pool_set_affinity(enum jbig2_affinity affinity) {
+#if JBIG2_HAVE_AFFINITY
+  static int cpu_node[CPU_SETSIZE];
+  numa_nodes = find_cpu_nodes(cpu_node);
+  naffinity_cpus = 0;
+  if (!numa_nodes) return false;
+  if (affinity == JBIG2_AFFINITY_NONE) return true;
+  // compact: node by node; spread: the i-th CPU of each node in turn
+  for (int i = 0; ; ++i) {
+    bool any = false;
+    for (int n = 0; n < numa_nodes; ++n) {
+      int seen = 0;
+      for (int c = 0; c < CPU_SETSIZE; ++c) {
+        if (cpu_node[c] != n) continue;
+        if (affinity == JBIG2_AFFINITY_COMPACT ? i == 0 : seen++ == i) {
+          affinity_cpus[naffinity_cpus] = c;
+          affinity_nodes[naffinity_cpus++] = n;
+          any = true;
+        }
+      }
+    }
+    if (!any || affinity == JBIG2_AFFINITY_COMPACT) break;
+  }
+  return naffinity_cpus > 0;
+#else
+  return affinity == JBIG2_AFFINITY_NONE;
+#endif
+}
+
+// see comments in .h file
+int
+jbig2_numa_nodes() {
+#if JBIG2_HAVE_AFFINITY
+  if (!numa_nodes) {
+    static int cpu_node[CPU_SETSIZE];
+    numa_nodes = find_cpu_nodes(cpu_node);
+  }
+  if (numa_nodes) return numa_nodes;
+#endif
+  return 1;
+}
+
+// -----------------------------------------------------------------------------
+// Call done for all jobs which are finished and in order. Only one thread does
+// this at a time, but without holding the lock, so that the others can keep
+// picking up jobs while, say, the output is being written. Called and returns
+// with the lock held.
+// -----------------------------------------------------------------------------
+static void
+pool_flush(struct pool *p) {
+  if (!p->done || p->flushing) return;
+  p->flushing = true;
+  while (!p->result && p->next_done < p->count && p->finished[p->next_done]) {
+    const int index = p->next_done;
+    POOL_UNLOCK(p);
+    const int r = p->done(p->arg, index);
+    POOL_LOCK(p);
+    ++p->next_done;
+    if (r) p->result = r;
+    if (p->window) POOL_WAKE(p);
+  }
+  p->flushing = false;
+}
+
+// -----------------------------------------------------------------------------
+// Run jobs of p as worker until there are none left to hand out. Returns true
+// if all the jobs of p have then returned.
+// -----------------------------------------------------------------------------
+static bool
+pool_run(struct pool *p, int worker) {
+  POOL_LOCK(p);
+  while (!p->result && p->next < p->count) {
+    if (p->window && p->next - p->next_done >= p->window) {
+      // The job at next_done is running or being flushed, and its thread
+      // wakes us once it has gone through done.
+      POOL_WAIT(p);
+      continue;
+    }
+    const int index = p->next++;
+    ++p->running;
+    POOL_UNLOCK(p);
+#if !JBIG2_NO_THREADS
+    ++in_job;
+#endif
+    p->fn(p->arg, index, worker);
+#if !JBIG2_NO_THREADS
+    --in_job;
+#endif
+    POOL_LOCK(p);
+    p->finished[index] = true;
+    --p->running;
+    pool_flush(p);
+  }
+  const bool all_returned = !p->running;
+  POOL_UNLOCK(p);
+  return all_returned;
+}
+
+#if !JBIG2_NO_THREADS
+// -----------------------------------------------------------------------------
+// Run the jobs of p as worker, and then those of the open pools, until all the
+// jobs of p have returned
+// -----------------------------------------------------------------------------
+static void
+pool_run_and_help(struct pool *p, int worker) {
+  if (pool_run(p, worker)) {
+    // the threads of p waiting for its last job can go
+    pthread_mutex_lock(&steal_mutex);
+    pthread_cond_broadcast(&steal_changed);
+    pthread_mutex_unlock(&steal_mutex);
+    return;
+  }
+
+  pthread_mutex_lock(&steal_mutex);
+  for (;;) {
+    POOL_LOCK(p);
+    const bool all_returned = !p->running;
+    POOL_UNLOCK(p);
+    if (all_returned) break;
+
+    struct pool *q = open_pools;
+    int q_worker = -1;
+    for (; q; q = q->next_open) {
+      // the pages of a node stay on it
+      if (q->node != thread_node) continue;
+      POOL_LOCK(q);
+      if (!q->result && q->next < q->count && q->workers < q->slots) {
+        q_worker = q->workers++;
+        ++q->helpers;
+      }
+      POOL_UNLOCK(q);
+      if (q_worker >= 0) break;
+    }
+    if (!q) {
+      pthread_cond_wait(&steal_changed, &steal_mutex);
+      continue;
+    }
+
+    pthread_mutex_unlock(&steal_mutex);
+    pool_run(q, q_worker);
+    // q stays alive until it has seen us leave
+    POOL_LOCK(q);
+    --q->helpers;
+    POOL_WAKE(q);
+    POOL_UNLOCK(q);
+    pthread_mutex_lock(&steal_mutex);
+  }
+  pthread_mutex_unlock(&steal_mutex);
+}
+
+struct pool_thread {
+  struct pool *p;
+  int worker;
+  pthread_t thread;
+};
+
+static void *
+pool_thread_main(void *arg) {
+  struct pool_thread *t = (struct pool_thread *) arg;
+  pin_worker(t->worker);
+  pool_run_and_help(t->p, t->worker);
+  return NULL;
+}
+#endif
+
+int
+jbig2_parallel_for(int nthreads, int count, jbig2_pool_fn fn,
+                   jbig2_pool_done_fn done, void *arg) {
+  return jbig2_parallel_for_window(nthreads, count, 0, fn, done, arg);
+}
+
+int
+jbig2_parallel_for_window(int nthreads, int count, int window,
+                          jbig2_pool_fn fn, jbig2_pool_done_fn done,
+                          void *arg) {
+  if (count <= 0) return 0;
+  if (nthreads < 1) nthreads = 1;
+
+  struct pool p;
+  p.fn = fn;
+  p.done = done;
+  p.arg = arg;
+  p.count = count;
+  p.window = done && window > 0 ? window : 0;
+  p.slots = nthreads;
+  p.next = 0;
+  p.next_done = 0;
+  p.flushing = false;
+  p.result = 0;
+  p.finished = (bool *) calloc(count, sizeof(bool));
+  if (!p.finished) abort();
+  p.running = 0;
+  p.workers = 1;  // the calling thread is worker 0
+  p.helpers = 0;
+  p.node = thread_node;
+  p.next_open = NULL;
+
+#if JBIG2_NO_THREADS
+  pool_run(&p, 0);
+#else
+  pthread_mutex_init(&p.mutex, NULL);
+  pthread_cond_init(&p.changed, NULL);
+
+  if (in_job) {
+    // Called from a job: let the idle threads of all pools help, and wait for
+    // the last of them to leave before p goes out of scope.
+    if (nthreads > 1) {
+      pthread_mutex_lock(&steal_mutex);
+      p.next_open = open_pools;
+      open_pools = &p;
+      pthread_cond_broadcast(&steal_changed);
+      pthread_mutex_unlock(&steal_mutex);
+    }
+    pool_run(&p, 0);
+    if (nthreads > 1) {
+      pthread_mutex_lock(&steal_mutex);
+      struct pool **link = &open_pools;
+      while (*link != &p) link = &(*link)->next_open;
+      *link = p.next_open;
+      pthread_mutex_unlock(&steal_mutex);
+    }
+    POOL_LOCK(&p);
+    while (p.helpers) POOL_WAIT(&p);
+    POOL_UNLOCK(&p);
+  } else {
+    // Threads with no job of their own help with the pools started by the
+    // jobs, so they are started even beyond count.
+    pin_worker(0);
+    p.node = thread_node;
+    struct pool_thread *threads = NULL;
+    int started = 0;
+    if (nthreads > 1) {
+      threads = (struct pool_thread *) malloc(sizeof(struct pool_thread) *
+                                              (nthreads - 1));
+      if (!threads) abort();
+      for (; started < nthreads - 1; ++started) {
+        threads[started].p = &p;
+        threads[started].worker = started + 1;
+        // If we can't get more threads, run with the ones we have.
+        if (pthread_create(&threads[started].thread, NULL, pool_thread_main,
+                           &threads[started])) break;
+      }
+    }
+
+    pool_run_and_help(&p, 0);
+
+    for (int i = 0; i < started; ++i) pthread_join(threads[i].thread, NULL);
+    free(threads);
+  }
+  pthread_cond_destroy(&p.changed);
+  pthread_mutex_destroy(&p.mutex);
+#endif
+
+  free(p.finished);
+  return p.result;
+}
+
+// -----------------------------------------------------------------------------
+// Everything below mutex is protected by it
+// -----------------------------------------------------------------------------
+struct jbig2_budget {
+  size_t limit;
+#if !JBIG2_NO_THREADS
+  pthread_mutex_t mutex;
+  pthread_cond_t changed;  // signalled as bytes are given back, and as next
+                           // moves on
+#endif
+  size_t used;
+  int next;  // the next job to take its bytes
+};
+
+// see comments in .h file
+struct jbig2_budget *
+jbig2_budget_new(size_t limit) {
+  struct jbig2_budget *const budget =
+      (struct jbig2_budget *) malloc(sizeof(struct jbig2_budget));
+  if (!budget) abort();
+  budget->limit = limit;
+  budget->used = 0;
+  budget->next = 0;
+#if !JBIG2_NO_THREADS
+  pthread_mutex_init(&budget->mutex, NULL);
+  pthread_cond_init(&budget->changed, NULL);
+#endif
+  return budget;
+}
+
+// see comments in .h file
+void
+jbig2_budget_free(struct jbig2_budget *budget) {
+  if (!budget) return;
+#if !JBIG2_NO_THREADS
+  pthread_cond_destroy(&budget->changed);
+  pthread_mutex_destroy(&budget->mutex);
+#endif
+  free(budget);
+}
+
+// see comments in .h file
+size_t
+jbig2_budget_limit(const struct jbig2_budget *budget) {
+  return budget->limit;
+}
+
+// see comments in .h file
+void
+jbig2_budget_take(struct jbig2_budget *budget, int index, size_t bytes) {
+  POOL_LOCK(budget);
+#if !JBIG2_NO_THREADS
+  // Without threads, the jobs run one after another and there is nobody to
+  // wait for.
+  while (budget->next != index ||
+         (budget->used && (budget->used >= budget->limit ||
+                           bytes > budget->limit - budget->used))) {
+    POOL_WAIT(budget);
+  }
+#endif
+  budget->used += bytes;
+  budget->next = index + 1;
+  POOL_WAKE(budget);
+  POOL_UNLOCK(budget);
+}
+
+// see comments in .h file
+void
+jbig2_budget_give(struct jbig2_budget *budget, size_t bytes) {
+  POOL_LOCK(budget);
+  budget->used -= bytes;
+  POOL_WAKE(budget);
+  POOL_UNLOCK(budget);
+}
+
+int
+jbig2_ncpus() {
+#if defined(_SC_NPROCESSORS_ONLN)
+  const long n = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n >= 1) return n;
+#endif
+  return 1;
+}
@@ -0,0 +1,134 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef JBIG2ENC_JBIG2POOL_H__
+#define JBIG2ENC_JBIG2POOL_H__
+
+#include <stddef.h>
+
+// -----------------------------------------------------------------------------
+// A minimal worker pool for running independent jobs on several cores.
+//
+// On WIN32 there is no pthreads, so all jobs run on the calling thread.
+// -----------------------------------------------------------------------------
+
+// -----------------------------------------------------------------------------
+// Called once for each job. index is the job number in [0, count) and worker
+// is the number of the thread running it in [0, nthreads), so that callers
+// can keep per-thread state (such as a jbig2enc_ctx) in an array.
+// -----------------------------------------------------------------------------
+typedef void (*jbig2_pool_fn)(void *arg, int index, int worker);
+
+// -----------------------------------------------------------------------------
+// Called once for each finished job, strictly in index order and never from
+// two threads at the same time. Returning non-zero stops the pool: no new jobs
+// are started and done is not called any more.
+// -----------------------------------------------------------------------------
+typedef int (*jbig2_pool_done_fn)(void *arg, int index);
+
+// -----------------------------------------------------------------------------
+// Run fn(arg, index, worker) for every index in [0, count), using up to
+// nthreads threads. The calling thread is one of them (worker 0). Jobs are
+// handed out in increasing index order, but may finish in any order. If done
+// is not NULL, done(arg, index) is called for job index as soon as it and all
+// the jobs before it have finished.
+//
+// Returns once all started jobs have finished: 0 if all of them did, or the
+// first non-zero value returned by done.
+//
+// Called from within a job of another pool, no threads are started. The jobs
+// are run by the calling thread and by the threads of any pool which have run
+// out of jobs of their own, up to nthreads at a time. Outside of a job, all
+// nthreads threads are started even if there are fewer jobs, since the idle
+// ones help with the pools started by the jobs.
+// -----------------------------------------------------------------------------
+int jbig2_parallel_for(int nthreads, int count, jbig2_pool_fn fn,
+                       jbig2_pool_done_fn done, void *arg);
+
+// -----------------------------------------------------------------------------
+// As jbig2_parallel_for, but with at most window jobs (if window > 0) started
+// and not yet through done at any time: a worker waits for done to catch up
+// rather than start a job window or more after the next one in order. This
+// bounds the memory held by jobs which have finished out of order. done must
+// not be NULL when window > 0.
+// -----------------------------------------------------------------------------
+int jbig2_parallel_for_window(int nthreads, int count, int window,
+                              jbig2_pool_fn fn, jbig2_pool_done_fn done,
+                              void *arg);
+
+// -----------------------------------------------------------------------------
+// Returns the number of online CPUs, or 1 if it cannot be determined.
+// -----------------------------------------------------------------------------
+int jbig2_ncpus();
+
+// -----------------------------------------------------------------------------
+// Where the threads of the pools run. With JBIG2_AFFINITY_COMPACT, worker k of
+// a pool is pinned to the k-th of the CPUs the process may use, taken NUMA node
+// by node, so that the workers fill one node before the next; with
+// JBIG2_AFFINITY_SPREAD, consecutive workers go round the nodes. Either way, a
+// pool started from within a job (the stripes and row bands of a page) is only
+// helped by threads on the node of that job, so that a page is read,
+// thresholded and coded on one node, in memory first touched there.
+// -----------------------------------------------------------------------------
+enum jbig2_affinity {
+  JBIG2_AFFINITY_NONE,
+  JBIG2_AFFINITY_COMPACT,
+  JBIG2_AFFINITY_SPREAD,
+};
+
+// -----------------------------------------------------------------------------
+// Pin the threads of the pools started from now on as affinity says. Returns
+// false if threads can't be pinned here (only on Linux).
+// -----------------------------------------------------------------------------
+bool jbig2_pool_set_affinity(enum jbig2_affinity affinity);
+
+// -----------------------------------------------------------------------------
+// Returns the number of NUMA nodes with CPUs the process may use, or 1 if it
+// cannot be determined.
+// -----------------------------------------------------------------------------
+int jbig2_numa_nodes();
+
+// -----------------------------------------------------------------------------
+// A memory budget shared by the jobs of a pool: each job takes the bytes it
+// will hold before it starts on them, and gives them back once they are
+// freed, possibly from done.
+//
+// Jobs get their bytes in index order, so job index waits for all the jobs
+// before it to have taken theirs: as done is also called in index order, the
+// jobs holding bytes always include the one done is waiting for, and the
+// budget can't deadlock. Every index from 0 must call jbig2_budget_take once,
+// with 0 if it needs nothing.
+// -----------------------------------------------------------------------------
+struct jbig2_budget;
+
+// -----------------------------------------------------------------------------
+// Returns a new budget of limit bytes (more than 0)
+// -----------------------------------------------------------------------------
+struct jbig2_budget *jbig2_budget_new(size_t limit);
+
+void jbig2_budget_free(struct jbig2_budget *budget);
+
+size_t jbig2_budget_limit(const struct jbig2_budget *budget);
+
+// -----------------------------------------------------------------------------
+// Take bytes for job index, once the jobs before it have taken theirs, waiting
+// until they fit in what is left. More bytes than the whole limit are taken
+// once nothing else is held, so such a job runs on its own.
+// -----------------------------------------------------------------------------
+void jbig2_budget_take(struct jbig2_budget *budget, int index, size_t bytes);
+
+// -----------------------------------------------------------------------------
+// Give back bytes taken by jbig2_budget_take
+// -----------------------------------------------------------------------------
+void jbig2_budget_give(struct jbig2_budget *budget, size_t bytes);
+
+#endif  // JBIG2ENC_JBIG2POOL_H__
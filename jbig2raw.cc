@@ -0,0 +1,280 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "jbig2raw.h"
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <allheaders.h>
+#include <pix.h>
+#include <zlib.h>
+
+#include "jbig2mmr.h"
+
+#define u32 uint32_t
+#define u8  uint8_t
+
+// the largest width or height taken
+#define MAX_SIDE (1 << 20)
+
+// -----------------------------------------------------------------------------
+// Parse a number from min to max at p into *value. Returns the end of it, or
+// NULL.
+// -----------------------------------------------------------------------------
+static const char *
+parse_number(const char *p, long min, long max, int *value) {
+  if (*p != '-' && (*p < '0' || *p > '9')) return NULL;
+  char *end;
+  const long v = strtol(p, &end, 10);
+  if (end == p || v < min || v > max) return NULL;
+  *value = (int) v;
+  return end;
+}
+
+// whether the word at p is word, followed by a comma, a space or the end
+static bool
+is_word(const char *p, const char *word) {
+  const size_t len = strlen(word);
+  return strncmp(p, word, len) == 0 &&
+         (p[len] == ',' || p[len] == ' ' || p[len] == 0);
+}
+
+// see comments in .h file
+const char *
+jbig2_raw_parse(const char *spec, struct jbig2_raw_params *params) {
+  memset(params, 0, sizeof(*params));
+  params->predictor = 1;
+  const char *p;
+  if (strncmp(spec, "ccitt:", 6) == 0) {
+    params->filter = JBIG2_RAW_CCITT;
+    p = spec + 6;
+  } else if (strncmp(spec, "flate:", 6) == 0) {
+    params->filter = JBIG2_RAW_FLATE;
+    p = spec + 6;
+  } else {
+    return NULL;
+  }
+  const bool ccitt = params->filter == JBIG2_RAW_CCITT;
+  p = parse_number(p, 1, MAX_SIDE, &params->width);
+  if (!p || *p != 'x') return NULL;
+  p = parse_number(p + 1, 1, MAX_SIDE, &params->height);
+  if (!p) return NULL;
+
+  while (*p == ',') {
+    ++p;
+    if (ccitt && strncmp(p, "k=", 2) == 0) {
+      p = parse_number(p + 2, INT_MIN, INT_MAX, &params->k);
+    } else if (ccitt && is_word(p, "blackis1")) {
+      params->black_is_1 = true;
+      p += 8;
+    } else if (ccitt && is_word(p, "align")) {
+      params->byte_align = true;
+      p += 5;
+    } else if (!ccitt && strncmp(p, "predictor=", 10) == 0) {
+      p = parse_number(p + 10, 1, 15, &params->predictor);
+      if (p && params->predictor > 2 && params->predictor < 10) return NULL;
+    } else if (is_word(p, "invert")) {
+      params->invert = true;
+      p += 6;
+    } else {
+      return NULL;
+    }
+    if (!p) return NULL;
+  }
+  return *p == 0 || *p == ' ' ? p : NULL;
+}
+
+// -----------------------------------------------------------------------------
+// The state of reading a raw stream, between its rows
+// -----------------------------------------------------------------------------
+struct jbig2_raw_reader {
+  struct jbig2_raw_params params;
+  int wpl;
+  u32 flip;  // XORed into each word of a row, to make 1 black
+  u32 tail;  // the pixels of the last word of a row
+  struct jbig2_ccitt_decoder *ccitt;
+  // Flate
+  z_stream z;
+  const u8 *next_in;  // what is left of the stream after z.next_in
+  size_t left_in;
+  size_t row_bytes;
+  u8 *line, *prev;  // this row (after its PNG filter byte) and the one above
+};
+
+// see comments in .h file
+struct jbig2_raw_reader *
+jbig2_raw_reader_new(const struct jbig2_raw_params *params,
+                     const u8 *data, size_t size) {
+  struct jbig2_raw_reader *const rdr =
+      (struct jbig2_raw_reader *) calloc(1, sizeof(*rdr));
+  if (!rdr) abort();
+  rdr->params = *params;
+  rdr->wpl = (params->width + 31) / 32;
+  rdr->tail = params->width & 31 ? 0xffffffffu << (32 - (params->width & 31))
+                                 : 0xffffffffu;
+  if (params->filter == JBIG2_RAW_CCITT) {
+    rdr->flip = params->black_is_1 != params->invert ? 0xffffffffu : 0;
+    rdr->ccitt = jbig2_ccitt_decoder_new(
+        data, size, params->k < 0 ? JBIG2_CCITT_T6 : JBIG2_CCITT_T4,
+        params->k > 0, params->byte_align, false, params->width);
+    return rdr;
+  }
+
+  rdr->flip = params->invert ? 0 : 0xffffffffu;
+  if (inflateInit(&rdr->z) != Z_OK) abort();
+  rdr->next_in = data;
+  rdr->left_in = size;
+  rdr->row_bytes = (params->width + 7) / 8;
+  // PNG rows start with a filter byte, and the row above the first is zeros
+  rdr->line = (u8 *) calloc(2, rdr->row_bytes + 1);
+  if (!rdr->line) abort();
+  rdr->prev = rdr->line + rdr->row_bytes + 1;
+  return rdr;
+}
+
+// -----------------------------------------------------------------------------
+// Inflate the next length bytes of the stream into out. Returns false if it
+// ends first, or is corrupt.
+// -----------------------------------------------------------------------------
+static bool
+inflate_bytes(struct jbig2_raw_reader *rdr, u8 *out, size_t length) {
+  z_stream *const z = &rdr->z;
+  z->next_out = out;
+  z->avail_out = length;
+  while (z->avail_out) {
+    if (z->avail_in == 0 && rdr->left_in) {
+      const size_t n = rdr->left_in < UINT_MAX ? rdr->left_in : UINT_MAX;
+      z->next_in = (Bytef *) rdr->next_in;
+      z->avail_in = n;
+      rdr->next_in += n;
+      rdr->left_in -= n;
+    }
+    const int ret = inflate(z, Z_NO_FLUSH);
+    if (ret == Z_STREAM_END) break;
+    if (ret != Z_OK) return false;
+  }
+  return z->avail_out == 0;
+}
+
+// -----------------------------------------------------------------------------
+// Undo the PNG filter of type filter of row, given the row above it. The
+// "pixels" of the filters are bytes for 1 bpp images.
+// -----------------------------------------------------------------------------
+static bool
+unfilter_png(int filter, u8 *row, const u8 *prev, size_t n) {
+  switch (filter) {
+    case 0:
+      break;
+    case 1:
+      for (size_t i = 1; i < n; ++i) row[i] += row[i - 1];
+      break;
+    case 2:
+      for (size_t i = 0; i < n; ++i) row[i] += prev[i];
+      break;
+    case 3:
+      row[0] += prev[0] >> 1;
+      for (size_t i = 1; i < n; ++i) row[i] += (row[i - 1] + prev[i]) >> 1;
+      break;
+    case 4:
+      row[0] += prev[0];
+      for (size_t i = 1; i < n; ++i) {
+        const int a = row[i - 1], b = prev[i], c = prev[i - 1];
+        const int pa = abs(b - c), pb = abs(a - c), pc = abs(a + b - 2 * c);
+        row[i] += pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+      }
+      break;
+    default:
+      return false;
+  }
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+// Undo TIFF predictor 2 for 1 bit samples: each is the XOR of the one before
+// it and itself, so that each pixel is the XOR of all those up to it.
+// -----------------------------------------------------------------------------
+static void
+unpredict_tiff(u8 *row, size_t n) {
+  u8 carry = 0;
+  for (size_t i = 0; i < n; ++i) {
+    u8 x = row[i];
+    x ^= x >> 1;
+    x ^= x >> 2;
+    x ^= x >> 4;
+    x ^= carry;
+    row[i] = x;
+    carry = x & 1 ? 0xff : 0;
+  }
+}
+
+// see comments in .h file
+int
+jbig2_raw_reader_row(struct jbig2_raw_reader *rdr, u32 *row) {
+  if (rdr->ccitt) {
+    if (jbig2_ccitt_decoder_row(rdr->ccitt, row)) return -1;
+  } else {
+    const bool png = rdr->params.predictor >= 10;
+    u8 *const line = rdr->line + 1;
+    if (!inflate_bytes(rdr, png ? rdr->line : line, rdr->row_bytes + png))
+      return -1;
+    if (png) {
+      if (!unfilter_png(rdr->line[0], line, rdr->prev + 1, rdr->row_bytes))
+        return -1;
+      memcpy(rdr->prev + 1, line, rdr->row_bytes);
+    } else if (rdr->params.predictor == 2) {
+      unpredict_tiff(line, rdr->row_bytes);
+    }
+    for (int j = 0; j < rdr->wpl; ++j) {
+      u32 word = 0;
+      for (size_t k = 0; k < 4; ++k) {
+        const size_t i = j * 4 + k;
+        if (i < rdr->row_bytes) word |= (u32) line[i] << (24 - k * 8);
+      }
+      row[j] = word;
+    }
+  }
+  for (int j = 0; j < rdr->wpl; ++j) row[j] ^= rdr->flip;
+  row[rdr->wpl - 1] &= rdr->tail;
+  return 0;
+}
+
+// see comments in .h file
+void
+jbig2_raw_reader_free(struct jbig2_raw_reader *rdr) {
+  if (!rdr) return;
+  if (rdr->ccitt) {
+    jbig2_ccitt_decoder_free(rdr->ccitt);
+  } else {
+    inflateEnd(&rdr->z);
+    free(rdr->line);
+  }
+  free(rdr);
+}
+
+// see comments in .h file
+PIX *
+jbig2_raw_read(const struct jbig2_raw_params *params, const u8 *data,
+               size_t size) {
+  PIX *pix = pixCreate(params->width, params->height, 1);
+  if (!pix) return NULL;
+  struct jbig2_raw_reader *const rdr = jbig2_raw_reader_new(params, data, size);
+  for (int y = 0; y < params->height; ++y) {
+    if (jbig2_raw_reader_row(rdr, pix->data + (size_t) y * pix->wpl)) {
+      pixDestroy(&pix);
+      break;
+    }
+  }
+  jbig2_raw_reader_free(rdr);
+  return pix;
+}
@@ -0,0 +1,93 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef JBIG2ENC_JBIG2RAW_H__
+#define JBIG2ENC_JBIG2RAW_H__
+
+#include <stddef.h>
+#if defined(sun)
+#include <sys/types.h>
+#else
+#include <stdint.h>
+#endif
+
+struct Pix;
+
+// -----------------------------------------------------------------------------
+// Readers of the raw 1 bpp image streams of PDF files, as tools which
+// recompress PDFs take them out: /CCITTFaxDecode streams, decoded by
+// jbig2_ccitt_decoder, and /FlateDecode streams, inflated by zlib and
+// unpredicted. Either is read a row at a time, so that a page can be coded
+// while it is being decoded, without a PNG wrapped around it.
+//
+// The rows come out as the page looks: 1 is black. The samples of a 1 bpp
+// DeviceGray image are 0 for black, so CCITT black runs are black unless
+// BlackIs1 is given, and the samples of a Flate stream are inverted, unless
+// the image has a /Decode array of [1 0].
+// -----------------------------------------------------------------------------
+enum jbig2_raw_filter {
+  JBIG2_RAW_NONE = 0,  // not a raw stream, but an image file
+  JBIG2_RAW_CCITT,
+  JBIG2_RAW_FLATE,
+};
+
+struct jbig2_raw_params {
+  int filter;  // a jbig2_raw_filter
+  int width, height;  // of the image (/Columns and /Rows)
+  int k;  // CCITT /K: < 0 for G4, 0 for G3 1D, > 0 for G3 with 2D rows
+  bool black_is_1;  // CCITT /BlackIs1
+  bool byte_align;  // CCITT /EncodedByteAlign
+  int predictor;  // Flate /Predictor: 1 (none), 2 (TIFF) or 10..15 (PNG)
+  bool invert;  // the image has /Decode [1 0]
+};
+
+// -----------------------------------------------------------------------------
+// Parse the description of a raw stream at spec, up to a space or the end of
+// it, into params:
+//
+//   ccitt:<width>x<height>[,k=<K>][,blackis1][,align][,invert]
+//   flate:<width>x<height>[,predictor=<n>][,invert]
+//
+// Returns the end of it, or NULL if it isn't valid.
+// -----------------------------------------------------------------------------
+const char *jbig2_raw_parse(const char *spec, struct jbig2_raw_params *params);
+
+// -----------------------------------------------------------------------------
+// Start reading the raw stream of size bytes at data, which must last as long
+// as the reader.
+//
+// WARNING: returns a malloced reader which the caller must free with
+// jbig2_raw_reader_free
+// -----------------------------------------------------------------------------
+struct jbig2_raw_reader;
+
+struct jbig2_raw_reader *
+jbig2_raw_reader_new(const struct jbig2_raw_params *params,
+                     const uint8_t *data, size_t size);
+
+// -----------------------------------------------------------------------------
+// Read the next row of the image into row, in Leptonica's 1 bpp packed format
+// ((width + 31) / 32 words, the pad bits cleared). Returns 0, or -1 if the
+// stream is corrupt or cut short.
+// -----------------------------------------------------------------------------
+int jbig2_raw_reader_row(struct jbig2_raw_reader *rdr, uint32_t *row);
+
+void jbig2_raw_reader_free(struct jbig2_raw_reader *rdr);
+
+// -----------------------------------------------------------------------------
+// Read the whole image of a raw stream into a 1 bpp pix, or return NULL if it
+// is corrupt or cut short
+// -----------------------------------------------------------------------------
+struct Pix *jbig2_raw_read(const struct jbig2_raw_params *params,
+                           const uint8_t *data, size_t size);
+
+#endif  // JBIG2ENC_JBIG2RAW_H__
@@ -7,6 +7,8 @@
 #ifdef __MINGW32__ 
 #define htons my_htons
 #define htonl my_htonl
+#define ntohs my_htons
+#define ntohl my_htonl
 unsigned short my_htons(unsigned short); 
 unsigned long my_htonl(unsigned long);   
 #else 
@@ -64,6 +66,8 @@ struct Segment {
   int retain_bits;
   unsigned page;  // page number
   unsigned len;   // length of trailing data
+  int nreferred;  // number of referred to segments, at most 4
+  unsigned referred_to[4];
 
   Segment()
       : number(0),
@@ -71,7 +75,15 @@ struct Segment {
         deferred_non_retain(0),
         retain_bits(0),
         page(0),
-        len(0) {}
+        len(0),
+        nreferred(0) {}
+
+  // ---------------------------------------------------------------------------
+  // Return the size of each referred to segment number (7.2.5)
+  // ---------------------------------------------------------------------------
+  unsigned reference_size() const {
+    return number <= 256 ? 1 : number <= 65536 ? 2 : 4;
+  }
 
   // ---------------------------------------------------------------------------
   // Return the size of the segment page association field for this segment.
@@ -87,7 +99,8 @@ struct Segment {
   unsigned size() const {
     const int pagesize = page_size();
 
-    return sizeof(struct jbig2_segment) + pagesize + sizeof(u32);
+    return sizeof(struct jbig2_segment) + nreferred * reference_size() +
+           pagesize + sizeof(u32);
   }
 
   // ---------------------------------------------------------------------------
@@ -103,7 +116,8 @@ struct Segment {
     s.deferred_non_retain = deferred_non_retain;
     s.retain_bits = retain_bits;
 #undef F
-    s.segment_count = 0;
+    if (nreferred > 4) abort();
+    s.segment_count = nreferred;
 
     const int pagesize = page_size();
     if (pagesize == 4) s.page_assoc_size = 1;
@@ -112,9 +126,20 @@ struct Segment {
 
     memcpy(buf, &s, sizeof(s));
     j += sizeof(s);
-#define APPEND(type, val) type __i; __i = val; \
+#define APPEND(type, val) { type __i; __i = val; \
     memcpy(&buf[j], &__i, sizeof(type)); \
-    j += sizeof(type)
+    j += sizeof(type); }
+
+    const int refsize = reference_size();
+    for (int i = 0; i < nreferred; ++i) {
+      if (refsize == 4) {
+        APPEND(u32, htonl(referred_to[i]));
+      } else if (refsize == 2) {
+        APPEND(u16, htons(referred_to[i]));
+      } else {
+        APPEND(u8, referred_to[i]);
+      }
+    }
 
     if (pagesize == 4) {
       APPEND(u32, htonl(page));
@@ -123,9 +148,59 @@ struct Segment {
     }
 
     APPEND(u32, htonl(len));
+#undef APPEND
 
     if (j != size()) abort();
   }
+
+  // ---------------------------------------------------------------------------
+  // Parse a segment header, as written by write, from the length bytes at buf.
+  // Returns its size, or 0 if it is truncated or in a form write never makes
+  // (more than 4 referred to segments).
+  // ---------------------------------------------------------------------------
+  unsigned read(const u8 *buf, size_t length) {
+    struct jbig2_segment s;
+    if (length < sizeof(s)) return 0;
+    memcpy(&s, buf, sizeof(s));
+    if (s.segment_count > 4) return 0;
+    number = ntohl(s.number);
+    type = s.type;
+    deferred_non_retain = s.deferred_non_retain;
+    retain_bits = s.retain_bits;
+    nreferred = s.segment_count;
+    page = s.page_assoc_size ? 256 : 0;  // for page_size
+    if (length < size()) return 0;
+
+    unsigned j = sizeof(s);
+#define TAKE(type, var) { type __i; memcpy(&__i, &buf[j], sizeof(type)); \
+    var = __i; j += sizeof(type); }
+
+    const int refsize = reference_size();
+    for (int i = 0; i < nreferred; ++i) {
+      if (refsize == 4) {
+        TAKE(u32, referred_to[i]);
+        referred_to[i] = ntohl(referred_to[i]);
+      } else if (refsize == 2) {
+        TAKE(u16, referred_to[i]);
+        referred_to[i] = ntohs(referred_to[i]);
+      } else {
+        TAKE(u8, referred_to[i]);
+      }
+    }
+
+    if (s.page_assoc_size) {
+      TAKE(u32, page);
+      page = ntohl(page);
+    } else {
+      TAKE(u8, page);
+    }
+
+    TAKE(u32, len);
+    len = ntohl(len);
+#undef TAKE
+
+    return j;
+  }
 };
 
 #endif  // THIRD_PARTY_JBIG2ENC_JBIG2SEGMENTS_H__
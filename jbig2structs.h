@@ -25,6 +25,7 @@ enum {
   segment_imm_generic_region = 38,
   segment_page_information = 48,
   segment_imm_text_region =  6,
+  segment_imm_lossless_refinement_region = 43,
   segment_end_of_page = 49,
   segment_end_of_file = 51
 };
@@ -104,6 +105,27 @@ struct jbig2_generic_region {
   signed char a1x, a1y, a2x, a2y, a3x, a3y, a4x, a4y;
 } PACKED ;
 
+struct jbig2_refinement_region {
+  u32 width;
+  u32 height;
+  u32 x;
+  u32 y;
+  u8 comb_operator;
+
+#ifndef _BIG_ENDIAN
+  u8 grtemplate : 1;
+  u8 tpgron : 1;
+  u8 reserved : 6;
+#else
+  u8 reserved : 6;
+  u8 tpgron : 1;
+  u8 grtemplate : 1;
+#endif
+
+  // With template 0, the four bytes of the AT pixels follow: RA1 then RA2.
+  signed char ra1x, ra1y, ra2x, ra2y;
+} PACKED;
+
 struct jbig2_symbol_dict {
 #ifndef _BIG_ENDIAN
   u8 sdhuff:1;
@@ -0,0 +1,643 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "jbig2sym.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <allheaders.h>
+#include <pix.h>
+
+#include "jbig2arith.h"
+
+#define u32 uint32_t
+#define u8  uint8_t
+
+#if defined(__GNUC__)
+#define clz32(x) __builtin_clz(x)
+#define popcount32(x) __builtin_popcount(x)
+// for the classes read by jbig2_symbols_match while _add_page adds more
+#define load_acquire(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define load_relaxed(p) __atomic_load_n(p, __ATOMIC_RELAXED)
+#define store_release(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#else
+// only built without threads (see jbig2pool.h)
+#define load_acquire(p) (*(p))
+#define load_relaxed(p) (*(p))
+#define store_release(p, v) (*(p) = (v))
+
+static inline int
+clz32(u32 x) {
+  int n = 0;
+  while (!(x & 0x80000000u)) {
+    x <<= 1;
+    n++;
+  }
+  return n;
+}
+
+static inline int
+popcount32(u32 x) {
+  int n = 0;
+  for (; x; x &= x - 1) n++;
+  return n;
+}
+#endif
+
+// Components wider or higher than this are left in the generic region: they
+// are pictures or rules rather than characters, and would hardly ever match.
+#define MAX_SYMBOL_SIZE 256
+
+// The ink of a bitmap is counted in each cell of a GRID x GRID grid over it
+#define GRID 4
+
+// The classes are kept in chunks of SYMBOL_CHUNK, which never move, so that
+// they can be read while more are added; there can be MAX_SYMBOL_CHUNKS
+#define SYMBOL_CHUNK_BITS 12
+#define SYMBOL_CHUNK (1 << SYMBOL_CHUNK_BITS)
+#define MAX_SYMBOL_CHUNKS 4096
+
+// Hash buckets of the classes, by size. There are never more, for the same
+// reason, but classes of the same size share a chain anyway.
+#define SYMBOL_BUCKETS (1 << 16)
+
+// -----------------------------------------------------------------------------
+// A class of components, coded once in the dictionary
+// -----------------------------------------------------------------------------
+struct symbol {
+  PIX *pix;  // the first component of the class, which stands for all of them
+  int ink;  // number of black pixels
+  int grid[GRID * GRID];  // number of black pixels in each cell of the grid
+  int id;  // the number of the symbol in the dictionary, once it is coded
+  int next;  // the next (newer) class in the same hash bucket, or -1
+};
+
+// -----------------------------------------------------------------------------
+// A component of a page, drawn as a symbol with its top left corner at x, y
+// -----------------------------------------------------------------------------
+struct instance {
+  int symbol;  // before classification, the index of the component
+  int x, y;
+};
+
+struct jbig2_symbols_page {
+  int width, height, xres, yres;
+  PIX *residual;  // the components which can't be symbols, or NULL
+
+  // The components, until the page is classified. components[i] is the class
+  // of one component (but with next unused) and instances[i] is where it is.
+  struct symbol *components;
+  struct instance *instances;
+  int ninstances;
+
+  // With jbig2_symbols_match, the class found for each component among the
+  // first nknown, or -1 if none matches it; else NULL
+  int *classes;
+  int nknown;
+};
+
+struct jbig2_symbols {
+  float threshold, weight;
+  struct symbol *chunks[MAX_SYMBOL_CHUNKS];
+  int nsymbols;  // published with store_release once each class is linked
+  int *buckets;  // the first (oldest) class of each hash bucket, or -1
+  int *tails;  // and the last one, only used by _add_page
+  struct jbig2_symbols_page **pages;
+  int npages, pages_capacity;
+};
+
+static inline struct symbol *
+symbol_at(const struct jbig2_symbols *symbols, int i) {
+  return &symbols->chunks[i >> SYMBOL_CHUNK_BITS][i & (SYMBOL_CHUNK - 1)];
+}
+
+// -----------------------------------------------------------------------------
+// A run of black pixels x0..x1 in row y, in the union-find forest of runs
+// which finds the components
+// -----------------------------------------------------------------------------
+struct run {
+  int y, x0, x1;
+  int parent;  // the run with the lowest index in the same component is root
+};
+
+static int
+find_root(struct run *runs, int i) {
+  while (runs[i].parent != i) {
+    runs[i].parent = runs[runs[i].parent].parent;
+    i = runs[i].parent;
+  }
+  return i;
+}
+
+static void
+unite(struct run *runs, int a, int b) {
+  a = find_root(runs, a);
+  b = find_root(runs, b);
+  if (a < b) {
+    runs[b].parent = a;
+  } else if (b < a) {
+    runs[a].parent = b;
+  }
+}
+
+// -----------------------------------------------------------------------------
+// Return the first x' >= x where line (of width pixels) has a pixel of the
+// given colour, or width if there is none. The pad bits must be zero.
+// -----------------------------------------------------------------------------
+static int
+find_pixel(const u32 *line, int x, int width, bool black) {
+  const u32 flip = black ? 0 : 0xffffffffu;
+  while (x < width) {
+    const u32 w = (line[x >> 5] ^ flip) & (0xffffffffu >> (x & 31));
+    if (w) {
+      x = (x & ~31) + clz32(w);
+      return x < width ? x : width;
+    }
+    x = (x & ~31) + 32;
+  }
+  return width;
+}
+
+// -----------------------------------------------------------------------------
+// Set pixels x0..x1 of line
+// -----------------------------------------------------------------------------
+static void
+set_span(u32 *line, int x0, int x1) {
+  const int w0 = x0 >> 5, w1 = x1 >> 5;
+  const u32 m0 = 0xffffffffu >> (x0 & 31);
+  const u32 m1 = 0xffffffffu << (31 - (x1 & 31));
+  if (w0 == w1) {
+    line[w0] |= m0 & m1;
+    return;
+  }
+  line[w0] |= m0;
+  for (int w = w0 + 1; w < w1; ++w) line[w] = 0xffffffffu;
+  line[w1] |= m1;
+}
+
+// -----------------------------------------------------------------------------
+// Add the pixels x0..x1 of row y of a w x h bitmap to the ink in the cells of
+// grid. Cell column c holds the pixels x with x * GRID / w == c.
+// -----------------------------------------------------------------------------
+static void
+add_grid_span(int *grid, int w, int h, int y, int x0, int x1) {
+  int *const row = grid + (y * GRID / h) * GRID;
+  for (int c = 0; c < GRID; ++c) {
+    const int start = (c * w + GRID - 1) / GRID;
+    const int end = ((c + 1) * w + GRID - 1) / GRID;
+    const int lo = x0 > start ? x0 : start;
+    const int hi = x1 + 1 < end ? x1 + 1 : end;
+    if (hi > lo) row[c] += hi - lo;
+  }
+}
+
+// see comments in .h file
+struct jbig2_symbols_page *
+jbig2_symbols_extract(struct Pix *bw) {
+  const int width = bw->w, height = bw->h;
+  pixSetPadBits(bw, 0);
+
+  // Find the runs of each row and join them to the runs of the row above
+  // which touch them, also diagonally.
+  int nruns = 0, capacity = 1024;
+  struct run *runs = (struct run *) malloc(capacity * sizeof(struct run));
+  if (!runs) abort();
+  int above = 0;  // first run of the row above
+  for (int y = 0; y < height; ++y) {
+    const u32 *const line = bw->data + y * bw->wpl;
+    const int first = nruns;
+    for (int x = 0; ; ) {
+      const int x0 = find_pixel(line, x, width, true);
+      if (x0 >= width) break;
+      x = find_pixel(line, x0, width, false);
+      if (nruns == capacity) {
+        capacity *= 2;
+        runs = (struct run *) realloc(runs, capacity * sizeof(struct run));
+        if (!runs) abort();
+      }
+      runs[nruns].y = y;
+      runs[nruns].x0 = x0;
+      runs[nruns].x1 = x - 1;
+      runs[nruns].parent = nruns;
+      nruns++;
+    }
+
+    int j = above;
+    for (int i = first; i < nruns; ++i) {
+      while (j < first && runs[j].x1 < runs[i].x0 - 1) j++;
+      for (int k = j; k < first && runs[k].x0 <= runs[i].x1 + 1; ++k) {
+        unite(runs, i, k);
+      }
+    }
+    above = first;
+  }
+
+  // Number the components. Each root comes before the other runs of its
+  // component, so its label is known by the time they are reached.
+  int *const label = (int *) malloc((nruns ? nruns : 1) * sizeof(int));
+  if (!label) abort();
+  int ncomponents = 0;
+  for (int i = 0; i < nruns; ++i) {
+    const int root = find_root(runs, i);
+    label[i] = root == i ? ncomponents++ : label[root];
+  }
+
+  struct box {
+    int x0, y0, x1, y1;
+  } *const boxes = (struct box *) malloc((ncomponents ? ncomponents : 1) *
+                                         sizeof(struct box));
+  if (!boxes) abort();
+  for (int i = 0; i < nruns; ++i) {
+    struct box *const b = &boxes[label[i]];
+    if (runs[i].parent == i) {
+      b->x0 = runs[i].x0;
+      b->x1 = runs[i].x1;
+      b->y0 = b->y1 = runs[i].y;
+      continue;
+    }
+    if (runs[i].x0 < b->x0) b->x0 = runs[i].x0;
+    if (runs[i].x1 > b->x1) b->x1 = runs[i].x1;
+    b->y1 = runs[i].y;
+  }
+
+  struct jbig2_symbols_page *const page =
+      (struct jbig2_symbols_page *) calloc(1, sizeof(*page));
+  if (!page) abort();
+  page->width = width;
+  page->height = height;
+  page->xres = bw->xres;
+  page->yres = bw->yres;
+  page->components = (struct symbol *) calloc(ncomponents ? ncomponents : 1,
+                                              sizeof(struct symbol));
+  page->instances = (struct instance *) malloc(
+      (ncomponents ? ncomponents : 1) * sizeof(struct instance));
+  if (!page->components || !page->instances) abort();
+
+  // The components which are small enough get bitmaps of their own; the rest
+  // stay in the residual image. index[c] is the instance of component c.
+  int *const index =
+      (int *) malloc((ncomponents ? ncomponents : 1) * sizeof(int));
+  if (!index) abort();
+  for (int c = 0; c < ncomponents; ++c) {
+    const struct box *const b = &boxes[c];
+    const int w = b->x1 - b->x0 + 1, h = b->y1 - b->y0 + 1;
+    if (w > MAX_SYMBOL_SIZE || h > MAX_SYMBOL_SIZE) {
+      index[c] = -1;
+      if (!page->residual) {
+        page->residual = pixCreate(width, height, 1);
+        if (!page->residual) abort();
+      }
+      continue;
+    }
+    const int n = page->ninstances++;
+    index[c] = n;
+    page->components[n].pix = pixCreate(w, h, 1);
+    if (!page->components[n].pix) abort();
+    page->instances[n].symbol = n;
+    page->instances[n].x = b->x0;
+    page->instances[n].y = b->y0;
+  }
+
+  for (int i = 0; i < nruns; ++i) {
+    const struct run *const r = &runs[i];
+    const int n = index[label[i]];
+    if (n < 0) {
+      PIX *const res = page->residual;
+      set_span(res->data + r->y * res->wpl, r->x0, r->x1);
+      continue;
+    }
+    struct symbol *const s = &page->components[n];
+    const int x = page->instances[n].x, y = page->instances[n].y;
+    set_span(s->pix->data + (r->y - y) * s->pix->wpl, r->x0 - x, r->x1 - x);
+    s->ink += r->x1 - r->x0 + 1;
+    add_grid_span(s->grid, s->pix->w, s->pix->h, r->y - y, r->x0 - x,
+                  r->x1 - x);
+  }
+
+  free(index);
+  free(boxes);
+  free(label);
+  free(runs);
+  return page;
+}
+
+// see comments in .h file
+struct jbig2_symbols *
+jbig2_symbols_new(float threshold, float weight) {
+  struct jbig2_symbols *const symbols =
+      (struct jbig2_symbols *) calloc(1, sizeof(*symbols));
+  if (!symbols) abort();
+  symbols->threshold = threshold;
+  symbols->weight = weight;
+  symbols->buckets = (int *) malloc(SYMBOL_BUCKETS * sizeof(int));
+  symbols->tails = (int *) malloc(SYMBOL_BUCKETS * sizeof(int));
+  if (!symbols->buckets || !symbols->tails) abort();
+  for (int i = 0; i < SYMBOL_BUCKETS; ++i) {
+    symbols->buckets[i] = -1;
+    symbols->tails[i] = -1;
+  }
+  return symbols;
+}
+
+// see comments in .h file
+void
+jbig2_symbols_free(struct jbig2_symbols *symbols) {
+  if (!symbols) return;
+  for (int p = 0; p < symbols->npages; ++p) {
+    jbig2_symbols_page_done(symbols, p);
+  }
+  for (int i = 0; i < symbols->nsymbols; ++i) {
+    pixDestroy(&symbol_at(symbols, i)->pix);
+  }
+  for (int c = 0; c < MAX_SYMBOL_CHUNKS && symbols->chunks[c]; ++c) {
+    free(symbols->chunks[c]);
+  }
+  free(symbols->buckets);
+  free(symbols->tails);
+  free(symbols->pages);
+  free(symbols);
+}
+
+static int
+bucket_of(int w, int h) {
+  return ((u32) w * 0x9e3779b1u ^ (u32) h * 0x85ebca77u) >> 7 &
+         (SYMBOL_BUCKETS - 1);
+}
+
+// -----------------------------------------------------------------------------
+// Return true if component c (of the same size as class s) is in class s
+// -----------------------------------------------------------------------------
+static bool
+matches(const struct jbig2_symbols *symbols, const struct symbol *s,
+        const struct symbol *c) {
+  const int w = c->pix->w, h = c->pix->h;
+  const double t = symbols->threshold + (1.0 - symbols->threshold) *
+                   symbols->weight * s->ink / ((double) w * h);
+  // the correlation is at least t if and only if and * and >= need
+  const double need = t * s->ink * c->ink;
+
+  // No more pixels can be black in both than in the emptier one, in each cell.
+  int bound = 0;
+  for (int i = 0; i < GRID * GRID; ++i) {
+    bound += s->grid[i] < c->grid[i] ? s->grid[i] : c->grid[i];
+  }
+  if ((double) bound * bound < need) return false;
+
+  int both = 0;
+  const u32 *a = s->pix->data, *b = c->pix->data;
+  const int words = h * c->pix->wpl;
+  for (int i = 0; i < words; ++i) both += popcount32(a[i] & b[i]);
+  return (double) both * both >= need;
+}
+
+// -----------------------------------------------------------------------------
+// The first (oldest) class from first to before last which component c is in,
+// or -1. Classes are only read up to last, so more may be added meanwhile.
+// -----------------------------------------------------------------------------
+static int
+find_class(const struct jbig2_symbols *symbols, const struct symbol *c,
+           int first, int last) {
+  const int w = c->pix->w, h = c->pix->h;
+  for (int i = load_relaxed(&symbols->buckets[bucket_of(w, h)]);
+       i >= 0 && i < last; i = load_relaxed(&symbol_at(symbols, i)->next)) {
+    const struct symbol *const s = symbol_at(symbols, i);
+    if (i >= first && (int) s->pix->w == w && (int) s->pix->h == h &&
+        matches(symbols, s, c))
+      return i;
+  }
+  return -1;
+}
+
+// see comments in .h file
+void
+jbig2_symbols_match(const struct jbig2_symbols *symbols,
+                    struct jbig2_symbols_page *page) {
+  page->nknown = load_acquire(&symbols->nsymbols);
+  page->classes = (int *) malloc((page->ninstances ? page->ninstances : 1) *
+                                 sizeof(int));
+  if (!page->classes) abort();
+  for (int n = 0; n < page->ninstances; ++n) {
+    page->classes[n] = find_class(symbols, &page->components[n], 0,
+                                  page->nknown);
+  }
+}
+
+// see comments in .h file
+int
+jbig2_symbols_add_page(struct jbig2_symbols *symbols,
+                       struct jbig2_symbols_page *page) {
+  // the classes jbig2_symbols_match has already looked through
+  const int known = page->classes ? page->nknown : 0;
+  for (int n = 0; n < page->ninstances; ++n) {
+    struct symbol *const c = &page->components[n];
+    int i = page->classes ? page->classes[n] : -1;
+    if (i < 0) i = find_class(symbols, c, known, symbols->nsymbols);
+    if (i >= 0) {
+      pixDestroy(&c->pix);
+    } else {
+      i = symbols->nsymbols;
+      const int chunk = i >> SYMBOL_CHUNK_BITS;
+      if (chunk == MAX_SYMBOL_CHUNKS) abort();
+      if (!symbols->chunks[chunk]) {
+        symbols->chunks[chunk] =
+            (struct symbol *) malloc(SYMBOL_CHUNK * sizeof(struct symbol));
+        if (!symbols->chunks[chunk]) abort();
+      }
+      struct symbol *const s = symbol_at(symbols, i);
+      *s = *c;
+      s->id = -1;
+      s->next = -1;
+      // linked at the end of its chain, and then counted, for _match
+      const int b = bucket_of(c->pix->w, c->pix->h);
+      if (symbols->tails[b] < 0) {
+        store_release(&symbols->buckets[b], i);
+      } else {
+        store_release(&symbol_at(symbols, symbols->tails[b])->next, i);
+      }
+      symbols->tails[b] = i;
+      store_release(&symbols->nsymbols, i + 1);
+    }
+    page->instances[n].symbol = i;
+  }
+  free(page->classes);
+  page->classes = NULL;
+  free(page->components);
+  page->components = NULL;
+
+  if (symbols->npages == symbols->pages_capacity) {
+    symbols->pages_capacity = symbols->pages_capacity
+                              ? 2 * symbols->pages_capacity : 16;
+    symbols->pages = (struct jbig2_symbols_page **) realloc(
+        symbols->pages,
+        symbols->pages_capacity * sizeof(struct jbig2_symbols_page *));
+    if (!symbols->pages) abort();
+  }
+  symbols->pages[symbols->npages] = page;
+  return symbols->npages++;
+}
+
+// -----------------------------------------------------------------------------
+// The order of the symbols in the dictionary: by height, which groups them
+// into height classes (6.5.5), and then by width so that the width deltas are
+// small
+// -----------------------------------------------------------------------------
+struct symbol_order {
+  int h, w, index;
+};
+
+static int
+compare_symbol_order(const void *a, const void *b) {
+  const struct symbol_order *x = (const struct symbol_order *) a;
+  const struct symbol_order *y = (const struct symbol_order *) b;
+  if (x->h != y->h) return x->h - y->h;
+  if (x->w != y->w) return x->w - y->w;
+  return x->index - y->index;
+}
+
+// see comments in .h file
+int
+jbig2_symbols_encode_dictionary(struct jbig2_symbols *symbols,
+                                struct jbig2enc_ctx *ctx) {
+  const int n = symbols->nsymbols;
+  struct symbol_order *const order =
+      (struct symbol_order *) malloc((n ? n : 1) * sizeof(*order));
+  if (!order) abort();
+  for (int i = 0; i < n; ++i) {
+    order[i].h = symbol_at(symbols, i)->pix->h;
+    order[i].w = symbol_at(symbols, i)->pix->w;
+    order[i].index = i;
+  }
+  qsort(order, n, sizeof(*order), compare_symbol_order);
+
+  int height = 0;
+  for (int i = 0; i < n; ) {
+    // one height class
+    jbig2enc_int(ctx, JBIG2_IADH, order[i].h - height);
+    height = order[i].h;
+    int width = 0;
+    for (; i < n && order[i].h == height; ++i) {
+      struct symbol *const s = symbol_at(symbols, order[i].index);
+      s->id = i;
+      jbig2enc_int(ctx, JBIG2_IADW, order[i].w - width);
+      width = order[i].w;
+      jbig2enc_bitimage(ctx, (const u8 *) s->pix->data, width, height, false,
+                        0);
+    }
+    jbig2enc_oob(ctx, JBIG2_IADW);
+  }
+  free(order);
+
+  // all the symbols are exported: a run of none which aren't, then all
+  jbig2enc_int(ctx, JBIG2_IAEX, 0);
+  jbig2enc_int(ctx, JBIG2_IAEX, n);
+  return n;
+}
+
+// -----------------------------------------------------------------------------
+// The order of the instances in a text region: by the row of their bottom
+// edges, which are the strips (T), and then from left to right (S)
+// -----------------------------------------------------------------------------
+struct instance_order {
+  int t, s, id, w;
+};
+
+static int
+compare_instance_order(const void *a, const void *b) {
+  const struct instance_order *x = (const struct instance_order *) a;
+  const struct instance_order *y = (const struct instance_order *) b;
+  if (x->t != y->t) return x->t - y->t;
+  return x->s - y->s;
+}
+
+// see comments in .h file
+int
+jbig2_symbols_encode_text(const struct jbig2_symbols *symbols,
+                          struct jbig2enc_ctx *ctx, int pageno) {
+  const struct jbig2_symbols_page *const page = symbols->pages[pageno];
+  const int n = page->ninstances;
+  struct instance_order *const order =
+      (struct instance_order *) malloc((n ? n : 1) * sizeof(*order));
+  if (!order) abort();
+  for (int i = 0; i < n; ++i) {
+    const struct instance *const inst = &page->instances[i];
+    const struct symbol *const s = symbol_at(symbols, inst->symbol);
+    order[i].t = inst->y + s->pix->h - 1;
+    order[i].s = inst->x;
+    order[i].id = s->id;
+    order[i].w = s->pix->w;
+  }
+  qsort(order, n, sizeof(*order), compare_instance_order);
+
+  int symcodelen = 0;
+  while ((1 << symcodelen) < symbols->nsymbols) symcodelen++;
+
+  // the initial STRIPT, and then each strip
+  jbig2enc_int(ctx, JBIG2_IADT, 0);
+  int stript = 0, firsts = 0;
+  for (int i = 0; i < n; ) {
+    const int t = order[i].t;
+    jbig2enc_int(ctx, JBIG2_IADT, t - stript);
+    stript = t;
+    jbig2enc_int(ctx, JBIG2_IAFS, order[i].s - firsts);
+    firsts = order[i].s;
+    int curs = firsts;
+    for (bool first = true; i < n && order[i].t == t; ++i, first = false) {
+      if (!first) jbig2enc_int(ctx, JBIG2_IADS, order[i].s - curs);
+      jbig2enc_iaid(ctx, symcodelen, order[i].id);
+      curs = order[i].s + order[i].w - 1;
+    }
+    jbig2enc_oob(ctx, JBIG2_IADS);
+  }
+  free(order);
+  return n;
+}
+
+// see comments in .h file
+void
+jbig2_symbols_page_info(const struct jbig2_symbols *symbols, int pageno,
+                        int *width, int *height, int *xres, int *yres) {
+  const struct jbig2_symbols_page *const page = symbols->pages[pageno];
+  *width = page->width;
+  *height = page->height;
+  *xres = page->xres;
+  *yres = page->yres;
+}
+
+// see comments in .h file
+struct Pix *
+jbig2_symbols_residual(const struct jbig2_symbols *symbols, int pageno) {
+  return symbols->pages[pageno]->residual;
+}
+
+// see comments in .h file
+void
+jbig2_symbols_page_done(struct jbig2_symbols *symbols, int pageno) {
+  jbig2_symbols_page_free(symbols->pages[pageno]);
+  symbols->pages[pageno] = NULL;
+}
+
+// see comments in .h file
+void
+jbig2_symbols_page_free(struct jbig2_symbols_page *page) {
+  if (!page) return;
+  if (page->components) {
+    for (int n = 0; n < page->ninstances; ++n) {
+      pixDestroy(&page->components[n].pix);
+    }
+    free(page->components);
+  }
+  free(page->classes);
+  pixDestroy(&page->residual);
+  free(page->instances);
+  free(page);
+}
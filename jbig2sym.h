@@ -0,0 +1,116 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef JBIG2ENC_JBIG2SYM_H__
+#define JBIG2ENC_JBIG2SYM_H__
+
+struct Pix;
+struct jbig2enc_ctx;
+
+// -----------------------------------------------------------------------------
+// Symbol coding (6.4, 6.5): the connected components of the pages are sorted
+// into classes of components which look alike, each class is coded once, in a
+// symbol dictionary shared by all the pages, and each page is a text region
+// placing the symbols. Components too large to be symbols are left in a
+// generic region. This is lossy: every component is drawn as the first one of
+// its class.
+//
+// Instead of correlating each component with every class, the classes are
+// hashed on their size, and a component is only compared with the classes of
+// exactly its size. Most of those are rejected without looking at the pixels,
+// by bounds on the correlation from the ink in a 4x4 grid over each bitmap.
+//
+// A component is in the first (oldest) class it matches. The pages are taken
+// in four steps: _extract finds the components of a page and _match looks for
+// their classes among those there are so far, both of which can run for
+// different pages in parallel, also while _add_page runs; _add_page classifies
+// the rest of them (in page order, one page at a time); and once all the pages
+// have been added the dictionary and then each page are coded (see
+// jbig2_encode_symbol_dictionary and jbig2_encode_symbol_page in jbig2enc.h).
+// The classes are the same whether or not the pages went through _match, and
+// whichever classes it found.
+// -----------------------------------------------------------------------------
+struct jbig2_symbols;
+struct jbig2_symbols_page;
+
+// -----------------------------------------------------------------------------
+// Create a classifier. Two components are in the same class if their
+// correlation (the square of the number of black pixels in both, over the
+// product of the numbers of black pixels in each) is at least
+//
+//   threshold + (1 - threshold) * weight * (fraction of black in the class)
+//
+// as for Leptonica's jbCorrelation; the weight keeps heavy, dense components
+// apart, which correlate well even when they differ.
+// -----------------------------------------------------------------------------
+struct jbig2_symbols *jbig2_symbols_new(float threshold, float weight);
+
+void jbig2_symbols_free(struct jbig2_symbols *symbols);
+
+// -----------------------------------------------------------------------------
+// Find the 8-connected components of a 1 bpp image. The image isn't kept.
+// This uses nothing but the image, so it can run on several pages at once.
+// -----------------------------------------------------------------------------
+struct jbig2_symbols_page *jbig2_symbols_extract(struct Pix *bw);
+
+// -----------------------------------------------------------------------------
+// Find the classes of the components of page among those already in symbols,
+// so that _add_page only has to look through the classes added since. This
+// only reads symbols, and runs alongside _add_page adding other pages.
+// -----------------------------------------------------------------------------
+void jbig2_symbols_match(const struct jbig2_symbols *symbols,
+                         struct jbig2_symbols_page *page);
+
+// -----------------------------------------------------------------------------
+// Sort the components of page into the classes of symbols, making new classes
+// as needed, and take page over as the next page of symbols (numbered from 0
+// in the order they are added). Returns the page number.
+// -----------------------------------------------------------------------------
+int jbig2_symbols_add_page(struct jbig2_symbols *symbols,
+                           struct jbig2_symbols_page *page);
+
+// -----------------------------------------------------------------------------
+// Code the symbol dictionary of all the classes into ctx (7.4.2.2, without
+// the data header). Call this once, after the last page has been added, and
+// before coding any page. Returns the number of symbols.
+// -----------------------------------------------------------------------------
+int jbig2_symbols_encode_dictionary(struct jbig2_symbols *symbols,
+                                    struct jbig2enc_ctx *ctx);
+
+// -----------------------------------------------------------------------------
+// Code the text region of page pageno into ctx (7.4.3.2, without the data
+// header), with REFCORNER BOTTOMLEFT and strips of one row. Returns the number
+// of symbol instances.
+// -----------------------------------------------------------------------------
+int jbig2_symbols_encode_text(const struct jbig2_symbols *symbols,
+                              struct jbig2enc_ctx *ctx, int pageno);
+
+// -----------------------------------------------------------------------------
+// The size and resolution of page pageno, and its pixels which aren't in any
+// symbol (NULL if there are none, otherwise owned by symbols)
+// -----------------------------------------------------------------------------
+void jbig2_symbols_page_info(const struct jbig2_symbols *symbols, int pageno,
+                             int *width, int *height, int *xres, int *yres);
+struct Pix *jbig2_symbols_residual(const struct jbig2_symbols *symbols,
+                                   int pageno);
+
+// -----------------------------------------------------------------------------
+// Free what is kept for coding page pageno, once it has been coded
+// -----------------------------------------------------------------------------
+void jbig2_symbols_page_done(struct jbig2_symbols *symbols, int pageno);
+
+// -----------------------------------------------------------------------------
+// Free a page from _extract which won't be added
+// -----------------------------------------------------------------------------
+void jbig2_symbols_page_free(struct jbig2_symbols_page *page);
+
+#endif  // JBIG2ENC_JBIG2SYM_H__
@@ -0,0 +1,94 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "jbig2synth.h"
+
+#include <string.h>
+
+#include <allheaders.h>
+#include <pix.h>
+
+// see comments in .h file
+uint32_t
+jbig2_next_random(uint32_t *state) {
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *state = x;
+}
+
+static inline void
+set_black(PIX *pix, int x, int y) {
+  pix->data[y * pix->wpl + (x >> 5)] |= 0x80000000u >> (x & 31);
+}
+
+// see comments in .h file
+PIX *
+jbig2_make_synthetic(const char *kind, int w, int h) {
+  PIX *pix = pixCreate(w, h, 1);
+  if (!pix) return NULL;
+  uint32_t state = 0x12345678;
+
+  if (strcmp(kind, "blank") == 0) {
+    // pixCreate gives a white page
+  } else if (strcmp(kind, "text") == 0) {
+    const int margin = w / 10, line_height = 50, xheight = 22;
+    for (int base = margin + line_height; base + 12 < h - margin;
+         base += line_height) {
+      int x = margin;
+      const int end =
+          w - margin - (jbig2_next_random(&state) % 4 == 0 ? w / 3 : 0);
+      while (x < end) {
+        // a word of 2 to 9 glyphs
+        const int nglyphs = 2 + jbig2_next_random(&state) % 8;
+        for (int g = 0; g < nglyphs && x < end; ++g) {
+          const int gw = 10 + jbig2_next_random(&state) % 10;
+          const uint32_t shape = jbig2_next_random(&state);
+          const int top = base - xheight - (shape & 1 ? 12 : 0);
+          const int bottom = base + (shape & 2 ? 10 : 0);
+          for (int y = top; y < bottom; ++y) {
+            for (int dx = 0; dx < gw && x + dx < end; ++dx) {
+              // strokes: the left and right edges and a few bars
+              const bool stroke = dx < 3 || dx >= gw - 3 ||
+                  ((shape >> 4) & 1 && y - top < 3) ||
+                  ((shape >> 5) & 1 && bottom - y <= 3) ||
+                  ((shape >> 6) & 1 && (y - top) / 3 == (bottom - top) / 6);
+              if (stroke) set_black(pix, x + dx, y);
+            }
+          }
+          x += gw + 3;
+        }
+        x += 15;  // space between words
+      }
+    }
+  } else if (strcmp(kind, "halftone") == 0) {
+    for (int y = 0; y < h; ++y) {
+      for (int x = 0; x < w; ++x) {
+        // darkness from 0 to 255 across the page, dithered with noise
+        const uint32_t level = (uint32_t) (x + y) * 255 / (w + h);
+        if ((jbig2_next_random(&state) & 255) < level) set_black(pix, x, y);
+      }
+    }
+  } else if (strcmp(kind, "random") == 0) {
+    for (int y = 0; y < h; ++y) {
+      uint32_t *line = pix->data + y * pix->wpl;
+      for (unsigned k = 0; k < pix->wpl; ++k) line[k] = jbig2_next_random(&state);
+      // the pad bits must be zero
+      if (w & 31) line[w >> 5] &= ~(0xffffffffu >> (w & 31));
+    }
+  } else {
+    pixDestroy(&pix);
+    return NULL;
+  }
+  return pix;
+}
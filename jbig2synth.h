@@ -0,0 +1,39 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef JBIG2ENC_JBIG2SYNTH_H__
+#define JBIG2ENC_JBIG2SYNTH_H__
+
+#include <stdint.h>
+
+struct Pix;
+
+// -----------------------------------------------------------------------------
+// A small deterministic random number generator (xorshift32), so that the
+// synthetic pages are the same on every run and every platform. state must
+// not be zero.
+// -----------------------------------------------------------------------------
+uint32_t jbig2_next_random(uint32_t *state);
+
+// -----------------------------------------------------------------------------
+// Make a 1 bpp synthetic page of w x h pixels of the given kind, for the
+// benchmarks (jbig2bench.cc, jbig2micro.cc):
+//   blank: all white
+//   text: lines of "words" made of random glyph-sized blobs, with margins,
+//         like a scanned page of text at 300 dpi
+//   halftone: a dithered smooth gradient, the worst case for the coder
+//   random: each pixel black with a probability of 1/2
+// Returns NULL if kind is unknown.
+// -----------------------------------------------------------------------------
+struct Pix *jbig2_make_synthetic(const char *kind, int w, int h);
+
+#endif  // JBIG2ENC_JBIG2SYNTH_H__
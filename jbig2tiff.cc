@@ -0,0 +1,412 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "jbig2tiff.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <allheaders.h>
+#include <pix.h>
+
+#include "jbig2mmr.h"
+
+#define u32 uint32_t
+#define u16 uint16_t
+#define u8  uint8_t
+
+// the most images followed along the chain, which also ends any loop in it
+#define MAX_IMAGES 65536
+// the largest width or height taken
+#define MAX_SIDE (1 << 20)
+
+// field types
+enum {
+  TYPE_SHORT = 3,
+  TYPE_LONG = 4,
+  TYPE_RATIONAL = 5,
+};
+
+// compressions
+enum {
+  COMPRESSION_NONE = 1,
+  COMPRESSION_MH = 2,
+  COMPRESSION_G3 = 3,
+  COMPRESSION_G4 = 4,
+  COMPRESSION_PACKBITS = 32773,
+};
+
+// -----------------------------------------------------------------------------
+// The file, and the byte order of its numbers
+// -----------------------------------------------------------------------------
+struct tiff {
+  const u8 *data;
+  size_t size;
+  bool big_endian;
+};
+
+static u32
+get16(const struct tiff *t, size_t offset) {
+  const u8 *const p = t->data + offset;
+  return t->big_endian ? (p[0] << 8) | p[1] : (p[1] << 8) | p[0];
+}
+
+static u32
+get32(const struct tiff *t, size_t offset) {
+  const u8 *const p = t->data + offset;
+  return t->big_endian
+             ? ((u32) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]
+             : ((u32) p[3] << 24) | (p[2] << 16) | (p[1] << 8) | p[0];
+}
+
+// -----------------------------------------------------------------------------
+// Sets up t for the file at data. Returns the offset of its first IFD, or 0 if
+// it isn't a TIFF file.
+// -----------------------------------------------------------------------------
+static u32
+tiff_open(struct tiff *t, const u8 *data, size_t size) {
+  t->data = data;
+  t->size = size;
+  if (size < 8) return 0;
+  if (data[0] == 'I' && data[1] == 'I') {
+    t->big_endian = false;
+  } else if (data[0] == 'M' && data[1] == 'M') {
+    t->big_endian = true;
+  } else {
+    return 0;
+  }
+  if (get16(t, 2) != 42) return 0;
+  return get32(t, 4);
+}
+
+// whether an IFD at offset, of however many entries it has, is in the file
+static bool
+ifd_valid(const struct tiff *t, u32 offset) {
+  if (offset < 8 || offset > t->size - 2) return false;
+  return (size_t) offset + 2 + get16(t, offset) * 12 + 4 <= t->size;
+}
+
+// -----------------------------------------------------------------------------
+// Returns the offset of the IFD of image index, or 0 if there is none
+// -----------------------------------------------------------------------------
+static u32
+find_ifd(const struct tiff *t, u32 ifd, int index) {
+  for (int i = 0; ifd_valid(t, ifd) && i < MAX_IMAGES; ++i) {
+    if (i == index) return ifd;
+    ifd = get32(t, ifd + 2 + get16(t, ifd) * 12);
+  }
+  return 0;
+}
+
+// see comments in .h file
+int
+jbig2_tiff_count(const u8 *data, size_t size) {
+  struct tiff t;
+  u32 ifd = tiff_open(&t, data, size);
+  int n = 0;
+  while (ifd && n < MAX_IMAGES) {
+    if (!ifd_valid(&t, ifd)) return 0;
+    ++n;
+    ifd = get32(&t, ifd + 2 + get16(&t, ifd) * 12);
+  }
+  return ifd ? 0 : n;
+}
+
+// -----------------------------------------------------------------------------
+// The fields of an image which the reader uses
+// -----------------------------------------------------------------------------
+struct tiff_image {
+  u32 width, height;
+  u32 bits_per_sample, samples_per_pixel;
+  u32 compression;
+  u32 photometric;
+  u32 fill_order;
+  u32 rows_per_strip;
+  u32 t4_options;
+  u32 resolution_unit;
+  double xres, yres;  // 0 if not given
+  bool tiled;
+  // StripOffsets and StripByteCounts: the type and number of values, and
+  // where they are
+  u32 offsets_type, nstrips, offsets_at;
+  u32 counts_type, ncounts, counts_at;
+};
+
+// the size of a value of type, or 0 for a type which isn't read
+static u32
+type_size(u32 type) {
+  return type == TYPE_SHORT ? 2 : type == TYPE_LONG ? 4
+                                : type == TYPE_RATIONAL ? 8 : 0;
+}
+
+// -----------------------------------------------------------------------------
+// Finds the values of the entry at offset: sets *at to where they are, in the
+// entry itself if they fit. Returns false if they aren't all in the file.
+// -----------------------------------------------------------------------------
+static bool
+entry_values(const struct tiff *t, u32 offset, u32 *at) {
+  const u32 size = type_size(get16(t, offset + 2));
+  const u32 count = get32(t, offset + 4);
+  if (!size || count > t->size / size) return false;
+  if (size * count <= 4) {
+    *at = offset + 8;
+    return true;
+  }
+  *at = get32(t, offset + 8);
+  return *at <= t->size && size * count <= t->size - *at;
+}
+
+// value i of the values of type at offset
+static u32
+value_at(const struct tiff *t, u32 type, u32 at, u32 i) {
+  return type == TYPE_SHORT ? get16(t, at + i * 2) : get32(t, at + i * 4);
+}
+
+// -----------------------------------------------------------------------------
+// Reads the IFD at offset into image. Returns false if the image is not one
+// which can be read.
+// -----------------------------------------------------------------------------
+static bool
+read_image(const struct tiff *t, u32 ifd, struct tiff_image *image) {
+  memset(image, 0, sizeof(*image));
+  image->bits_per_sample = 1;
+  image->samples_per_pixel = 1;
+  image->compression = COMPRESSION_NONE;
+  image->photometric = 0;
+  image->fill_order = 1;
+  image->rows_per_strip = 0xffffffffu;
+  image->resolution_unit = 2;
+
+  const u32 nentries = get16(t, ifd);
+  for (u32 e = 0; e < nentries; ++e) {
+    const u32 offset = ifd + 2 + e * 12;
+    const u32 tag = get16(t, offset);
+    const u32 type = get16(t, offset + 2);
+    const u32 count = get32(t, offset + 4);
+    u32 at;
+    if (!entry_values(t, offset, &at)) {
+      // unknown types only matter for the tags read below
+      if (tag == 256 || tag == 257 || tag == 273 || tag == 279) return false;
+      continue;
+    }
+    const u32 value = type == TYPE_RATIONAL ? 0 : value_at(t, type, at, 0);
+    double ratio = 0;
+    if (type == TYPE_RATIONAL && get32(t, at + 4))
+      ratio = (double) get32(t, at) / get32(t, at + 4);
+    switch (tag) {
+      case 256: image->width = value; break;
+      case 257: image->height = value; break;
+      case 258: image->bits_per_sample = value; break;
+      case 259: image->compression = value; break;
+      case 262: image->photometric = value; break;
+      case 266: image->fill_order = value; break;
+      case 273:
+        image->offsets_type = type;
+        image->nstrips = count;
+        image->offsets_at = at;
+        break;
+      case 277: image->samples_per_pixel = value; break;
+      case 278: image->rows_per_strip = value; break;
+      case 279:
+        image->counts_type = type;
+        image->ncounts = count;
+        image->counts_at = at;
+        break;
+      case 282: image->xres = ratio; break;
+      case 283: image->yres = ratio; break;
+      case 292: image->t4_options = value; break;
+      case 296: image->resolution_unit = value; break;
+      case 322: image->tiled = true; break;
+      default: break;
+    }
+  }
+
+  if (image->width == 0 || image->width > MAX_SIDE ||
+      image->height == 0 || image->height > MAX_SIDE ||
+      image->bits_per_sample != 1 || image->samples_per_pixel != 1 ||
+      image->photometric > 1 || image->tiled ||
+      (image->fill_order != 1 && image->fill_order != 2))
+    return false;
+  if (image->compression != COMPRESSION_NONE &&
+      image->compression != COMPRESSION_MH &&
+      image->compression != COMPRESSION_G3 &&
+      image->compression != COMPRESSION_G4 &&
+      image->compression != COMPRESSION_PACKBITS)
+    return false;
+  // T4Options bit 1 is uncompressed mode, which isn't supported
+  if (image->compression == COMPRESSION_G3 && (image->t4_options & 2))
+    return false;
+  if (image->rows_per_strip == 0 || image->rows_per_strip > image->height)
+    image->rows_per_strip = image->height;
+  const u32 nstrips = (image->height + image->rows_per_strip - 1) /
+                      image->rows_per_strip;
+  return image->offsets_type != TYPE_RATIONAL && image->nstrips == nstrips &&
+         image->counts_type != TYPE_RATIONAL && image->ncounts == nstrips;
+}
+
+// see comments in .h file
+int
+jbig2_tiff_info(const u8 *data, size_t size, int index, int *width,
+                int *height) {
+  struct tiff t;
+  const u32 ifd = find_ifd(&t, tiff_open(&t, data, size), index);
+  struct tiff_image image;
+  if (!ifd || !read_image(&t, ifd, &image)) return -1;
+  *width = image.width;
+  *height = image.height;
+  return 0;
+}
+
+// -----------------------------------------------------------------------------
+// Packs rows of row_bytes bytes each, from data, into the words of rows, wpl
+// to a row. The bits past the width w are cleared.
+// -----------------------------------------------------------------------------
+static void
+pack_rows(const u8 *data, u32 row_bytes, u32 nrows, bool lsb_first, u32 w,
+          u32 *rows, int wpl) {
+  const u32 tail = w & 31 ? 0xffffffffu << (32 - (w & 31)) : 0xffffffffu;
+  for (u32 y = 0; y < nrows; ++y) {
+    const u8 *const src = data + (size_t) y * row_bytes;
+    u32 *const dst = rows + (size_t) y * wpl;
+    for (int j = 0; j < wpl; ++j) {
+      u32 word = 0;
+      for (u32 k = 0; k < 4; ++k) {
+        const u32 i = j * 4 + k;
+        u8 byte = i < row_bytes ? src[i] : 0;
+        if (lsb_first) {
+          byte = (byte & 0xf0) >> 4 | (byte & 0x0f) << 4;
+          byte = (byte & 0xcc) >> 2 | (byte & 0x33) << 2;
+          byte = (byte & 0xaa) >> 1 | (byte & 0x55) << 1;
+        }
+        word |= (u32) byte << (24 - k * 8);
+      }
+      dst[j] = word;
+    }
+    dst[wpl - 1] &= tail;
+  }
+}
+
+// -----------------------------------------------------------------------------
+// Decodes PackBits data of length bytes into out, of out_size bytes. Returns
+// false if it ends before out is filled.
+// -----------------------------------------------------------------------------
+static bool
+unpack_bits(const u8 *data, size_t length, u8 *out, size_t out_size) {
+  size_t i = 0, o = 0;
+  while (o < out_size && i < length) {
+    const int n = (signed char) data[i++];
+    if (n >= 0) {
+      size_t count = n + 1;
+      if (count > length - i) return false;
+      if (count > out_size - o) count = out_size - o;
+      memcpy(out + o, data + i, count);
+      i += n + 1;
+      o += count;
+    } else if (n != -128) {
+      if (i == length) return false;
+      size_t count = 1 - n;
+      if (count > out_size - o) count = out_size - o;
+      memset(out + o, data[i++], count);
+      o += count;
+    }
+  }
+  return o == out_size;
+}
+
+// -----------------------------------------------------------------------------
+// Decodes the strip of nrows rows at data, length bytes, into rows. Returns
+// false if it is corrupt.
+// -----------------------------------------------------------------------------
+static bool
+read_strip(const struct tiff_image *image, const u8 *data, size_t length,
+           u32 nrows, u32 *rows, int wpl) {
+  const bool lsb_first = image->fill_order == 2;
+  const u32 row_bytes = (image->width + 7) / 8;
+  switch (image->compression) {
+    case COMPRESSION_NONE:
+      if (length / row_bytes < nrows) return false;
+      pack_rows(data, row_bytes, nrows, lsb_first, image->width, rows, wpl);
+      return true;
+    case COMPRESSION_PACKBITS: {
+      const size_t size = (size_t) row_bytes * nrows;
+      u8 *const buf = (u8 *) malloc(size);
+      if (!buf) abort();
+      const bool ok = unpack_bits(data, length, buf, size);
+      if (ok)
+        pack_rows(buf, row_bytes, nrows, lsb_first, image->width, rows, wpl);
+      free(buf);
+      return ok;
+    }
+    case COMPRESSION_MH:
+      return jbig2_ccitt_decode(data, length, JBIG2_CCITT_MH, false,
+                                lsb_first, image->width, nrows, rows,
+                                wpl) == 0;
+    case COMPRESSION_G3:
+      return jbig2_ccitt_decode(data, length, JBIG2_CCITT_T4,
+                                image->t4_options & 1, lsb_first,
+                                image->width, nrows, rows, wpl) == 0;
+    default:
+      return jbig2_ccitt_decode(data, length, JBIG2_CCITT_T6, false,
+                                lsb_first, image->width, nrows, rows,
+                                wpl) == 0;
+  }
+}
+
+// see comments in .h file
+PIX *
+jbig2_tiff_read(const u8 *data, size_t size, int index) {
+  struct tiff t;
+  const u32 ifd = find_ifd(&t, tiff_open(&t, data, size), index);
+  struct tiff_image image;
+  if (!ifd || !read_image(&t, ifd, &image)) return NULL;
+
+  PIX *pix = pixCreate(image.width, image.height, 1);
+  if (!pix) return NULL;
+  const int wpl = pix->wpl;
+  l_uint32 *const words = pix->data;
+  for (u32 s = 0; s < image.nstrips; ++s) {
+    const u32 y = s * image.rows_per_strip;
+    const u32 nrows = image.height - y < image.rows_per_strip
+                          ? image.height - y : image.rows_per_strip;
+    const u32 offset = value_at(&t, image.offsets_type, image.offsets_at, s);
+    u32 length = value_at(&t, image.counts_type, image.counts_at, s);
+    if (offset > size) {
+      pixDestroy(&pix);
+      return NULL;
+    }
+    // some writers count past the end of the file
+    if (length > size - offset) length = size - offset;
+    if (!read_strip(&image, data + offset, length, nrows,
+                    words + (size_t) y * wpl, wpl)) {
+      pixDestroy(&pix);
+      return NULL;
+    }
+  }
+  // CCITT white runs and 0 bits are white, unless PhotometricInterpretation
+  // is BlackIsZero
+  if (image.photometric == 1) {
+    const u32 tail = image.width & 31 ? 0xffffffffu << (32 - (image.width & 31))
+                                      : 0xffffffffu;
+    for (u32 y = 0; y < image.height; ++y) {
+      u32 *const row = words + (size_t) y * wpl;
+      for (int j = 0; j < wpl; ++j) row[j] = ~row[j];
+      row[wpl - 1] &= tail;
+    }
+  }
+
+  const double scale = image.resolution_unit == 3 ? 2.54 : 1;
+  if (image.resolution_unit != 1) {
+    pix->xres = (l_int32) (image.xres * scale + 0.5);
+    pix->yres = (l_int32) (image.yres * scale + 0.5);
+  }
+  return pix;
+}
@@ -0,0 +1,57 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef JBIG2ENC_JBIG2TIFF_H__
+#define JBIG2ENC_JBIG2TIFF_H__
+
+#include <stddef.h>
+#if defined(sun)
+#include <sys/types.h>
+#else
+#include <stdint.h>
+#endif
+
+struct Pix;
+
+// -----------------------------------------------------------------------------
+// A reader of the bilevel images of a TIFF file held in memory, as scanners
+// and fax software write them: one sample of one bit per pixel, in strips
+// which are uncompressed, PackBits or CCITT (modified Huffman, G3 or G4)
+// coded. CCITT strips are decoded by jbig2_ccitt_decode straight into the
+// words of the image. Anything else (tiles, LZW, gray or colour images) is
+// left to libtiff, where it is built in (HAVE_LIBTIFF).
+//
+// All the functions can be called from several threads at once.
+// -----------------------------------------------------------------------------
+
+// -----------------------------------------------------------------------------
+// Returns the number of images (IFDs) of the size bytes of a TIFF file at
+// data, or 0 if it isn't one, or its chain of images is broken.
+// -----------------------------------------------------------------------------
+int jbig2_tiff_count(const uint8_t *data, size_t size);
+
+// -----------------------------------------------------------------------------
+// Sets *width and *height to the size of the image index (from 0) of the TIFF
+// file at data. Returns 0, or -1 if there is no such image or it isn't one
+// which jbig2_tiff_read can read.
+// -----------------------------------------------------------------------------
+int jbig2_tiff_info(const uint8_t *data, size_t size, int index, int *width,
+                    int *height);
+
+// -----------------------------------------------------------------------------
+// Decodes the image index (from 0) of the TIFF file at data into a 1 bpp pix,
+// with the resolution of the file. Returns NULL if there is no such image, it
+// isn't one which can be read (see above), or it is corrupt.
+// -----------------------------------------------------------------------------
+struct Pix *jbig2_tiff_read(const uint8_t *data, size_t size, int index);
+
+#endif  // JBIG2ENC_JBIG2TIFF_H__
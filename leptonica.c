@@ -1,7 +1,13 @@
+/* Defined as empty and extern by c-micro.sh, to call the line kernels */
+#ifndef LEPTONICA_EXPORT
 #define LEPTONICA_EXPORT static
+#endif
+#ifndef LEPTONICA_EXTERN
 #define LEPTONICA_EXTERN static
+#endif
 
 #include "colormap.c"
+#include "cpufeatures.c"
 #include "grayquant.c"
 #include "grayquantlow.c"
 #include "pix1.c"
@@ -16,12 +16,19 @@ LEPT_DLL LEPTONICA_EXTERN l_int32 pixcmapToArrays ( PIXCMAP *cmap, l_int32 **prm
 LEPT_DLL extern PIX * pixThresholdToBinary ( PIX *pixs, l_int32 thresh );
 LEPT_DLL LEPTONICA_EXTERN void thresholdToBinaryLow ( l_uint32 *datad, l_int32 w, l_int32 h, l_int32 wpld, l_uint32 *datas, l_int32 d, l_int32 wpls, l_int32 thresh );
 LEPT_DLL LEPTONICA_EXTERN void thresholdToBinaryLineLow ( l_uint32 *lined, l_int32 w, l_uint32 *lines, l_int32 d, l_int32 thresh );
+LEPT_DLL LEPTONICA_EXTERN void thresholdCmapToBinaryLow ( l_uint32 *datad, l_int32 w, l_int32 h, l_int32 wpld, l_uint32 *datas, l_int32 d, l_int32 wpls, l_uint8 *tab );
 LEPT_DLL extern JBCLASSER * jbCorrelationInitWithoutComponents ( l_int32 components, l_int32 maxwidth, l_int32 maxheight, l_float32 thresh, l_float32 weightfactor );
 LEPT_DLL extern l_int32 jbAddPage ( JBCLASSER *classer, PIX *pixs );
 LEPT_DLL extern void jbClasserDestroy ( JBCLASSER **pclasser );
 LEPT_DLL extern l_int32 jbGetLLCorners ( JBCLASSER *classer );
 LEPT_DLL extern l_int32 numaGetIValue ( NUMA *na, l_int32 index, l_int32 *pival );
-LEPT_DLL LEPTONICA_EXTERN PIX * pixCreate ( l_int32 width, l_int32 height, l_int32 depth );
+LEPT_DLL extern void setPixMemoryManager ( void *(allocator(size_t)), void (deallocator(void *)) );
+LEPT_DLL extern l_int32 setPixDataCache ( size_t maxbytes );
+LEPT_DLL extern void emptyPixDataCache ( void );
+LEPT_DLL extern void setPixBytesCounter ( L_PIX_BYTES *counter );
+LEPT_DLL extern l_int32 setPixDataHugePages ( l_int32 flag );
+LEPT_DLL extern l_int32 setPixDataNodeLocal ( l_int32 flag );
+LEPT_DLL extern PIX * pixCreate ( l_int32 width, l_int32 height, l_int32 depth );
 LEPT_DLL LEPTONICA_EXTERN PIX * pixCreateNoInit ( l_int32 width, l_int32 height, l_int32 depth );
 LEPT_DLL LEPTONICA_EXTERN PIX * pixCreateTemplate ( PIX *pixs );
 LEPT_DLL LEPTONICA_EXTERN PIX * pixCreateTemplateNoInit ( PIX *pixs );
@@ -64,13 +71,29 @@ LEPT_DLL LEPTONICA_EXTERN l_int32 pixSetPixel ( PIX *pix, l_int32 x, l_int32 y,
 LEPT_DLL extern l_int32 pixSetPadBits ( PIX *pix, l_int32 val );
 LEPT_DLL extern PIX * pixRemoveBorder ( PIX *pixs, l_int32 npix );
 LEPT_DLL LEPTONICA_EXTERN l_int32 composeRGBPixel ( l_int32 rval, l_int32 gval, l_int32 bval, l_uint32 *ppixel );
+LEPT_DLL LEPTONICA_EXTERN l_int32 lineEndianByteSwap ( l_uint32 *datad, l_uint32 *datas, l_int32 wpl );
 LEPT_DLL LEPTONICA_EXTERN PIX * pixInvert ( PIX *pixd, PIX *pixs );
 LEPT_DLL extern l_int32 pixCountPixels ( PIX *pix, l_int32 *pcount, l_int32 *tab8 );
 LEPT_DLL extern void pixaDestroy ( PIXA **ppixa );
 LEPT_DLL extern PIX * pixRemoveColormap ( PIX *pixs, l_int32 type );
 LEPT_DLL extern PIX * pixConvertRGBToGrayFast ( PIX *pixs );
+LEPT_DLL extern PIX * pixConvertRGBToBinaryFast ( PIX *pixs, l_int32 thresh );
+LEPT_DLL extern PIX * pixConvertTo1Transfer ( PIX **ppixs, l_int32 thresh, l_int32 factor );
 LEPT_DLL LEPTONICA_EXTERN PIX * pixReadStreamPng ( FILE *fp );
+LEPT_DLL extern PIX * pixReadMemPng ( const l_uint8 *cdata, size_t size );
+LEPT_DLL extern l_int32 sreadHeaderPng ( const l_uint8 *cdata, size_t size, l_int32 *pwidth, l_int32 *pheight, l_int32 *pbps, l_int32 *pspp, l_int32 *piscmap );
+LEPT_DLL extern L_PNG_BIN_READER * pngBinReaderCreate ( FILE *fp, l_int32 thresh );
+LEPT_DLL extern L_PNG_BIN_READER * pngBinReaderCreateMem ( const l_uint8 *cdata, size_t size, l_int32 thresh );
+LEPT_DLL extern void pngBinReaderDestroy ( L_PNG_BIN_READER **prdr );
+LEPT_DLL extern l_int32 pngBinReaderGetInfo ( L_PNG_BIN_READER *rdr, l_int32 *pw, l_int32 *ph, l_int32 *pxres, l_int32 *pyres );
+LEPT_DLL extern l_int32 pngBinReaderReadRow ( L_PNG_BIN_READER *rdr, l_uint32 *lined );
+LEPT_DLL extern void l_pngSetReadTrusted ( l_int32 flag );
 LEPT_DLL LEPTONICA_EXTERN PIX * pixReadStreamPnm ( FILE *fp );
+LEPT_DLL extern PIX * pixReadMemPnm ( const l_uint8 *cdata, size_t size );
+LEPT_DLL extern l_int32 sreadHeaderPnm ( const l_uint8 *cdata, size_t size, l_int32 *pwidth, l_int32 *pheight, l_int32 *pdepth, l_int32 *ptype, l_int32 *pbps, l_int32 *pspp );
+LEPT_DLL extern l_int32 sreadSizePnm ( const l_uint8 *cdata, size_t size, size_t *pnbytes );
+LEPT_DLL LEPTONICA_EXTERN PIX * pixReadStreamPnmGz ( FILE *fp );
+LEPT_DLL extern PIX * pixReadMemPnmGz ( const l_uint8 *cdata, size_t size );
 LEPT_DLL LEPTONICA_EXTERN l_int32 freadHeaderPnm ( FILE *fp, PIX **ppix, l_int32 *pwidth, l_int32 *pheight, l_int32 *pdepth, l_int32 *ptype, l_int32 *pbps, l_int32 *pspp );
 LEPT_DLL extern PTA * ptaCreate ( l_int32 n );
 LEPT_DLL extern void ptaDestroy ( PTA **ppta );
@@ -78,13 +101,20 @@ LEPT_DLL extern l_int32 ptaAddPt ( PTA *pta, l_float32 x, l_float32 y );
 LEPT_DLL extern PIX * pixRead ( const char *filename );
 LEPT_DLL LEPTONICA_EXTERN PIX * pixReadStream ( FILE *fp, l_int32 hint );
 LEPT_DLL extern l_int32 findFileFormatStream ( FILE *fp, l_int32 *pformat );
-LEPT_DLL LEPTONICA_EXTERN l_int32 findFileFormatBuffer ( const l_uint8 *buf, l_int32 *pformat );
+LEPT_DLL extern l_int32 findFileFormatBuffer ( const l_uint8 *buf, l_int32 *pformat );
+LEPT_DLL extern PIX * pixReadMem ( const l_uint8 *data, size_t size );
+LEPT_DLL extern l_int32 pixReadHeaderMem ( const l_uint8 *data, size_t size, l_int32 *pformat, l_int32 *pw, l_int32 *ph, l_int32 *pbps, l_int32 *pspp, l_int32 *piscmap );
 LEPT_DLL extern l_int32 pixRasterop ( PIX *pixd, l_int32 dx, l_int32 dy, l_int32 dw, l_int32 dh, l_int32 op, PIX *pixs, l_int32 sx, l_int32 sy );
 LEPT_DLL LEPTONICA_EXTERN void rasteropUniLow ( l_uint32 *datad, l_int32 dpixw, l_int32 dpixh, l_int32 depth, l_int32 dwpl, l_int32 dx, l_int32 dy, l_int32 dw, l_int32 dh, l_int32 op );
 LEPT_DLL extern PIX * pixScaleGray2xLIThresh ( PIX *pixs, l_int32 thresh );
 LEPT_DLL extern PIX * pixScaleGray4xLIThresh ( PIX *pixs, l_int32 thresh );
-LEPT_DLL LEPTONICA_EXTERN void scaleGray2xLILineLow ( l_uint32 *lined, l_int32 wpld, l_uint32 *lines, l_int32 ws, l_int32 wpls, l_int32 lastlineflag );
-LEPT_DLL LEPTONICA_EXTERN void scaleGray4xLILineLow ( l_uint32 *lined, l_int32 wpld, l_uint32 *lines, l_int32 ws, l_int32 wpls, l_int32 lastlineflag );
+LEPT_DLL extern PIX * pixReduceRankBinary ( PIX *pixs, l_int32 factor, l_int32 level );
+LEPT_DLL LEPTONICA_EXTERN void scaleGray2xLIThreshLineLow ( l_uint32 *lined, l_int32 wpld, l_uint32 *lines, l_int32 ws, l_int32 wpls, l_int32 lastlineflag, l_int32 thresh );
+LEPT_DLL LEPTONICA_EXTERN void scaleGray4xLIThreshLineLow ( l_uint32 *lined, l_int32 wpld, l_uint32 *lines, l_int32 ws, l_int32 wpls, l_int32 lastlineflag, l_int32 thresh );
+LEPT_DLL LEPTONICA_EXTERN void reduceRankBinary2LineLow ( l_uint32 *lined, l_uint32 *lines, l_uint32 *lines2, l_int32 wpls, l_uint32 lastmask, l_int32 level, l_uint8 *tab );
+LEPT_DLL LEPTONICA_EXTERN void reduceRankBinary4LineLow ( l_uint32 *lined, l_uint32 *lines, l_int32 nlines, l_int32 wpls, l_uint32 lastmask, l_int32 level, l_uint16 *tab );
+LEPT_DLL LEPTONICA_EXTERN l_uint8 * makeSubsampleTab2x ( void );
+LEPT_DLL LEPTONICA_EXTERN l_uint16 * makeCountTab4x ( void );
 LEPT_DLL LEPTONICA_EXTERN l_int32 returnErrorInt ( const char *msg, const char *procname, l_int32 ival );
 LEPT_DLL LEPTONICA_EXTERN void * returnErrorPtr ( const char *msg, const char *procname, void *pval );
 LEPT_DLL LEPTONICA_EXTERN void l_error ( const char *msg, const char *procname );
@@ -97,6 +127,11 @@ LEPT_DLL LEPTONICA_EXTERN size_t fnbytesInFile ( FILE *fp );
 LEPT_DLL LEPTONICA_EXTERN l_uint16 convertOnBigEnd16 ( l_uint16 shortin );
 LEPT_DLL LEPTONICA_EXTERN FILE * fopenReadStream ( const char *filename );
 LEPT_DLL LEPTONICA_EXTERN char * genPathname ( const char *dir, const char *fname );
+LEPT_DLL extern void setRowBandRunner ( L_PARALLEL_FOR runner, l_int32 nthreads );
+LEPT_DLL LEPTONICA_EXTERN l_int32 getRowBandCount ( l_int32 w, l_int32 h );
+LEPT_DLL LEPTONICA_EXTERN void runRowBands ( l_int32 w, l_int32 h, L_BAND_FUNC fn, void *arg );
+LEPT_DLL extern void setConvertStepHook ( L_STEP_FUNC fn, void *arg );
+LEPT_DLL LEPTONICA_EXTERN void convertStepDone ( l_int32 step );
 
 #ifdef __cplusplus
 }
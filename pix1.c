@@ -32,6 +32,17 @@
  *          static void  *pix_malloc()
  *          static void   pix_free()
  *          void          setPixMemoryManager()
+ *          l_int32       setPixDataCache()
+ *          void          emptyPixDataCache()
+ *          void          setPixBytesCounter()
+ *          l_int32       setPixDataHugePages()
+ *          l_int32       setPixDataNodeLocal()
+ *   static l_int32       pix_cache_node()
+ *   static void         *pix_cache_malloc()
+ *   static void          pix_cache_free()
+ *   static void         *pix_map_huge()
+ *   static void         *pix_map_fresh()
+ *   static void          pix_cache_release()
  *
  *    Pix creation
  *          PIX          *pixCreate()
@@ -116,6 +127,12 @@
  *  To use it, you must call pmsCreate() before any pix have been allocated
  *  and pmsDestroy() at the end after all pix have been destroyed.
  *
+ *  Here, setPixDataCache() installs an allocator that keeps the large
+ *  data buffers of destroyed pix for reuse, so that a program making
+ *  images of the same sizes over and over (e.g., one per page) doesn't
+ *  have the system map and fault in fresh memory each time.  The same
+ *  two rules apply; emptyPixDataCache() frees the buffers kept.
+ *
  *
  *  Direct manipulation of the pix data field
  *  -----------------------------------------
@@ -170,8 +187,31 @@
 #include <stdlib.h>
 #include <string.h>
 #include "allheaders.h"
+#ifndef _WIN32
+#include <pthread.h>
+#endif  /* _WIN32 */
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif  /* __linux__ */
+
+    /* Set this to 1 to fill the data of every pix made by
+     * pixCreateNoInit() with a junk pattern.  Any function that
+     * makes pixd without initializing it and then fails to write
+     * every pixel will then give visibly wrong output, instead of
+     * usually getting zeroes from fresh memory. */
+#ifndef PIX_NOINIT_AUDIT
+#define PIX_NOINIT_AUDIT   0
+#endif  /* ~PIX_NOINIT_AUDIT */
+#define PIX_NOINIT_JUNK    0xa5
 
 static void pixFree(PIX *pix);
+static void *pix_cache_malloc(size_t size);
+static void pix_cache_free(void *ptr);
+static void *pix_map_huge(size_t size, size_t *plength);
+static void *pix_map_fresh(size_t size, size_t *plength);
+static void pix_cache_release(void *block);
 
 
 /*-------------------------------------------------------------------------*
@@ -222,6 +262,488 @@ pix_free(void  *ptr)
 #endif  /* _MSC_VER */
 }
 
+/*!
+ *  setPixMemoryManager()
+ *
+ *      Input:  allocator (<optional>; use null to skip)
+ *              deallocator (<optional>; use null to skip)
+ *      Return: void
+ *
+ *  Notes:
+ *      (1) Use this to change the alloc and/or dealloc functions;
+ *          e.g., setPixMemoryManager(my_malloc, my_free).
+ *      (2) Call it before any pix have been allocated.
+ */
+LEPTONICA_REAL_EXPORT void
+setPixMemoryManager(void  *(allocator(size_t)),
+                    void  (deallocator(void *)))
+{
+    if (allocator) pix_mem_manager.allocator = allocator;
+    if (deallocator) pix_mem_manager.deallocator = deallocator;
+    return;
+}
+
+
+/*-------------------------------------------------------------------------*
+ *                            Pix Data Cache                               *
+ *                                                                         *
+ *  The data buffers of at least PIX_CACHE_MIN_BYTES are kept when their   *
+ *  pix is destroyed, up to a total of maxbytes, and handed out again for  *
+ *  new pix of the same or a slightly smaller size.  The oldest ones go    *
+ *  first when there is no room.  Each buffer starts with a header that    *
+ *  holds its size, the counter it was charged to, the length of its      *
+ *  mapping if it was mapped on its own and the NUMA node it was made on,  *
+ *  so they can only be freed by pix_cache_free().  The cache is locked,   *
+ *  so pix can be created and destroyed by any thread.                     *
+ *-------------------------------------------------------------------------*/
+#define  PIX_CACHE_MIN_BYTES    (256 * 1024)  /* smaller buffers aren't kept */
+#define  PIX_CACHE_SLOTS        16     /* most buffers kept */
+#define  PIX_CACHE_HEADER       32     /* keeps the data 16-byte aligned */
+#define  PIX_HUGE_PAGE_BYTES    (2 * 1024 * 1024)  /* on x86-64 and arm64 */
+
+struct PixDataCache
+{
+    size_t           maxbytes;         /* most bytes kept              */
+    size_t           bytes;            /* bytes kept now               */
+    l_int32          n;                /* number of buffers kept       */
+    l_int32          hugepages;        /* map new buffers of at least  */
+                                       /* PIX_HUGE_PAGE_BYTES with     */
+                                       /* huge pages                   */
+    l_int32          nodelocal;        /* only reuse buffers on the    */
+                                       /* node they were made on       */
+    void            *buf[PIX_CACHE_SLOTS];  /* buffers, oldest first   */
+#ifndef _WIN32
+    pthread_mutex_t  mutex;
+#endif  /* _WIN32 */
+};
+
+static struct PixDataCache  pix_data_cache = {
+    0, 0, 0, 0, 0, {NULL},
+#ifndef _WIN32
+    PTHREAD_MUTEX_INITIALIZER
+#endif  /* _WIN32 */
+};
+
+#ifndef _WIN32
+#define  PIX_CACHE_LOCK()    pthread_mutex_lock(&pix_data_cache.mutex)
+#define  PIX_CACHE_UNLOCK()  pthread_mutex_unlock(&pix_data_cache.mutex)
+#else  /* _WIN32 */
+#define  PIX_CACHE_LOCK()
+#define  PIX_CACHE_UNLOCK()
+#endif  /* _WIN32 */
+
+    /* Returns the size of a buffer made by pix_cache_malloc() */
+#define  PIX_CACHE_SIZE(block)  (*(size_t *)(block))
+    /* Returns the counter charged for it (see setPixBytesCounter()) */
+#define  PIX_CACHE_COUNTER(block) \
+         (*(L_PIX_BYTES **)((char *)(block) + sizeof(size_t)))
+    /* Returns the length of its mapping, or 0 if it was malloced */
+#define  PIX_CACHE_MAPPED(block) \
+         (*(size_t *)((char *)(block) + sizeof(size_t) + sizeof(void *)))
+    /* Returns the NUMA node it was made on, or -1 if not known */
+#define  PIX_CACHE_NODE(block) \
+         (*(l_int32 *)((char *)(block) + 2 * sizeof(size_t) + sizeof(void *)))
+
+static L_THREAD_LOCAL L_PIX_BYTES  *PixBytesCounter = NULL;
+
+
+/*!
+ *  setPixDataCache()
+ *
+ *      Input:  maxbytes (most bytes of freed pix data to keep for reuse)
+ *      Return: 0 if OK, 1 on error
+ *
+ *  Notes:
+ *      (1) The first call installs the cache as the pix memory manager,
+ *          so it must come before any pix have been allocated, and
+ *          setPixMemoryManager() can't be used with it.
+ *      (2) Later calls only change maxbytes.  Use 0 to keep nothing.
+ */
+LEPTONICA_REAL_EXPORT l_int32
+setPixDataCache(size_t  maxbytes)
+{
+l_int32  trim;
+
+    PROCNAME("setPixDataCache");
+
+    if (pix_mem_manager.allocator != &pix_cache_malloc) {
+        if (pix_mem_manager.allocator != &malloc)
+            return ERROR_INT("another allocator in use", procName, 1);
+        setPixMemoryManager(&pix_cache_malloc, &pix_cache_free);
+    }
+    PIX_CACHE_LOCK();
+    pix_data_cache.maxbytes = maxbytes;
+    trim = (pix_data_cache.bytes > maxbytes);
+    PIX_CACHE_UNLOCK();
+    if (trim)
+        emptyPixDataCache();
+    return 0;
+}
+
+
+/*!
+ *  emptyPixDataCache()
+ *
+ *      Return: void
+ *
+ *  Notes:
+ *      (1) Frees the buffers kept by the cache.  The cache stays in use.
+ */
+LEPTONICA_REAL_EXPORT void
+emptyPixDataCache(void)
+{
+l_int32  i;
+
+    PIX_CACHE_LOCK();
+    for (i = 0; i < pix_data_cache.n; i++)
+        pix_cache_release(pix_data_cache.buf[i]);
+    pix_data_cache.n = 0;
+    pix_data_cache.bytes = 0;
+    PIX_CACHE_UNLOCK();
+    return;
+}
+
+
+/*!
+ *  setPixBytesCounter()
+ *
+ *      Input:  counter (to charge the pix data allocated by this thread
+ *                       with; or null to stop)
+ *      Return: void
+ *
+ *  Notes:
+ *      (1) Only works with the pix data cache (see setPixDataCache()).
+ *      (2) While it is set, the bytes of each buffer that this thread
+ *          allocates are added to counter->bytes, and taken off again
+ *          when the buffer is freed, by whichever thread frees it;
+ *          counter->peak is the most there have been.  So counter must
+ *          outlast the pix made with it.
+ */
+LEPTONICA_REAL_EXPORT void
+setPixBytesCounter(L_PIX_BYTES  *counter)
+{
+    PixBytesCounter = counter;
+    return;
+}
+
+
+/*!
+ *  setPixDataHugePages()
+ *
+ *      Input:  flag (1 to back the large pix data with huge pages; 0 not)
+ *      Return: 0 if OK, 1 on error
+ *
+ *  Notes:
+ *      (1) Only works with the pix data cache (see setPixDataCache()).
+ *      (2) While it is set, new buffers of at least 2 MiB are mapped
+ *          on their own, aligned to 2 MiB, with explicit huge pages
+ *          (MAP_HUGETLB) if the system has some reserved and otherwise
+ *          with transparent huge pages (madvise(MADV_HUGEPAGE)).  The
+ *          page-sized images are read and written linearly, and with
+ *          4 KiB pages the TLB misses are a large part of decoding and
+ *          thresholding them.
+ *      (3) Only on Linux; elsewhere it returns 1 and does nothing.
+ */
+LEPTONICA_REAL_EXPORT l_int32
+setPixDataHugePages(l_int32  flag)
+{
+    PROCNAME("setPixDataHugePages");
+
+    if (pix_mem_manager.allocator != &pix_cache_malloc)
+        return ERROR_INT("pix data cache not in use", procName, 1);
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    PIX_CACHE_LOCK();
+    pix_data_cache.hugepages = flag;
+    PIX_CACHE_UNLOCK();
+    return 0;
+#else  /* !__linux__ */
+    return (flag != 0);
+#endif  /* __linux__ */
+}
+
+
+/*!
+ *  setPixDataNodeLocal()
+ *
+ *      Input:  flag (1 to keep the large pix data on the NUMA node of the
+ *                    thread making it; 0 not)
+ *      Return: 0 if OK, 1 on error
+ *
+ *  Notes:
+ *      (1) Only works with the pix data cache (see setPixDataCache()).
+ *      (2) While it is set, a buffer kept by the cache is only handed
+ *          out again on the node it was made on, and new buffers are
+ *          mapped on their own, so that their pages come from the node
+ *          of the thread which first writes them, rather than from
+ *          memory that malloc had from a thread on another node.
+ *          This is for threads pinned to the CPUs of one node, each
+ *          making and using the pix of its own pages.
+ *      (3) Only on Linux; elsewhere it returns 1 and does nothing.
+ */
+LEPTONICA_REAL_EXPORT l_int32
+setPixDataNodeLocal(l_int32  flag)
+{
+    PROCNAME("setPixDataNodeLocal");
+
+    if (pix_mem_manager.allocator != &pix_cache_malloc)
+        return ERROR_INT("pix data cache not in use", procName, 1);
+#if defined(__linux__) && defined(SYS_getcpu)
+    PIX_CACHE_LOCK();
+    pix_data_cache.nodelocal = flag;
+    PIX_CACHE_UNLOCK();
+    return 0;
+#else  /* !__linux__ */
+    return (flag != 0);
+#endif  /* __linux__ */
+}
+
+
+/*!
+ *  pix_cache_node()
+ *
+ *      Return: NUMA node of the CPU running the calling thread, or -1
+ *              if buffers aren't kept on their node or it isn't known
+ */
+static l_int32
+pix_cache_node(void)
+{
+#if defined(__linux__) && defined(SYS_getcpu)
+unsigned int  cpu, node;
+
+    if (!pix_data_cache.nodelocal)
+        return -1;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0)
+        return -1;
+    return (l_int32)node;
+#else  /* !__linux__ */
+    return -1;
+#endif  /* __linux__ */
+}
+
+
+/*!
+ *  pix_map_huge()
+ *
+ *      Input:  size (bytes)
+ *              &length (<return> length of the mapping)
+ *      Return: mapping of at least size bytes, backed by huge pages
+ *              where possible, or null on error
+ */
+static void *
+pix_map_huge(size_t   size,
+             size_t  *plength)
+{
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+size_t  length;
+char   *map, *aligned;
+
+    length = (size + PIX_HUGE_PAGE_BYTES - 1) &
+             ~(size_t)(PIX_HUGE_PAGE_BYTES - 1);
+#ifdef MAP_HUGETLB
+    map = (char *)mmap(NULL, length, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (map != MAP_FAILED) {
+        *plength = length;
+        return map;
+    }
+#endif  /* MAP_HUGETLB */
+        /* Map a huge page more, and trim it to a 2 MiB boundary */
+    map = (char *)mmap(NULL, length + PIX_HUGE_PAGE_BYTES,
+                       PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                       -1, 0);
+    if (map == MAP_FAILED)
+        return NULL;
+    aligned = (char *)(((size_t)map + PIX_HUGE_PAGE_BYTES - 1) &
+                       ~(size_t)(PIX_HUGE_PAGE_BYTES - 1));
+    if (aligned > map)
+        munmap(map, aligned - map);
+    munmap(aligned + length, map + PIX_HUGE_PAGE_BYTES - aligned);
+    madvise(aligned, length, MADV_HUGEPAGE);
+    *plength = length;
+    return aligned;
+#else  /* !__linux__ */
+    return NULL;
+#endif  /* __linux__ */
+}
+
+
+/*!
+ *  pix_map_fresh()
+ *
+ *      Input:  size (bytes)
+ *              &length (<return> length of the mapping)
+ *      Return: mapping of at least size bytes, with no pages until they
+ *              are written, or null on error
+ */
+static void *
+pix_map_fresh(size_t   size,
+              size_t  *plength)
+{
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+size_t  length;
+void   *map;
+
+    length = (size + 4095) & ~(size_t)4095;
+    map = mmap(NULL, length, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED)
+        return NULL;
+    *plength = length;
+    return map;
+#else  /* !__linux__ */
+    return NULL;
+#endif  /* __linux__ */
+}
+
+
+/*!
+ *  pix_cache_release()
+ *
+ *      Input:  block (buffer made by pix_cache_malloc())
+ *      Return: void
+ *
+ *  Notes:
+ *      (1) Gives the buffer back to the system, not to the cache.
+ */
+static void
+pix_cache_release(void  *block)
+{
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    if (PIX_CACHE_MAPPED(block)) {
+        munmap(block, PIX_CACHE_MAPPED(block));
+        return;
+    }
+#endif  /* __linux__ */
+    free(block);
+    return;
+}
+
+
+/*!
+ *  pix_cache_malloc()
+ *
+ *      Input:  size (bytes)
+ *      Return: data, or null on error
+ *
+ *  Notes:
+ *      (1) Takes the smallest buffer kept that holds size bytes, if it
+ *          isn't more than a quarter larger and, with setPixDataNodeLocal(),
+ *          was made on the node of this thread; otherwise mallocs one.
+ */
+static void *
+pix_cache_malloc(size_t  size)
+{
+l_int32  i, best, huge, node;
+size_t   bestsize, bufsize, length;
+void    *block;
+
+    block = NULL;
+    huge = 0;
+    node = -1;
+    if (size >= PIX_CACHE_MIN_BYTES) {
+        node = pix_cache_node();
+        PIX_CACHE_LOCK();
+        huge = pix_data_cache.hugepages &&
+               PIX_CACHE_HEADER + size >= PIX_HUGE_PAGE_BYTES;
+        best = -1;
+        bestsize = 0;
+        for (i = 0; i < pix_data_cache.n; i++) {
+            bufsize = PIX_CACHE_SIZE(pix_data_cache.buf[i]);
+            if (bufsize >= size && bufsize - size <= size / 4 &&
+                PIX_CACHE_NODE(pix_data_cache.buf[i]) == node &&
+                (best < 0 || bufsize < bestsize)) {
+                best = i;
+                bestsize = bufsize;
+            }
+        }
+        if (best >= 0) {
+            block = pix_data_cache.buf[best];
+            pix_data_cache.bytes -= bestsize;
+            pix_data_cache.n--;
+            memmove(pix_data_cache.buf + best, pix_data_cache.buf + best + 1,
+                    sizeof(void *) * (pix_data_cache.n - best));
+        }
+        PIX_CACHE_UNLOCK();
+    }
+
+    if (!block && huge) {
+        if ((block = pix_map_huge(PIX_CACHE_HEADER + size, &length)) != NULL) {
+            PIX_CACHE_SIZE(block) = size;
+            PIX_CACHE_MAPPED(block) = length;
+            PIX_CACHE_NODE(block) = node;
+        }
+    }
+    if (!block && node >= 0) {
+        if ((block = pix_map_fresh(PIX_CACHE_HEADER + size, &length)) != NULL) {
+            PIX_CACHE_SIZE(block) = size;
+            PIX_CACHE_MAPPED(block) = length;
+            PIX_CACHE_NODE(block) = node;
+        }
+    }
+    if (!block) {
+        if ((block = malloc(PIX_CACHE_HEADER + size)) == NULL)
+            return NULL;
+        PIX_CACHE_SIZE(block) = size;
+        PIX_CACHE_MAPPED(block) = 0;
+        PIX_CACHE_NODE(block) = node;
+    }
+    if ((PIX_CACHE_COUNTER(block) = PixBytesCounter) != NULL) {
+        PIX_CACHE_LOCK();
+        PixBytesCounter->bytes += size;
+        if (PixBytesCounter->bytes > PixBytesCounter->peak)
+            PixBytesCounter->peak = PixBytesCounter->bytes;
+        PIX_CACHE_UNLOCK();
+    }
+    return (char *)block + PIX_CACHE_HEADER;
+}
+
+
+/*!
+ *  pix_cache_free()
+ *
+ *      Input:  ptr (data from pix_cache_malloc())
+ *      Return: void
+ */
+static void
+pix_cache_free(void  *ptr)
+{
+size_t        size;
+void         *block, *evicted;
+L_PIX_BYTES  *counter;
+
+    if (!ptr) return;
+    block = (char *)ptr - PIX_CACHE_HEADER;
+    size = PIX_CACHE_SIZE(block);
+    if ((counter = PIX_CACHE_COUNTER(block)) != NULL) {
+        PIX_CACHE_LOCK();
+        counter->bytes -= size;
+        PIX_CACHE_UNLOCK();
+    }
+    if (size >= PIX_CACHE_MIN_BYTES) {
+        PIX_CACHE_LOCK();
+        if (size <= pix_data_cache.maxbytes) {
+                /* Make room by dropping the oldest buffers */
+            while (pix_data_cache.n == PIX_CACHE_SLOTS ||
+                   pix_data_cache.bytes + size > pix_data_cache.maxbytes) {
+                evicted = pix_data_cache.buf[0];
+                pix_data_cache.bytes -= PIX_CACHE_SIZE(evicted);
+                pix_data_cache.n--;
+                memmove(pix_data_cache.buf, pix_data_cache.buf + 1,
+                        sizeof(void *) * pix_data_cache.n);
+                pix_cache_release(evicted);
+            }
+            pix_data_cache.buf[pix_data_cache.n++] = block;
+            pix_data_cache.bytes += size;
+            block = NULL;
+        }
+        PIX_CACHE_UNLOCK();
+    }
+    if (block)
+        pix_cache_release(block);
+    return;
+}
+
+
 /*--------------------------------------------------------------------*
  *                              Pix Creation                          *
  *--------------------------------------------------------------------*/
@@ -232,7 +754,7 @@ pix_free(void  *ptr)
  *      Return: pixd (with data allocated and initialized to 0),
  *                    or null on error
  */
-LEPTONICA_EXPORT PIX *
+LEPTONICA_REAL_EXPORT PIX *
 pixCreate(l_int32  width,
           l_int32  height,
           l_int32  depth)
@@ -243,7 +765,7 @@ PIX  *pixd;
 
     if ((pixd = pixCreateNoInit(width, height, depth)) == NULL)
         return (PIX *)ERROR_PTR("pixd not made", procName, NULL);
-    memset(pixd->data, 0, 4 * pixd->wpl * pixd->h);
+    memset(pixd->data, 0, (size_t)4 * pixd->wpl * pixd->h);
     return pixd;
 }
 
@@ -258,6 +780,11 @@ PIX  *pixd;
  *  Notes:
  *      (1) Must set pad bits to avoid reading unitialized data, because
  *          some optimized routines (e.g., pixConnComp()) read from pad bits.
+ *      (2) Use this instead of pixCreate() only when the caller writes
+ *          every pixel of pixd.  The data may be a buffer recycled from
+ *          an earlier pix (see setPixDataCache()), so anything not
+ *          written holds old image data.  Build with PIX_NOINIT_AUDIT
+ *          set to 1 to check callers.
  */
 LEPTONICA_EXPORT PIX *
 pixCreateNoInit(l_int32  width,
@@ -272,8 +799,11 @@ l_uint32  *data;
     if ((pixd = pixCreateHeader(width, height, depth)) == NULL)
         return (PIX *)ERROR_PTR("pixd not made", procName, NULL);
     wpl = pixGetWpl(pixd);
-    if ((data = (l_uint32 *)pix_malloc(4 * wpl * height)) == NULL)
+    if ((data = (l_uint32 *)pix_malloc((size_t)4 * wpl * height)) == NULL)
         return (PIX *)ERROR_PTR("pix_malloc fail for data", procName, NULL);
+#if PIX_NOINIT_AUDIT
+    memset(data, PIX_NOINIT_JUNK, (size_t)4 * wpl * height);
+#endif  /* PIX_NOINIT_AUDIT */
     pixSetData(pixd, data);
     pixSetPadBits(pixd, 0);
     return pixd;
@@ -303,7 +833,7 @@ PIX  *pixd;
 
     if ((pixd = pixCreateTemplateNoInit(pixs)) == NULL)
         return (PIX *)ERROR_PTR("pixd not made", procName, NULL);
-    memset(pixd->data, 0, 4 * pixd->wpl * pixd->h);
+    memset(pixd->data, 0, (size_t)4 * pixd->wpl * pixd->h);
     return pixd;
 }
 
@@ -366,6 +896,10 @@ PIX     *pixd;
         return (PIX *)ERROR_PTR("width must be > 0", procName, NULL);
     if (height <= 0)
         return (PIX *)ERROR_PTR("height must be > 0", procName, NULL);
+        /* The bits of a row must fit in an l_int32; the image data as a
+         * whole is sized with size_t, and may be over 4 GB. */
+    if (width > (0x7fffffff - 31) / depth)
+        return (PIX *)ERROR_PTR("width too large for depth", procName, NULL);
 
     if ((pixd = (PIX *)CALLOC(1, sizeof(PIX))) == NULL)
         return (PIX *)ERROR_PTR("CALLOC fail for pixd", procName, NULL);
@@ -515,7 +1049,7 @@ LEPTONICA_REAL_EXPORT PIX *
 pixCopy(PIX  *pixd,   /* can be null */
         PIX  *pixs)
 {
-l_int32    bytes;
+size_t     bytes;
 l_uint32  *datas, *datad;
 
     PROCNAME("pixCopy");
@@ -526,7 +1060,7 @@ l_uint32  *datas, *datad;
         return pixd;
 
         /* Total bytes in image data */
-    bytes = 4 * pixGetWpl(pixs) * pixGetHeight(pixs);
+    bytes = (size_t)4 * pixGetWpl(pixs) * pixGetHeight(pixs);
 
         /* If we're making a new pix ... */
     if (!pixd) {
@@ -572,7 +1106,8 @@ LEPTONICA_EXPORT l_int32
 pixResizeImageData(PIX  *pixd,
                    PIX  *pixs)
 {
-l_int32    w, h, d, wpl, bytes;
+l_int32    w, h, d, wpl;
+size_t     bytes;
 l_uint32  *data;
 
     PROCNAME("pixResizeImageData");
@@ -591,7 +1126,7 @@ l_uint32  *data;
     pixSetHeight(pixd, h);
     pixSetDepth(pixd, d);
     pixSetWpl(pixd, wpl);
-    bytes = 4 * wpl * h;
+    bytes = (size_t)4 * wpl * h;
 
     if ((data = pixGetData(pixd)) != NULL) {
         pix_free(data);
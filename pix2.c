@@ -161,7 +161,7 @@ l_uint32  *line, *data;
 
     data = pixGetData(pix);
     wpl = pixGetWpl(pix);
-    line = data + y * wpl;
+    line = data + (size_t)y * wpl;
     switch (d)
     {
     case 1:
@@ -241,7 +241,7 @@ l_uint32  *data, *pword;
         mask = ~mask;
 
     for (i = 0; i < h; i++) {
-        pword = data + i * wpl + fullwords;
+        pword = data + (size_t)i * wpl + fullwords;
         if (val == 0) /* clear */
             *pword = *pword & mask;
         else  /* set */
@@ -283,3 +283,60 @@ composeRGBPixel(l_int32    rval,
               (bval << L_BLUE_SHIFT);
     return 0;
 }
+
+
+/*-------------------------------------------------------------*
+ *             Conversion between big and little endians       *
+ *-------------------------------------------------------------*/
+/*!
+ *  lineEndianByteSwap()
+ *
+ *      Input   datad (dest byte array data, reordered on little-endians)
+ *              datas (a src line of pix data)
+ *              wpl (number of 32 bit words in the line)
+ *      Return: 0 if OK, 1 on error
+ *
+ *  Notes:
+ *      (1) This is used on little-endian platforms to swap
+ *          the bytes within each word in the line of image data.
+ *          Bytes 0 <==> 3 and 1 <==> 2 are swapped in the dest
+ *          byte array data8d, relative to the pix data in datas.
+ *      (2) The bytes represent 8 bit pixel values.  They are swapped
+ *          for little endians so that when the dest array (char *)datad
+ *          is addressed by bytes, the pixels are chosen sequentially
+ *          from left to right in the image.
+ *      (3) datad and datas may be the same line, for swapping in place.
+ */
+LEPTONICA_EXPORT l_int32
+lineEndianByteSwap(l_uint32  *datad,
+                   l_uint32  *datas,
+                   l_int32    wpl)
+{
+l_int32   j;
+l_uint32  word;
+
+    PROCNAME("lineEndianByteSwap");
+
+    if (!datad || !datas)
+        return ERROR_INT("datad and datas not both defined", procName, 1);
+
+#ifdef L_BIG_ENDIAN
+
+    if (datad != datas)
+        memcpy((char *)datad, (char *)datas, 4 * wpl);
+    return 0;
+
+#else   /* L_LITTLE_ENDIAN */
+
+    for (j = 0; j < wpl; j++, datas++, datad++) {
+        word = *datas;
+        *datad = (word >> 24) |
+                 ((word >> 8) & 0x0000ff00) |
+                 ((word << 8) & 0x00ff0000) |
+                 (word << 24);
+    }
+    return 0;
+
+#endif   /* L_BIG_ENDIAN */
+
+}
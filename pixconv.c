@@ -33,8 +33,14 @@
  *           PIX        *pixConvertRGBToLuminance()
  *           PIX        *pixConvertRGBToGray()
  *           PIX        *pixConvertRGBToGrayFast()
+ *
+ *      Conversion from RGB color to binary
+ *           PIX        *pixConvertRGBToBinaryFast()
  *           PIX        *pixConvertRGBToGrayMinMax()
  *
+ *      Conversion to binary, taking ownership of the input
+ *           PIX        *pixConvertTo1Transfer()
+ *
  *      Conversion from grayscale to colormap
  *           PIX        *pixConvertGrayToColormap()  -- 2, 4, 8 bpp
  *           PIX        *pixConvertGrayToColormap8()  -- 8 bpp only
@@ -121,6 +127,22 @@
 #define DEBUG_UNROLLING 0
 #endif   /* ~NO_CONSOLE_IO */
 
+static PIX *pixThresholdCmapTransfer(PIX *pixs, l_int32 thresh);
+static PIX *pixThresholdGrayLutTransfer(PIX *pixs, l_int32 thresh);
+static PIX *pixExpandGrayTo8(PIX *pixs);
+static PIX *pixThresholdLutTransfer(PIX *pixs, const l_uint8 *bits);
+static void convertRGBToGrayFastBand(void *arg, l_int32 y0, l_int32 y1);
+
+    /* Arguments of convertRGBToGrayFastBand() */
+struct ConvertBands
+{
+    l_uint32  *datad;
+    l_int32    wpld;
+    l_uint32  *datas;
+    l_int32    wpls;
+    l_int32    w;
+};
+
 
 /*-------------------------------------------------------------*
  *               Conversion from colormapped pix               *
@@ -200,27 +222,30 @@ PIX       *pixd;
     datas = pixGetData(pixs);
     wpls = pixGetWpl(pixs);
     if (type == REMOVE_CMAP_TO_BINARY) {
-        if ((pixd = pixCopy(NULL, pixs)) == NULL)
-            return (PIX *)ERROR_PTR("pixd not made", procName, NULL);
         pixcmapGetColor(cmap, 0, &rval, &gval, &bval);
         if (rval == 0)  /* photometrically inverted from standard */
-            pixInvert(pixd, pixd);
+            pixd = pixInvert(NULL, pixs);  /* copies as it inverts */
+        else
+            pixd = pixCopy(NULL, pixs);
+        if (pixd == NULL)
+            return (PIX *)ERROR_PTR("pixd not made", procName, NULL);
         pixDestroyColormap(pixd);
     }
     else if (type == REMOVE_CMAP_TO_GRAYSCALE) {
-        if ((pixd = pixCreate(w, h, 8)) == NULL)
+        if ((pixd = pixCreateNoInit(w, h, 8)) == NULL)
             return (PIX *)ERROR_PTR("pixd not made", procName, NULL);
         pixCopyResolution(pixd, pixs);
         datad = pixGetData(pixd);
         wpld = pixGetWpl(pixd);
-        if ((graymap = (l_int32 *)CALLOC(ncolors, sizeof(l_int32))) == NULL)
+            /* Indices not in the colormap map to black */
+        if ((graymap = (l_int32 *)CALLOC(256, sizeof(l_int32))) == NULL)
             return (PIX *)ERROR_PTR("calloc fail for graymap", procName, NULL);
         for (i = 0; i < pixcmapGetCount(cmap); i++) {
             graymap[i] = (rmap[i] + 2 * gmap[i] + bmap[i]) / 4;
         }
         for (i = 0; i < h; i++) {
-            lines = datas + i * wpls;
-            lined = datad + i * wpld;
+            lines = datas + (size_t)i * wpls;
+            lined = datad + (size_t)i * wpld;
             switch (d)   /* depth test above; no default permitted */
             {
                 case 8:
@@ -360,7 +385,7 @@ PIX       *pixd;
             FREE(graymap);
     }
     else {  /* type == REMOVE_CMAP_TO_FULL_COLOR */
-        if ((pixd = pixCreate(w, h, 32)) == NULL)
+        if ((pixd = pixCreateNoInit(w, h, 32)) == NULL)
             return (PIX *)ERROR_PTR("pixd not made", procName, NULL);
         pixCopyResolution(pixd, pixs);
         datad = pixGetData(pixd);
@@ -371,8 +396,8 @@ PIX       *pixd;
             composeRGBPixel(rmap[i], gmap[i], bmap[i], lut + i);
 
         for (i = 0; i < h; i++) {
-            lines = datas + i * wpls;
-            lined = datad + i * wpld;
+            lines = datas + (size_t)i * wpls;
+            lined = datad + (size_t)i * wpld;
             for (j = 0; j < w; j++) {
                 if (d == 8)
                     sval = GET_DATA_BYTE(lines, j);
@@ -384,8 +409,10 @@ PIX       *pixd;
                     sval = GET_DATA_BIT(lines, j);
                 else
                     return NULL;
-                if (sval >= ncolors)
+                if (sval >= ncolors) {
                     L_WARNING("pixel value out of bounds", procName);
+                    lined[j] = 0;
+                }
                 else
                     lined[j] = lut[sval];
             }
@@ -421,9 +448,9 @@ PIX       *pixd;
 LEPTONICA_REAL_EXPORT PIX *
 pixConvertRGBToGrayFast(PIX  *pixs)
 {
-l_int32    i, j, w, h, wpls, wpld, val;
-l_uint32  *datas, *lines, *datad, *lined;
-PIX       *pixd;
+l_int32               w, h;
+struct ConvertBands   cb;
+PIX                  *pixd;
 
     PROCNAME("pixConvertRGBToGrayFast");
 
@@ -432,23 +459,421 @@ PIX       *pixd;
     if (pixGetDepth(pixs) != 32)
         return (PIX *)ERROR_PTR("pixs not 32 bpp", procName, NULL);
 
+    pixGetDimensions(pixs, &w, &h, NULL);
+    if ((pixd = pixCreateNoInit(w, h, 8)) == NULL)
+        return (PIX *)ERROR_PTR("pixd not made", procName, NULL);
+    pixCopyResolution(pixd, pixs);
+    cb.datad = pixGetData(pixd);
+    cb.wpld = pixGetWpl(pixd);
+    cb.datas = pixGetData(pixs);
+    cb.wpls = pixGetWpl(pixs);
+    cb.w = w;
+    runRowBands(w, h, convertRGBToGrayFastBand, &cb);
+    return pixd;
+}
+
+
+static void
+convertRGBToGrayFastBand(void    *arg,
+                         l_int32  y0,
+                         l_int32  y1)
+{
+l_int32               i, j, val;
+l_uint32             *lines, *lined;
+struct ConvertBands  *cb;
+
+    cb = (struct ConvertBands *)arg;
+    for (i = y0; i < y1; i++) {
+        lines = cb->datas + i * cb->wpls;
+        lined = cb->datad + i * cb->wpld;
+        for (j = 0; j < cb->w; j++, lines++) {
+            val = ((*lines) >> L_GREEN_SHIFT) & 0xff;
+            SET_DATA_BYTE(lined, j, val);
+        }
+    }
+    return;
+}
+
+
+/*!
+ *  pixConvertRGBToBinaryFast()
+ *
+ *      Input:  pix (32 bpp RGB)
+ *              thresh (threshold value, 0 ... 256)
+ *      Return: 1 bpp pix, or null on error
+ *
+ *  Notes:
+ *      (1) This gives the same result as
+ *              pixt = pixConvertRGBToGrayFast(pixs);
+ *              pixd = pixThresholdToBinary(pixt, thresh);
+ *          but the green samples are thresholded directly, without
+ *          making the intermediate 8 bpp image.
+ */
+LEPTONICA_REAL_EXPORT PIX *
+pixConvertRGBToBinaryFast(PIX     *pixs,
+                          l_int32  thresh)
+{
+l_int32    w, h, wpls, wpld;
+l_uint32  *datas, *datad;
+PIX       *pixd;
+
+    PROCNAME("pixConvertRGBToBinaryFast");
+
+    if (!pixs)
+        return (PIX *)ERROR_PTR("pixs not defined", procName, NULL);
+    if (pixGetDepth(pixs) != 32)
+        return (PIX *)ERROR_PTR("pixs not 32 bpp", procName, NULL);
+    if (thresh < 0 || thresh > 256)
+        return (PIX *)ERROR_PTR("thresh not in {0-256}", procName, NULL);
+
     pixGetDimensions(pixs, &w, &h, NULL);
     datas = pixGetData(pixs);
     wpls = pixGetWpl(pixs);
+    if ((pixd = pixCreateNoInit(w, h, 1)) == NULL)
+        return (PIX *)ERROR_PTR("pixd not made", procName, NULL);
+    pixCopyResolution(pixd, pixs);
+    datad = pixGetData(pixd);
+    wpld = pixGetWpl(pixd);
+
+    thresholdToBinaryLow(datad, w, h, wpld, datas, 32, wpls, thresh);
+    return pixd;
+}
+
+
+/*---------------------------------------------------------------------*
+ *            Conversion to binary, taking ownership of the input       *
+ *---------------------------------------------------------------------*/
+/*!
+ *  pixConvertTo1Transfer()
+ *
+ *      Input:  &pixs (<will be nulled>; 1, 2, 4, 8 or 32 bpp, with or
+ *                     without colormap)
+ *              thresh (threshold value for gray or green samples, on
+ *                      the 8 bpp scale: 0 ... 256)
+ *              factor (1 for no scaling; 2 or 4 to upscale the gray
+ *                      image by linear interpolation before thresholding)
+ *      Return: pixd (1 bpp), or null on error
+ *
+ *  Notes:
+ *      (1) This gives the same result as removing any colormap with
+ *          REMOVE_CMAP_BASED_ON_SRC, followed by pixThresholdToBinary()
+ *          or pixConvertRGBToBinaryFast() for factor == 1, and by
+ *          pixScaleGray2xLIThresh() or pixScaleGray4xLIThresh()
+ *          (via pixConvertRGBToGrayFast() for rgb) otherwise.
+ *          A 1 bpp image is not scaled.
+ *      (2) pixs is consumed, as with pixTransferAllData(): the handle
+ *          is nulled, even on error.  If pixs is not cloned, the
+ *          result is made without a second image buffer: a 1 bpp pix
+ *          is returned as is, a colormap on a 1 bpp pix is removed
+ *          in place, and 4, 8 and 32 bpp images are thresholded into
+ *          their own data.  This works because each dest word is
+ *          written only after the source words that it overwrites
+ *          have been read.  Otherwise, or if the rows are to be done
+ *          in parallel bands (see runRowBands()), a new pix is made and
+ *          the ref count of pixs is decremented.
+ *      (3) Without upscaling, a colormapped pix is thresholded by
+ *          table lookup on the colormap indices, in the same way:
+ *          the green sample is used for a colormap with color, and
+ *          the gray value given by pixRemoveColormap() otherwise.
+ *          Upscaling always makes a new pix.
+ *      (4) 2 and 4 bpp gray is thresholded by table lookup too, as if
+ *          each sample had been scaled to 8 bpp (multiplied by 85 or
+ *          17) first, so that thresh means the same for all depths.
+ *          For upscaling, it is expanded to 8 bpp in that way first.
+ *      (5) The steps are marked with convertStepDone(): L_STEP_CMAP
+ *          after the colormap is removed, L_STEP_GRAY after rgb, or
+ *          2 or 4 bpp gray, is made 8 bpp gray for upscaling, and
+ *          L_STEP_THRESHOLD at the end.
+ *          Without upscaling, rgb goes to 1 bpp in one step.
+ */
+LEPTONICA_REAL_EXPORT PIX *
+pixConvertTo1Transfer(PIX    **ppixs,
+                      l_int32  thresh,
+                      l_int32  factor)
+{
+l_int32    w, h, d, wpls, wpld, colorfound, rval, gval, bval;
+l_uint32  *data;
+PIX       *pixs, *pixt, *pixd;
+PIXCMAP   *cmap;
+
+    PROCNAME("pixConvertTo1Transfer");
+
+    if (!ppixs)
+        return (PIX *)ERROR_PTR("&pixs not defined", procName, NULL);
+    if ((pixs = *ppixs) == NULL)
+        return (PIX *)ERROR_PTR("pixs not defined", procName, NULL);
+    *ppixs = NULL;
+    if (factor != 1 && factor != 2 && factor != 4) {
+        pixDestroy(&pixs);
+        return (PIX *)ERROR_PTR("factor not 1, 2 or 4", procName, NULL);
+    }
+
+        /* A colormap without color on a 1 bpp pix is removed in
+         * place, as pixRemoveColormap() would do on a copy.  Other
+         * colormapped images are thresholded by table lookup,
+         * without making the gray or rgb image. */
+    if ((cmap = pixGetColormap(pixs)) != NULL) {
+        pixcmapHasColor(cmap, &colorfound);
+        d = pixGetDepth(pixs);
+        if (d == 1 && !colorfound && pixGetRefcount(pixs) == 1) {
+            pixcmapGetColor(cmap, 0, &rval, &gval, &bval);
+            if (rval == 0)  /* photometrically inverted from standard */
+                pixInvert(pixs, pixs);
+            pixDestroyColormap(pixs);
+        }
+        else if (factor == 1 && (d == 2 || d == 4 || d == 8 ||
+                                 (d == 1 && colorfound))) {
+            pixd = pixThresholdCmapTransfer(pixs, thresh);
+            convertStepDone(L_STEP_THRESHOLD);
+            return pixd;
+        }
+        else {
+            pixt = pixRemoveColormap(pixs, REMOVE_CMAP_BASED_ON_SRC);
+            pixDestroy(&pixs);
+            if ((pixs = pixt) == NULL)
+                return (PIX *)ERROR_PTR("cmap not removed", procName, NULL);
+        }
+        convertStepDone(L_STEP_CMAP);
+    }
+
+    pixGetDimensions(pixs, &w, &h, &d);
+    if (d == 1)
+        return pixs;
+
+    if (factor == 1 && (d == 2 || d == 4)) {
+        pixd = pixThresholdGrayLutTransfer(pixs, thresh);
+        convertStepDone(L_STEP_THRESHOLD);
+        return pixd;
+    }
+
+    if (factor > 1) {
+        if (d == 32 || d == 2 || d == 4) {
+            if (d == 32)
+                pixt = pixConvertRGBToGrayFast(pixs);
+            else
+                pixt = pixExpandGrayTo8(pixs);
+            pixDestroy(&pixs);
+            if ((pixs = pixt) == NULL)
+                return (PIX *)ERROR_PTR("pixs not made gray", procName, NULL);
+            convertStepDone(L_STEP_GRAY);
+        }
+        if (factor == 2)
+            pixd = pixScaleGray2xLIThresh(pixs, thresh);
+        else
+            pixd = pixScaleGray4xLIThresh(pixs, thresh);
+        pixDestroy(&pixs);
+        convertStepDone(L_STEP_THRESHOLD);
+        return pixd;
+    }
+
+        /* In place, the rows can't be done in parallel */
+    if (pixGetRefcount(pixs) > 1 || getRowBandCount(w, h) > 1) {
+        if (d == 32)
+            pixd = pixConvertRGBToBinaryFast(pixs, thresh);
+        else
+            pixd = pixThresholdToBinary(pixs, thresh);
+        pixDestroy(&pixs);
+        convertStepDone(L_STEP_THRESHOLD);
+        return pixd;
+    }
+
+        /* Threshold in place */
+    if (d != 8 && d != 32) {
+        pixDestroy(&pixs);
+        return (PIX *)ERROR_PTR("pixs not 1, 2, 4, 8 or 32 bpp", procName,
+                                NULL);
+    }
+    if (thresh < 0 || thresh > 256) {
+        pixDestroy(&pixs);
+        return (PIX *)ERROR_PTR("thresh out of range", procName, NULL);
+    }
+    data = pixGetData(pixs);
+    wpls = pixGetWpl(pixs);
+    wpld = (w + 31) / 32;
+    thresholdToBinaryLow(data, w, h, wpld, data, d, wpls, thresh);
+    pixSetDepth(pixs, 1);
+    pixSetWpl(pixs, wpld);
+    convertStepDone(L_STEP_THRESHOLD);
+    return pixs;
+}
+
+
+/*!
+ *  pixThresholdCmapTransfer()
+ *
+ *      Input:  pixs (1, 2, 4 or 8 bpp, with colormap; consumed)
+ *              thresh (threshold value, 0 ... 256)
+ *      Return: pixd (1 bpp), or null on error
+ *
+ *  Notes:
+ *      (1) Each colormap index is given the bit that thresholding
+ *          the image made by pixRemoveColormap(), with
+ *          REMOVE_CMAP_BASED_ON_SRC, would give it.  Indices not
+ *          in the colormap are taken as black.
+ *      (2) See pixThresholdLutTransfer().
+ */
+static PIX *
+pixThresholdCmapTransfer(PIX     *pixs,
+                         l_int32  thresh)
+{
+l_int32    i, ncolors, colorfound, val;
+l_int32    rval, gval, bval;
+l_uint8    bits[256];
+PIXCMAP   *cmap;
+
+    PROCNAME("pixThresholdCmapTransfer");
+
+    if (thresh < 0 || thresh > 256) {
+        pixDestroy(&pixs);
+        return (PIX *)ERROR_PTR("thresh not in {0-256}", procName, NULL);
+    }
+
+    cmap = pixGetColormap(pixs);
+    ncolors = pixcmapGetCount(cmap);
+    pixcmapHasColor(cmap, &colorfound);
+    for (i = 0; i < 256; i++) {
+        val = 0;
+        if (i < ncolors) {
+            pixcmapGetColor(cmap, i, &rval, &gval, &bval);
+            val = (colorfound) ? gval : (rval + 2 * gval + bval) / 4;
+        }
+        bits[i] = (val < thresh) ? 1 : 0;
+    }
+    return pixThresholdLutTransfer(pixs, bits);
+}
+
+
+/*!
+ *  pixThresholdGrayLutTransfer()
+ *
+ *      Input:  pixs (2 or 4 bpp gray, without colormap; consumed)
+ *              thresh (threshold value, 0 ... 256)
+ *      Return: pixd (1 bpp), or null on error
+ *
+ *  Notes:
+ *      (1) A sample is black if it is less than thresh when scaled
+ *          to 8 bpp, as pixConvert2To8() and pixConvert4To8() of
+ *          Leptonica do it: by 255 / 3 = 85 or 255 / 15 = 17.
+ *      (2) See pixThresholdLutTransfer().
+ */
+static PIX *
+pixThresholdGrayLutTransfer(PIX     *pixs,
+                            l_int32  thresh)
+{
+l_int32  i, maxval;
+l_uint8  bits[256];
+
+    PROCNAME("pixThresholdGrayLutTransfer");
+
+    if (thresh < 0 || thresh > 256) {
+        pixDestroy(&pixs);
+        return (PIX *)ERROR_PTR("thresh not in {0-256}", procName, NULL);
+    }
+
+    maxval = (1 << pixGetDepth(pixs)) - 1;
+    for (i = 0; i < 256; i++)
+        bits[i] = (i <= maxval && i * (255 / maxval) < thresh) ? 1 : 0;
+    return pixThresholdLutTransfer(pixs, bits);
+}
+
+
+/*!
+ *  pixExpandGrayTo8()
+ *
+ *      Input:  pixs (2 or 4 bpp gray, without colormap)
+ *      Return: pixd (8 bpp), or null on error
+ *
+ *  Notes:
+ *      (1) Each sample is scaled to 8 bpp as pixThresholdGrayLutTransfer()
+ *          takes it to be, by 85 or 17, as pixConvert2To8() and
+ *          pixConvert4To8() of Leptonica do.
+ */
+static PIX *
+pixExpandGrayTo8(PIX  *pixs)
+{
+l_int32    i, j, w, h, d, wpls, wpld, scale;
+l_uint32  *datas, *datad, *lines, *lined;
+PIX       *pixd;
+
+    PROCNAME("pixExpandGrayTo8");
+
+    pixGetDimensions(pixs, &w, &h, &d);
+    if (d != 2 && d != 4)
+        return (PIX *)ERROR_PTR("pixs not 2 or 4 bpp", procName, NULL);
     if ((pixd = pixCreate(w, h, 8)) == NULL)
         return (PIX *)ERROR_PTR("pixd not made", procName, NULL);
     pixCopyResolution(pixd, pixs);
+    datas = pixGetData(pixs);
+    wpls = pixGetWpl(pixs);
     datad = pixGetData(pixd);
     wpld = pixGetWpl(pixd);
-    
+    scale = 255 / ((1 << d) - 1);
     for (i = 0; i < h; i++) {
         lines = datas + i * wpls;
         lined = datad + i * wpld;
-        for (j = 0; j < w; j++, lines++) {
-            val = ((*lines) >> L_GREEN_SHIFT) & 0xff;
-            SET_DATA_BYTE(lined, j, val);
+        if (d == 2) {
+            for (j = 0; j < w; j++)
+                SET_DATA_BYTE(lined, j, GET_DATA_DIBIT(lines, j) * scale);
+        } else {
+            for (j = 0; j < w; j++)
+                SET_DATA_BYTE(lined, j, GET_DATA_QBIT(lines, j) * scale);
+        }
+    }
+    return pixd;
+}
+
+
+/*!
+ *  pixThresholdLutTransfer()
+ *
+ *      Input:  pixs (1, 2, 4 or 8 bpp; consumed)
+ *              bits (the dest bit for each sample value)
+ *      Return: pixd (1 bpp), or null on error
+ *
+ *  Notes:
+ *      (1) The bits are assembled into a table from the source bytes
+ *          to the dest bits, so that thresholdCmapToBinaryLow() works
+ *          a byte at a time.  If pixs is not cloned, the result goes
+ *          into its own data.  Any colormap is dropped.
+ */
+static PIX *
+pixThresholdLutTransfer(PIX            *pixs,
+                        const l_uint8  *bits)
+{
+l_int32    i, j, w, h, d, wpls, wpld, index;
+l_uint8    tab[256];
+l_uint32  *datas, *datad;
+PIX       *pixd;
+
+    PROCNAME("pixThresholdLutTransfer");
+
+    pixGetDimensions(pixs, &w, &h, &d);
+    for (i = 0; i < 256; i++) {
+        tab[i] = 0;
+        for (j = 0; j < 8; j += d) {
+            index = (i >> (8 - d - j)) & ((1 << d) - 1);
+            tab[i] = (tab[i] << 1) | bits[index];
         }
     }
 
+    datas = pixGetData(pixs);
+    wpls = pixGetWpl(pixs);
+    wpld = (w + 31) / 32;
+    if (pixGetRefcount(pixs) == 1 && getRowBandCount(w, h) == 1) {
+        thresholdCmapToBinaryLow(datas, w, h, wpld, datas, d, wpls, tab);
+        pixDestroyColormap(pixs);
+        pixSetDepth(pixs, 1);
+        pixSetWpl(pixs, wpld);
+        return pixs;
+    }
+
+    if ((pixd = pixCreateNoInit(w, h, 1)) == NULL) {
+        pixDestroy(&pixs);
+        return (PIX *)ERROR_PTR("pixd not made", procName, NULL);
+    }
+    pixCopyResolution(pixd, pixs);
+    datad = pixGetData(pixd);
+    thresholdCmapToBinaryLow(datad, w, h, wpld, datas, d, wpls, tab);
+    pixDestroy(&pixs);
     return pixd;
 }
@@ -18,11 +18,20 @@
  *                     
  *    Read png from file
  *          PIX        *pixReadStreamPng()
+ *   static PIX        *pixReadPngIo()
  *          l_int32     readHeaderPng()
  *          l_int32     freadHeaderPng()
  *          l_int32     sreadHeaderPng()
  *          l_int32     fgetPngResolution()
  *
+ *    Read png from file, one binarized row at a time
+ *          L_PNG_BIN_READER  *pngBinReaderCreate()
+ *          L_PNG_BIN_READER  *pngBinReaderCreateMem()
+ *   static L_PNG_BIN_READER  *pngBinReaderCreateIo()
+ *          void               pngBinReaderDestroy()
+ *          l_int32            pngBinReaderGetInfo()
+ *          l_int32            pngBinReaderReadRow()
+ *
  *    Write png to file
  *          l_int32     pixWritePng()  [ special top level ]
  *          l_int32     pixWriteStreamPng()
@@ -36,10 +45,16 @@
  *          void        l_pngSetStripAlpha()
  *          void        l_pngSetWriteAlpha()
  *          void        l_pngSetZlibCompression()
+ *          void        l_pngSetReadTrusted()
  *
  *    Read/write to memory   [not on windows]
  *          PIX        *pixReadMemPng()
  *          l_int32     pixWriteMemPng()
+ *   static void        pngMemReadFn()
+ *
+ *    pixReadMemPng() and pngBinReaderCreateMem() read directly from
+ *    the given bytes with a libpng read callback, so they work on
+ *    all platforms.
  *
  *    Documentation: libpng.txt and example.c
  *
@@ -71,6 +86,12 @@
  *        an RGBA png file with 4 spp, and writes the alpha channel.
  *    These are set with accessors.
  *
+ *    A fourth, var_PNG_READ_TRUSTED, default FALSE, skips computing
+ *    and checking the CRCs of the chunks on reading, which is a good
+ *    part of the decoding time of large images.  It is set with
+ *    l_pngSetReadTrusted(), and is only for data that can't have been
+ *    damaged, such as a file just written by a program we trust.
+ *
  *    Two convenience functions are included for reading the alpha
  *    channel (if it exists) into the pix, and for writing out the
  *    alpha sample of a pix to a png file:
@@ -113,15 +134,163 @@
 static l_int32   var_PNG_STRIP_16_TO_8 = 1;
     /* strip alpha on reading png; default is for stripping */
 static l_int32   var_PNG_STRIP_ALPHA = 1;
+    /* don't check chunk CRCs on reading png; default is to check */
+static l_int32   var_PNG_READ_TRUSTED = 0;
 
 #ifndef  NO_CONSOLE_IO
 #define  DEBUG     0
 #endif  /* ~NO_CONSOLE_IO */
 
+struct L_PngMemSource;
+static PIX *pixReadPngIo(FILE *fp, struct L_PngMemSource *src);
+static L_PNG_BIN_READER *pngBinReaderCreateIo(FILE *fp, const l_uint8 *cdata,
+                                              size_t size, l_int32 thresh);
+
 
 /*---------------------------------------------------------------------*
  *                              Reading png                            *
  *---------------------------------------------------------------------*/
+    /* Compressed data being read from memory with pngMemReadFn() */
+struct L_PngMemSource
+{
+    const l_uint8     *data;
+    size_t             size;
+    size_t             offset;       /* number of bytes read so far         */
+};
+typedef struct L_PngMemSource  L_PNG_MEM_SOURCE;
+
+/*
+ *  pngMemReadFn()
+ *
+ *  libpng read callback for an L_PNG_MEM_SOURCE.  Running out of data
+ *  is a png error, as it is for a file.
+ */
+static void
+pngMemReadFn(png_structp  png_ptr,
+             png_bytep    outbytes,
+             png_size_t   nbytes)
+{
+L_PNG_MEM_SOURCE  *src;
+
+    src = (L_PNG_MEM_SOURCE *)png_get_io_ptr(png_ptr);
+    if (nbytes > src->size - src->offset)
+        png_error(png_ptr, "Read Error");
+    memcpy(outbytes, src->data + src->offset, nbytes);
+    src->offset += nbytes;
+}
+
+
+/*
+ *  pngReadImageData()
+ *
+ *      Input:  png_ptr, info_ptr (set up and with the header read)
+ *              pix (to be filled)
+ *              spp (samples/pixel after the transforms)
+ *              row_pointers (one for each row of the image, or null)
+ *              rowbuf (single png row, if row_pointers is null)
+ *      Return: 0 if OK, 1 on error
+ *
+ *  Notes:
+ *      (1) For spp == 1, the rows of pix are used as row_pointers, so
+ *          libpng decodes straight into them; the bytes are in png
+ *          (MSB first) order, and have to be swapped into words by
+ *          the caller on little-endian machines.
+ *      (2) For rgb, each png row is expanded to 32 bpp into pix, from
+ *          row_pointers (the whole image, for interlaced images) or
+ *          from rowbuf (one row at a time).
+ *      (3) This has its own setjmp, so that the caller can clean up
+ *          pix and the row buffers after a png error.  No libpng
+ *          function that can fail may be called after this returns.
+ */
+static l_int32
+pngReadImageData(png_structp   png_ptr,
+                 png_infop     info_ptr,
+                 PIX          *pix,
+                 l_int32       spp,
+                 png_bytep    *row_pointers,
+                 png_bytep     rowbuf)
+{
+l_int32    i, j, k, w, h, wpl;
+l_uint32  *data, *ppixel;
+png_bytep  rowptr;
+
+    if (setjmp(png_jmpbuf(png_ptr)))
+        return 1;
+
+    pixGetDimensions(pix, &w, &h, NULL);
+    wpl = pixGetWpl(pix);
+    data = pixGetData(pix);
+    if (row_pointers)
+        png_read_image(png_ptr, row_pointers);
+    if (spp != 1) {   /* spp == 3 or spp == 4 */
+        for (i = 0; i < h; i++) {
+            ppixel = data + (size_t)i * wpl;
+            if (row_pointers) {
+                rowptr = row_pointers[i];
+            } else {
+                rowptr = rowbuf;
+                png_read_row(png_ptr, rowptr, NULL);
+            }
+            for (j = k = 0; j < w; j++) {
+                SET_DATA_BYTE(ppixel, COLOR_RED, rowptr[k++]);
+                SET_DATA_BYTE(ppixel, COLOR_GREEN, rowptr[k++]);
+                SET_DATA_BYTE(ppixel, COLOR_BLUE, rowptr[k++]);
+                if (spp == 4)
+                    SET_DATA_BYTE(ppixel, L_ALPHA_CHANNEL, rowptr[k++]);
+                ppixel++;
+            }
+        }
+    }
+
+        /* Read the rest of the file, with any text chunks after
+         * the image data, into info_ptr */
+    png_read_end(png_ptr, info_ptr);
+    return 0;
+}
+
+
+/*!
+ *  pngSwapLine()
+ *
+ *      Input:  line (of a pix, with the png bytes as decoded)
+ *              wpl
+ *              bits (of image data in the line: width * depth)
+ *              invert (1 to invert the pixels as well)
+ *      Return: void
+ *
+ *  Notes:
+ *      (1) This swaps the png (MSB first) bytes into native words,
+ *          inverts the pixels if requested, and clears the pad bits,
+ *          all in a single pass over the line.  It does the work of
+ *          lineEndianByteSwap(), pixInvert() and pixSetPadBits().
+ */
+static void
+pngSwapLine(l_uint32  *line,
+            l_int32    wpl,
+            l_int32    bits,
+            l_int32    invert)
+{
+l_int32   j;
+l_uint32  word, xormask;
+
+    if (wpl <= 0)
+        return;
+    xormask = invert ? 0xffffffff : 0;
+    for (j = 0; j < wpl; j++) {
+        word = line[j];
+#ifndef L_BIG_ENDIAN
+        word = (word >> 24) |
+               ((word >> 8) & 0x0000ff00) |
+               ((word << 8) & 0x00ff0000) |
+               (word << 24);
+#endif  /* !L_BIG_ENDIAN */
+        line[j] = word ^ xormask;
+    }
+    if (bits & 31)
+        line[wpl - 1] &= 0xffffffff << (32 - (bits & 31));
+}
+
+
 /*!
  *  pixReadStreamPng()
  *
@@ -133,20 +302,144 @@ static l_int32   var_PNG_STRIP_ALPHA = 1;
  *          at the beginning of the file.
  *      (2) To do sequential reads of png format images from a stream,
  *          use pixReadStreamPng()
+ *      (3) Grayscale and colormapped images are decoded by libpng
+ *          directly into the rows of the pix, which are then byte
+ *          swapped in place on little-endian machines.  Only rgb
+ *          images need a png row buffer: a single row, or the whole
+ *          image if it is interlaced.
  */
 LEPTONICA_EXPORT PIX *
 pixReadStreamPng(FILE  *fp)
+{
+    PROCNAME("pixReadStreamPng");
+
+    if (!fp)
+        return (PIX *)ERROR_PTR("fp not defined", procName, NULL);
+    return pixReadPngIo(fp, NULL);
+}
+
+
+/*!
+ *  pixReadMemPng()
+ *
+ *      Input:  cdata (const; png-encoded)
+ *              size (of data)
+ *      Return: pix, or null on error
+ *
+ *  Notes:
+ *      (1) The result is the same as from pixReadStreamPng() on a
+ *          file holding the same bytes.
+ */
+LEPTONICA_REAL_EXPORT PIX *
+pixReadMemPng(const l_uint8  *cdata,
+              size_t          size)
+{
+L_PNG_MEM_SOURCE  src;
+
+    PROCNAME("pixReadMemPng");
+
+    if (!cdata)
+        return (PIX *)ERROR_PTR("cdata not defined", procName, NULL);
+    src.data = cdata;
+    src.size = size;
+    src.offset = 0;
+    return pixReadPngIo(NULL, &src);
+}
+
+
+/*!
+ *  sreadHeaderPng()
+ *
+ *      Input:  cdata (const; png-encoded)
+ *              size (of data)
+ *              &width (<return>)
+ *              &height (<return>)
+ *              &bps (<return>, bits/sample)
+ *              &spp (<return>, samples/pixel)
+ *              &iscmap (<optional return>; input NULL to ignore)
+ *      Return: 0 if OK, 1 on error
+ *
+ *  Notes:
+ *      (1) This reads the IHDR chunk, which comes first in every png
+ *          file, without decoding anything.
+ *      (2) spp is 1 for gray and colormapped images, 2 for gray with
+ *          alpha, 3 for rgb and 4 for rgba.
+ */
+LEPTONICA_REAL_EXPORT l_int32
+sreadHeaderPng(const l_uint8  *cdata,
+               size_t          size,
+               l_int32        *pwidth,
+               l_int32        *pheight,
+               l_int32        *pbps,
+               l_int32        *pspp,
+               l_int32        *piscmap)
+{
+l_uint32  w, h;
+l_int32   colortype;
+
+    PROCNAME("sreadHeaderPng");
+
+    if (!cdata)
+        return ERROR_INT("cdata not defined", procName, 1);
+    if (!pwidth || !pheight || !pbps || !pspp)
+        return ERROR_INT("input ptr(s) not defined", procName, 1);
+    if (size < 26 || memcmp(cdata + 12, "IHDR", 4))
+        return ERROR_INT("no IHDR chunk", procName, 1);
+
+    w = (l_uint32)cdata[16] << 24 | cdata[17] << 16 | cdata[18] << 8 |
+        cdata[19];
+    h = (l_uint32)cdata[20] << 24 | cdata[21] << 16 | cdata[22] << 8 |
+        cdata[23];
+    if (w == 0 || h == 0 || w > 0x7fffffff || h > 0x7fffffff)
+        return ERROR_INT("invalid sizes", procName, 1);
+    colortype = cdata[25];
+    switch (colortype)
+    {
+    case PNG_COLOR_TYPE_GRAY:
+    case PNG_COLOR_TYPE_PALETTE:
+        *pspp = 1;
+        break;
+    case PNG_COLOR_TYPE_GRAY_ALPHA:
+        *pspp = 2;
+        break;
+    case PNG_COLOR_TYPE_RGB:
+        *pspp = 3;
+        break;
+    case PNG_COLOR_TYPE_RGB_ALPHA:
+        *pspp = 4;
+        break;
+    default:
+        return ERROR_INT("invalid color type", procName, 1);
+    }
+    *pwidth = w;
+    *pheight = h;
+    *pbps = cdata[24];
+    if (piscmap)
+        *piscmap = (colortype == PNG_COLOR_TYPE_PALETTE);
+    return 0;
+}
+
+
+/*
+ *  pixReadPngIo()
+ *
+ *      Input:  stream, or null to read from src
+ *              src (memory source, if stream is null)
+ *      Return: pix, or null on error
+ */
+static PIX *
+pixReadPngIo(FILE              *fp,
+             L_PNG_MEM_SOURCE  *src)
 {
 l_uint8      rval, gval, bval;
-l_int32      i, j, k;
-l_int32      wpl, d, spp, cindex;
-l_uint32     png_transforms;
-l_uint32    *data, *line, *ppixel;
+l_int32      i;
+l_int32      wpl, d, spp, cindex, ret, invert;
+l_uint32    *data, *line;
 int          num_palette, num_text;
 png_byte     bit_depth, color_type, channels;
 png_uint_32  w, h, rowbytes;
 png_uint_32  xres, yres;
-png_bytep    rowptr;
+png_bytep    rowbuf;
 png_bytep   *row_pointers;
 png_structp  png_ptr;
 png_infop    info_ptr, end_info;
@@ -155,10 +448,8 @@ png_textp    text_ptr;  /* ptr to text_chunk */
 PIX         *pix;
 PIXCMAP     *cmap;
 
-    PROCNAME("pixReadStreamPng");
+    PROCNAME("pixReadPngIo");
 
-    if (!fp)
-        return (PIX *)ERROR_PTR("fp not defined", procName, NULL);
     pix = NULL;
 
         /* Allocate the 3 data structures */
@@ -182,25 +473,26 @@ PIXCMAP     *cmap;
         return (PIX *)ERROR_PTR("internal png error", procName, NULL);
     }
 
-    png_init_io(png_ptr, fp);
+    if (var_PNG_READ_TRUSTED)
+        png_set_crc_action(png_ptr, PNG_CRC_QUIET_USE, PNG_CRC_QUIET_USE);
+    if (fp)
+        png_init_io(png_ptr, fp);
+    else
+        png_set_read_fn(png_ptr, src, pngMemReadFn);
+    png_read_info(png_ptr, info_ptr);
 
         /* ---------------------------------------------------------- *
-         *  Set the transforms flags.  Whatever happens here,
-         *  NEVER invert 1 bpp using PNG_TRANSFORM_INVERT_MONO.
+         *  Set the transforms.  Whatever happens here,
+         *  NEVER invert 1 bpp using png_set_invert_mono().
          * ---------------------------------------------------------- */
-        /* To strip 16 --> 8 bit depth, use PNG_TRANSFORM_STRIP_16 */
+        /* Strip 16 --> 8 bit depth */
     if (var_PNG_STRIP_16_TO_8 == 1)   /* our default */
-        png_transforms = PNG_TRANSFORM_STRIP_16;
-    else
-        png_transforms = PNG_TRANSFORM_IDENTITY;
-        /* To remove alpha channel, use PNG_TRANSFORM_STRIP_ALPHA */
+        png_set_strip_16(png_ptr);
+        /* Remove alpha channel */
     if (var_PNG_STRIP_ALPHA == 1)   /* our default */
-        png_transforms |= PNG_TRANSFORM_STRIP_ALPHA;
+        png_set_strip_alpha(png_ptr);
+    png_read_update_info(png_ptr, info_ptr);
 
-        /* Read it */
-    png_read_png(png_ptr, info_ptr, png_transforms, NULL);
-
-    row_pointers = png_get_rows(png_ptr, info_ptr);
     w = png_get_image_width(png_ptr, info_ptr);
     h = png_get_image_height(png_ptr, info_ptr);
     bit_depth = png_get_bit_depth(png_ptr, info_ptr);
@@ -221,6 +513,7 @@ PIXCMAP     *cmap;
         /* Remove if/when this is implemented for all bit_depths */
     if (spp == 3 && bit_depth != 8) {
         fprintf(stderr, "Help: spp = 3 and depth = %d != 8\n!!", bit_depth);
+        png_destroy_read_struct(&png_ptr, &info_ptr, &end_info);
         return (PIX *)ERROR_PTR("not implemented for this depth",
             procName, NULL);
     }
@@ -239,7 +532,13 @@ PIXCMAP     *cmap;
     else
         cmap = NULL;
 
-    if ((pix = pixCreate(w, h, d)) == NULL) {
+        /* Rows decoded in place fill the whole pix, except for pad
+         * bits, which are cleared after the rows are swapped */
+    if (spp == 1)
+        pix = pixCreateNoInit(w, h, d);
+    else
+        pix = pixCreate(w, h, d);
+    if (pix == NULL) {
         png_destroy_read_struct(&png_ptr, &info_ptr, &end_info);
         return (PIX *)ERROR_PTR("pix not made", procName, NULL);
     }
@@ -247,29 +546,39 @@ PIXCMAP     *cmap;
     data = pixGetData(pix);
     pixSetColormap(pix, cmap);
 
-    if (spp == 1) {   /* copy straight from buffer to pix */
-        for (i = 0; i < h; i++) {
-            line = data + i * wpl;
-            rowptr = row_pointers[i];
-            for (j = 0; j < rowbytes; j++) {
-                SET_DATA_BYTE(line, j, rowptr[j]);
-            }
-        }
+        /* Set up where libpng puts the rows */
+    row_pointers = NULL;
+    rowbuf = NULL;
+    if (spp == 1 ||
+        png_get_interlace_type(png_ptr, info_ptr) != PNG_INTERLACE_NONE)
+        row_pointers = (png_bytep *)CALLOC(h, sizeof(png_bytep));
+    if (spp == 1) {
+        for (i = 0; i < h && row_pointers; i++)
+            row_pointers[i] = (png_bytep)(data + (size_t)i * wpl);
     }
-    else  {   /* spp == 3 or spp == 4 */
-        for (i = 0; i < h; i++) {
-            ppixel = data + i * wpl;
-            rowptr = row_pointers[i];
-            for (j = k = 0; j < w; j++) {
-                SET_DATA_BYTE(ppixel, COLOR_RED, rowptr[k++]);
-                SET_DATA_BYTE(ppixel, COLOR_GREEN, rowptr[k++]);
-                SET_DATA_BYTE(ppixel, COLOR_BLUE, rowptr[k++]);
-                if (spp == 4)
-                    SET_DATA_BYTE(ppixel, L_ALPHA_CHANNEL, rowptr[k++]);
-                ppixel++;
-            }
+    else if (row_pointers) {
+        if ((rowbuf = (png_bytep)CALLOC(h, rowbytes)) != NULL) {
+            for (i = 0; i < h; i++)
+                row_pointers[i] = rowbuf + (size_t)i * rowbytes;
         }
     }
+    else
+        rowbuf = (png_bytep)CALLOC(1, rowbytes);
+    if ((spp == 1 && !row_pointers) || (spp != 1 && !rowbuf)) {
+        FREE(row_pointers);
+        pixDestroy(&pix);
+        png_destroy_read_struct(&png_ptr, &info_ptr, &end_info);
+        return (PIX *)ERROR_PTR("row buffers not made", procName, NULL);
+    }
+
+    ret = pngReadImageData(png_ptr, info_ptr, pix, spp, row_pointers, rowbuf);
+    FREE(row_pointers);
+    FREE(rowbuf);
+    if (ret) {
+        pixDestroy(&pix);
+        png_destroy_read_struct(&png_ptr, &info_ptr, &end_info);
+        return (PIX *)ERROR_PTR("internal png error", procName, NULL);
+    }
 
 #if  DEBUG
     if (cmap) {
@@ -302,10 +611,17 @@ PIXCMAP     *cmap;
          *     if black = 0, white = 1 (255)
          *          0, 0, 0, 0, 255, 255, 255, 0
          * So we test the first byte to see if it is 0;
-         * if so, invert the data.  */
-    if (d == 1 && (!cmap || (cmap && ((l_uint8 *)(cmap->array))[0] == 0x0))) {
-/*        fprintf(stderr, "Inverting binary data on png read\n"); */
-        pixInvert(pix, pix);
+         * if so, invert the data.  The inversion is done as the
+         * rows are swapped into native words, in the same pass.  */
+    invert = (d == 1 &&
+              (!cmap || (cmap && ((l_uint8 *)(cmap->array))[0] == 0x0)));
+
+        /* The png bytes are MSB first; swap them into native words */
+    if (spp == 1) {
+        for (i = 0; i < h; i++) {
+            line = data + (size_t)i * wpl;
+            pngSwapLine(line, wpl, w * d, invert);
+        }
     }
 
     xres = png_get_x_pixels_per_meter(png_ptr, info_ptr);
@@ -322,6 +638,457 @@ PIXCMAP     *cmap;
     return pix;
 }
 
+
+/*---------------------------------------------------------------------*
+ *                Reading png one binarized row at a time              *
+ *---------------------------------------------------------------------*/
+struct L_PngBinReader
+{
+    png_structp        png_ptr;
+    png_infop          info_ptr;
+    L_PNG_MEM_SOURCE   src;          /* compressed data, if not from a file */
+    l_int32            w;            /* image width                         */
+    l_int32            h;            /* image height                        */
+    l_int32            xres;         /* resolution (ppi)                    */
+    l_int32            yres;         /* resolution (ppi)                    */
+    l_int32            d;            /* bits/sample; 1, 2, 4 or 8, or 32    */
+                                     /* for rgb (3 spp)                     */
+    l_int32            stride;       /* bytes from one pixel to the next    */
+                                     /* in a png row; for d == 8 and 32     */
+    l_int32            sampoff;      /* offset of the sample used (gray or  */
+                                     /* green) in a pixel; for d == 32      */
+    l_int32            thresh;       /* as for pixThresholdToBinary()       */
+    l_int32            row;          /* number of rows read so far          */
+    png_uint_32        rowbytes;     /* size of a png row                   */
+    l_uint8           *rowbuf;       /* one png row                         */
+    l_uint8            sampbit[256]; /* output bit for each sample value    */
+    l_uint8            bytelut[256]; /* output bits for each input byte,    */
+                                     /* right-justified; for d < 8          */
+};
+
+
+/*!
+ *  pngBinReaderCreate()
+ *
+ *      Input:  stream
+ *              thresh (threshold value, as for pixThresholdToBinary())
+ *      Return: reader, or null on error or if the image can't be
+ *              read this way
+ *
+ *  Notes:
+ *      (1) This reads the png header and sets up for reading the image
+ *          with pngBinReaderReadRow(), so that a 1 bpp version of
+ *          the image can be generated without holding all of it in
+ *          memory.  The rows are identical to those of
+ *              pixt = pixRemoveColormap(pixReadStreamPng(fp),
+ *                                       REMOVE_CMAP_BASED_ON_SRC);
+ *          followed, if pixt is not 1 bpp, by pixConvertRGBToGrayFast()
+ *          for rgb and pixThresholdToBinary(pixt, thresh).
+ *      (2) 16 bps samples and alpha are not stripped by libpng
+ *          transforms, which would each take another pass over the
+ *          row: only the high byte of the gray or green sample of
+ *          each pixel is read from the png row.  This is what the
+ *          transforms leave of it, so the rows are still identical.
+ *      (3) The stream must be positioned at the beginning of the
+ *          file.  A file which isn't png, interlaced images and a
+ *          thresh that pixThresholdToBinary() would reject are not
+ *          handled; for
+ *          these, null is returned without an error message and the
+ *          caller should rewind the stream and use the full image path.
+ */
+LEPTONICA_REAL_EXPORT L_PNG_BIN_READER *
+pngBinReaderCreate(FILE    *fp,
+                   l_int32  thresh)
+{
+    PROCNAME("pngBinReaderCreate");
+
+    if (!fp)
+        return (L_PNG_BIN_READER *)ERROR_PTR("fp not defined", procName, NULL);
+    return pngBinReaderCreateIo(fp, NULL, 0, thresh);
+}
+
+
+/*!
+ *  pngBinReaderCreateMem()
+ *
+ *      Input:  cdata (const; png-encoded)
+ *              size (of data)
+ *              thresh (threshold value, as for pixThresholdToBinary())
+ *      Return: reader, or null on error or if the image can't be
+ *              read this way
+ *
+ *  Notes:
+ *      (1) As pngBinReaderCreate(), reading from memory.  cdata must
+ *          stay valid until the reader is destroyed.
+ */
+LEPTONICA_REAL_EXPORT L_PNG_BIN_READER *
+pngBinReaderCreateMem(const l_uint8  *cdata,
+                      size_t          size,
+                      l_int32         thresh)
+{
+    PROCNAME("pngBinReaderCreateMem");
+
+    if (!cdata)
+        return (L_PNG_BIN_READER *)ERROR_PTR("cdata not defined",
+                                             procName, NULL);
+    return pngBinReaderCreateIo(NULL, cdata, size, thresh);
+}
+
+
+/*
+ *  pngBinReaderCreateIo()
+ *
+ *      Input:  stream, or null to read from cdata
+ *              cdata, size (png data, if stream is null)
+ *              thresh
+ *      Return: reader, or null (see pngBinReaderCreate())
+ */
+static L_PNG_BIN_READER *
+pngBinReaderCreateIo(FILE           *fp,
+                     const l_uint8  *cdata,
+                     size_t          size,
+                     l_int32         thresh)
+{
+l_int32            i, j, d, spp, bps, ncolors, colorfound, index, val;
+int                num_palette;
+png_byte           sig[8];
+png_byte           bit_depth, color_type;
+png_uint_32        xres, yres;
+png_colorp         palette;
+png_structp        png_ptr;
+png_infop          info_ptr;
+L_PNG_BIN_READER  *rdr;
+
+    PROCNAME("pngBinReaderCreateIo");
+
+    if (var_PNG_STRIP_16_TO_8 != 1 || var_PNG_STRIP_ALPHA != 1)
+        return NULL;
+    if (fp) {
+        if (fread(sig, 1, 8, fp) != 8)
+            return NULL;
+    } else {
+        if (size < 8)
+            return NULL;
+        memcpy(sig, cdata, 8);
+    }
+    if (png_sig_cmp(sig, 0, 8))
+        return NULL;
+
+    if ((rdr = (L_PNG_BIN_READER *)CALLOC(1, sizeof(L_PNG_BIN_READER)))
+            == NULL)
+        return (L_PNG_BIN_READER *)ERROR_PTR("rdr not made", procName, NULL);
+
+    if ((png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING,
+                   (png_voidp)NULL, NULL, NULL)) == NULL) {
+        FREE(rdr);
+        return (L_PNG_BIN_READER *)ERROR_PTR("png_ptr not made",
+                                             procName, NULL);
+    }
+    if ((info_ptr = png_create_info_struct(png_ptr)) == NULL) {
+        png_destroy_read_struct(&png_ptr, (png_infopp)NULL, (png_infopp)NULL);
+        FREE(rdr);
+        return (L_PNG_BIN_READER *)ERROR_PTR("info_ptr not made",
+                                             procName, NULL);
+    }
+    rdr->png_ptr = png_ptr;
+    rdr->info_ptr = info_ptr;
+
+        /* Set up png setjmp error handling */
+    if (setjmp(png_jmpbuf(png_ptr))) {
+        pngBinReaderDestroy(&rdr);
+        return (L_PNG_BIN_READER *)ERROR_PTR("internal png error",
+                                             procName, NULL);
+    }
+
+    if (var_PNG_READ_TRUSTED)
+        png_set_crc_action(png_ptr, PNG_CRC_QUIET_USE, PNG_CRC_QUIET_USE);
+    if (fp) {
+        png_init_io(png_ptr, fp);
+    } else {
+        rdr->src.data = cdata;
+        rdr->src.size = size;
+        rdr->src.offset = 8;
+        png_set_read_fn(png_ptr, &rdr->src, pngMemReadFn);
+    }
+    png_set_sig_bytes(png_ptr, 8);
+    png_read_info(png_ptr, info_ptr);
+    if (png_get_interlace_type(png_ptr, info_ptr) != PNG_INTERLACE_NONE) {
+        pngBinReaderDestroy(&rdr);
+        return NULL;
+    }
+
+        /* No transforms: the rows are read as they are stored */
+    png_read_update_info(png_ptr, info_ptr);
+
+    rdr->w = png_get_image_width(png_ptr, info_ptr);
+    rdr->h = png_get_image_height(png_ptr, info_ptr);
+    bit_depth = png_get_bit_depth(png_ptr, info_ptr);
+    color_type = png_get_color_type(png_ptr, info_ptr);
+    spp = png_get_channels(png_ptr, info_ptr);
+    rdr->rowbytes = png_get_rowbytes(png_ptr, info_ptr);
+    xres = png_get_x_pixels_per_meter(png_ptr, info_ptr);
+    yres = png_get_y_pixels_per_meter(png_ptr, info_ptr);
+    rdr->xres = (l_int32)((l_float32)xres / 39.37 + 0.5);  /* to ppi */
+    rdr->yres = (l_int32)((l_float32)yres / 39.37 + 0.5);  /* to ppi */
+    rdr->thresh = thresh;
+
+        /* What pixReadStreamPng() makes of it, after stripping 16
+         * bps samples to their high byte and dropping alpha */
+    bps = (bit_depth == 16) ? 2 : 1;
+    rdr->stride = spp * bps;
+    rdr->sampoff = 0;
+    if (color_type == PNG_COLOR_TYPE_PALETTE) {
+        d = bit_depth;
+    } else if (color_type & PNG_COLOR_MASK_COLOR) {
+        d = 32;
+        rdr->sampoff = bps;  /* green */
+    } else if (spp == 1 && bit_depth <= 8) {
+        d = bit_depth;
+    } else {  /* 16 bps gray, or gray with alpha */
+        d = 8;
+    }
+    rdr->d = d;
+
+    palette = NULL;
+    ncolors = 0;
+    colorfound = FALSE;
+    if (d != 0 && (color_type == PNG_COLOR_TYPE_PALETTE ||
+                   color_type == PNG_COLOR_MASK_PALETTE)) {
+        png_get_PLTE(png_ptr, info_ptr, &palette, &num_palette);
+            /* pixReadStreamPng() drops colors which don't fit in d bpp */
+        ncolors = L_MIN(num_palette, 1 << d);
+        for (i = 0; i < ncolors; i++) {
+            if (palette[i].red != palette[i].green ||
+                palette[i].red != palette[i].blue)
+                colorfound = TRUE;
+        }
+    }
+
+        /* Reject what we can't do, or can't do the same way as
+         * the full image path */
+    if (d == 0 || rdr->rowbytes == 0 || (palette && ncolors == 0) ||
+        ((d != 1 || colorfound) && (thresh < 0 || thresh > 256))) {
+        pngBinReaderDestroy(&rdr);
+        return NULL;
+    }
+
+        /* Make the output bit for each sample value.  See
+         * pixReadStreamPng() and pixRemoveColormap() for the
+         * polarity of 1 bpp images: with no colormap they are
+         * inverted on reading, and with a colormap they are inverted
+         * on reading if the blue sample of the first color is 0.
+         * For a gray colormap, this is undone when removing the
+         * colormap.  2 and 4 bpp gray samples are scaled to 8 bpp,
+         * as in pixConvertTo1Transfer(). */
+    if (d <= 8) {
+        for (i = 0; i < (1 << d); i++) {
+            if (!palette) {
+                val = (d == 1) ? !i : (i * (255 / ((1 << d) - 1)) < thresh);
+            } else if (d == 1 && !colorfound) {
+                val = i;
+            } else {
+                index = (d == 1 && palette[0].blue == 0) ? !i : i;
+                if (index >= ncolors)
+                    val = 0;
+                else if (colorfound)
+                    val = palette[index].green;
+                else
+                    val = (palette[index].red + 2 * palette[index].green +
+                           palette[index].blue) / 4;
+                val = (val < thresh);
+            }
+            rdr->sampbit[i] = val;
+        }
+    }
+    if (d < 8) {
+        for (i = 0; i < 256; i++) {
+            for (j = 0, val = 0; j < 8; j += d)
+                val = (val << 1) | rdr->sampbit[(i >> (8 - d - j)) &
+                                                ((1 << d) - 1)];
+            rdr->bytelut[i] = val;
+        }
+    }
+
+    if ((rdr->rowbuf = (l_uint8 *)CALLOC(rdr->rowbytes, 1)) == NULL) {
+        pngBinReaderDestroy(&rdr);
+        return (L_PNG_BIN_READER *)ERROR_PTR("rowbuf not made",
+                                             procName, NULL);
+    }
+
+    return rdr;
+}
+
+
+/*!
+ *  pngBinReaderDestroy()
+ *
+ *      Input:  &rdr (<will be nulled>)
+ *      Return: void
+ */
+LEPTONICA_REAL_EXPORT void
+pngBinReaderDestroy(L_PNG_BIN_READER  **prdr)
+{
+L_PNG_BIN_READER  *rdr;
+
+    PROCNAME("pngBinReaderDestroy");
+
+    if (prdr == NULL) {
+        L_WARNING("ptr address is NULL!", procName);
+        return;
+    }
+    if ((rdr = *prdr) == NULL)
+        return;
+
+    png_destroy_read_struct(&rdr->png_ptr, &rdr->info_ptr, (png_infopp)NULL);
+    if (rdr->rowbuf)
+        FREE(rdr->rowbuf);
+    FREE(rdr);
+    *prdr = NULL;
+    return;
+}
+
+
+/*!
+ *  pngBinReaderGetInfo()
+ *
+ *      Input:  rdr
+ *              &w, &h (<optional return>; size of the image)
+ *              &xres, &yres (<optional return>; resolution in ppi)
+ *      Return: 0 if OK, 1 on error
+ */
+LEPTONICA_REAL_EXPORT l_int32
+pngBinReaderGetInfo(L_PNG_BIN_READER  *rdr,
+                    l_int32           *pw,
+                    l_int32           *ph,
+                    l_int32           *pxres,
+                    l_int32           *pyres)
+{
+    PROCNAME("pngBinReaderGetInfo");
+
+    if (!rdr)
+        return ERROR_INT("rdr not defined", procName, 1);
+    if (pw) *pw = rdr->w;
+    if (ph) *ph = rdr->h;
+    if (pxres) *pxres = rdr->xres;
+    if (pyres) *pyres = rdr->yres;
+    return 0;
+}
+
+
+/*!
+ *  pngBinReaderReadRow()
+ *
+ *      Input:  rdr
+ *              lined (one row of a 1 bpp image of the size of the png)
+ *      Return: 0 if OK, 1 on error
+ *
+ *  Notes:
+ *      (1) Reads the next row of the image and writes its 1 bpp
+ *          version to lined, with the pad bits set to 0.
+ *      (2) After the last row, the rest of the png is read, so that
+ *          errors in it are reported by the last call, as they would
+ *          be by pixReadStreamPng().
+ */
+LEPTONICA_REAL_EXPORT l_int32
+pngBinReaderReadRow(L_PNG_BIN_READER  *rdr,
+                    l_uint32          *lined)
+{
+l_int32    j, k, n, w, d, wpl, nbits;
+l_uint32   dword;
+l_uint8   *rowbuf;
+
+    PROCNAME("pngBinReaderReadRow");
+
+    if (!rdr)
+        return ERROR_INT("rdr not defined", procName, 1);
+    if (!lined)
+        return ERROR_INT("lined not defined", procName, 1);
+    if (rdr->row >= rdr->h)
+        return ERROR_INT("no more rows", procName, 1);
+
+    if (setjmp(png_jmpbuf(rdr->png_ptr)))
+        return ERROR_INT("internal png error", procName, 1);
+
+    rowbuf = rdr->rowbuf;
+    png_read_row(rdr->png_ptr, rowbuf, NULL);
+    if (++rdr->row == rdr->h)
+        png_read_end(rdr->png_ptr, NULL);
+
+    w = rdr->w;
+    d = rdr->d;
+    wpl = (w + 31) / 32;
+    memset(lined, 0, 4 * wpl);
+    switch (d)
+    {
+    case 1:
+        for (j = 0; j < rdr->rowbytes; j++)
+            SET_DATA_BYTE(lined, j, rdr->bytelut[rowbuf[j]]);
+        if (w & 31)
+            lined[wpl - 1] &= 0xffffffff << (32 - (w & 31));
+        break;
+    case 2:
+    case 4:  /* 8 / d dest bits from each byte, by table lookup */
+        n = 8 / d;
+        for (j = 0, k = 0, nbits = 0, dword = 0; j < rdr->rowbytes; j++) {
+            dword = (dword << n) | rdr->bytelut[rowbuf[j]];
+            if ((nbits += n) == 32) {
+                lined[k++] = dword;
+                nbits = 0;
+                dword = 0;
+            }
+        }
+        if (nbits)
+            lined[k] = dword << (32 - nbits);
+        if (w & 31)
+            lined[wpl - 1] &= 0xffffffff << (32 - (w & 31));
+        break;
+    case 8:
+        if (rdr->stride == 1) {
+            for (j = 0; j < w; j++) {
+                if (rdr->sampbit[rowbuf[j]])
+                    SET_DATA_BIT(lined, j);
+            }
+        } else {  /* the high byte of 16 bps gray, or gray with alpha */
+            for (j = 0, k = 0; j < w; j++, k += rdr->stride) {
+                if (rdr->sampbit[rowbuf[k]])
+                    SET_DATA_BIT(lined, j);
+            }
+        }
+        break;
+    default:  /* 32 bpp rgb: use the green sample, as in
+               * pixConvertRGBToGrayFast() */
+        for (j = 0, k = rdr->sampoff; j < w; j++, k += rdr->stride) {
+            if (rowbuf[k] < rdr->thresh)
+                SET_DATA_BIT(lined, j);
+        }
+        break;
+    }
+
+    return 0;
+}
+
+
+/*---------------------------------------------------------------------*
+ *                  Setting flags for special modes                    *
+ *---------------------------------------------------------------------*/
+/*!
+ *  l_pngSetReadTrusted()
+ *
+ *      Input:  flag (1 for no CRC checks on reading; 0 for checks)
+ *      Return: void
+ *
+ *  Notes:
+ *      (1) With flag == 1, the CRCs of the chunks are neither computed
+ *          nor checked, so damaged data gives a damaged image instead
+ *          of an error.  Default is to check.
+ */
+LEPTONICA_REAL_EXPORT void
+l_pngSetReadTrusted(l_int32  flag)
+{
+    var_PNG_READ_TRUSTED = flag;
+    return;
+}
+
 /* --------------------------------------------*/
 #endif  /* HAVE_LIBPNG */
 /* --------------------------------------------*/
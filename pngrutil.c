@@ -2926,12 +2926,347 @@ png_do_read_interlace(png_structp png_ptr)
 }
 #endif /* PNG_READ_INTERLACING_SUPPORTED */
 
+#if defined(__SSE2__) && !defined(PNG_NO_SSE2_FILTERS)
+/* SSE2 versions of the filters, in the manner of the intel/ code of
+ * libpng 1.6.  Sub, Avg and Paeth are done for a whole pixel at a time, so
+ * they are only worth it for 3 and 4 bytes per pixel, which is what RGB and
+ * RGBA pages are; Up is done 16 bytes at a time for any pixel size.  They are
+ * used when the compiler targets SSE2 (e.g. on x86-64) and cpuGetLevel() of
+ * cpufeatures.h allows it, so JBIG2_CPU=scalar gives the C code; define
+ * PNG_NO_SSE2_FILTERS to leave them out.  The results are the same as those
+ * of the C code.
+ *
+ * The loads and stores never touch bytes outside the row: a 3 byte pixel is
+ * loaded with 4 bytes only when there is at least one more byte after it.
+ */
+#include <emmintrin.h>
+#include "cpufeatures.h"
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+
+static __m128i
+png_sse2_load4(png_voidp p)
+{
+   png_uint_32 tmp;
+   png_memcpy(&tmp, p, 4);
+   return _mm_cvtsi32_si128((int)tmp);
+}
+
+static void
+png_sse2_store4(png_voidp p, __m128i v)
+{
+   png_uint_32 tmp = (png_uint_32)_mm_cvtsi128_si32(v);
+   png_memcpy(p, &tmp, 4);
+}
+
+static __m128i
+png_sse2_load3(png_voidp p)
+{
+   png_uint_32 tmp = 0;
+   png_memcpy(&tmp, p, 3);
+   return _mm_cvtsi32_si128((int)tmp);
+}
+
+static void
+png_sse2_store3(png_voidp p, __m128i v)
+{
+   png_uint_32 tmp = (png_uint_32)_mm_cvtsi128_si32(v);
+   png_memcpy(p, &tmp, 3);
+}
+
+static void
+png_read_filter_row_up_sse2(png_size_t rowbytes, png_bytep row,
+   png_bytep prev_row)
+{
+   png_size_t i = 0;
+
+   for (; i + 16 <= rowbytes; i += 16)
+   {
+      __m128i r = _mm_loadu_si128((const __m128i *)(row + i));
+      __m128i p = _mm_loadu_si128((const __m128i *)(prev_row + i));
+      _mm_storeu_si128((__m128i *)(row + i), _mm_add_epi8(r, p));
+   }
+   for (; i < rowbytes; i++)
+      row[i] = (png_byte)(row[i] + prev_row[i]);
+}
+
+static void
+png_read_filter_row_sub3_sse2(png_size_t rowbytes, png_bytep row)
+{
+   __m128i a, d = _mm_setzero_si128();
+
+   while (rowbytes >= 4)
+   {
+      a = d;
+      d = _mm_add_epi8(png_sse2_load4(row), a);
+      png_sse2_store3(row, d);
+      row += 3;
+      rowbytes -= 3;
+   }
+   if (rowbytes > 0)
+   {
+      a = d;
+      d = _mm_add_epi8(png_sse2_load3(row), a);
+      png_sse2_store3(row, d);
+   }
+}
+
+static void
+png_read_filter_row_sub4_sse2(png_size_t rowbytes, png_bytep row)
+{
+   __m128i d = _mm_setzero_si128();
+
+   while (rowbytes > 0)
+   {
+      d = _mm_add_epi8(png_sse2_load4(row), d);
+      png_sse2_store4(row, d);
+      row += 4;
+      rowbytes -= 4;
+   }
+}
+
+/* (a + b) / 2 rounded down: _mm_avg_epu8 rounds up */
+static __m128i
+png_sse2_avg(__m128i a, __m128i b)
+{
+   __m128i avg = _mm_avg_epu8(a, b);
+   return _mm_sub_epi8(avg, _mm_and_si128(_mm_xor_si128(a, b),
+      _mm_set1_epi8(1)));
+}
+
+static void
+png_read_filter_row_avg3_sse2(png_size_t rowbytes, png_bytep row,
+   png_bytep prev_row)
+{
+   __m128i d = _mm_setzero_si128();
+
+   while (rowbytes >= 4)
+   {
+      d = _mm_add_epi8(png_sse2_load4(row),
+         png_sse2_avg(d, png_sse2_load4(prev_row)));
+      png_sse2_store3(row, d);
+      row += 3;
+      prev_row += 3;
+      rowbytes -= 3;
+   }
+   if (rowbytes > 0)
+   {
+      d = _mm_add_epi8(png_sse2_load3(row),
+         png_sse2_avg(d, png_sse2_load3(prev_row)));
+      png_sse2_store3(row, d);
+   }
+}
+
+static void
+png_read_filter_row_avg4_sse2(png_size_t rowbytes, png_bytep row,
+   png_bytep prev_row)
+{
+   __m128i d = _mm_setzero_si128();
+
+   while (rowbytes > 0)
+   {
+      d = _mm_add_epi8(png_sse2_load4(row),
+         png_sse2_avg(d, png_sse2_load4(prev_row)));
+      png_sse2_store4(row, d);
+      row += 4;
+      prev_row += 4;
+      rowbytes -= 4;
+   }
+}
+
+static __m128i
+png_sse2_abs_i16(__m128i x)
+{
+#if defined(__SSSE3__)
+   return _mm_abs_epi16(x);
+#else
+   __m128i is_negative = _mm_cmplt_epi16(x, _mm_setzero_si128());
+   x = _mm_xor_si128(x, is_negative);
+   return _mm_add_epi16(x, _mm_srli_epi16(is_negative, 15));
+#endif
+}
+
+static __m128i
+png_sse2_if_then_else(__m128i c, __m128i t, __m128i e)
+{
+   return _mm_or_si128(_mm_and_si128(c, t), _mm_andnot_si128(c, e));
+}
+
+/* The Paeth predictor of one pixel, with a (left), b (above) and c (above
+ * left) unpacked to 16 bits per byte.  Ties go to a, then b, as in the C code.
+ */
+static __m128i
+png_sse2_paeth(__m128i a, __m128i b, __m128i c)
+{
+   __m128i pa = _mm_sub_epi16(b, c);
+   __m128i pb = _mm_sub_epi16(a, c);
+   __m128i pc = _mm_add_epi16(pa, pb);
+   __m128i smallest;
+
+   pa = png_sse2_abs_i16(pa);
+   pb = png_sse2_abs_i16(pb);
+   pc = png_sse2_abs_i16(pc);
+   smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+   return png_sse2_if_then_else(_mm_cmpeq_epi16(smallest, pa), a,
+      png_sse2_if_then_else(_mm_cmpeq_epi16(smallest, pb), b, c));
+}
+
+static void
+png_read_filter_row_paeth3_sse2(png_size_t rowbytes, png_bytep row,
+   png_bytep prev_row)
+{
+   __m128i zero = _mm_setzero_si128();
+   __m128i a, b = zero, c, d = zero;
+
+   /* d, the pixel just done, and b are kept unpacked to 16 bits; the high
+    * bytes stay zero as the additions are done bytewise.
+    */
+   while (rowbytes >= 4)
+   {
+      c = b;
+      b = _mm_unpacklo_epi8(png_sse2_load4(prev_row), zero);
+      a = d;
+      d = _mm_unpacklo_epi8(png_sse2_load4(row), zero);
+      d = _mm_add_epi8(d, png_sse2_paeth(a, b, c));
+      png_sse2_store3(row, _mm_packus_epi16(d, d));
+      row += 3;
+      prev_row += 3;
+      rowbytes -= 3;
+   }
+   if (rowbytes > 0)
+   {
+      c = b;
+      b = _mm_unpacklo_epi8(png_sse2_load3(prev_row), zero);
+      a = d;
+      d = _mm_unpacklo_epi8(png_sse2_load3(row), zero);
+      d = _mm_add_epi8(d, png_sse2_paeth(a, b, c));
+      png_sse2_store3(row, _mm_packus_epi16(d, d));
+   }
+}
+
+static void
+png_read_filter_row_paeth4_sse2(png_size_t rowbytes, png_bytep row,
+   png_bytep prev_row)
+{
+   __m128i zero = _mm_setzero_si128();
+   __m128i a, b = zero, c, d = zero;
+
+   while (rowbytes > 0)
+   {
+      c = b;
+      b = _mm_unpacklo_epi8(png_sse2_load4(prev_row), zero);
+      a = d;
+      d = _mm_unpacklo_epi8(png_sse2_load4(row), zero);
+      d = _mm_add_epi8(d, png_sse2_paeth(a, b, c));
+      png_sse2_store4(row, _mm_packus_epi16(d, d));
+      row += 4;
+      prev_row += 4;
+      rowbytes -= 4;
+   }
+}
+
+/* Returns 1 if the row was done with SSE2, 0 if the C code has to do it */
+static int
+png_read_filter_row_sse2(png_row_infop row_info, png_bytep row,
+   png_bytep prev_row, int filter)
+{
+   png_size_t rowbytes = row_info->rowbytes;
+   png_uint_32 bpp = (row_info->pixel_depth + 7) >> 3;
+
+   if (filter == PNG_FILTER_VALUE_UP)
+   {
+      png_read_filter_row_up_sse2(rowbytes, row, prev_row);
+      return 1;
+   }
+   if (bpp == 3)
+   {
+      switch (filter)
+      {
+         case PNG_FILTER_VALUE_SUB:
+            png_read_filter_row_sub3_sse2(rowbytes, row);
+            return 1;
+         case PNG_FILTER_VALUE_AVG:
+            png_read_filter_row_avg3_sse2(rowbytes, row, prev_row);
+            return 1;
+         case PNG_FILTER_VALUE_PAETH:
+            png_read_filter_row_paeth3_sse2(rowbytes, row, prev_row);
+            return 1;
+      }
+   }
+   else if (bpp == 4)
+   {
+      switch (filter)
+      {
+         case PNG_FILTER_VALUE_SUB:
+            png_read_filter_row_sub4_sse2(rowbytes, row);
+            return 1;
+         case PNG_FILTER_VALUE_AVG:
+            png_read_filter_row_avg4_sse2(rowbytes, row, prev_row);
+            return 1;
+         case PNG_FILTER_VALUE_PAETH:
+            png_read_filter_row_paeth4_sse2(rowbytes, row, prev_row);
+            return 1;
+      }
+   }
+   return 0;
+}
+#endif /* __SSE2__ && !PNG_NO_SSE2_FILTERS */
+
+/* Paeth for 1 byte per pixel, as in libpng 1.6: a and c stay in registers and
+ * the predictor is picked with two compares.  Each byte depends on the one
+ * before it, so this is as fast as it gets, with or without SIMD.
+ */
+static void
+png_read_filter_row_paeth_1byte_pixel(png_row_infop row_info, png_bytep row,
+   png_bytep prev_row)
+{
+   png_bytep rp_end = row + row_info->rowbytes;
+   int a, c;
+
+   c = *prev_row++;
+   a = *row + c;
+   *row++ = (png_byte)a;
+
+   while (row < rp_end)
+   {
+      int b, pa, pb, pc, p;
+
+      a &= 0xff;
+      b = *prev_row++;
+
+      p = b - c;
+      pc = a - c;
+      pa = p < 0 ? -p : p;
+      pb = pc < 0 ? -pc : pc;
+      pc = (p + pc) < 0 ? -(p + pc) : p + pc;
+
+      /* Ties go to a, then b, as below */
+      if (pb < pa)
+      {
+         pa = pb;
+         a = b;
+      }
+      if (pc < pa)
+         a = c;
+
+      c = b;
+      a += *row;
+      *row++ = (png_byte)a;
+   }
+}
+
 void /* PRIVATE */
 png_read_filter_row(png_structp png_ptr, png_row_infop row_info, png_bytep row,
    png_bytep prev_row, int filter)
 {
    png_debug(1, "in png_read_filter_row");
    png_debug2(2, "row = %lu, filter = %d", png_ptr->row_number, filter);
+#if defined(__SSE2__) && !defined(PNG_NO_SSE2_FILTERS)
+   if (cpuGetLevel() >= L_CPU_SSE2 &&
+       png_read_filter_row_sse2(row_info, row, prev_row, filter))
+      return;
+#endif
    switch (filter)
    {
       case PNG_FILTER_VALUE_NONE:
@@ -2999,6 +3334,12 @@ png_read_filter_row(png_structp png_ptr, png_row_infop row_info, png_bytep row,
          png_uint_32 bpp = (row_info->pixel_depth + 7) >> 3;
          png_uint_32 istop=row_info->rowbytes - bpp;
 
+         if (bpp == 1)
+         {
+            png_read_filter_row_paeth_1byte_pixel(row_info, row, prev_row);
+            break;
+         }
+
          for (i = 0; i < bpp; i++)
          {
             *rp = (png_byte)(((int)(*rp) + (int)(*pp++)) & 0xff);
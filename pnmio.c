@@ -26,11 +26,31 @@
  *      Read/write to memory   [not on windows]
  *          PIX             *pixReadMemPnm()
  *          l_int32          sreadHeaderPnm()
+ *          l_int32          sreadSizePnm()
  *          l_int32          pixWriteMemPnm()
  *
+ *      Gzip-compressed raw pnm (.pnm.gz)
+ *          PIX             *pixReadStreamPnmGz()
+ *          PIX             *pixReadMemPnmGz()
+ *
  *      Local helpers
  *          static l_int32   pnmReadNextAsciiValue();
  *          static l_int32   pnmSkipCommentLines();
+ *          static l_int32   pnmGetDepth();
+ *          static size_t    pnmRawRowBytes();
+ *          static void      pnmUnpackRawRow();
+ *          static const char *pnmRawReadError();
+ *
+ *      Local helpers for parsing in memory (like fscanf/fgetc)
+ *          static l_int32   pnmMemReadHeader();
+ *          static l_int32   pnmMemReadInt();
+ *          static void      pnmMemSkipSpace();
+ *          static l_int32   pnmMemSkipCommentLines();
+ *          static l_int32   pnmMemReadNextAsciiValue();
+ *
+ *      Local helpers for gzipped pnm
+ *          static PIX      *pnmGzReadPix();
+ *          static size_t    pnmGzInflate();
  *       
  *      These are here by popular demand, with the help of Mattias
  *      Kregert (mattias@kregert.se), who provided the first implementation.
@@ -69,6 +89,7 @@
 
 #include <string.h>
 #include "allheaders.h"
+#include "zlib.h"
 
 /* --------------------------------------------*/
 #if  USE_PNMIO   /* defined in environ.h */
@@ -77,11 +98,42 @@
 
 static l_int32 pnmReadNextAsciiValue(FILE  *fp, l_int32 *pval);
 static l_int32 pnmSkipCommentLines(FILE  *fp);
+static l_int32 pnmGetDepth(l_int32 type, l_int32 maxval, l_int32 *pd);
+static size_t pnmRawRowBytes(l_int32 w, l_int32 d, l_int32 type);
+static void pnmUnpackRawRow(l_uint32 *line, l_int32 wpl, l_int32 d,
+                            l_int32 type, const l_uint8 *bytes,
+                            size_t nbytes);
+static const char *pnmRawReadError(l_int32 d, l_int32 type);
+static l_int32 pnmMemReadHeader(const l_uint8 *cdata, size_t size,
+                                l_int32 *pw, l_int32 *ph, l_int32 *pd,
+                                l_int32 *ptype, size_t *ppos);
+static l_int32 pnmMemReadInt(const l_uint8 *cdata, size_t size,
+                             size_t *ppos, l_int32 *pval);
+static void pnmMemSkipSpace(const l_uint8 *cdata, size_t size, size_t *ppos);
+static l_int32 pnmMemSkipCommentLines(const l_uint8 *cdata, size_t size,
+                                      size_t *ppos);
+static l_int32 pnmMemReadNextAsciiValue(const l_uint8 *cdata, size_t size,
+                                        size_t *ppos, l_int32 *pval);
+struct PnmGzSource;
+static PIX *pnmGzReadPix(FILE *fp, const l_uint8 *cdata, size_t size);
+static size_t pnmGzInflate(struct PnmGzSource *src, l_uint8 *out, size_t n);
 
     /* a sanity check on the size read from file */
 static const l_int32  MAX_PNM_WIDTH = 100000;
 static const l_int32  MAX_PNM_HEIGHT = 100000;
 
+    /* Inflated bytes kept for parsing the header of a gzipped pnm */
+static const l_int32  PNM_GZ_HEADER_SIZE = 4096;
+
+    /* Inflate state for a gzipped pnm, read from a stream or memory */
+struct PnmGzSource {
+    z_stream   z;
+    FILE      *fp;         /* null when all input is in memory */
+    l_uint8    inbuf[16384];  /* input read from fp for inflate() */
+    l_int32    end;        /* set at the end of the gzip stream */
+    l_int32    error;      /* set on corrupt or truncated input */
+};
+
 
 /*--------------------------------------------------------------------*
  *                          Stream interface                          *
@@ -95,12 +147,12 @@ static const l_int32  MAX_PNM_HEIGHT = 100000;
 LEPTONICA_EXPORT PIX *
 pixReadStreamPnm(FILE  *fp)
 {
-l_uint8    val8, rval8, gval8, bval8;
-l_uint16   val16;
-l_int32    w, h, d, bpl, wpl, i, j, type;
+l_uint8   *rowbuf, *buf;
+l_int32    w, h, d, wpl, i, j, type;
 l_int32    val, rval, gval, bval;
 l_uint32   rgbval;
 l_uint32  *line, *data;
+size_t     nread, rowbytes;
 PIX       *pix;
 
     PROCNAME("pixReadStreamPnm");
@@ -137,66 +189,158 @@ PIX       *pix;
         return pix;
     }
 
-        /* "raw" format for 1 bpp */
-    if (type == 4) {
-        bpl = (d * w + 7) / 8;
-        for (i = 0; i < h; i++) {
-            line = data + i * wpl;
-            for (j = 0; j < bpl; j++) {
-                if (fread(&val8, 1, 1, fp) != 1)
-                    return (PIX *)ERROR_PTR( "read error in 4", procName, pix);
-                SET_DATA_BYTE(line, j, val8);
-            }
+        /* "raw" formats.  Each row is read with a single fread().
+         * For 1 bpp and 8 bpp, the file data has the same byte order
+         * as the pix data on a big-endian machine, so it is read
+         * straight into the pix and byte swapped in place.  The other
+         * depths are unpacked from a row buffer.  On a short read, the
+         * pix is returned with everything up to the error filled in. */
+    rowbytes = pnmRawRowBytes(w, d, type);
+    rowbuf = NULL;
+    if (!(type == 4 || (type == 5 && d == 8))) {
+        if ((rowbuf = (l_uint8 *)CALLOC(rowbytes, 1)) == NULL)
+            return (PIX *)ERROR_PTR( "rowbuf not made", procName, pix);
+    }
+    for (i = 0; i < h; i++) {
+        line = data + (size_t)i * wpl;
+        buf = rowbuf ? rowbuf : (l_uint8 *)line;
+        nread = fread(buf, 1, rowbytes, fp);
+        pnmUnpackRawRow(line, wpl, d, type, buf, nread);
+        if (nread != rowbytes) {
+            FREE(rowbuf);
+            return (PIX *)ERROR_PTR(pnmRawReadError(d, type), procName, pix);
         }
-        return pix;
     }
+    FREE(rowbuf);
+    return pix;
+}
+
 
-        /* "raw" format for grayscale */
-    if (type == 5) {
-        bpl = (d * w + 7) / 8;
+/*!
+ *  pixReadMemPnm()
+ *
+ *      Input:  cdata (const; pnm-encoded)
+ *              size (of data)
+ *      Return: pix, or null on error
+ *
+ *  Notes:
+ *      (1) The header and ascii data are parsed in place, and raw
+ *          data is unpacked straight from cdata into the pix.  The
+ *          result is the same as from pixReadStreamPnm() on a file
+ *          holding the same bytes.
+ */
+LEPTONICA_REAL_EXPORT PIX *
+pixReadMemPnm(const l_uint8  *cdata,
+              size_t          size)
+{
+l_int32    w, h, d, wpl, i, j, type;
+l_int32    val, rval, gval, bval;
+l_uint32   rgbval;
+l_uint32  *line, *data;
+size_t     pos, nbytes, rowbytes;
+PIX       *pix;
+
+    PROCNAME("pixReadMemPnm");
+
+    if (!cdata)
+        return (PIX *)ERROR_PTR("cdata not defined", procName, NULL);
+
+    if (pnmMemReadHeader(cdata, size, &w, &h, &d, &type, &pos))
+        return (PIX *)ERROR_PTR( "pix not made", procName, NULL);
+    if ((pix = pixCreate(w, h, d)) == NULL)
+        return (PIX *)ERROR_PTR( "pix not made", procName, NULL);
+    data = pixGetData(pix);
+    wpl = pixGetWpl(pix);
+
+        /* Old "ascii" format */
+    if (type <= 3) {
         for (i = 0; i < h; i++) {
-            line = data + i * wpl;
-            if (d != 16) {
-                for (j = 0; j < w; j++) {
-                    if (fread(&val8, 1, 1, fp) != 1)
-                        return (PIX *)ERROR_PTR( "error in 5", procName, pix);
-                    if (d == 2)
-                        SET_DATA_DIBIT(line, j, val8);
-                    else if (d == 4)
-                        SET_DATA_QBIT(line, j, val8);
-                    else  /* d == 8 */
-                        SET_DATA_BYTE(line, j, val8);
+            for (j = 0; j < w; j++) {
+                if (type == 1 || type == 2) {
+                    if (pnmMemReadNextAsciiValue(cdata, size, &pos, &val))
+                        return (PIX *)ERROR_PTR( "read abend", procName, pix);
+                    pixSetPixel(pix, j, i, val);
                 }
-            }
-            else {  /* d == 16 */
-                for (j = 0; j < w; j++) {
-                    if (fread(&val16, 2, 1, fp) != 1)
-                        return (PIX *)ERROR_PTR( "16 bpp error", procName, pix);
-                    SET_DATA_TWO_BYTES(line, j, val16);
+                else {  /* type == 3 */
+                    if (pnmMemReadNextAsciiValue(cdata, size, &pos, &rval) ||
+                        pnmMemReadNextAsciiValue(cdata, size, &pos, &gval) ||
+                        pnmMemReadNextAsciiValue(cdata, size, &pos, &bval))
+                        return (PIX *)ERROR_PTR( "read abend", procName, pix);
+                    composeRGBPixel(rval, gval, bval, &rgbval);
+                    pixSetPixel(pix, j, i, rgbval);
                 }
             }
         }
         return pix;
     }
 
-        /* "raw" format, type == 6; rgb */
+        /* "raw" formats */
+    rowbytes = pnmRawRowBytes(w, d, type);
     for (i = 0; i < h; i++) {
-        line = data + i * wpl;
-        for (j = 0; j < wpl; j++) {
-            if (fread(&rval8, 1, 1, fp) != 1)
-                return (PIX *)ERROR_PTR( "read error type 6", procName, pix);
-            if (fread(&gval8, 1, 1, fp) != 1)
-                return (PIX *)ERROR_PTR( "read error type 6", procName, pix);
-            if (fread(&bval8, 1, 1, fp) != 1)
-                return (PIX *)ERROR_PTR( "read error type 6", procName, pix);
-            composeRGBPixel(rval8, gval8, bval8, &rgbval);
-            line[j] = rgbval;
-        }
+        line = data + (size_t)i * wpl;
+        nbytes = L_MIN(rowbytes, size - pos);
+        pnmUnpackRawRow(line, wpl, d, type, cdata + pos, nbytes);
+        pos += nbytes;
+        if (nbytes != rowbytes)
+            return (PIX *)ERROR_PTR(pnmRawReadError(d, type), procName, pix);
     }
     return pix;
 }
 
 
+/*--------------------------------------------------------------------*
+ *                 Gzip-compressed raw pnm (.pnm.gz)                  *
+ *--------------------------------------------------------------------*/
+/*!
+ *  pixReadStreamPnmGz()
+ *
+ *      Input:  stream opened for read, at the start of the gzip data
+ *      Return: pix, or null on error
+ *
+ *  Notes:
+ *      (1) This reads a raw (P4, P5 or P6) pnm file compressed with
+ *          gzip.  Each row is inflated straight into the pix (or,
+ *          for depths that have to be unpacked, into a row buffer),
+ *          so the decompressed file is never held in memory.
+ *      (2) Compared to png, there is no per-row filtering and no
+ *          chunk crc to check, so this is the cheaper compressed
+ *          input format.
+ *      (3) The header must be in the first PNM_GZ_HEADER_SIZE bytes
+ *          of the inflated data, and the ascii types are not read.
+ */
+LEPTONICA_EXPORT PIX *
+pixReadStreamPnmGz(FILE  *fp)
+{
+    PROCNAME("pixReadStreamPnmGz");
+
+    if (!fp)
+        return (PIX *)ERROR_PTR("fp not defined", procName, NULL);
+    return pnmGzReadPix(fp, NULL, 0);
+}
+
+
+/*!
+ *  pixReadMemPnmGz()
+ *
+ *      Input:  cdata (const; gzipped pnm)
+ *              size (of data)
+ *      Return: pix, or null on error
+ *
+ *  Notes:
+ *      (1) See pixReadStreamPnmGz().
+ */
+LEPTONICA_REAL_EXPORT PIX *
+pixReadMemPnmGz(const l_uint8  *cdata,
+                size_t          size)
+{
+    PROCNAME("pixReadMemPnmGz");
+
+    if (!cdata)
+        return (PIX *)ERROR_PTR("cdata not defined", procName, NULL);
+    return pnmGzReadPix(NULL, cdata, size);
+}
+
+
 /*!
  *  freadHeaderPnm()
  *
@@ -244,31 +388,17 @@ l_int32  maxval;
         return ERROR_INT("invalid sizes", procName, 1);
 
         /* Get depth of pix */
-    if (type == 1 || type == 4)
-        d = 1;
-    else if (type == 2 || type == 5) {
+    maxval = 0;
+    if (type == 2 || type == 5) {
         if (fscanf(fp, "%d\n", &maxval) != 1)
             return ERROR_INT("invalid read for maxval (2,5)", procName, 1);
-        if (maxval == 3)
-            d = 2;
-        else if (maxval == 15)
-            d = 4;
-        else if (maxval == 255)
-            d = 8;
-        else if (maxval == 0xffff)
-            d = 16;
-        else {
-            fprintf(stderr, "maxval = %d\n", maxval);
-            return ERROR_INT("invalid maxval", procName, 1);
-        }
     }
-    else {  /* type == 3 || type == 6; this is rgb  */
+    else if (type == 3 || type == 6) {
         if (fscanf(fp, "%d\n", &maxval) != 1)
             return ERROR_INT("invalid read for maxval (3,6)", procName, 1);
-        if (maxval != 255)
-            L_WARNING_INT("unexpected maxval = %d", procName, maxval);
-        d = 32;
     }
+    if (pnmGetDepth(type, maxval, &d))
+        return ERROR_INT("invalid maxval", procName, 1);
     *pwidth = w;
     *pheight = h;
     *pdepth = d;
@@ -288,6 +418,108 @@ l_int32  maxval;
 /*---------------------------------------------------------------------*
  *                         Read/write to memory                        *
  *---------------------------------------------------------------------*/
+/*!
+ *  sreadHeaderPnm()
+ *
+ *      Input:  cdata (const; pnm-encoded)
+ *              size (of data)
+ *              &width (<return>)
+ *              &height (<return>)
+ *              &depth (<return>)
+ *              &type (<return> pnm type)
+ *              &bps (<optional return>, bits/sample)
+ *              &spp (<optional return>, samples/pixel)
+ *      Return: 0 if OK, 1 on error
+ *
+ *  Notes:
+ *      (1) As freadHeaderPnm(), for the data in memory.  depth is that
+ *          of the pix which pixReadMemPnm() would make.
+ */
+LEPTONICA_REAL_EXPORT l_int32
+sreadHeaderPnm(const l_uint8  *cdata,
+               size_t          size,
+               l_int32        *pwidth,
+               l_int32        *pheight,
+               l_int32        *pdepth,
+               l_int32        *ptype,
+               l_int32        *pbps,
+               l_int32        *pspp)
+{
+l_int32  d;
+size_t   pos;
+
+    PROCNAME("sreadHeaderPnm");
+
+    if (!cdata)
+        return ERROR_INT("cdata not defined", procName, 1);
+    if (!pwidth || !pheight || !pdepth || !ptype)
+        return ERROR_INT("input ptr(s) not defined", procName, 1);
+
+    if (pnmMemReadHeader(cdata, size, pwidth, pheight, &d, ptype, &pos))
+        return ERROR_INT("invalid pnm header", procName, 1);
+    *pdepth = d;
+    if (pbps) *pbps = (d == 32) ? 8 : d;
+    if (pspp) *pspp = (d == 32) ? 3 : 1;
+    return 0;
+}
+
+
+/*!
+ *  sreadSizePnm()
+ *
+ *      Input:  cdata (const; one or more pnm images, one after another)
+ *              size (of data)
+ *              &nbytes (<return> bytes of the first image)
+ *      Return: 0 if OK, 1 on error
+ *
+ *  Notes:
+ *      (1) Ghostscript (-sDEVICE=pbmraw, pgmraw, ...) writes all the
+ *          pages of a document to one stream as pnm images, one after
+ *          another.  This finds where the first image in cdata ends,
+ *          and so where the next one starts, without unpacking it:
+ *          the raster of the raw types is skipped, and the values of
+ *          the ascii types are only parsed.
+ *      (2) nbytes takes in the header, the raster and any whitespace
+ *          after it, so it is size for the last image.
+ *      (3) Returns an error if the raster is cut short.
+ */
+LEPTONICA_REAL_EXPORT l_int32
+sreadSizePnm(const l_uint8  *cdata,
+             size_t          size,
+             size_t         *pnbytes)
+{
+l_int32  w, h, d, type, val;
+size_t   pos, rasterbytes, nvals, i;
+
+    PROCNAME("sreadSizePnm");
+
+    if (!pnbytes)
+        return ERROR_INT("&nbytes not defined", procName, 1);
+    *pnbytes = 0;
+    if (!cdata)
+        return ERROR_INT("cdata not defined", procName, 1);
+
+    if (pnmMemReadHeader(cdata, size, &w, &h, &d, &type, &pos))
+        return ERROR_INT("invalid pnm header", procName, 1);
+    if (type <= 3) {
+        nvals = (size_t)w * h * (type == 3 ? 3 : 1);
+        for (i = 0; i < nvals; i++) {
+            if (pnmMemReadNextAsciiValue(cdata, size, &pos, &val))
+                return ERROR_INT("image cut short", procName, 1);
+        }
+    }
+    else {
+        rasterbytes = pnmRawRowBytes(w, d, type) * h;
+        if (rasterbytes > size - pos)
+            return ERROR_INT("image cut short", procName, 1);
+        pos += rasterbytes;
+    }
+    pnmMemSkipSpace(cdata, size, &pos);
+    *pnbytes = pos;
+    return 0;
+}
+
+
 #ifdef HAVE_CONFIG_H
 #include "config_auto.h"
 #endif  /* HAVE_CONFIG_H */
@@ -363,6 +595,478 @@ l_int32  c;
     return 0;
 }
 
+
+/*!
+ *  pnmGetDepth()
+ *
+ *      Input:  type (pnm type)
+ *              maxval (from the header; ignored for 1 bpp types)
+ *              &d (<return> depth of pix)
+ *      Return: 0 if OK, 1 if maxval is invalid
+ */
+static l_int32
+pnmGetDepth(l_int32   type,
+            l_int32   maxval,
+            l_int32  *pd)
+{
+    PROCNAME("pnmGetDepth");
+
+    if (type == 1 || type == 4)
+        *pd = 1;
+    else if (type == 2 || type == 5) {
+        if (maxval == 3)
+            *pd = 2;
+        else if (maxval == 15)
+            *pd = 4;
+        else if (maxval == 255)
+            *pd = 8;
+        else if (maxval == 0xffff)
+            *pd = 16;
+        else {
+            fprintf(stderr, "maxval = %d\n", maxval);
+            return 1;
+        }
+    }
+    else {  /* type == 3 || type == 6; this is rgb  */
+        if (maxval != 255)
+            L_WARNING_INT("unexpected maxval = %d", procName, maxval);
+        *pd = 32;
+    }
+    return 0;
+}
+
+
+/*!
+ *  pnmRawRowBytes()
+ *
+ *      Input:  w, d (of pix), type (4, 5 or 6)
+ *      Return: number of bytes in a row of raw pnm data
+ *
+ *  Notes:
+ *      (1) Raw grayscale is one byte per sample, or two for 16 bpp,
+ *          whatever the depth.
+ */
+static size_t
+pnmRawRowBytes(l_int32  w,
+               l_int32  d,
+               l_int32  type)
+{
+    if (type == 4)
+        return (w + 7) / 8;
+    else if (type == 5)
+        return (d == 16) ? 2 * (size_t)w : (size_t)w;
+    else  /* type == 6 */
+        return 3 * (size_t)w;
+}
+
+
+/*!
+ *  pnmUnpackRawRow()
+ *
+ *      Input:  line (of the pix), wpl
+ *              d (of pix), type (4, 5 or 6)
+ *              bytes (raw row data; for type 4 and 8 bpp type 5, this
+ *                     can be line itself)
+ *              nbytes (available; less than a full row after a short
+ *                      read, in which case only the whole samples in
+ *                      it are unpacked)
+ *      Return: void
+ */
+static void
+pnmUnpackRawRow(l_uint32       *line,
+                l_int32         wpl,
+                l_int32         d,
+                l_int32         type,
+                const l_uint8  *bytes,
+                size_t          nbytes)
+{
+size_t    j, k;
+l_uint16  val16;
+
+    if (type == 4 || (type == 5 && d == 8)) {
+            /* the bytes are the pix data of a big-endian machine */
+        if (bytes != (const l_uint8 *)line)
+            memcpy(line, bytes, nbytes);
+        lineEndianByteSwap(line, line, wpl);
+    }
+    else if (type == 5 && d != 16) {
+        for (j = 0; j < nbytes; j++) {
+            if (d == 2)
+                SET_DATA_DIBIT(line, j, bytes[j]);
+            else  /* d == 4 */
+                SET_DATA_QBIT(line, j, bytes[j]);
+        }
+    }
+    else if (type == 5) {  /* d == 16; samples in machine byte order */
+        for (j = 0; j < nbytes / 2; j++) {
+            memcpy(&val16, bytes + 2 * j, 2);
+            SET_DATA_TWO_BYTES(line, j, val16);
+        }
+    }
+    else {  /* type == 6 */
+        for (j = 0, k = 0; j < nbytes / 3; j++, k += 3) {
+            line[j] = ((l_uint32)bytes[k] << L_RED_SHIFT) |
+                      ((l_uint32)bytes[k + 1] << L_GREEN_SHIFT) |
+                      ((l_uint32)bytes[k + 2] << L_BLUE_SHIFT);
+        }
+    }
+    return;
+}
+
+
+/*!
+ *  pnmRawReadError()
+ *
+ *      Return: error message for a short read of raw data
+ */
+static const char *
+pnmRawReadError(l_int32  d,
+                l_int32  type)
+{
+    if (type == 4)
+        return "read error in 4";
+    else if (type == 5 && d == 16)
+        return "16 bpp error";
+    else if (type == 5)
+        return "error in 5";
+    else
+        return "read error type 6";
+}
+
+
+/*--------------------------------------------------------------------*
+ *                   Parsing pnm data in memory                       *
+ *--------------------------------------------------------------------*/
+/*!
+ *  pnmMemReadHeader()
+ *
+ *      Input:  cdata, size
+ *              &w, &h, &d, &type (<return>)
+ *              &pos (<return> offset of the image data in cdata)
+ *      Return: 0 if OK, 1 on error
+ *
+ *  Notes:
+ *      (1) This accepts exactly what freadHeaderPnm() does.  In
+ *          particular, like the "%d\n" format used there, all the
+ *          whitespace after the last number is skipped.
+ */
+static l_int32
+pnmMemReadHeader(const l_uint8  *cdata,
+                 size_t          size,
+                 l_int32        *pw,
+                 l_int32        *ph,
+                 l_int32        *pd,
+                 l_int32        *ptype,
+                 size_t         *ppos)
+{
+l_int32  w, h, type, maxval;
+size_t   pos;
+
+    PROCNAME("pnmMemReadHeader");
+
+    pos = 0;
+    if (size < 1 || cdata[0] != 'P')
+        return ERROR_INT("invalid read for type", procName, 1);
+    pos = 1;
+    if (pnmMemReadInt(cdata, size, &pos, &type))
+        return ERROR_INT("invalid read for type", procName, 1);
+    pnmMemSkipSpace(cdata, size, &pos);
+    if (type < 1 || type > 6)
+        return ERROR_INT("invalid pnm file", procName, 1);
+
+    if (pnmMemSkipCommentLines(cdata, size, &pos))
+        return ERROR_INT("no data in file", procName, 1);
+
+    if (pnmMemReadInt(cdata, size, &pos, &w))
+        return ERROR_INT("invalid read for w,h", procName, 1);
+    pnmMemSkipSpace(cdata, size, &pos);
+    if (pnmMemReadInt(cdata, size, &pos, &h))
+        return ERROR_INT("invalid read for w,h", procName, 1);
+    pnmMemSkipSpace(cdata, size, &pos);
+    if (w <= 0 || h <= 0 || w > MAX_PNM_WIDTH || h > MAX_PNM_HEIGHT)
+        return ERROR_INT("invalid sizes", procName, 1);
+
+    maxval = 0;
+    if (type != 1 && type != 4) {
+        if (pnmMemReadInt(cdata, size, &pos, &maxval))
+            return ERROR_INT("invalid read for maxval", procName, 1);
+        pnmMemSkipSpace(cdata, size, &pos);
+    }
+    if (pnmGetDepth(type, maxval, pd))
+        return ERROR_INT("invalid maxval", procName, 1);
+
+    *pw = w;
+    *ph = h;
+    *ptype = type;
+    *ppos = pos;
+    return 0;
+}
+
+
+/*!
+ *  pnmMemReadInt()
+ *
+ *      Return: 0 if OK, 1 if there is no number at *ppos
+ *
+ *  Notes:
+ *      (1) As fscanf("%d"): leading whitespace is skipped, and on
+ *          failure *pval is unchanged.
+ */
+static l_int32
+pnmMemReadInt(const l_uint8  *cdata,
+              size_t          size,
+              size_t         *ppos,
+              l_int32        *pval)
+{
+l_int32  sign, val;
+size_t   pos;
+
+    pnmMemSkipSpace(cdata, size, ppos);
+    pos = *ppos;
+    sign = 1;
+    if (pos < size && (cdata[pos] == '-' || cdata[pos] == '+')) {
+        if (cdata[pos] == '-')
+            sign = -1;
+        pos++;
+    }
+    if (pos >= size || cdata[pos] < '0' || cdata[pos] > '9') {
+        *ppos = pos;
+        return 1;
+    }
+    for (val = 0; pos < size && cdata[pos] >= '0' && cdata[pos] <= '9'; pos++)
+        val = 10 * val + (cdata[pos] - '0');
+    *pval = sign * val;
+    *ppos = pos;
+    return 0;
+}
+
+
+/*!
+ *  pnmMemSkipSpace()
+ *
+ *  Skips whitespace, as a whitespace directive in an fscanf() format.
+ */
+static void
+pnmMemSkipSpace(const l_uint8  *cdata,
+                size_t          size,
+                size_t         *ppos)
+{
+size_t  pos;
+
+    for (pos = *ppos; pos < size; pos++) {
+        if (cdata[pos] != ' ' && cdata[pos] != '\t' && cdata[pos] != '\n' &&
+            cdata[pos] != '\v' && cdata[pos] != '\f' && cdata[pos] != '\r')
+            break;
+    }
+    *ppos = pos;
+    return;
+}
+
+
+/*!
+ *  pnmMemSkipCommentLines()
+ *
+ *      Return: 0 if OK, 1 on error or end of data
+ *
+ *  Notes:
+ *      (1) As pnmSkipCommentLines()
+ */
+static l_int32
+pnmMemSkipCommentLines(const l_uint8  *cdata,
+                       size_t          size,
+                       size_t         *ppos)
+{
+size_t  pos;
+
+    pos = *ppos;
+    if (pos >= size)
+        return 1;
+    while (cdata[pos] == '#') {  /* each line starting with '#' */
+        do {  /* this entire line */
+            if (++pos >= size)
+                return 1;
+        } while (cdata[pos] != '\n');
+        if (++pos >= size)
+            return 1;
+    }
+    *ppos = pos;
+    return 0;
+}
+
+
+/*!
+ *  pnmMemReadNextAsciiValue()
+ *
+ *      Return: 0 if OK, 1 on error or end of data
+ *
+ *  Notes:
+ *      (1) As pnmReadNextAsciiValue()
+ */
+static l_int32
+pnmMemReadNextAsciiValue(const l_uint8  *cdata,
+                         size_t          size,
+                         size_t         *ppos,
+                         l_int32        *pval)
+{
+size_t  pos;
+
+    *pval = 0;
+    for (pos = *ppos; pos < size; pos++) {  /* skip whitespace */
+        if (cdata[pos] != ' ' && cdata[pos] != '\t' && cdata[pos] != '\n' &&
+            cdata[pos] != '\r')
+            break;
+    }
+    *ppos = pos;
+    if (pos >= size)
+        return 1;
+    (void)pnmMemReadInt(cdata, size, ppos, pval);
+    return 0;
+}
+
+
+/*--------------------------------------------------------------------*
+ *                   Helpers for gzipped pnm                          *
+ *--------------------------------------------------------------------*/
+/*!
+ *  pnmGzReadPix()
+ *
+ *      Input:  fp (stream to read gzip data from; or null)
+ *              cdata, size (gzip data in memory, if fp is null)
+ *      Return: pix, or null on error
+ *
+ *  Notes:
+ *      (1) As for the other readers, a pix with everything up to a
+ *          short read filled in is returned along with the error.
+ */
+static PIX *
+pnmGzReadPix(FILE           *fp,
+             const l_uint8  *cdata,
+             size_t          size)
+{
+l_uint8             *hbuf, *rowbuf, *buf;
+l_int32              w, h, d, wpl, i, type;
+l_uint32            *line, *data;
+size_t               hsize, pos, nbytes, rowbytes;
+PIX                 *pix;
+struct PnmGzSource  *src;
+
+    PROCNAME("pnmGzReadPix");
+
+    if ((src = (struct PnmGzSource *)CALLOC(1, sizeof(struct PnmGzSource)))
+            == NULL)
+        return (PIX *)ERROR_PTR("src not made", procName, NULL);
+    if ((hbuf = (l_uint8 *)CALLOC(PNM_GZ_HEADER_SIZE, 1)) == NULL) {
+        FREE(src);
+        return (PIX *)ERROR_PTR("hbuf not made", procName, NULL);
+    }
+    src->fp = fp;
+    src->z.next_in = (Bytef *)cdata;
+    src->z.avail_in = fp ? 0 : size;
+    if (inflateInit2(&src->z, 16 + MAX_WBITS) != Z_OK) {  /* gzip only */
+        FREE(hbuf);
+        FREE(src);
+        return (PIX *)ERROR_PTR("inflateInit2 failed", procName, NULL);
+    }
+
+        /* Parse the header.  If it ends exactly at the end of what has
+         * been inflated, the whitespace after it continues beyond, and
+         * is skipped just like pnmMemReadHeader() does. */
+    pix = NULL;
+    rowbuf = NULL;
+    hsize = pnmGzInflate(src, hbuf, PNM_GZ_HEADER_SIZE);
+    if (pnmMemReadHeader(hbuf, hsize, &w, &h, &d, &type, &pos)) {
+        L_ERROR("invalid header", procName);
+        goto cleanup;
+    }
+    while (pos == hsize && !src->end && !src->error) {
+        hsize = pnmGzInflate(src, hbuf, PNM_GZ_HEADER_SIZE);
+        pos = 0;
+        pnmMemSkipSpace(hbuf, hsize, &pos);
+    }
+    if (type <= 3) {
+        L_ERROR("ascii pnm not read from gzip data", procName);
+        goto cleanup;
+    }
+    if ((pix = pixCreate(w, h, d)) == NULL) {
+        L_ERROR("pix not made", procName);
+        goto cleanup;
+    }
+    data = pixGetData(pix);
+    wpl = pixGetWpl(pix);
+
+        /* Inflate each row, starting with what is left after the header */
+    rowbytes = pnmRawRowBytes(w, d, type);
+    if (!(type == 4 || (type == 5 && d == 8))) {
+        if ((rowbuf = (l_uint8 *)CALLOC(rowbytes, 1)) == NULL) {
+            L_ERROR("rowbuf not made", procName);
+            goto cleanup;
+        }
+    }
+    for (i = 0; i < h; i++) {
+        line = data + (size_t)i * wpl;
+        buf = rowbuf ? rowbuf : (l_uint8 *)line;
+        nbytes = L_MIN(rowbytes, hsize - pos);
+        memcpy(buf, hbuf + pos, nbytes);
+        pos += nbytes;
+        if (nbytes < rowbytes)
+            nbytes += pnmGzInflate(src, buf + nbytes, rowbytes - nbytes);
+        pnmUnpackRawRow(line, wpl, d, type, buf, nbytes);
+        if (nbytes != rowbytes) {
+            L_ERROR(pnmRawReadError(d, type), procName);
+            break;
+        }
+    }
+
+cleanup:
+    inflateEnd(&src->z);
+    FREE(src);
+    FREE(hbuf);
+    FREE(rowbuf);
+    return pix;
+}
+
+
+/*!
+ *  pnmGzInflate()
+ *
+ *      Input:  src
+ *              out (buffer for the inflated bytes)
+ *              n (number of bytes wanted)
+ *      Return: number of bytes inflated; less than n at the end of the
+ *              gzip stream or on error
+ */
+static size_t
+pnmGzInflate(struct PnmGzSource  *src,
+             l_uint8             *out,
+             size_t               n)
+{
+l_int32  ret;
+size_t   nread;
+
+    src->z.next_out = out;
+    src->z.avail_out = n;
+    while (src->z.avail_out > 0 && !src->end && !src->error) {
+        if (src->z.avail_in == 0) {
+            if (src->fp)
+                nread = fread(src->inbuf, 1, sizeof(src->inbuf), src->fp);
+            else
+                nread = 0;
+            if (nread == 0) {  /* truncated */
+                src->error = 1;
+                break;
+            }
+            src->z.next_in = src->inbuf;
+            src->z.avail_in = nread;
+        }
+        ret = inflate(&src->z, Z_NO_FLUSH);
+        if (ret == Z_STREAM_END)
+            src->end = 1;
+        else if (ret != Z_OK)
+            src->error = 1;
+    }
+    return n - src->z.avail_out;
+}
+
 /* --------------------------------------------*/
 #endif  /* USE_PNMIO */
 /* --------------------------------------------*/
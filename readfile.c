@@ -164,6 +164,11 @@ PIX     *pix;
             return (PIX *)ERROR_PTR("pnm: no pix returned", procName, NULL);
         break;
 
+    case IFF_PNM_GZ:
+        if ((pix = pixReadStreamPnmGz(fp)) == NULL)
+            return (PIX *)ERROR_PTR("pnm.gz: no pix returned", procName, NULL);
+        break;
+
 #if HAVE_LIBGIF
     case IFF_GIF:
         if ((pix = pixReadStreamGif(fp)) == NULL)
@@ -271,7 +276,7 @@ l_int32  format;
  *      (2) For tiff files, this returns IFF_TIFF.  The specific tiff
  *          compression is then determined using findTiffCompression().
  */
-LEPTONICA_EXPORT l_int32
+LEPTONICA_REAL_EXPORT l_int32
 findFileFormatBuffer(const l_uint8  *buf,
                      l_int32        *pformat)
 {
@@ -363,6 +368,12 @@ l_uint16  twobytepw;
         return 0;
     }
 
+        /* Check for the gzip id; only gzipped pnm is read */
+    if (buf[0] == 0x1f && buf[1] == 0x8b) {
+        *pformat = IFF_PNM_GZ;
+        return 0;
+    }
+
         /* Check for "spix" serialized pix */
     if (buf[0] == 's' && buf[1] == 'p' && buf[2] == 'i' && buf[3] == 'x') {
         *pformat = IFF_SPIX;
@@ -374,6 +385,145 @@ l_uint16  twobytepw;
 }
 
 
+/*---------------------------------------------------------------------*
+ *                            Read from memory                         *
+ *---------------------------------------------------------------------*/
+/*!
+ *  pixReadMem()
+ *
+ *      Input:  data (const; encoded)
+ *              datasize (size of data)
+ *      Return: pix, or null on error
+ *
+ *  Notes:
+ *      (1) This is a variation of pixReadStream(), where the data is
+ *          read from a memory buffer rather than a file, e.g. one
+ *          that the file has been mapped to.
+ *      (2) Only png, pnm and gzipped pnm can be read this way; without fmemopen()
+ *          the other formats need a file stream.
+ */
+LEPTONICA_REAL_EXPORT PIX *
+pixReadMem(const l_uint8  *data,
+           size_t          size)
+{
+l_int32  format;
+PIX     *pix;
+
+    PROCNAME("pixReadMem");
+
+    if (!data)
+        return (PIX *)ERROR_PTR("data not defined", procName, NULL);
+    if (size < 12)
+        return (PIX *)ERROR_PTR("size < 12", procName, NULL);
+    pix = NULL;
+
+    findFileFormatBuffer(data, &format);
+    switch (format)
+    {
+    case IFF_PNG:
+        if ((pix = pixReadMemPng(data, size)) == NULL)
+            return (PIX *)ERROR_PTR("png: no pix returned", procName, NULL);
+        break;
+
+    case IFF_PNM:
+        if ((pix = pixReadMemPnm(data, size)) == NULL)
+            return (PIX *)ERROR_PTR("pnm: no pix returned", procName, NULL);
+        break;
+
+    case IFF_PNM_GZ:
+        if ((pix = pixReadMemPnmGz(data, size)) == NULL)
+            return (PIX *)ERROR_PTR("pnm.gz: no pix returned", procName, NULL);
+        break;
+
+    case IFF_UNKNOWN:
+        return (PIX *)ERROR_PTR("Unknown format: no pix returned",
+                procName, NULL);
+        break;
+
+    default:
+        return (PIX *)ERROR_PTR("format not readable from memory",
+                procName, NULL);
+        break;
+    }
+
+    if (pix)
+        pixSetInputFormat(pix, format);
+    return pix;
+}
+
+/*!
+ *  pixReadHeaderMem()
+ *
+ *      Input:  data (const; encoded)
+ *              size (size of data)
+ *              &format (<return> image format)
+ *              &w, &h (<optional returns> width and height)
+ *              &bps <optional return> bits/sample
+ *              &spp <optional return> samples/pixel (1 to 4)
+ *              &iscmap (<optional return> 1 if cmap exists; 0 otherwise)
+ *      Return: 0 if OK, 1 on error
+ *
+ *  Notes:
+ *      (1) This reads the header of the image which pixReadMem() would
+ *          read, without decoding it.  Only png and pnm headers can be
+ *          read this way: for other formats, including gzipped pnm,
+ *          only the format is returned, with 1 and no error message.
+ */
+LEPTONICA_REAL_EXPORT l_int32
+pixReadHeaderMem(const l_uint8  *data,
+                 size_t          size,
+                 l_int32        *pformat,
+                 l_int32        *pw,
+                 l_int32        *ph,
+                 l_int32        *pbps,
+                 l_int32        *pspp,
+                 l_int32        *piscmap)
+{
+l_int32  format, w, h, d, bps, spp, iscmap, type;
+
+    PROCNAME("pixReadHeaderMem");
+
+    if (pw) *pw = 0;
+    if (ph) *ph = 0;
+    if (pbps) *pbps = 0;
+    if (pspp) *pspp = 0;
+    if (piscmap) *piscmap = 0;
+    if (!pformat)
+        return ERROR_INT("&format not defined", procName, 1);
+    *pformat = IFF_UNKNOWN;
+    if (!data)
+        return ERROR_INT("data not defined", procName, 1);
+    if (size < 12)
+        return ERROR_INT("size < 12", procName, 1);
+
+    findFileFormatBuffer(data, &format);
+    *pformat = format;
+    iscmap = 0;
+    switch (format)
+    {
+    case IFF_PNG:
+        if (sreadHeaderPng(data, size, &w, &h, &bps, &spp, &iscmap))
+            return ERROR_INT("png: no header info returned", procName, 1);
+        break;
+
+    case IFF_PNM:
+        if (sreadHeaderPnm(data, size, &w, &h, &d, &type, &bps, &spp))
+            return ERROR_INT("pnm: no header info returned", procName, 1);
+        break;
+
+    default:
+        return 1;
+    }
+
+    if (pw) *pw = w;
+    if (ph) *ph = h;
+    if (pbps) *pbps = bps;
+    if (pspp) *pspp = spp;
+    if (piscmap) *piscmap = iscmap;
+    return 0;
+}
+
+
 /*---------------------------------------------------------------------*
  *             Test function for I/O with different formats            *
  *---------------------------------------------------------------------*/
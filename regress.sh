@@ -0,0 +1,102 @@
+#! /bin/bash --
+# Checks that jbig2 still makes exactly the expected output for each page of
+# the corpus in regress/ and each set of options below, and prints the speed
+# of each run next to the speed recorded with the expected output.
+#
+# Usage: ./regress.sh [--update] [-n <runs>] [<jbig2 binary>]
+#
+# The binary defaults to ./jbig2.halfstatic (see c-halfstatic.sh), which has
+# the zlib and libpng of this tree built in, so the output doesn't depend on
+# the libraries installed. The speed is the best of <runs> (def: 3) runs, in
+# Mpix/s as reported by --stats=json. --update rewrites regress/expected.txt
+# with the output and the speed of this run instead of checking them.
+set -e
+
+update=false
+runs=3
+while [ $# -gt 0 ]; do
+  case "$1" in
+    --update) update=true; shift ;;
+    -n) runs="$2"; shift 2 ;;
+    *) break ;;
+  esac
+done
+jbig2="${1:-./jbig2.halfstatic}"
+dir="$(dirname "$0")/regress"
+expected="$dir/expected.txt"
+
+# The option sets; _ is for none
+optsets=(_ -d -p -2 -4 '-T 128')
+
+# The raw streams (see --raw), each with the only options it is run with
+rawsets=('g4-vl1-start.ccitt	--raw ccitt:8x2,k=-1')
+
+if [ ! -x "$jbig2" ]; then
+  echo "$0: no jbig2 binary at $jbig2" >&2
+  exit 2
+fi
+
+tmp="$(mktemp -d)"
+trap 'rm -rf "$tmp"' EXIT
+out="$tmp/expected.txt"
+echo "# options	file	sha1 of output	exit status	Mpix/s" >"$out"
+
+failed=0
+total=0
+
+# Run jbig2 with the options opts (_ for none) on page, and check the result
+check() {
+  local opts="$1" page="$2"
+  local args="$opts" name best speed status sha line want was result
+  [ "$args" = _ ] && args=
+  name="$(basename "$page")"
+  best=0
+  for ((run = 0; run < runs; ++run)); do
+    status=0
+    $jbig2 $args --stats=json "$page" >"$tmp/out" 2>"$tmp/err" || status=$?
+    speed="$(sed -n 's/.*"pixels_per_second": \([0-9.e+-]*\).*/\1/p' \
+             "$tmp/err")"
+    speed="$(awk -v s="${speed:-0}" -v b="$best" \
+             'BEGIN { s /= 1e6; print (s > b ? s : b) }')"
+    best="$speed"
+  done
+  sha="$(sha1sum <"$tmp/out" | cut -d' ' -f1)"
+  best="$(printf '%.2f' "$best")"
+  printf '%s\t%s\t%s\t%s\t%s\n' "$opts" "$name" "$sha" "$status" "$best" \
+      >>"$out"
+  total=$((total + 1))
+  $update && return 0
+
+  line="$(awk -F'\t' -v o="$opts" -v n="$name" \
+          '$1 == o && $2 == n' "$expected")"
+  want="$(printf '%s' "$line" | cut -f3-4)"
+  was="$(printf '%s' "$line" | cut -f5)"
+  if [ -z "$line" ]; then
+    result=NEW
+    failed=$((failed + 1))
+  elif [ "$want" != "$sha	$status" ]; then
+    result=FAIL
+    failed=$((failed + 1))
+  else
+    result=ok
+  fi
+  printf '%-4s %-8s %-14s %8s Mpix/s (was %s)\n' "$result" "$opts" "$name" \
+      "$best" "${was:--}"
+}
+
+for opts in "${optsets[@]}"; do
+  for page in "$dir"/*.png "$dir"/*.p[bgp]m "$dir"/*.pnm.gz "$dir"/*.tif; do
+    check "$opts" "$page"
+  done
+done
+for rawset in "${rawsets[@]}"; do
+  check "${rawset#*	}" "$dir/${rawset%%	*}"
+done
+
+if $update; then
+  cp "$out" "$expected"
+  echo "Wrote $total results to $expected"
+  exit 0
+fi
+echo "$((total - failed)) of $total ok"
+[ "$failed" = 0 ]
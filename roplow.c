@@ -196,7 +196,7 @@ l_int32    i, j;
     lwbits = dw & 31;
     if (lwbits)
         lwmask = lmask32[lwbits];
-    pfword = datad + dwpl * dy + (dx >> 5);
+    pfword = datad + (size_t)dwpl * dy + (dx >> 5);
     
 
     /*--------------------------------------------------------*
@@ -274,7 +274,7 @@ l_int32    i, j;
         dfwpartb = 1;
         dfwbits = 32 - (dx & 31);
         dfwmask = rmask32[dfwbits];
-        pdfwpart = datad + dwpl * dy + (dx >> 5);
+        pdfwpart = datad + (size_t)dwpl * dy + (dx >> 5);
     }
 
         /* is the first word doubly partial? */
@@ -299,7 +299,7 @@ l_int32    i, j;
             if (dfwpartb)
                 pdfwfull = pdfwpart + 1;
             else
-                pdfwfull = datad + dwpl * dy + (dx >> 5);
+                pdfwfull = datad + (size_t)dwpl * dy + (dx >> 5);
         }
     }
 
@@ -313,7 +313,7 @@ l_int32    i, j;
         if (dfwpartb)
             pdlwpart = pdfwpart + 1 + dnfullw;
         else
-            pdlwpart = datad + dwpl * dy + (dx >> 5) + dnfullw;
+            pdlwpart = datad + (size_t)dwpl * dy + (dx >> 5) + dnfullw;
     }
 
 
@@ -79,6 +79,9 @@
  *               PIX    *pixScaleGray4xLIThresh()
  *               PIX    *pixScaleGray4xLIDither()
  *
+ *         Binary downscale 2x and 4x by rank
+ *               PIX    *pixReduceRankBinary()
+ *
  *         Grayscale downscaling using min and max
  *               PIX    *pixScaleGrayMinMax()
  *               PIX    *pixScaleGrayMinMax2()
@@ -100,6 +103,37 @@
 
 extern l_float32  AlphaMaskBorderVals[2];
 
+static void scaleGray2xLIThreshBand(void *arg, l_int32 y0, l_int32 y1);
+static void scaleGray4xLIThreshBand(void *arg, l_int32 y0, l_int32 y1);
+static void reduceRankBinaryBand(void *arg, l_int32 y0, l_int32 y1);
+
+    /* Arguments of scaleGray*xLIThreshBand() */
+struct ScaleBands
+{
+    l_uint32  *datad;
+    l_int32    wpld;
+    l_uint32  *datas;
+    l_int32    ws;
+    l_int32    hs;
+    l_int32    wpls;
+    l_int32    thresh;
+};
+
+    /* Arguments of reduceRankBinaryBand() */
+struct ReduceBands
+{
+    l_uint32  *datad;
+    l_int32    wpld;
+    l_uint32  *datas;
+    l_int32    hs;
+    l_int32    wpls;
+    l_uint32   lastmask;
+    l_int32    factor;
+    l_int32    level;
+    l_uint8   *tab2;
+    l_uint16  *tab4;
+};
+
 /*------------------------------------------------------------------*
  *                Scale 2x followed by binarization                 *
  *------------------------------------------------------------------*/
@@ -113,15 +147,16 @@ extern l_float32  AlphaMaskBorderVals[2];
  *  Notes:
  *      (1) This does 2x upscale on pixs, using linear interpolation,
  *          followed by thresholding to binary.
- *      (2) Buffers are used to avoid making a large grayscale image.
+ *      (2) The interpolated gray values are thresholded as they are
+ *          made, so no grayscale image or line buffer is needed.
  */
 LEPTONICA_REAL_EXPORT PIX *
 pixScaleGray2xLIThresh(PIX     *pixs,
                        l_int32  thresh)
 {
-l_int32    i, ws, hs, hsm, wd, hd, wpls, wplb, wpld;
-l_uint32  *datas, *datad, *lines, *lined, *lineb;
-PIX       *pixd;
+l_int32              ws, hs, wd, hd;
+struct ScaleBands   sb;
+PIX                 *pixd;
 
     PROCNAME("pixScaleGray2xLIThresh");
 
@@ -138,44 +173,45 @@ PIX       *pixd;
     pixGetDimensions(pixs, &ws, &hs, NULL);
     wd = 2 * ws;
     hd = 2 * hs;
-    hsm = hs - 1;
-    datas = pixGetData(pixs);
-    wpls = pixGetWpl(pixs);
-
-        /* Make line buffer for 2 lines of virtual intermediate image */
-    wplb = (wd + 3) / 4;
-    if ((lineb = (l_uint32 *)CALLOC(2 * wplb, sizeof(l_uint32))) == NULL)
-        return (PIX *)ERROR_PTR("lineb not made", procName, NULL);
 
         /* Make dest binary image */
-    if ((pixd = pixCreate(wd, hd, 1)) == NULL)
+    if ((pixd = pixCreateNoInit(wd, hd, 1)) == NULL)
         return (PIX *)ERROR_PTR("pixd not made", procName, NULL);
     pixCopyResolution(pixd, pixs);
     pixScaleResolution(pixd, 2.0, 2.0);
-    wpld = pixGetWpl(pixd);
-    datad = pixGetData(pixd);
-
-        /* Do all but last src line */
-    for (i = 0; i < hsm; i++) {
-        lines = datas + i * wpls;
-        lined = datad + 2 * i * wpld;  /* do 2 dest lines at a time */
-        scaleGray2xLILineLow(lineb, wplb, lines, ws, wpls, 0);
-        thresholdToBinaryLineLow(lined, wd, lineb, 8, thresh);
-        thresholdToBinaryLineLow(lined + wpld, wd, lineb + wplb, 8, thresh);
-    }
-
-        /* Do last src line */
-    lines = datas + hsm * wpls;
-    lined = datad + 2 * hsm * wpld;
-    scaleGray2xLILineLow(lineb, wplb, lines, ws, wpls, 1);
-    thresholdToBinaryLineLow(lined, wd, lineb, 8, thresh);
-    thresholdToBinaryLineLow(lined + wpld, wd, lineb + wplb, 8, thresh);
 
-    FREE(lineb);
+        /* Each src line makes 2 dest lines, so the src lines can be
+         * split into bands that are done in parallel */
+    sb.datad = pixGetData(pixd);
+    sb.wpld = pixGetWpl(pixd);
+    sb.datas = pixGetData(pixs);
+    sb.ws = ws;
+    sb.hs = hs;
+    sb.wpls = pixGetWpl(pixs);
+    sb.thresh = thresh;
+    runRowBands(wd * 2, hs, scaleGray2xLIThreshBand, &sb);
     return pixd;
 }
 
 
+static void
+scaleGray2xLIThreshBand(void    *arg,
+                         l_int32  y0,
+                         l_int32  y1)
+{
+l_int32             i;
+struct ScaleBands  *sb;
+
+    sb = (struct ScaleBands *)arg;
+    for (i = y0; i < y1; i++) {
+        scaleGray2xLIThreshLineLow(sb->datad + 2 * i * sb->wpld, sb->wpld,
+                                   sb->datas + i * sb->wpls, sb->ws, sb->wpls,
+                                   i == sb->hs - 1, sb->thresh);
+    }
+    return;
+}
+
+
 /*------------------------------------------------------------------*
  *                Scale 4x followed by binarization                 *
  *------------------------------------------------------------------*/
@@ -189,19 +225,16 @@ PIX       *pixd;
  *  Notes:
  *      (1) This does 4x upscale on pixs, using linear interpolation,
  *          followed by thresholding to binary.
- *      (2) Buffers are used to avoid making a large grayscale image.
- *      (3) If a full 4x expanded grayscale image can be kept in memory,
- *          this function is only about 10% faster than separately doing
- *          a linear interpolation to a large grayscale image, followed
- *          by thresholding to binary.
+ *      (2) The interpolated gray values are thresholded as they are
+ *          made, so no grayscale image or line buffer is needed.
  */
 LEPTONICA_REAL_EXPORT PIX *
 pixScaleGray4xLIThresh(PIX     *pixs,
                        l_int32  thresh)
 {
-l_int32    i, j, ws, hs, hsm, wd, hd, wpls, wplb, wpld;
-l_uint32  *datas, *datad, *lines, *lined, *lineb;
-PIX       *pixd;
+l_int32              ws, hs, wd, hd;
+struct ScaleBands   sb;
+PIX                 *pixd;
 
     PROCNAME("pixScaleGray4xLIThresh");
 
@@ -218,43 +251,148 @@ PIX       *pixd;
     pixGetDimensions(pixs, &ws, &hs, NULL);
     wd = 4 * ws;
     hd = 4 * hs;
-    hsm = hs - 1;
-    datas = pixGetData(pixs);
-    wpls = pixGetWpl(pixs);
-
-        /* Make line buffer for 4 lines of virtual intermediate image */
-    wplb = (wd + 3) / 4;
-    if ((lineb = (l_uint32 *)CALLOC(4 * wplb, sizeof(l_uint32))) == NULL)
-        return (PIX *)ERROR_PTR("lineb not made", procName, NULL);
 
         /* Make dest binary image */
-    if ((pixd = pixCreate(wd, hd, 1)) == NULL)
+    if ((pixd = pixCreateNoInit(wd, hd, 1)) == NULL)
         return (PIX *)ERROR_PTR("pixd not made", procName, NULL);
     pixCopyResolution(pixd, pixs);
     pixScaleResolution(pixd, 4.0, 4.0);
-    wpld = pixGetWpl(pixd);
-    datad = pixGetData(pixd);
-
-        /* Do all but last src line */
-    for (i = 0; i < hsm; i++) {
-        lines = datas + i * wpls;
-        lined = datad + 4 * i * wpld;  /* do 4 dest lines at a time */
-        scaleGray4xLILineLow(lineb, wplb, lines, ws, wpls, 0);
-        for (j = 0; j < 4; j++) {
-            thresholdToBinaryLineLow(lined + j * wpld, wd,
-                                     lineb + j * wplb, 8, thresh);
-        }
+
+        /* Each src line makes 4 dest lines, so the src lines can be
+         * split into bands that are done in parallel */
+    sb.datad = pixGetData(pixd);
+    sb.wpld = pixGetWpl(pixd);
+    sb.datas = pixGetData(pixs);
+    sb.ws = ws;
+    sb.hs = hs;
+    sb.wpls = pixGetWpl(pixs);
+    sb.thresh = thresh;
+    runRowBands(wd * 4, hs, scaleGray4xLIThreshBand, &sb);
+    return pixd;
+}
+
+
+static void
+scaleGray4xLIThreshBand(void    *arg,
+                         l_int32  y0,
+                         l_int32  y1)
+{
+l_int32             i;
+struct ScaleBands  *sb;
+
+    sb = (struct ScaleBands *)arg;
+    for (i = y0; i < y1; i++) {
+        scaleGray4xLIThreshLineLow(sb->datad + 4 * i * sb->wpld, sb->wpld,
+                                   sb->datas + i * sb->wpls, sb->ws, sb->wpls,
+                                   i == sb->hs - 1, sb->thresh);
     }
+    return;
+}
+
+
+/*------------------------------------------------------------------*
+ *                Binary downscale 2x and 4x by rank                *
+ *------------------------------------------------------------------*/
+/*!
+ *  pixReduceRankBinary()
+ *
+ *      Input:  pixs (1 bpp)
+ *              factor (2 or 4)
+ *              level (rank threshold: 1 ... factor^2)
+ *      Return: pixd (1 bpp), or null on error
+ *
+ *  Notes:
+ *      (1) Each dest pixel is made from a factor x factor block of src
+ *          pixels, and is 1 if at least level of them are.  With level
+ *          1 this is the OR of the block, which keeps every stroke;
+ *          higher levels drop thin ones and specks.
+ *      (2) The dest is ceil(w / factor) x ceil(h / factor): the blocks
+ *          at the right and bottom edges which stick out of pixs have
+ *          white pixels there.
+ *      (3) The resolution is divided by factor.
+ *      (4) The work is done a src word at a time, with lookup tables,
+ *          in parallel row bands (see runRowBands()).
+ */
+LEPTONICA_REAL_EXPORT PIX *
+pixReduceRankBinary(PIX     *pixs,
+                    l_int32  factor,
+                    l_int32  level)
+{
+l_int32              ws, hs, wd, hd;
+struct ReduceBands  rb;
+PIX                 *pixd;
+
+    PROCNAME("pixReduceRankBinary");
 
-        /* Do last src line */
-    lines = datas + hsm * wpls;
-    lined = datad + 4 * hsm * wpld;
-    scaleGray4xLILineLow(lineb, wplb, lines, ws, wpls, 1);
-    for (j = 0; j < 4; j++) {
-        thresholdToBinaryLineLow(lined + j * wpld, wd,
-                                 lineb + j * wplb, 8, thresh);
+    if (!pixs)
+        return (PIX *)ERROR_PTR("pixs not defined", procName, NULL);
+    if (pixGetDepth(pixs) != 1)
+        return (PIX *)ERROR_PTR("pixs must be 1 bpp", procName, NULL);
+    if (factor != 2 && factor != 4)
+        return (PIX *)ERROR_PTR("factor not 2 or 4", procName, NULL);
+    if (level < 1 || level > factor * factor)
+        return (PIX *)ERROR_PTR("level not in [1, ... factor^2]",
+            procName, NULL);
+
+    pixGetDimensions(pixs, &ws, &hs, NULL);
+    wd = (ws + factor - 1) / factor;
+    hd = (hs + factor - 1) / factor;
+    if ((pixd = pixCreateNoInit(wd, hd, 1)) == NULL)
+        return (PIX *)ERROR_PTR("pixd not made", procName, NULL);
+    pixCopyResolution(pixd, pixs);
+    pixScaleResolution(pixd, 1.0 / factor, 1.0 / factor);
+
+    rb.datad = pixGetData(pixd);
+    rb.wpld = pixGetWpl(pixd);
+    rb.datas = pixGetData(pixs);
+    rb.hs = hs;
+    rb.wpls = pixGetWpl(pixs);
+    rb.lastmask = (ws & 31) ? 0xffffffff << (32 - (ws & 31)) : 0xffffffff;
+    rb.factor = factor;
+    rb.level = level;
+    rb.tab2 = NULL;
+    rb.tab4 = NULL;
+    if ((factor == 2 && (rb.tab2 = makeSubsampleTab2x()) == NULL) ||
+        (factor == 4 && (rb.tab4 = makeCountTab4x()) == NULL)) {
+        pixDestroy(&pixd);
+        return (PIX *)ERROR_PTR("tab not made", procName, NULL);
     }
 
-    FREE(lineb);
+        /* Each dest line is made from its own src lines, so the dest
+         * lines can be split into bands that are done in parallel */
+    runRowBands(ws * factor, hd, reduceRankBinaryBand, &rb);
+    if (rb.tab2)
+        FREE(rb.tab2);
+    if (rb.tab4)
+        FREE(rb.tab4);
     return pixd;
 }
+
+
+static void
+reduceRankBinaryBand(void    *arg,
+                     l_int32  y0,
+                     l_int32  y1)
+{
+l_int32              i, nlines;
+l_uint32            *lines;
+struct ReduceBands  *rb;
+
+    rb = (struct ReduceBands *)arg;
+    for (i = y0; i < y1; i++) {
+        lines = rb->datas + rb->factor * i * rb->wpls;
+        nlines = L_MIN(rb->factor, rb->hs - rb->factor * i);
+        if (rb->factor == 2) {
+            reduceRankBinary2LineLow(rb->datad + i * rb->wpld, lines,
+                                     (nlines == 2) ? lines + rb->wpls : NULL,
+                                     rb->wpls, rb->lastmask, rb->level,
+                                     rb->tab2);
+        }
+        else {
+            reduceRankBinary4LineLow(rb->datad + i * rb->wpld, lines, nlines,
+                                     rb->wpls, rb->lastmask, rb->level,
+                                     rb->tab4);
+        }
+    }
+    return;
+}
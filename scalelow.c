@@ -27,13 +27,15 @@
  *                  void       scaleColor2xLILow()
  *                  void       scaleColor2xLILineLow()
  *
- *         Grayscale (interpolated) scaling: 2x upscaling
- *                  void       scaleGray2xLILow()
- *                  void       scaleGray2xLILineLow()
+ *         Grayscale (interpolated) 2x and 4x upscaling to binary
+ *                  void       scaleGray2xLIThreshLineLow()
+ *                  void       scaleGray4xLIThreshLineLow()
  *
- *         Grayscale (interpolated) scaling: 4x upscaling
- *                  void       scaleGray4xLILow()
- *                  void       scaleGray4xLILineLow()
+ *         Binary 2x and 4x downscaling by rank
+ *                  void       reduceRankBinary2LineLow()
+ *                  void       reduceRankBinary4LineLow()
+ *                  l_uint8   *makeSubsampleTab2x()
+ *                  l_uint16  *makeCountTab4x()
  *
  *         Grayscale and color scaling by closest pixel sampling
  *                  l_int32    scaleBySamplingLow()
@@ -86,6 +88,10 @@
 #include <string.h>
 #include "allheaders.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif  /* __SSE2__ */
+
 #ifndef  NO_CONSOLE_IO
 #define  DEBUG_OVERFLOW   0
 #define  DEBUG_UNROLLING  0
@@ -93,11 +99,59 @@
 
 
 /*------------------------------------------------------------------*
- *                2x linear interpolated gray scaling               *
+ *       2x and 4x linear interpolated gray scaling to binary       *
  *------------------------------------------------------------------*/
+/*
+ *  The dest pixel in row k and column c (0 <= k, c < f) of the f x f
+ *  block made from src pixel s1, with s2 to its right, s3 below and
+ *  s4 below s2, has the value [W / f^2], with
+ *      W = (f - c) * top + c * topr
+ *      top = (f - k) * s1 + k * s3,   topr = (f - k) * s2 + k * s4
+ *  which is what Leptonica's scaleGray2xLILineLow() and
+ *  scaleGray4xLILineLow() compute.  (At the right edge s2 = s1 and
+ *  s4 = s3, and on the last line s3 = s1 and s4 = s2.)  So the dest
+ *  bit, which is 1 if the value is less than thresh, is 1 if
+ *  W < f^2 * thresh, and the gray lines never have to be made.
+ */
+#if defined(__SSE2__)
+    /* Swap the bytes of each word, giving the 16 pixels in order */
+static __m128i
+swapBytesSSE2(__m128i  x)
+{
+    x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+    x = _mm_shufflelo_epi16(x, _MM_SHUFFLE(2, 3, 0, 1));
+    return _mm_shufflehi_epi16(x, _MM_SHUFFLE(2, 3, 0, 1));
+}
+
+    /* Load src pixels j, ..., j + 15 into *pv and j + 1, ..., j + 16
+     * into *pv1, as bytes in pixel order */
+static void
+loadPixelsSSE2(l_uint32  *line,
+               l_int32    j,
+               __m128i   *pv,
+               __m128i   *pv1)
+{
+    *pv = swapBytesSSE2(_mm_loadu_si128((const __m128i *)(line + j / 4)));
+    *pv1 = _mm_or_si128(_mm_srli_si128(*pv, 1),
+               _mm_slli_si128(_mm_cvtsi32_si128(GET_DATA_BYTE(line, j + 16)),
+                              15));
+}
+
+    /* Bit 31 - i of the result is bit i of the 32 bit mask */
+static l_uint32
+reverseBits32(l_uint32  x)
+{
+    x = ((x >> 1) & 0x55555555) | ((x & 0x55555555) << 1);
+    x = ((x >> 2) & 0x33333333) | ((x & 0x33333333) << 2);
+    x = ((x >> 4) & 0x0f0f0f0f) | ((x & 0x0f0f0f0f) << 4);
+    x = ((x >> 8) & 0x00ff00ff) | ((x & 0x00ff00ff) << 8);
+    return (x >> 16) | (x << 16);
+}
+#endif  /* __SSE2__ */
+
 
 /*!
- *  scaleGray2xLILineLow()
+ *  scaleGray2xLIThreshLineLow()
  *
  *      Input:  lined   (ptr to top destline, to be made from current src line)
  *              wpld
@@ -105,153 +159,120 @@
  *              ws
  *              wpls
  *              lastlineflag  (1 if last src line; 0 otherwise)
+ *              thresh  (dest bit is 1 for interpolated values < thresh)
  *      Return: void
+ *
+ *  Notes:
+ *      (1) This makes the 2 lines of 1 bpp dest with the same bits as
+ *          2x linear interpolation followed by thresholdToBinaryLineLow(),
+ *          without making the 8 bpp lines.  The last word of each dest
+ *          line is written in full, with the pad bits cleared.
  */
 LEPTONICA_EXPORT void
-scaleGray2xLILineLow(l_uint32  *lined,
-                     l_int32    wpld,
-                     l_uint32  *lines,
-                     l_int32    ws,
-                     l_int32    wpls,
-                     l_int32    lastlineflag)
+scaleGray2xLIThreshLineLow(l_uint32  *lined,
+                           l_int32    wpld,
+                           l_uint32  *lines,
+                           l_int32    ws,
+                           l_int32    wpls,
+                           l_int32    lastlineflag,
+                           l_int32    thresh)
 {
-l_int32    j, jd, wsm, w;
-l_int32    sval1, sval2, sval3, sval4;
+l_int32    j, jd, wsm, t4, s1, s2, s3, s4, top, topr;
+l_uint32   dword0, dword1;
 l_uint32  *linesp, *linedp;
-l_uint32   words, wordsp, wordd, worddp;
 
     wsm = ws - 1;
+    linesp = (lastlineflag) ? lines : lines + wpls;
+    linedp = lined + wpld;
+    t4 = 4 * thresh;
+    j = 0;
+
+#if defined(__SSE2__)
+    if (cpuGetLevel() >= L_CPU_SSE2) {
+    l_int32  h;
+    __m128i  zero, thr, a, a1, p, p1, s1v, s2v, dy, dyr, topv, toprv, m0, m1;
+
+        /* 16 src pixels, making 1 dest word in each line, at a time */
+    zero = _mm_setzero_si128();
+    thr = _mm_set1_epi16(t4);
+    for (; j + 16 <= wsm; j += 16) {
+        loadPixelsSSE2(lines, j, &a, &a1);
+        loadPixelsSSE2(linesp, j, &p, &p1);
+        dword0 = dword1 = 0;
+        for (h = 0; h < 2; h++) {
+            if (h == 0) {
+                s1v = _mm_unpacklo_epi8(a, zero);
+                s2v = _mm_unpacklo_epi8(a1, zero);
+                dy = _mm_sub_epi16(_mm_unpacklo_epi8(p, zero), s1v);
+                dyr = _mm_sub_epi16(_mm_unpacklo_epi8(p1, zero), s2v);
+            }
+            else {
+                s1v = _mm_unpackhi_epi8(a, zero);
+                s2v = _mm_unpackhi_epi8(a1, zero);
+                dy = _mm_sub_epi16(_mm_unpackhi_epi8(p, zero), s1v);
+                dyr = _mm_sub_epi16(_mm_unpackhi_epi8(p1, zero), s2v);
+            }
 
-    if (lastlineflag == 0) {
-        linesp = lines + wpls;
-        linedp = lined + wpld;
-
-            /* Unroll the loop 4x and work on full words */
-        words = lines[0];
-        wordsp = linesp[0];
-        sval2 = (words >> 24) & 0xff;
-        sval4 = (wordsp >> 24) & 0xff;
-        for (j = 0, jd = 0, w = 0; j + 3 < wsm; j += 4, jd += 8, w++) {
-                /* At the top of the loop,
-                 * words == lines[w], wordsp == linesp[w]
-                 * and the top bytes of those have been loaded into
-                 * sval2 and sval4. */
-            sval1 = sval2;
-            sval2 = (words >> 16) & 0xff;
-            sval3 = sval4;
-            sval4 = (wordsp >> 16) & 0xff;
-            wordd = (sval1 << 24) | (((sval1 + sval2) >> 1) << 16);
-            worddp = (((sval1 + sval3) >> 1) << 24) |
-                (((sval1 + sval2 + sval3 + sval4) >> 2) << 16);
-
-            sval1 = sval2;
-            sval2 = (words >> 8) & 0xff;
-            sval3 = sval4;
-            sval4 = (wordsp >> 8) & 0xff;
-            wordd |= (sval1 << 8) | ((sval1 + sval2) >> 1);
-            worddp |= (((sval1 + sval3) >> 1) << 8) |
-                ((sval1 + sval2 + sval3 + sval4) >> 2);
-            lined[w * 2] = wordd;
-            linedp[w * 2] = worddp;
-
-            sval1 = sval2;
-            sval2 = words & 0xff;
-            sval3 = sval4;
-            sval4 = wordsp & 0xff;
-            wordd = (sval1 << 24) |                              /* pix 1 */
-                (((sval1 + sval2) >> 1) << 16);                  /* pix 2 */
-            worddp = (((sval1 + sval3) >> 1) << 24) |            /* pix 3 */
-                (((sval1 + sval2 + sval3 + sval4) >> 2) << 16);  /* pix 4 */
-
-                /* Load the next word as we need its first byte */
-            words = lines[w + 1];
-            wordsp = linesp[w + 1];
-            sval1 = sval2;
-            sval2 = (words >> 24) & 0xff;
-            sval3 = sval4;
-            sval4 = (wordsp >> 24) & 0xff;
-            wordd |= (sval1 << 8) |                              /* pix 1 */
-                ((sval1 + sval2) >> 1);                          /* pix 2 */
-            worddp |= (((sval1 + sval3) >> 1) << 8) |            /* pix 3 */
-                ((sval1 + sval2 + sval3 + sval4) >> 2);          /* pix 4 */
-            lined[w * 2 + 1] = wordd;
-            linedp[w * 2 + 1] = worddp;
+                /* Row 0 */
+            topv = _mm_add_epi16(s1v, s1v);
+            toprv = _mm_add_epi16(s2v, s2v);
+            m0 = _mm_cmplt_epi16(_mm_add_epi16(topv, topv), thr);
+            m1 = _mm_cmplt_epi16(_mm_add_epi16(topv, toprv), thr);
+            dword0 |= (l_uint32)_mm_movemask_epi8(_mm_packs_epi16(
+                          _mm_unpacklo_epi16(m0, m1),
+                          _mm_unpackhi_epi16(m0, m1))) << (16 * h);
+
+                /* Row 1 */
+            topv = _mm_add_epi16(topv, dy);
+            toprv = _mm_add_epi16(toprv, dyr);
+            m0 = _mm_cmplt_epi16(_mm_add_epi16(topv, topv), thr);
+            m1 = _mm_cmplt_epi16(_mm_add_epi16(topv, toprv), thr);
+            dword1 |= (l_uint32)_mm_movemask_epi8(_mm_packs_epi16(
+                          _mm_unpacklo_epi16(m0, m1),
+                          _mm_unpackhi_epi16(m0, m1))) << (16 * h);
         }
+        lined[j / 16] = reverseBits32(dword0);
+        linedp[j / 16] = reverseBits32(dword1);
+    }
+    }
+#endif  /* __SSE2__ */
 
-            /* Finish up the last word */
-        for (; j < wsm; j++, jd += 2) {
-            sval1 = sval2;
-            sval3 = sval4;
-            sval2 = GET_DATA_BYTE(lines, j + 1);
-            sval4 = GET_DATA_BYTE(linesp, j + 1);
-            SET_DATA_BYTE(lined, jd, sval1);                     /* pix 1 */
-            SET_DATA_BYTE(lined, jd + 1, (sval1 + sval2) / 2);   /* pix 2 */
-            SET_DATA_BYTE(linedp, jd, (sval1 + sval3) / 2);      /* pix 3 */
-            SET_DATA_BYTE(linedp, jd + 1,
-                          (sval1 + sval2 + sval3 + sval4) / 4);  /* pix 4 */
+        /* The rest, a pixel at a time; 2 * j is at a word boundary */
+    dword0 = dword1 = 0;
+    for (jd = 2 * j; j < ws; j++) {
+        s1 = GET_DATA_BYTE(lines, j);
+        s3 = GET_DATA_BYTE(linesp, j);
+        if (j < wsm) {
+            s2 = GET_DATA_BYTE(lines, j + 1);
+            s4 = GET_DATA_BYTE(linesp, j + 1);
+        }
+        else {
+            s2 = s1;
+            s4 = s3;
         }
-        sval1 = sval2;
-        sval3 = sval4;
-        SET_DATA_BYTE(lined, 2 * wsm, sval1);                     /* pix 1 */
-        SET_DATA_BYTE(lined, 2 * wsm + 1, sval1);                 /* pix 2 */
-        SET_DATA_BYTE(linedp, 2 * wsm, (sval1 + sval3) / 2);      /* pix 3 */
-        SET_DATA_BYTE(linedp, 2 * wsm + 1, (sval1 + sval3) / 2);  /* pix 4 */
-
-#if DEBUG_UNROLLING
-#define CHECK_BYTE(a, b, c) if (GET_DATA_BYTE(a, b) != c) {\
-     fprintf(stderr, "Error: mismatch at %d, %d vs %d\n", \
-             j, GET_DATA_BYTE(a, b), c); }
-
-        sval2 = GET_DATA_BYTE(lines, 0);
-        sval4 = GET_DATA_BYTE(linesp, 0);
-        for (j = 0, jd = 0; j < wsm; j++, jd += 2) {
-            sval1 = sval2;
-            sval3 = sval4;
-            sval2 = GET_DATA_BYTE(lines, j + 1);
-            sval4 = GET_DATA_BYTE(linesp, j + 1);
-            CHECK_BYTE(lined, jd, sval1);                     /* pix 1 */
-            CHECK_BYTE(lined, jd + 1, (sval1 + sval2) / 2);   /* pix 2 */
-            CHECK_BYTE(linedp, jd, (sval1 + sval3) / 2);      /* pix 3 */
-            CHECK_BYTE(linedp, jd + 1,
-                          (sval1 + sval2 + sval3 + sval4) / 4);  /* pix 4 */
+        top = 2 * s1;
+        topr = 2 * s2;
+        dword0 = (dword0 << 2) | ((2 * top < t4) << 1) | (top + topr < t4);
+        top = s1 + s3;
+        topr = s2 + s4;
+        dword1 = (dword1 << 2) | ((2 * top < t4) << 1) | (top + topr < t4);
+        jd += 2;
+        if ((jd & 31) == 0) {
+            lined[jd / 32 - 1] = dword0;
+            linedp[jd / 32 - 1] = dword1;
+            dword0 = dword1 = 0;
         }
-        sval1 = sval2;
-        sval3 = sval4;
-        CHECK_BYTE(lined, 2 * wsm, sval1);                     /* pix 1 */
-        CHECK_BYTE(lined, 2 * wsm + 1, sval1);                 /* pix 2 */
-        CHECK_BYTE(linedp, 2 * wsm, (sval1 + sval3) / 2);      /* pix 3 */
-        CHECK_BYTE(linedp, 2 * wsm + 1, (sval1 + sval3) / 2);  /* pix 4 */
-#undef CHECK_BYTE
-#endif
     }
-    else {   /* last row of src pixels: lastlineflag == 1 */
-        linedp = lined + wpld;
-        sval2 = GET_DATA_BYTE(lines, 0);
-        for (j = 0, jd = 0; j < wsm; j++, jd += 2) {
-            sval1 = sval2;
-            sval2 = GET_DATA_BYTE(lines, j + 1);
-            SET_DATA_BYTE(lined, jd, sval1);                       /* pix 1 */
-            SET_DATA_BYTE(linedp, jd, sval1);                      /* pix 3 */
-            SET_DATA_BYTE(lined, jd + 1, (sval1 + sval2) / 2);     /* pix 2 */
-            SET_DATA_BYTE(linedp, jd + 1, (sval1 + sval2) / 2);    /* pix 4 */
-        }  
-        sval1 = sval2;
-        SET_DATA_BYTE(lined, 2 * wsm, sval1);                     /* pix 1 */
-        SET_DATA_BYTE(lined, 2 * wsm + 1, sval1);                 /* pix 2 */
-        SET_DATA_BYTE(linedp, 2 * wsm, sval1);                    /* pix 3 */
-        SET_DATA_BYTE(linedp, 2 * wsm + 1, sval1);                /* pix 4 */
+    if (jd & 31) {
+        lined[jd / 32] = dword0 << (32 - (jd & 31));
+        linedp[jd / 32] = dword1 << (32 - (jd & 31));
     }
-        
     return;
 }
 
 
-/*------------------------------------------------------------------*
- *               4x linear interpolated gray scaling                *
- *------------------------------------------------------------------*/
-
 /*!
- *  scaleGray4xLILineLow()
+ *  scaleGray4xLIThreshLineLow()
  *
  *      Input:  lined   (ptr to top destline, to be made from current src line)
  *              wpld
@@ -259,122 +280,312 @@ l_uint32   words, wordsp, wordd, worddp;
  *              ws
  *              wpls
  *              lastlineflag  (1 if last src line; 0 otherwise)
+ *              thresh  (dest bit is 1 for interpolated values < thresh)
  *      Return: void
+ *
+ *  Notes:
+ *      (1) This makes the 4 lines of 1 bpp dest with the same bits as
+ *          4x linear interpolation followed by thresholdToBinaryLineLow(),
+ *          without making the 8 bpp lines.  The last word of each dest
+ *          line is written in full, with the pad bits cleared.
  */
 LEPTONICA_EXPORT void
-scaleGray4xLILineLow(l_uint32  *lined,
-                     l_int32    wpld,
-                     l_uint32  *lines,
-                     l_int32    ws,
-                     l_int32    wpls,
-                     l_int32    lastlineflag)
+scaleGray4xLIThreshLineLow(l_uint32  *lined,
+                           l_int32    wpld,
+                           l_uint32  *lines,
+                           l_int32    ws,
+                           l_int32    wpls,
+                           l_int32    lastlineflag,
+                           l_int32    thresh)
 {
-l_int32    j, jd, wsm, wsm4;
-l_int32    s1, s2, s3, s4, s1t, s2t, s3t, s4t;
-l_uint32  *linesp, *linedp1, *linedp2, *linedp3;
+l_int32    j, jd, k, c, wsm, t16, s1, s2, s3, s4, top, topr;
+l_uint32   dword[4], bits;
+l_uint32  *linesp;
 
     wsm = ws - 1;
-    wsm4 = 4 * wsm;
-
-    if (lastlineflag == 0) {
-        linesp = lines + wpls;
-        linedp1 = lined + wpld;
-        linedp2 = lined + 2 * wpld;
-        linedp3 = lined + 3 * wpld;
-        s2 = GET_DATA_BYTE(lines, 0);
-        s4 = GET_DATA_BYTE(linesp, 0);
-        for (j = 0, jd = 0; j < wsm; j++, jd += 4) {
-            s1 = s2;
-            s3 = s4;
+    linesp = (lastlineflag) ? lines : lines + wpls;
+    t16 = 16 * thresh;
+    j = 0;
+
+#if defined(__SSE2__)
+    if (cpuGetLevel() >= L_CPU_SSE2) {
+    l_int32  h;
+    __m128i  zero, thr, a, a1, p, p1, s1v, s2v, dy, dyr, topv, toprv, d;
+    __m128i  m0, m1, m2, m3, lo01, lo23, hi01, hi23;
+
+        /* 16 src pixels, making 2 dest words in each line, at a time */
+    zero = _mm_setzero_si128();
+    thr = _mm_set1_epi16(t16);
+    for (; j + 16 <= wsm; j += 16) {
+        loadPixelsSSE2(lines, j, &a, &a1);
+        loadPixelsSSE2(linesp, j, &p, &p1);
+        for (h = 0; h < 2; h++) {
+            if (h == 0) {
+                s1v = _mm_unpacklo_epi8(a, zero);
+                s2v = _mm_unpacklo_epi8(a1, zero);
+                dy = _mm_sub_epi16(_mm_unpacklo_epi8(p, zero), s1v);
+                dyr = _mm_sub_epi16(_mm_unpacklo_epi8(p1, zero), s2v);
+            }
+            else {
+                s1v = _mm_unpackhi_epi8(a, zero);
+                s2v = _mm_unpackhi_epi8(a1, zero);
+                dy = _mm_sub_epi16(_mm_unpackhi_epi8(p, zero), s1v);
+                dyr = _mm_sub_epi16(_mm_unpackhi_epi8(p1, zero), s2v);
+            }
+            topv = _mm_slli_epi16(s1v, 2);
+            toprv = _mm_slli_epi16(s2v, 2);
+            for (k = 0; k < 4; k++) {
+                    /* W for c = 0 ... 3 is 4 * top + c * (topr - top) */
+                d = _mm_sub_epi16(toprv, topv);
+                m0 = _mm_slli_epi16(topv, 2);
+                m1 = _mm_add_epi16(m0, d);
+                m2 = _mm_add_epi16(m1, d);
+                m3 = _mm_add_epi16(m2, d);
+                m0 = _mm_cmplt_epi16(m0, thr);
+                m1 = _mm_cmplt_epi16(m1, thr);
+                m2 = _mm_cmplt_epi16(m2, thr);
+                m3 = _mm_cmplt_epi16(m3, thr);
+
+                    /* Interleave into dest order, c = 0 ... 3 for
+                     * each src pixel in turn */
+                lo01 = _mm_unpacklo_epi16(m0, m1);
+                lo23 = _mm_unpacklo_epi16(m2, m3);
+                hi01 = _mm_unpackhi_epi16(m0, m1);
+                hi23 = _mm_unpackhi_epi16(m2, m3);
+                bits = (l_uint32)_mm_movemask_epi8(_mm_packs_epi16(
+                           _mm_unpacklo_epi32(lo01, lo23),
+                           _mm_unpackhi_epi32(lo01, lo23))) |
+                       ((l_uint32)_mm_movemask_epi8(_mm_packs_epi16(
+                           _mm_unpacklo_epi32(hi01, hi23),
+                           _mm_unpackhi_epi32(hi01, hi23))) << 16);
+                lined[k * wpld + j / 8 + h] = reverseBits32(bits);
+                topv = _mm_add_epi16(topv, dy);
+                toprv = _mm_add_epi16(toprv, dyr);
+            }
+        }
+    }
+    }
+#endif  /* __SSE2__ */
+
+        /* The rest, a pixel at a time; 4 * j is at a word boundary */
+    for (k = 0; k < 4; k++)
+        dword[k] = 0;
+    for (jd = 4 * j; j < ws; j++) {
+        s1 = GET_DATA_BYTE(lines, j);
+        s3 = GET_DATA_BYTE(linesp, j);
+        if (j < wsm) {
             s2 = GET_DATA_BYTE(lines, j + 1);
             s4 = GET_DATA_BYTE(linesp, j + 1);
-            s1t = 3 * s1;
-            s2t = 3 * s2;
-            s3t = 3 * s3;
-            s4t = 3 * s4;
-            SET_DATA_BYTE(lined, jd, s1);                             /* d1 */
-            SET_DATA_BYTE(lined, jd + 1, (s1t + s2) / 4);             /* d2 */
-            SET_DATA_BYTE(lined, jd + 2, (s1 + s2) / 2);              /* d3 */
-            SET_DATA_BYTE(lined, jd + 3, (s1 + s2t) / 4);             /* d4 */
-            SET_DATA_BYTE(linedp1, jd, (s1t + s3) / 4);                /* d5 */
-            SET_DATA_BYTE(linedp1, jd + 1, (9*s1 + s2t + s3t + s4) / 16); /*d6*/
-            SET_DATA_BYTE(linedp1, jd + 2, (s1t + s2t + s3 + s4) / 8); /* d7 */
-            SET_DATA_BYTE(linedp1, jd + 3, (s1t + 9*s2 + s3 + s4t) / 16);/*d8*/
-            SET_DATA_BYTE(linedp2, jd, (s1 + s3) / 2);                /* d9 */
-            SET_DATA_BYTE(linedp2, jd + 1, (s1t + s2 + s3t + s4) / 8);/* d10 */
-            SET_DATA_BYTE(linedp2, jd + 2, (s1 + s2 + s3 + s4) / 4);  /* d11 */
-            SET_DATA_BYTE(linedp2, jd + 3, (s1 + s2t + s3 + s4t) / 8);/* d12 */
-            SET_DATA_BYTE(linedp3, jd, (s1 + s3t) / 4);               /* d13 */
-            SET_DATA_BYTE(linedp3, jd + 1, (s1t + s2 + 9*s3 + s4t) / 16);/*d14*/
-            SET_DATA_BYTE(linedp3, jd + 2, (s1 + s2 + s3t + s4t) / 8); /* d15 */
-            SET_DATA_BYTE(linedp3, jd + 3, (s1 + s2t + s3t + 9*s4) / 16);/*d16*/
-        }  
-        s1 = s2;
-        s3 = s4;
-        s1t = 3 * s1;
-        s3t = 3 * s3;
-        SET_DATA_BYTE(lined, wsm4, s1);                               /* d1 */
-        SET_DATA_BYTE(lined, wsm4 + 1, s1);                           /* d2 */
-        SET_DATA_BYTE(lined, wsm4 + 2, s1);                           /* d3 */
-        SET_DATA_BYTE(lined, wsm4 + 3, s1);                           /* d4 */
-        SET_DATA_BYTE(linedp1, wsm4, (s1t + s3) / 4);                 /* d5 */
-        SET_DATA_BYTE(linedp1, wsm4 + 1, (s1t + s3) / 4);             /* d6 */
-        SET_DATA_BYTE(linedp1, wsm4 + 2, (s1t + s3) / 4);             /* d7 */
-        SET_DATA_BYTE(linedp1, wsm4 + 3, (s1t + s3) / 4);             /* d8 */
-        SET_DATA_BYTE(linedp2, wsm4, (s1 + s3) / 2);                  /* d9 */
-        SET_DATA_BYTE(linedp2, wsm4 + 1, (s1 + s3) / 2);              /* d10 */
-        SET_DATA_BYTE(linedp2, wsm4 + 2, (s1 + s3) / 2);              /* d11 */
-        SET_DATA_BYTE(linedp2, wsm4 + 3, (s1 + s3) / 2);              /* d12 */
-        SET_DATA_BYTE(linedp3, wsm4, (s1 + s3t) / 4);                 /* d13 */
-        SET_DATA_BYTE(linedp3, wsm4 + 1, (s1 + s3t) / 4);             /* d14 */
-        SET_DATA_BYTE(linedp3, wsm4 + 2, (s1 + s3t) / 4);             /* d15 */
-        SET_DATA_BYTE(linedp3, wsm4 + 3, (s1 + s3t) / 4);             /* d16 */
+        }
+        else {
+            s2 = s1;
+            s4 = s3;
+        }
+        for (k = 0; k < 4; k++) {
+            top = (4 - k) * s1 + k * s3;
+            topr = (4 - k) * s2 + k * s4;
+            bits = 0;
+            for (c = 0; c < 4; c++)
+                bits = (bits << 1) | ((4 - c) * top + c * topr < t16);
+            dword[k] = (dword[k] << 4) | bits;
+        }
+        jd += 4;
+        if ((jd & 31) == 0) {
+            for (k = 0; k < 4; k++) {
+                lined[k * wpld + jd / 32 - 1] = dword[k];
+                dword[k] = 0;
+            }
+        }
     }
-    else {   /* last row of src pixels: lastlineflag == 1 */
-        linedp1 = lined + wpld;
-        linedp2 = lined + 2 * wpld;
-        linedp3 = lined + 3 * wpld;
-        s2 = GET_DATA_BYTE(lines, 0);
-        for (j = 0, jd = 0; j < wsm; j++, jd += 4) {
-            s1 = s2;
-            s2 = GET_DATA_BYTE(lines, j + 1);
-            s1t = 3 * s1;
-            s2t = 3 * s2;
-            SET_DATA_BYTE(lined, jd, s1);                            /* d1 */
-            SET_DATA_BYTE(lined, jd + 1, (s1t + s2) / 4 );           /* d2 */
-            SET_DATA_BYTE(lined, jd + 2, (s1 + s2) / 2 );            /* d3 */
-            SET_DATA_BYTE(lined, jd + 3, (s1 + s2t) / 4 );           /* d4 */
-            SET_DATA_BYTE(linedp1, jd, s1);                          /* d5 */
-            SET_DATA_BYTE(linedp1, jd + 1, (s1t + s2) / 4 );         /* d6 */
-            SET_DATA_BYTE(linedp1, jd + 2, (s1 + s2) / 2 );          /* d7 */
-            SET_DATA_BYTE(linedp1, jd + 3, (s1 + s2t) / 4 );         /* d8 */
-            SET_DATA_BYTE(linedp2, jd, s1);                          /* d9 */
-            SET_DATA_BYTE(linedp2, jd + 1, (s1t + s2) / 4 );         /* d10 */
-            SET_DATA_BYTE(linedp2, jd + 2, (s1 + s2) / 2 );          /* d11 */
-            SET_DATA_BYTE(linedp2, jd + 3, (s1 + s2t) / 4 );         /* d12 */
-            SET_DATA_BYTE(linedp3, jd, s1);                          /* d13 */
-            SET_DATA_BYTE(linedp3, jd + 1, (s1t + s2) / 4 );         /* d14 */
-            SET_DATA_BYTE(linedp3, jd + 2, (s1 + s2) / 2 );          /* d15 */
-            SET_DATA_BYTE(linedp3, jd + 3, (s1 + s2t) / 4 );         /* d16 */
-        }  
-        s1 = s2;
-        SET_DATA_BYTE(lined, wsm4, s1);                              /* d1 */
-        SET_DATA_BYTE(lined, wsm4 + 1, s1);                          /* d2 */
-        SET_DATA_BYTE(lined, wsm4 + 2, s1);                          /* d3 */
-        SET_DATA_BYTE(lined, wsm4 + 3, s1);                          /* d4 */
-        SET_DATA_BYTE(linedp1, wsm4, s1);                            /* d5 */
-        SET_DATA_BYTE(linedp1, wsm4 + 1, s1);                        /* d6 */
-        SET_DATA_BYTE(linedp1, wsm4 + 2, s1);                        /* d7 */
-        SET_DATA_BYTE(linedp1, wsm4 + 3, s1);                        /* d8 */
-        SET_DATA_BYTE(linedp2, wsm4, s1);                            /* d9 */
-        SET_DATA_BYTE(linedp2, wsm4 + 1, s1);                        /* d10 */
-        SET_DATA_BYTE(linedp2, wsm4 + 2, s1);                        /* d11 */
-        SET_DATA_BYTE(linedp2, wsm4 + 3, s1);                        /* d12 */
-        SET_DATA_BYTE(linedp3, wsm4, s1);                            /* d13 */
-        SET_DATA_BYTE(linedp3, wsm4 + 1, s1);                        /* d14 */
-        SET_DATA_BYTE(linedp3, wsm4 + 2, s1);                        /* d15 */
-        SET_DATA_BYTE(linedp3, wsm4 + 3, s1);                        /* d16 */
+    if (jd & 31) {
+        for (k = 0; k < 4; k++)
+            lined[k * wpld + jd / 32] = dword[k] << (32 - (jd & 31));
     }
-        
     return;
 }
+
+
+/*------------------------------------------------------------------*
+ *               Binary 2x and 4x downscaling by rank               *
+ *------------------------------------------------------------------*/
+/*!
+ *  reduceRankBinary2LineLow()
+ *
+ *      Input:  lined   (ptr to dest line)
+ *              lines   (ptr to first of the 2 src lines)
+ *              lines2  (ptr to second src line; null if there is none)
+ *              wpls
+ *              lastmask  (of the pixels in the last word of a src line)
+ *              level   (rank threshold: 1, 2, 3, 4)
+ *              tab     (from makeSubsampleTab2x())
+ *      Return: void
+ *
+ *  Notes:
+ *      (1) The dest pixel is 1 if at least level of the 4 pixels of its
+ *          2x2 block are.  The block is worked out for all 16 blocks of
+ *          a src word at once, in the bits of the even pixels (pixel j
+ *          in bit 31 - j), which tab then packs into 16 bits.
+ *      (2) The src pad bits are masked off, and a missing second line is
+ *          white, so the dest pad bits are left cleared.
+ */
+LEPTONICA_EXPORT void
+reduceRankBinary2LineLow(l_uint32  *lined,
+                         l_uint32  *lines,
+                         l_uint32  *lines2,
+                         l_int32    wpls,
+                         l_uint32   lastmask,
+                         l_int32    level,
+                         l_uint8   *tab)
+{
+l_int32   j;
+l_uint32  a, b, aor, aand, bor, band, w;
+
+    for (j = 0; j < wpls; j++) {
+        a = lines[j];
+        b = (lines2) ? lines2[j] : 0;
+        if (j == wpls - 1) {
+            a &= lastmask;
+            b &= lastmask;
+        }
+            /* OR and AND of each pair of pixels, in the even bit */
+        aor = a | (a << 1);
+        aand = a & (a << 1);
+        bor = b | (b << 1);
+        band = b & (b << 1);
+        switch (level)
+        {
+        case 1:
+            w = aor | bor;
+            break;
+        case 2:
+            w = aand | band | (aor & bor);
+            break;
+        case 3:
+            w = (aand & bor) | (band & aor);
+            break;
+        default:
+            w = aand & band;
+            break;
+        }
+        w &= 0xaaaaaaaa;
+        w = ((l_uint32)tab[w >> 24] << 12) | (tab[(w >> 16) & 0xff] << 8) |
+            (tab[(w >> 8) & 0xff] << 4) | tab[w & 0xff];
+        if (j & 1)
+            lined[j / 2] |= w;
+        else
+            lined[j / 2] = w << 16;
+    }
+    return;
+}
+
+
+/*!
+ *  reduceRankBinary4LineLow()
+ *
+ *      Input:  lined   (ptr to dest line)
+ *              lines   (ptr to first of the src lines)
+ *              nlines  (src lines, 1 to 4; the others are white)
+ *              wpls
+ *              lastmask  (of the pixels in the last word of a src line)
+ *              level   (rank threshold: 1 ... 16)
+ *              tab     (from makeCountTab4x())
+ *      Return: void
+ *
+ *  Notes:
+ *      (1) The dest pixel is 1 if at least level of the 16 pixels of its
+ *          4x4 block are.  tab gives the counts of the 2 blocks of a src
+ *          byte in a line, one to a byte, so that the 4 lines are summed
+ *          with 3 adds for each pair of dest pixels.
+ *      (2) As in reduceRankBinary2LineLow(), the dest pad bits are left
+ *          cleared.
+ */
+LEPTONICA_EXPORT void
+reduceRankBinary4LineLow(l_uint32  *lined,
+                         l_uint32  *lines,
+                         l_int32    nlines,
+                         l_int32    wpls,
+                         l_uint32   lastmask,
+                         l_int32    level,
+                         l_uint16  *tab)
+{
+l_int32   i, j, k;
+l_uint32  word, sum, bits;
+
+    for (j = 0; j < wpls; j++) {
+        bits = 0;
+        for (k = 24; k >= 0; k -= 8) {
+            sum = 0;
+            for (i = 0; i < nlines; i++) {
+                word = lines[i * wpls + j];
+                if (j == wpls - 1)
+                    word &= lastmask;
+                sum += tab[(word >> k) & 0xff];
+            }
+            bits = (bits << 2) | (((sum >> 8) >= (l_uint32)level) << 1) |
+                   ((sum & 0xff) >= (l_uint32)level);
+        }
+        if ((j & 3) == 0)
+            lined[j / 4] = bits << 24;
+        else
+            lined[j / 4] |= bits << (24 - 8 * (j & 3));
+    }
+    return;
+}
+
+
+/*!
+ *  makeSubsampleTab2x()
+ *
+ *      Return: tab (256 entries), or null on error
+ *
+ *  Notes:
+ *      (1) Entry i has the bits 7, 5, 3 and 1 of i in bits 3 ... 0: the
+ *          even pixels of a byte, packed.
+ */
+LEPTONICA_EXPORT l_uint8 *
+makeSubsampleTab2x(void)
+{
+l_int32   i;
+l_uint8  *tab;
+
+    PROCNAME("makeSubsampleTab2x");
+
+    if ((tab = (l_uint8 *)CALLOC(256, sizeof(l_uint8))) == NULL)
+        return (l_uint8 *)ERROR_PTR("tab not made", procName, NULL);
+    for (i = 0; i < 256; i++) {
+        tab[i] = ((i >> 4) & 8) | ((i >> 3) & 4) | ((i >> 2) & 2) |
+                 ((i >> 1) & 1);
+    }
+    return tab;
+}
+
+
+/*!
+ *  makeCountTab4x()
+ *
+ *      Return: tab (256 entries), or null on error
+ *
+ *  Notes:
+ *      (1) Entry i has the number of 1 bits in the high nibble of i in
+ *          its high byte, and in the low nibble in its low byte.
+ */
+LEPTONICA_EXPORT l_uint16 *
+makeCountTab4x(void)
+{
+l_int32    i, k, hi, lo;
+l_uint16  *tab;
+
+    PROCNAME("makeCountTab4x");
+
+    if ((tab = (l_uint16 *)CALLOC(256, sizeof(l_uint16))) == NULL)
+        return (l_uint16 *)ERROR_PTR("tab not made", procName, NULL);
+    for (i = 0; i < 256; i++) {
+        hi = lo = 0;
+        for (k = 0; k < 4; k++) {
+            hi += (i >> (k + 4)) & 1;
+            lo += (i >> k) & 1;
+        }
+        tab[i] = (hi << 8) | lo;
+    }
+    return tab;
+}
@@ -115,6 +115,15 @@
  *       Leptonica version number
  *           char      *getLeptonicaVersion()
  *
+ *       Running row bands in parallel
+ *           void       setRowBandRunner()
+ *           l_int32    getRowBandCount()
+ *           void       runRowBands()
+ *
+ *       Marking the steps of a conversion
+ *           void       setConvertStepHook()
+ *           void       convertStepDone()
+ *
  *       Timing
  *           void       startTimer()
  *           l_float32  stopTimer()
@@ -543,3 +552,180 @@ l_int32  dirlen, namelen, size;
     FREE(cdir);
     return pathout;
 }
+
+
+/*---------------------------------------------------------------------*
+ *                    Running row bands in parallel                    *
+ *---------------------------------------------------------------------*/
+/*
+ *  Many low-level loops work on each row of an image independently.
+ *  If a program supplies a way to run jobs on several threads with
+ *  setRowBandRunner(), runRowBands() splits such a loop into bands
+ *  of rows and runs the bands in parallel.  By default there is no
+ *  runner, so the loops run on the calling thread as before.
+ *
+ *  The runner is global, and must only be changed while no other
+ *  thread is using leptonica.  It must be reentrant: several threads
+ *  may call it at the same time.
+ */
+
+    /* Fewer pixels than this are not worth splitting into bands */
+#define  MIN_BAND_PIXELS    (1 << 21)
+
+static L_PARALLEL_FOR  RowBandRunner = NULL;
+static l_int32         RowBandThreads = 1;
+
+struct L_RowBands
+{
+    L_BAND_FUNC    fn;
+    void          *arg;
+    l_int32        h;
+    l_int32        nbands;
+};
+
+static void rowBandJob(void *arg, l_int32 index, l_int32 worker);
+
+
+/*!
+ *  setRowBandRunner()
+ *
+ *      Input:  runner (function that calls fn(arg, index, worker) for
+ *                      each index in [0, count) on up to nthreads
+ *                      threads, and returns when all have finished;
+ *                      or null to run everything on the calling thread)
+ *              nthreads (most threads to use for the bands of one image)
+ *      Return: void
+ */
+LEPTONICA_REAL_EXPORT void
+setRowBandRunner(L_PARALLEL_FOR  runner,
+                 l_int32         nthreads)
+{
+    RowBandRunner = runner;
+    RowBandThreads = L_MAX(1, nthreads);
+    return;
+}
+
+
+/*!
+ *  getRowBandCount()
+ *
+ *      Input:  w, h (number of pixels in each row, and of rows)
+ *      Return: number of bands runRowBands() splits the rows into;
+ *              1 if they are done serially
+ *
+ *  Notes:
+ *      (1) Callers that can do the work in place when it is serial,
+ *          but not in bands, use this to choose.
+ */
+LEPTONICA_EXPORT l_int32
+getRowBandCount(l_int32  w,
+                l_int32  h)
+{
+l_float64  npix;
+l_int32    nbands;
+
+    if (!RowBandRunner || RowBandThreads <= 1 || w <= 0 || h <= 1)
+        return 1;
+    npix = (l_float64)w * h;
+    nbands = (npix / MIN_BAND_PIXELS > RowBandThreads) ?
+             RowBandThreads : (l_int32)(npix / MIN_BAND_PIXELS);
+    return L_MAX(1, L_MIN(nbands, h));
+}
+
+
+/*!
+ *  runRowBands()
+ *
+ *      Input:  w, h (number of pixels in each row, and of rows)
+ *              fn (called as fn(arg, y0, y1) to do rows y0 ... y1 - 1)
+ *              arg
+ *      Return: void
+ *
+ *  Notes:
+ *      (1) The bands together cover rows 0 ... h - 1, each once.  fn
+ *          must not write anything that fn for another band reads.
+ *      (2) w is only used to judge how much work each row is.
+ */
+LEPTONICA_EXPORT void
+runRowBands(l_int32      w,
+            l_int32      h,
+            L_BAND_FUNC  fn,
+            void        *arg)
+{
+struct L_RowBands  rb;
+
+    rb.fn = fn;
+    rb.arg = arg;
+    rb.h = h;
+    rb.nbands = getRowBandCount(w, h);
+    if (rb.nbands <= 1)
+        fn(arg, 0, h);
+    else
+        RowBandRunner(rb.nbands, rb.nbands, rowBandJob, &rb);
+    return;
+}
+
+
+static void
+rowBandJob(void    *arg,
+           l_int32  index,
+           l_int32  worker)
+{
+struct L_RowBands  *rb;
+
+    rb = (struct L_RowBands *)arg;
+    rb->fn(rb->arg, (l_int32)((l_float64)index * rb->h / rb->nbands),
+           (l_int32)((l_float64)(index + 1) * rb->h / rb->nbands));
+    return;
+}
+
+
+/*---------------------------------------------------------------------*
+ *                  Marking the steps of a conversion                  *
+ *---------------------------------------------------------------------*/
+/*
+ *  Conversions made of several steps, such as pixConvertTo1Transfer(),
+ *  call convertStepDone() as each one finishes, so that a program can
+ *  find out where the time goes.  The hook is set for the calling
+ *  thread only: several threads can each be timing their own images.
+ */
+static L_THREAD_LOCAL L_STEP_FUNC  ConvertStepHook = NULL;
+static L_THREAD_LOCAL void        *ConvertStepArg = NULL;
+
+
+/*!
+ *  setConvertStepHook()
+ *
+ *      Input:  fn (called as fn(arg, step) when a step of a conversion
+ *                  done on this thread finishes; or null for none)
+ *              arg
+ *      Return: void
+ *
+ *  Notes:
+ *      (1) step is one of L_STEP_*.  The work done since the last call
+ *          of fn (or since the conversion started) was that step.
+ *          Steps which are not needed for an image are not marked.
+ */
+LEPTONICA_REAL_EXPORT void
+setConvertStepHook(L_STEP_FUNC  fn,
+                   void        *arg)
+{
+    ConvertStepHook = fn;
+    ConvertStepArg = arg;
+    return;
+}
+
+
+/*!
+ *  convertStepDone()
+ *
+ *      Input:  step (L_STEP_*)
+ *      Return: void
+ */
+LEPTONICA_EXPORT void
+convertStepDone(l_int32  step)
+{
+    if (ConvertStepHook)
+        ConvertStepHook(ConvertStepArg, step);
+    return;
+}